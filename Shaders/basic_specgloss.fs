@@ -33,10 +33,13 @@ uniform Light lights[3];
 uniform vec4 global_ambient;
 
 uniform bool has_tex_skysphere;
-uniform bool has_tex_skyenv;
+uniform vec3 sh_irradiance[9];
 
+#ifdef SKY_CUBEMAP
+uniform samplerCube tex_skysphere;
+#else
 uniform sampler2D tex_skysphere;
-uniform sampler2D tex_skyenv;
+#endif
 
 uniform ColorMap map_albedo;
 uniform ColorMap map_diffuse;
@@ -56,28 +59,30 @@ vec4 sample_colormap( ColorMap map, vec2 uv)
   return map.has_tex ? texture( map.tex, uv ) : map.color;
 }
 
-vec2 sphere_to_polar( vec3 normal )
+// The sky's own frame: skysphere_rotation spins it around the Y axis
+vec3 to_sky_space( vec3 dir )
 {
-  normal = normalize( normal );
-  return vec2( atan(normal.z, normal.x) / PI / 2.0 + 0.5 + skysphere_rotation, acos(normal.y) / PI );
+  float angle = skysphere_rotation * 2. * PI;
+  return vec3( cos( angle ) * dir.x - sin( angle ) * dir.z, dir.y, sin( angle ) * dir.x + cos( angle ) * dir.z );
 }
 
-vec3 sample_irradiance_fast( vec3 normal )
+// Irradiance from the sky's L2 spherical harmonics projection, which was convolved
+// with the cosine lobe on load; a handful of MADs instead of texture reads.
+vec3 sample_irradiance_sh( vec3 normal )
 {
-  // Sample the irradiance map if it exists, otherwise fall back to blurred reflection map.
-  if ( has_tex_skyenv )
-  {
-    vec2 polar = sphere_to_polar( normal );
-    // HACK: Sample a smaller mip here to avoid high frequency color variations on detailed normal
-    //       mapped areas.
-    float miplevel = 5.5; // tweaked for a 360x180 irradiance texture
-    return textureLod( tex_skyenv, polar, miplevel ).rgb * exposure;
-  }
-  else
-  {
-    vec2 polar = sphere_to_polar( normal );
-    return textureLod( tex_skysphere, polar, 0.80 * skysphere_mip_count ).rgb * exposure;
-  }
+  vec3 n = to_sky_space( normalize( normal ) );
+
+  vec3 irradiance =
+    sh_irradiance[0] * 0.282095 +
+    sh_irradiance[1] * 0.488603 * n.y +
+    sh_irradiance[2] * 0.488603 * n.z +
+    sh_irradiance[3] * 0.488603 * n.x +
+    sh_irradiance[4] * 1.092548 * n.x * n.y +
+    sh_irradiance[5] * 1.092548 * n.y * n.z +
+    sh_irradiance[6] * 0.315392 * ( 3. * n.z * n.z - 1. ) +
+    sh_irradiance[7] * 1.092548 * n.x * n.z +
+    sh_irradiance[8] * 0.546274 * ( n.x * n.x - n.y * n.y );
+  return max( irradiance, vec3(0.) ) * exposure;
 }
 
 float calculate_specular( vec3 normal, vec3 light_direction )
@@ -109,7 +114,7 @@ void main(void)
 
   normal = normalize( normal );
 
-  vec3 irradiance = sample_irradiance_fast( normal );
+  vec3 irradiance = sample_irradiance_sh( normal );
   ambient *= irradiance;
 
   vec3 color = ambient * global_ambient.rgb;
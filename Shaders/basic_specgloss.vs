@@ -1,10 +1,11 @@
 #version 410 core
 
-in vec3 in_pos;
-in vec3 in_normal;
-in vec3 in_tangent;
-in vec3 in_binormal;
-in vec2 in_texcoord;
+layout( location = 0 ) in vec3 in_pos;
+layout( location = 1 ) in vec3 in_normal;
+layout( location = 2 ) in vec3 in_tangent;
+layout( location = 3 ) in vec3 in_binormal;
+layout( location = 4 ) in vec2 in_texcoord;
+layout( location = 5 ) in mat4x4 in_instance_world;
 
 out vec3 out_normal;
 out vec3 out_tangent;
@@ -21,8 +22,11 @@ uniform mat4x4 mat_world;
 
 void main()
 {
+  // Node transform from the instance buffer, followed by the model root transform
+  mat4x4 world = in_instance_world * mat_world;
+
   vec4 o = vec4( in_pos.x, in_pos.y, in_pos.z, 1.0 );
-  o = mat_world * o;
+  o = world * o;
   out_worldpos = o.xyz;
   o = mat_view * o;
   out_viewpos = o.xyz;
@@ -33,8 +37,8 @@ void main()
   o = mat_projection * o;
   gl_Position = o;
 
-  out_normal = normalize( mat3( mat_world ) * in_normal );
-  out_tangent = normalize( mat3( mat_world ) * in_tangent );
-  out_binormal = normalize( mat3( mat_world ) * in_binormal );
+  out_normal = normalize( mat3( world ) * in_normal );
+  out_tangent = normalize( mat3( world ) * in_tangent );
+  out_binormal = normalize( mat3( world ) * in_binormal );
   out_texcoord = in_texcoord;
 }
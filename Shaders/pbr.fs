@@ -8,10 +8,9 @@ const bool use_wraparound_specular = true;
 const bool use_specular_ao_attenuation = true;
 // Increases roughness if normal map has variation and was minified.
 const bool use_normal_variation_to_roughness = true;
-// Shows all ColorMaps as horizontal bars
-const bool use_map_debugging = false;
-// Splits the screen in two and shows image-based specular (left) and diffuse (right) shading.
-const bool use_ambient_debugging = false;
+// Which ColorMaps have textures, whether there's a sky to light with (USE_IBL), whether it's
+// a cubemap or a panorama (SKY_CUBEMAP) and
+// the debug views (DEBUG_MAPS, DEBUG_AMBIENT) are #defined by the loader for each material variant.
 
 struct Light
 {
@@ -41,12 +40,15 @@ uniform uint frame_count;
 uniform vec3 camera_position;
 uniform Light lights[3];
 
+#ifdef SKY_CUBEMAP
+uniform samplerCube tex_skysphere;
+#else
 uniform sampler2D tex_skysphere;
-uniform sampler2D tex_skyenv;
+#endif
 uniform sampler2D tex_brdf_lut;
 
 uniform bool has_tex_skysphere;
-uniform bool has_tex_skyenv;
+uniform vec3 sh_irradiance[9];
 
 uniform ColorMap map_albedo;
 uniform ColorMap map_diffuse;
@@ -85,11 +87,6 @@ float random( vec3 v )
     return random(floatBitsToUint( v ));
 }
 
-vec4 sample_colormap( ColorMap map, vec2 uv )
-{
-  return map.has_tex ? texture( map.tex, uv ) : map.color;
-}
-
 vec3 fresnel_schlick( vec3 H, vec3 V, vec3 F0 )
 {
   float cosTheta = clamp( dot( H, V ), 0., 1. );
@@ -127,16 +124,34 @@ float geometry_smith( vec3 N, vec3 V, vec3 L, float roughness )
   return geometry_schlick_ggx( N, V, k ) * geometry_schlick_ggx( N, L, k );
 }
 
+// The sky's own frame: skysphere_rotation spins it around the Y axis
+vec3 to_sky_space( vec3 dir )
+{
+  float angle = skysphere_rotation * 2. * PI;
+  return vec3( cos( angle ) * dir.x - sin( angle ) * dir.z, dir.y, sin( angle ) * dir.x + cos( angle ) * dir.z );
+}
+
+#ifdef SKY_CUBEMAP
+vec3 sample_sky_lod( vec3 dir, float lod )
+{
+  return textureLod( tex_skysphere, to_sky_space( dir ), lod ).rgb;
+}
+#else
 vec2 sphere_to_polar( vec3 normal )
 {
   normal = normalize( normal );
   return vec2( atan(normal.z, normal.x) / PI / 2.0 + 0.5 + skysphere_rotation, acos(normal.y) / PI );
 }
 
+vec3 sample_sky_lod( vec3 dir, float lod )
+{
+  return textureLod( tex_skysphere, sphere_to_polar( dir ), lod ).rgb;
+}
+#endif
+
 vec3 sample_sky( vec3 normal )
 {
-  vec2 polar = sphere_to_polar( normal );
-  return texture( tex_skysphere, polar ).rgb * exposure;
+  return sample_sky_lod( normal, 0. ) * exposure;
 }
 
 // Takes samples around the hemisphere, converts them to radiances via weighting and
@@ -174,22 +189,23 @@ vec3 sample_irradiance_slow( vec3 normal, vec3 vertex_tangent )
   return irradiance;
 }
 
-vec3 sample_irradiance_fast( vec3 normal, vec3 vertex_tangent )
+// Irradiance from the sky's L2 spherical harmonics projection, which was convolved
+// with the cosine lobe on load; a handful of MADs instead of texture reads.
+vec3 sample_irradiance_sh( vec3 normal )
 {
-  // Sample the irradiance map if it exists, otherwise fall back to blurred reflection map.
-  if ( has_tex_skyenv )
-  {
-    vec2 polar = sphere_to_polar( normal );
-    // HACK: Sample a smaller mip here to avoid high frequency color variations on detailed normal
-    //       mapped areas.
-    float miplevel = 5.5; // tweaked for a 360x180 irradiance texture
-    return textureLod( tex_skyenv, polar, miplevel ).rgb * exposure;
-  }
-  else
-  {
-    vec2 polar = sphere_to_polar( normal );
-    return textureLod( tex_skysphere, polar, 0.80 * skysphere_mip_count ).rgb * exposure;
-  }
+  vec3 n = to_sky_space( normalize( normal ) );
+
+  vec3 irradiance =
+    sh_irradiance[0] * 0.282095 +
+    sh_irradiance[1] * 0.488603 * n.y +
+    sh_irradiance[2] * 0.488603 * n.z +
+    sh_irradiance[3] * 0.488603 * n.x +
+    sh_irradiance[4] * 1.092548 * n.x * n.y +
+    sh_irradiance[5] * 1.092548 * n.y * n.z +
+    sh_irradiance[6] * 0.315392 * ( 3. * n.z * n.z - 1. ) +
+    sh_irradiance[7] * 1.092548 * n.x * n.z +
+    sh_irradiance[8] * 0.546274 * ( n.x * n.x - n.y * n.y );
+  return max( irradiance, vec3(0.) ) * exposure;
 }
 
 
@@ -203,21 +219,16 @@ vec3 specular_ibl( vec3 V, vec3 N, float roughness, vec3 fresnel )
   // 2. Assume V = R = N so that we can just blur the skybox and sample that.
   // 3. Bake the BRDF integral into a lookup texture so that it can be computed in constant time.
   //
-  // Here we also simplify approximation #2 by using bilinear mipmaps with a magic formula instead
-  // of properly convolving it with a GGX lobe.
+  // The mips of tex_skysphere are convolved with a GGX lobe on load, one roughness step per mip.
   //
   // For details, see Brian Karis, "Real Shading in Unreal Engine 4", 2013.
 
   vec3 R = 2. * dot( V, N ) * N - V;
 
-  vec2 polar = sphere_to_polar( R );
-
   // Map roughness from range [0, 1] into a mip LOD [0, skysphere_mip_count].
-  // The magic numbers were chosen empirically.
-
-  float mip = 0.9 * skysphere_mip_count * pow(roughness, 0.25);
+  float mip = skysphere_mip_count * roughness;
 
-  vec3 prefiltered = textureLod( tex_skysphere, polar, mip ).rgb * exposure;
+  vec3 prefiltered = sample_sky_lod( R, mip ) * exposure;
 
   float NdotV = dot( N, V );
 
@@ -246,37 +257,51 @@ void main(void)
   float metallic = 0.0;
   float ao = 1.0;
 
-  if ( map_albedo.has_tex )
-    baseColor = sample_colormap( map_albedo, out_texcoord ).xyz;
-  else
-    baseColor = sample_colormap( map_diffuse, out_texcoord ).xyz;
-
-  roughness = sample_colormap( map_roughness, out_texcoord ).x;
-  metallic = sample_colormap( map_metallic, out_texcoord ).x;
+#if defined( HAS_MAP_ALBEDO )
+  baseColor = texture( map_albedo.tex, out_texcoord ).xyz;
+#elif defined( HAS_MAP_DIFFUSE )
+  baseColor = texture( map_diffuse.tex, out_texcoord ).xyz;
+#else
+  baseColor = map_diffuse.color.xyz;
+#endif
+
+#ifdef HAS_MAP_ROUGHNESS
+  roughness = texture( map_roughness.tex, out_texcoord ).x;
+#else
+  roughness = map_roughness.color.x;
+#endif
+
+#ifdef HAS_MAP_METALLIC
+  metallic = texture( map_metallic.tex, out_texcoord ).x;
+#else
+  metallic = map_metallic.color.x;
+#endif
+
+#if defined( HAS_MAP_AO )
+  ao = texture( map_ao.tex, out_texcoord ).x;
+#elif defined( HAS_MAP_AMBIENT )
+  ao = texture( map_ambient.tex, out_texcoord ).x;
+#endif
 
-  if ( map_ao.has_tex )
-    ao = sample_colormap( map_ao, out_texcoord ).x;
-  else if ( map_ambient.has_tex )
-    ao = sample_colormap( map_ambient, out_texcoord ).x;
+  vec3 normal = out_normal;
 
+#ifdef HAS_MAP_NORMALS
   vec3 normalmap = texture( map_normals.tex, out_texcoord ).xyz * vec3(2.0) - vec3(1.0);
   float normalmap_mip = textureQueryLod( map_normals.tex, out_texcoord ).x;
   float normalmap_length = length(normalmap);
   normalmap /= normalmap_length;
 
-  vec3 normal = out_normal;
-
-  if ( map_normals.has_tex )
-  {
-    // Mikkelsen's tangent space normal map decoding. See http://mikktspace.com/ for rationale.
-    vec3 bi = cross( out_normal, out_tangent );
-    vec3 nmap = normalmap.xyz;
-    normal = nmap.x * out_tangent + nmap.y * bi + nmap.z * out_normal;
-  }
+  // Mikkelsen's tangent space normal map decoding. See http://mikktspace.com/ for rationale.
+  vec3 bi = cross( out_normal, out_tangent );
+  vec3 nmap = normalmap.xyz;
+  normal = nmap.x * out_tangent + nmap.y * bi + nmap.z * out_normal;
+#else
+  vec3 normalmap = vec3( 0., 0., 1. );
+#endif
 
   normal = normalize( normal );
 
-  if ( use_map_debugging )
+#ifdef DEBUG_MAPS
   {
     vec3 c = vec3(1., 0., 0.);
     float y = gl_FragCoord.y / 1170.;
@@ -289,7 +314,9 @@ void main(void)
     frag_color = vec4(c, 1.);
     return;
   }
+#endif
 
+#ifdef HAS_MAP_NORMALS
   if (use_normal_variation_to_roughness)
   {
     // Try to reduce specular aliasing by increasing roughness when minified normal maps have high variation.
@@ -297,6 +324,7 @@ void main(void)
     float minification = clamp( normalmap_mip - 2., 0., 1. );
     roughness = mix( roughness, 1.0, variation * minification );
   }
+#endif
 
 
   vec3 N = normal;
@@ -306,11 +334,9 @@ void main(void)
   vec3 F0 = vec3(0.04);
   F0 = mix( F0, baseColor, metallic );
 
-  bool use_ibl = has_tex_skysphere;
-
   // Add contributions from analytic lights only if we don't have a skybox.
 
-  if (!use_ibl)
+#ifndef USE_IBL
   {
     for ( int i = 0; i < lights.length(); i++ )
     {
@@ -337,12 +363,17 @@ void main(void)
       Lo += ( kD * ( baseColor / PI ) + specular ) * radiance * NdotL;
     }
   }
+#endif
 
-  vec3 ambient = sample_colormap( map_ambient, out_texcoord ).xyz;
-  vec3 diffuse_ambient;
-  vec3 specular_ambient;
+#ifdef HAS_MAP_AMBIENT
+  vec3 ambient = texture( map_ambient.tex, out_texcoord ).xyz;
+#else
+  vec3 ambient = map_ambient.color.xyz;
+#endif
+  vec3 diffuse_ambient = vec3(0.);
+  vec3 specular_ambient = vec3(0.);
 
-  if ( use_ibl )
+#ifdef USE_IBL
   {
     // Image based lighting.
     // Based on https://learnopengl.com/PBR/IBL/Diffuse-irradiance
@@ -355,7 +386,7 @@ void main(void)
     }
     else
     {
-      irradiance = sample_irradiance_fast( normal, out_tangent );
+      irradiance = sample_irradiance_sh( normal );
     }
 
     // Compute the Fresnel term for a perfect mirror reflection with L = R.
@@ -391,10 +422,11 @@ void main(void)
       ambient = ao * (kD * diffuse_ambient) + specular_ambient;
     }
   }
+#endif
 
   vec3 color = ambient + Lo;
 
-  if ( use_ambient_debugging )
+#ifdef DEBUG_AMBIENT
   {
     float x = gl_FragCoord.x / 1280.;
     if ( x > 0.5 )
@@ -402,6 +434,7 @@ void main(void)
     else
         color = specular_ambient;
   }
+#endif
 
 
   // Tonemap, apply gamma correction and dither with noise.
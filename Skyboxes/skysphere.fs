@@ -3,9 +3,11 @@
 in vec3 out_worldpos;
 
 uniform float texture_lod;
+#ifdef SKY_CUBEMAP
+uniform samplerCube tex_skysphere;
+#else
 uniform sampler2D tex_skysphere;
-uniform sampler2D tex_skyenv;
-uniform bool has_tex_skyenv;
+#endif
 uniform float skysphere_rotation;
 uniform float skysphere_blur;
 uniform float skysphere_opacity;
@@ -41,20 +43,38 @@ float random( vec3 v )
     return random(floatBitsToUint( v ));
 }
 
+#ifdef SKY_CUBEMAP
+// The sky's own frame: skysphere_rotation spins it around the Y axis
+vec3 to_sky_space( vec3 dir )
+{
+  float angle = skysphere_rotation * 2. * PI;
+  return vec3( cos( angle ) * dir.x - sin( angle ) * dir.z, dir.y, sin( angle ) * dir.x + cos( angle ) * dir.z );
+}
+
+vec3 sample_sky_lod( vec3 dir, float lod )
+{
+  return textureLod( tex_skysphere, to_sky_space( dir ), lod ).rgb;
+}
+#else
 vec2 sphere_to_polar( vec3 normal )
 {
   normal = normalize( normal );
   return vec2( atan(normal.z, normal.x) / PI / 2.0 + 0.5 + skysphere_rotation, acos(normal.y) / PI );
 }
 
+vec3 sample_sky_lod( vec3 dir, float lod )
+{
+  return textureLod( tex_skysphere, sphere_to_polar( dir ), lod ).rgb;
+}
+#endif
+
 void main(void)
 {
   // vec3 sky_color = textureLod( tex_skysphere, sphere_to_polar( normalize( out_worldpos ) ), skysphere_blur ).rgb;
 
-  vec3 sky_env = textureLod( tex_skyenv, sphere_to_polar( normalize( out_worldpos ) ), skysphere_blur ).rgb;
-  vec3 sky_color = textureLod( tex_skysphere, sphere_to_polar( normalize( out_worldpos ) ), skysphere_blur ).rgb;
+  vec3 sky_color = sample_sky_lod( normalize( out_worldpos ), skysphere_blur );
 
-  vec3 color = mix( background_color.rgb, mix( sky_color, sky_env, skysphere_blur / 8.0 ) , skysphere_opacity );
+  vec3 color = mix( background_color.rgb, sky_color, skysphere_opacity );
   color *= exposure;
   color = color / (vec3(1.) + color);
   color = pow( color, vec3( 1. / 2.2 ));
@@ -1,17 +1,16 @@
 #version 410 core
 
-in vec3 in_pos;
-
 out vec3 out_worldpos;
 
-uniform mat4x4 mat_projection;
-uniform mat4x4 mat_view;
+uniform mat4x4 mat_view_projection_inverse;
 
+// One triangle covering the whole screen, on the far plane. The view ray through each corner is
+// unprojected from the near plane to the far plane; it's linear across the screen, so it interpolates.
 void main()
 {
-  vec4 o = vec4( in_pos.x, in_pos.y, in_pos.z, 1.0 );
-  out_worldpos = o.xyz;
-  o = mat_view * o;
-  o = mat_projection * o;
-  gl_Position = o;
-}
\ No newline at end of file
+  vec2 position = vec2( ( gl_VertexID & 1 ) * 4.0 - 1.0, ( gl_VertexID >> 1 ) * 4.0 - 1.0 );
+  vec4 near_point = mat_view_projection_inverse * vec4( position, -1.0, 1.0 );
+  vec4 far_point = mat_view_projection_inverse * vec4( position, 1.0, 1.0 );
+  out_worldpos = far_point.xyz / far_point.w - near_point.xyz / near_point.w;
+  gl_Position = vec4( position, 1.0, 1.0 );
+}
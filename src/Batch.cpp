@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "Geometry.h"
+#include "Batch.h"
+
+#include <jsonxx.h>
+
+namespace Batch
+{
+
+enum MODELSTATE
+{
+  MODELSTATE_QUEUED,
+  MODELSTATE_IMPORTED,
+  MODELSTATE_FAILED,
+  MODELSTATE_RENDERED,
+  MODELSTATE_WRITE_FAILED,
+};
+
+struct Model
+{
+  std::string mPath;
+  std::string mThumbnailPath;
+  MODELSTATE mState;
+  Geometry * mGeometry; // between the import and Next()
+  double mImportTime;
+
+  int mMeshCount;
+  int mMaterialCount;
+  int mVertexCount;
+  int mTriangleCount;
+  glm::vec3 mAABBMin;
+  glm::vec3 mAABBMax;
+};
+
+// Models imported ahead of the one being rendered; each one holds its buffers and decoded textures until then
+const int IMPORT_AHEAD_COUNT = 2;
+
+std::vector<Model> models;
+std::string outputDirectory;
+int width = 0;
+int height = 0;
+bool mergeStaticMeshes = false;
+std::chrono::steady_clock::time_point beginTime;
+
+int nextImport = 0;
+int current = -1;
+
+std::mutex mutex;
+std::condition_variable workAvailable;
+std::condition_variable modelImported;
+std::thread worker;
+bool quit = false;
+
+bool IsDirectory( const char * _path )
+{
+  struct stat status;
+  return stat( _path, &status ) == 0 && ( status.st_mode & S_IFMT ) == S_IFDIR;
+}
+
+void MakeDirectory( const char * _path )
+{
+#ifdef _WIN32
+  _mkdir( _path );
+#else
+  mkdir( _path, 0755 );
+#endif
+}
+
+std::string GetExtension( const std::string & _path )
+{
+  size_t dot = _path.find_last_of( '.' );
+  if ( dot == std::string::npos || _path.find_first_of( "/\\", dot ) != std::string::npos )
+  {
+    return "";
+  }
+  std::string extension = _path.substr( dot );
+  std::transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+  return extension;
+}
+
+std::string GetFilename( const std::string & _path )
+{
+  size_t separator = _path.find_last_of( "/\\" );
+  return separator == std::string::npos ? _path : _path.substr( separator + 1 );
+}
+
+// Sorted, so runs over the same directory always come out the same
+bool ListDirectory( const std::string & _directory, std::vector<std::string> & _paths )
+{
+  std::string extensions = "," + Geometry::GetSupportedExtensions() + ",";
+  std::transform( extensions.begin(), extensions.end(), extensions.begin(), ::tolower );
+
+  std::vector<std::string> filenames;
+#ifdef _WIN32
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileA( ( _directory + "\\*" ).c_str(), &data );
+  if ( find == INVALID_HANDLE_VALUE )
+  {
+    return false;
+  }
+  do
+  {
+    if ( !( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) )
+    {
+      filenames.push_back( data.cFileName );
+    }
+  } while ( FindNextFileA( find, &data ) );
+  FindClose( find );
+#else
+  DIR * dir = opendir( _directory.c_str() );
+  if ( !dir )
+  {
+    return false;
+  }
+  for ( struct dirent * entry = readdir( dir ); entry; entry = readdir( dir ) )
+  {
+    if ( !IsDirectory( ( _directory + "/" + entry->d_name ).c_str() ) )
+    {
+      filenames.push_back( entry->d_name );
+    }
+  }
+  closedir( dir );
+#endif
+
+  std::sort( filenames.begin(), filenames.end() );
+  for ( int i = 0; i < filenames.size(); i++ )
+  {
+    std::string extension = GetExtension( filenames[ i ] );
+    if ( !extension.empty() && extensions.find( "," + extension + "," ) != std::string::npos )
+    {
+      _paths.push_back( _directory + "/" + filenames[ i ] );
+    }
+  }
+  return true;
+}
+
+bool ReadList( const char * _path, std::vector<std::string> & _paths )
+{
+  FILE * file = fopen( _path, "rb" );
+  if ( !file )
+  {
+    return false;
+  }
+  char line[ 4096 ];
+  while ( fgets( line, sizeof( line ), file ) )
+  {
+    std::string path = line;
+    path.erase( path.find_last_not_of( " \t\r\n" ) + 1 );
+    if ( !path.empty() )
+    {
+      _paths.push_back( path );
+    }
+  }
+  fclose( file );
+  return true;
+}
+
+// Imports stay on a single thread: Geometry's import shares one Assimp importer and logger. The decode of
+// each model's textures spreads over every core by itself.
+void ImportThread()
+{
+  std::unique_lock<std::mutex> lock( mutex );
+  while ( true )
+  {
+    workAvailable.wait( lock, []() { return quit || ( nextImport < models.size() && nextImport <= current + IMPORT_AHEAD_COUNT ); } );
+    if ( quit )
+    {
+      return;
+    }
+    int index = nextImport++;
+    std::string path = models[ index ].mPath;
+    lock.unlock();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Geometry * geometry = new Geometry();
+    geometry->mMergeStaticMeshes = mergeStaticMeshes;
+    bool succeeded = geometry->ImportMesh( path.c_str() );
+    if ( !succeeded )
+    {
+      printf( "[Batch] Failed to import '%s'\n", path.c_str() );
+      delete geometry;
+      geometry = NULL;
+    }
+    double importTime = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+    lock.lock();
+    models[ index ].mGeometry = geometry;
+    models[ index ].mImportTime = importTime;
+    models[ index ].mState = succeeded ? MODELSTATE_IMPORTED : MODELSTATE_FAILED;
+    modelImported.notify_all();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interface
+
+bool Open( const char * _input, const char * _outputDirectory, int _width, int _height, bool _mergeStaticMeshes )
+{
+  std::vector<std::string> paths;
+  if ( IsDirectory( _input ) ? !ListDirectory( _input, paths ) : !ReadList( _input, paths ) )
+  {
+    printf( "[Batch] Can't read '%s'\n", _input );
+    return false;
+  }
+  printf( "[Batch] %d models to render\n", (int) paths.size() );
+
+  outputDirectory = _outputDirectory;
+  MakeDirectory( _outputDirectory );
+  width = _width;
+  height = _height;
+  mergeStaticMeshes = _mergeStaticMeshes;
+  beginTime = std::chrono::steady_clock::now();
+
+  // Named after the model file, extension included, so model.obj and model.fbx don't overwrite each other
+  std::set<std::string> thumbnailNames;
+  for ( int i = 0; i < paths.size(); i++ )
+  {
+    std::string name = GetFilename( paths[ i ] );
+    if ( !thumbnailNames.insert( name ).second )
+    {
+      char suffix[ 16 ];
+      snprintf( suffix, 16, "_%d", i );
+      name += suffix;
+    }
+
+    Model model;
+    model.mPath = paths[ i ];
+    model.mThumbnailPath = outputDirectory + "/" + name + ".png";
+    model.mState = MODELSTATE_QUEUED;
+    model.mGeometry = NULL;
+    model.mImportTime = 0.0;
+    model.mMeshCount = 0;
+    model.mMaterialCount = 0;
+    model.mVertexCount = 0;
+    model.mTriangleCount = 0;
+    models.push_back( model );
+  }
+
+  nextImport = 0;
+  current = -1;
+  quit = false;
+  worker = std::thread( ImportThread );
+  return true;
+}
+
+Geometry * Next( std::string & _thumbnailPath )
+{
+  std::unique_lock<std::mutex> lock( mutex );
+  while ( ++current < models.size() )
+  {
+    workAvailable.notify_all();
+    modelImported.wait( lock, []() { return models[ current ].mState != MODELSTATE_QUEUED; } );
+    if ( models[ current ].mState == MODELSTATE_IMPORTED )
+    {
+      Geometry * geometry = models[ current ].mGeometry;
+      models[ current ].mGeometry = NULL;
+      _thumbnailPath = models[ current ].mThumbnailPath;
+      return geometry;
+    }
+  }
+  return NULL;
+}
+
+void Rendered( const Geometry & _model )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  Model & model = models[ current ];
+  model.mState = MODELSTATE_RENDERED;
+  model.mMaterialCount = (int) _model.mMaterials.size();
+  // Static batches sit next to the meshes merged into them: count the meshes of the file, and the geometry once
+  for ( std::map<int, Geometry::Mesh>::const_iterator it = _model.mMeshes.begin(); it != _model.mMeshes.end(); it++ )
+  {
+    if ( it->second.mSourceRanges.empty() )
+    {
+      model.mMeshCount++;
+    }
+    if ( it->second.mBatchMeshIndex < 0 )
+    {
+      model.mVertexCount += it->second.mVertexCount;
+      model.mTriangleCount += it->second.mTriangleCount;
+    }
+  }
+  model.mAABBMin = _model.mAABBMin;
+  model.mAABBMax = _model.mAABBMax;
+}
+
+void ThumbnailsFailed( const std::vector<std::string> & _thumbnailPaths )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  for ( int i = 0; i < models.size(); i++ )
+  {
+    if ( models[ i ].mState == MODELSTATE_RENDERED && std::find( _thumbnailPaths.begin(), _thumbnailPaths.end(), models[ i ].mThumbnailPath ) != _thumbnailPaths.end() )
+    {
+      models[ i ].mState = MODELSTATE_WRITE_FAILED;
+    }
+  }
+}
+
+jsonxx::Array ToArray( const glm::vec3 & _vector )
+{
+  jsonxx::Array array;
+  array << _vector.x << _vector.y << _vector.z;
+  return array;
+}
+
+bool Close()
+{
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    quit = true;
+    workAvailable.notify_all();
+  }
+  if ( worker.joinable() )
+  {
+    worker.join();
+  }
+
+  int renderedCount = 0;
+  jsonxx::Array entries;
+  for ( int i = 0; i < models.size(); i++ )
+  {
+    const Model & model = models[ i ];
+    delete model.mGeometry;
+
+    jsonxx::Object entry;
+    entry << "model" << model.mPath;
+    entry << "importMs" << model.mImportTime;
+    if ( model.mState == MODELSTATE_RENDERED )
+    {
+      entry << "thumbnail" << model.mThumbnailPath;
+      entry << "meshes" << model.mMeshCount;
+      entry << "materials" << model.mMaterialCount;
+      entry << "vertices" << model.mVertexCount;
+      entry << "triangles" << model.mTriangleCount;
+      entry << "aabbMin" << ToArray( model.mAABBMin );
+      entry << "aabbMax" << ToArray( model.mAABBMax );
+      renderedCount++;
+    }
+    else
+    {
+      entry << "error" << ( model.mState == MODELSTATE_FAILED ? "import failed" : model.mState == MODELSTATE_WRITE_FAILED ? "thumbnail write failed" : "not rendered" );
+    }
+    entries << entry;
+  }
+
+  double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - beginTime ).count();
+  jsonxx::Object manifest;
+  manifest << "width" << width;
+  manifest << "height" << height;
+  manifest << "seconds" << seconds;
+  manifest << "models" << entries;
+
+  printf( "[Batch] Rendered %d of %d models in %.1f s (%.0f per minute)\n", renderedCount, (int) models.size(), seconds, seconds > 0.0 ? renderedCount * 60.0 / seconds : 0.0 );
+  models.clear();
+
+  std::string manifestPath = outputDirectory + "/manifest.json";
+  FILE * file = fopen( manifestPath.c_str(), "wb" );
+  if ( !file )
+  {
+    printf( "[Batch] Failed to write '%s'\n", manifestPath.c_str() );
+    return false;
+  }
+  std::string json = manifest.json();
+  fwrite( json.c_str(), 1, json.size(), file );
+  fclose( file );
+  return true;
+}
+
+}
@@ -0,0 +1,20 @@
+#include <string>
+#include <vector>
+
+// Thumbnails for a whole set of models in one run: the models are imported on a worker thread ahead of the
+// one being rendered, and a manifest.json describing all of them is written next to the thumbnails.
+namespace Batch
+{
+  // Takes every model with a supported extension in a directory, or one path per line of a text file, and
+  // starts importing them; _width and _height only go into the manifest
+  bool Open( const char * _input, const char * _outputDirectory, int _width, int _height, bool _mergeStaticMeshes );
+  // Blocks until the next model is imported and hands it over, to be uploaded and deleted by the caller;
+  // NULL once there are no more. Models that failed to import are skipped and listed as such in the manifest.
+  Geometry * Next( std::string & _thumbnailPath );
+  // Records the model last handed out by Next(), now uploaded into _model, in the manifest
+  void Rendered( const Geometry & _model );
+  // Thumbnails are written after Rendered(), in the background; marks the models whose thumbnail couldn't be
+  void ThumbnailsFailed( const std::vector<std::string> & _thumbnailPaths );
+  // Stops importing and writes the manifest
+  bool Close();
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define GLEW_NO_GLU
+#include "GL/glew.h"
+
+#include "Capture.h"
+#include "Parallel.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define PIPE_MODE "wb"
+#else
+#define PIPE_MODE "w"
+#endif
+
+namespace Capture
+{
+
+bool WritePNG( const char * _path, int _width, int _height, const unsigned char * _rgba )
+{
+  std::vector<unsigned char> rgb( _width * _height * 3 );
+  for ( int i = 0; i < _width * _height; i++ )
+  {
+    rgb[ i * 3 + 0 ] = _rgba[ i * 4 + 0 ];
+    rgb[ i * 3 + 1 ] = _rgba[ i * 4 + 1 ];
+    rgb[ i * 3 + 2 ] = _rgba[ i * 4 + 2 ];
+  }
+
+  if ( !stbi_write_png( _path, _width, _height, 3, rgb.data(), _width * 3 ) )
+  {
+    printf( "[Capture] Failed to write '%s'\n", _path );
+    return false;
+  }
+  printf( "[Capture] Wrote %dx%d image to '%s'\n", _width, _height, _path );
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sequences
+
+// Enough frames in flight for the copy to be done by the time its buffer comes around again
+const int READBACK_BUFFER_COUNT = 4;
+
+struct Readback
+{
+  unsigned int mGLBufferID;
+  GLsync mFence; // NULL if the buffer is free
+  int mFrame;
+  std::string mPath;
+};
+
+struct Frame
+{
+  int mIndex;
+  std::string mPath;
+  std::vector<unsigned char> mPixels; // bottom row first, as GL reads them
+};
+
+std::string outputPattern;
+FILE * pipeFile = NULL;
+int width = 0;
+int height = 0;
+
+Readback readbacks[ READBACK_BUFFER_COUNT ];
+int nextReadback = 0;
+int frameCount = 0;
+
+std::mutex mutex;
+std::condition_variable frameQueued;
+std::condition_variable frameTaken;
+std::deque<Frame *> queue;
+std::vector<std::thread> encoders;
+bool closing = false;
+bool failed = false;
+std::vector<std::string> failedPaths; // of the images that couldn't be written
+
+void Flip( std::vector<unsigned char> & _pixels )
+{
+  std::vector<unsigned char> row( width * 4 );
+  for ( int y = 0; y < height / 2; y++ )
+  {
+    unsigned char * top = &_pixels[ y * width * 4 ];
+    unsigned char * bottom = &_pixels[ ( height - 1 - y ) * width * 4 ];
+    memcpy( &row[ 0 ], top, width * 4 );
+    memcpy( top, bottom, width * 4 );
+    memcpy( bottom, &row[ 0 ], width * 4 );
+  }
+}
+
+std::string GetFramePath( int _index, const std::string & _path )
+{
+  if ( !_path.empty() )
+  {
+    return _path;
+  }
+  char path[ 1024 ];
+  snprintf( path, 1024, outputPattern.c_str(), _index );
+  return path;
+}
+
+// Frames come off the queue in order, which is what keeps the piped stream in order: there's only one
+// encoder thread then
+void EncoderThread()
+{
+  while ( true )
+  {
+    Frame * frame = NULL;
+    {
+      std::unique_lock<std::mutex> lock( mutex );
+      frameQueued.wait( lock, []() { return closing || !queue.empty(); } );
+      if ( queue.empty() )
+      {
+        return;
+      }
+      frame = queue.front();
+      queue.pop_front();
+      frameTaken.notify_all();
+    }
+
+    Flip( frame->mPixels );
+
+    bool succeeded = true;
+    if ( pipeFile )
+    {
+      succeeded = fwrite( &frame->mPixels[ 0 ], 1, frame->mPixels.size(), pipeFile ) == frame->mPixels.size();
+      if ( !succeeded )
+      {
+        printf( "[Capture] Writing frame %d to the pipe failed\n", frame->mIndex );
+      }
+    }
+    else
+    {
+      std::string path = GetFramePath( frame->mIndex, frame->mPath );
+      succeeded = WritePNG( path.c_str(), width, height, &frame->mPixels[ 0 ] );
+      if ( !succeeded )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        failedPaths.push_back( path );
+      }
+    }
+    delete frame;
+
+    if ( !succeeded )
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      failed = true;
+    }
+  }
+}
+
+// Maps the buffer once the GPU is done copying into it, and hands the pixels to the encoders
+void FinishReadback( Readback & _readback )
+{
+  glClientWaitSync( _readback.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED );
+  glDeleteSync( _readback.mFence );
+  _readback.mFence = NULL;
+
+  Frame * frame = new Frame();
+  frame->mIndex = _readback.mFrame;
+  frame->mPath = _readback.mPath;
+  frame->mPixels.resize( width * height * 4 );
+
+  glBindBuffer( GL_PIXEL_PACK_BUFFER, _readback.mGLBufferID );
+  const void * data = glMapBufferRange( GL_PIXEL_PACK_BUFFER, 0, frame->mPixels.size(), GL_MAP_READ_BIT );
+  if ( data )
+  {
+    memcpy( &frame->mPixels[ 0 ], data, frame->mPixels.size() );
+    glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+  }
+  glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+  std::unique_lock<std::mutex> lock( mutex );
+  if ( !data )
+  {
+    printf( "[Capture] Mapping frame %d failed\n", frame->mIndex );
+    failed = true;
+    if ( !pipeFile )
+    {
+      failedPaths.push_back( GetFramePath( frame->mIndex, frame->mPath ) );
+    }
+    delete frame;
+    return;
+  }
+
+  // Keeps memory in check if the encoders fall behind; then they're what limits the export anyway
+  frameTaken.wait( lock, []() { return queue.size() < encoders.size() * 2; } );
+  queue.push_back( frame );
+  frameQueued.notify_one();
+}
+
+bool OpenSequence( const char * _output, const char * _pipeCommand, int _width, int _height )
+{
+  width = _width;
+  height = _height;
+  outputPattern = _output ? _output : "";
+  frameCount = 0;
+  nextReadback = 0;
+  closing = false;
+  failed = false;
+  failedPaths.clear();
+
+  if ( _pipeCommand && *_pipeCommand )
+  {
+    pipeFile = popen( _pipeCommand, PIPE_MODE );
+    if ( !pipeFile )
+    {
+      printf( "[Capture] Failed to start '%s'\n", _pipeCommand );
+      return false;
+    }
+    printf( "[Capture] Piping %dx%d RGBA frames to '%s'\n", width, height, _pipeCommand );
+  }
+
+  for ( int i = 0; i < READBACK_BUFFER_COUNT; i++ )
+  {
+    glGenBuffers( 1, &readbacks[ i ].mGLBufferID );
+    glBindBuffer( GL_PIXEL_PACK_BUFFER, readbacks[ i ].mGLBufferID );
+    glBufferData( GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ );
+    readbacks[ i ].mFence = NULL;
+    readbacks[ i ].mFrame = -1;
+  }
+  glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+  int encoderCount = pipeFile ? 1 : Parallel::GetThreadCount();
+  for ( int i = 0; i < encoderCount; i++ )
+  {
+    encoders.push_back( std::thread( EncoderThread ) );
+  }
+  return true;
+}
+
+void CaptureFrame( const char * _path )
+{
+  Readback & readback = readbacks[ nextReadback ];
+  nextReadback = ( nextReadback + 1 ) % READBACK_BUFFER_COUNT;
+
+  // The oldest frame in flight, issued READBACK_BUFFER_COUNT frames ago
+  if ( readback.mFence )
+  {
+    FinishReadback( readback );
+  }
+
+  glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+  glBindBuffer( GL_PIXEL_PACK_BUFFER, readback.mGLBufferID );
+  glReadPixels( 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+  glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+  readback.mFence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+  readback.mFrame = frameCount++;
+  readback.mPath = _path ? _path : "";
+}
+
+bool CloseSequence( std::vector<std::string> * _failedPaths )
+{
+  // Oldest first
+  for ( int i = 0; i < READBACK_BUFFER_COUNT; i++ )
+  {
+    Readback & readback = readbacks[ ( nextReadback + i ) % READBACK_BUFFER_COUNT ];
+    if ( readback.mFence )
+    {
+      FinishReadback( readback );
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    closing = true;
+    frameQueued.notify_all();
+  }
+  for ( int i = 0; i < encoders.size(); i++ )
+  {
+    encoders[ i ].join();
+  }
+  encoders.clear();
+
+  for ( int i = 0; i < READBACK_BUFFER_COUNT; i++ )
+  {
+    glDeleteBuffers( 1, &readbacks[ i ].mGLBufferID );
+    readbacks[ i ].mGLBufferID = 0;
+  }
+
+  if ( pipeFile )
+  {
+    failed = pclose( pipeFile ) != 0 || failed;
+    pipeFile = NULL;
+  }
+
+  printf( "[Capture] %s %d frames\n", failed ? "Failed to write some of" : "Wrote", frameCount );
+  if ( _failedPaths )
+  {
+    *_failedPaths = failedPaths;
+  }
+  return !failed;
+}
+
+}
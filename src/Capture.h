@@ -0,0 +1,20 @@
+#include <string>
+#include <vector>
+
+// Writing rendered frames to disk
+namespace Capture
+{
+  // Writes top-down RGBA8 pixels as an RGB PNG; the alpha channel only holds whatever the blending left in it
+  bool WritePNG( const char * _path, int _width, int _height, const unsigned char * _rgba );
+
+  // Image sequences: frames are read back through a ring of pixel buffers, so reading one never waits for the GPU
+  // to finish it, and they're encoded on worker threads. _output is a printf pattern for the frame number
+  // (e.g. "frame_%04d.png"); with a _pipeCommand, raw top-down RGBA8 frames go to that command's stdin instead.
+  bool OpenSequence( const char * _output, const char * _pipeCommand, int _width, int _height );
+  // Queues the readback of what has been rendered into the current framebuffer so far; call from the GL thread.
+  // _path names this frame's image instead of the pattern.
+  void CaptureFrame( const char * _path = NULL );
+  // Reads back and encodes the frames still in flight; returns whether every frame was written. The paths of the
+  // images that weren't go into _failedPaths.
+  bool CloseSequence( std::vector<std::string> * _failedPaths = NULL );
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "FileWatcher.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+namespace FileWatcher
+{
+
+struct WatchedFile
+{
+  std::string mPath;
+  std::string mDirectory;
+  std::string mFilename;
+  int mWatchDescriptor;
+  time_t mModificationTime;
+};
+
+std::vector<WatchedFile> watchedFiles;
+
+#ifdef __linux__
+int inotifyDescriptor = -1;
+#endif
+
+time_t GetModificationTime( const char * _path )
+{
+  struct stat status;
+  if ( stat( _path, &status ) != 0 )
+  {
+    return 0;
+  }
+  return status.st_mtime;
+}
+
+bool Open()
+{
+#ifdef __linux__
+  inotifyDescriptor = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+  if ( inotifyDescriptor < 0 )
+  {
+    printf( "[FileWatcher] inotify unavailable, falling back to polling\n" );
+  }
+#endif
+  return true;
+}
+
+void Watch( const char * _path )
+{
+  for ( int i = 0; i < watchedFiles.size(); i++ )
+  {
+    if ( watchedFiles[ i ].mPath == _path )
+    {
+      return;
+    }
+  }
+
+  WatchedFile file;
+  file.mPath = _path;
+  size_t separator = file.mPath.find_last_of( "/\\" );
+  file.mDirectory = separator == std::string::npos ? "." : file.mPath.substr( 0, separator );
+  file.mFilename = separator == std::string::npos ? file.mPath : file.mPath.substr( separator + 1 );
+  file.mWatchDescriptor = -1;
+  file.mModificationTime = GetModificationTime( _path );
+
+#ifdef __linux__
+  if ( inotifyDescriptor >= 0 )
+  {
+    // Watch the directory rather than the file: editors tend to save by writing a new file and renaming it over the old one.
+    // Not IN_CREATE, a recreated file is still empty then; its IN_CLOSE_WRITE follows once it has been written
+    file.mWatchDescriptor = inotify_add_watch( inotifyDescriptor, file.mDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO );
+    if ( file.mWatchDescriptor < 0 )
+    {
+      printf( "[FileWatcher] Can't watch '%s', falling back to polling\n", file.mDirectory.c_str() );
+    }
+  }
+#endif
+
+  watchedFiles.push_back( file );
+}
+
+void AddChange( std::vector<std::string> & _changedPaths, const std::string & _path )
+{
+  if ( std::find( _changedPaths.begin(), _changedPaths.end(), _path ) == _changedPaths.end() )
+  {
+    _changedPaths.push_back( _path );
+  }
+}
+
+bool PollChanges( std::vector<std::string> & _changedPaths )
+{
+  size_t previousCount = _changedPaths.size();
+
+#ifdef __linux__
+  if ( inotifyDescriptor >= 0 )
+  {
+    char buffer[ 4096 ] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while ( true )
+    {
+      ssize_t length = read( inotifyDescriptor, buffer, sizeof( buffer ) );
+      if ( length <= 0 )
+      {
+        break;
+      }
+
+      for ( char * ptr = buffer; ptr < buffer + length; )
+      {
+        const struct inotify_event * event = (const struct inotify_event *) ptr;
+        for ( int i = 0; i < watchedFiles.size(); i++ )
+        {
+          if ( event->len && watchedFiles[ i ].mWatchDescriptor == event->wd && watchedFiles[ i ].mFilename == event->name )
+          {
+            AddChange( _changedPaths, watchedFiles[ i ].mPath );
+          }
+        }
+        ptr += sizeof( struct inotify_event ) + event->len;
+      }
+    }
+  }
+#endif
+
+  for ( int i = 0; i < watchedFiles.size(); i++ )
+  {
+    WatchedFile & file = watchedFiles[ i ];
+    if ( file.mWatchDescriptor >= 0 )
+    {
+      continue;
+    }
+
+    time_t modificationTime = GetModificationTime( file.mPath.c_str() );
+    if ( modificationTime != file.mModificationTime )
+    {
+      file.mModificationTime = modificationTime;
+      AddChange( _changedPaths, file.mPath );
+    }
+  }
+
+  return _changedPaths.size() != previousCount;
+}
+
+void Close()
+{
+#ifdef __linux__
+  if ( inotifyDescriptor >= 0 )
+  {
+    close( inotifyDescriptor );
+    inotifyDescriptor = -1;
+  }
+#endif
+  watchedFiles.clear();
+}
+
+}
@@ -0,0 +1,12 @@
+#include <string>
+#include <vector>
+
+// Reports when watched files change on disk; uses inotify on Linux, and polls modification times elsewhere
+namespace FileWatcher
+{
+  bool Open();
+  void Watch( const char * _path );
+  // Appends the path of every watched file that changed since the last call, as it was passed to Watch()
+  bool PollChanges( std::vector<std::string> & _changedPaths );
+  void Close();
+}
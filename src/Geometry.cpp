@@ -1,4 +1,6 @@
 #include "Geometry.h"
+#include "Parallel.h"
+#include "Profiler.h"
 
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -13,6 +15,8 @@
 #include <glm.hpp>
 #include <common.hpp>
 
+#include <algorithm>
+
 #ifdef min
 #undef min
 #endif
@@ -22,17 +26,6 @@
 
 Assimp::Importer gImporter;
 
-#pragma pack(1)
-struct Vertex
-{
-  glm::vec3 v3Vector;
-  glm::vec3 v3Normal;
-  glm::vec3 v3Tangent;
-  glm::vec3 v3Binormal;
-  glm::vec2 fTexcoord;
-};
-#pragma pack()
-
 // Transform an AABB into an OBB, and return its AABB
 void TransformBoundingBox( const glm::vec3 & inMin, const glm::vec3 & inMax, const glm::mat4x4 & m, glm::vec3 & outMin, glm::vec3 & outMax )
 {
@@ -49,7 +42,7 @@ void TransformBoundingBox( const glm::vec3 & inMin, const glm::vec3 & inMax, con
   outMax = glm::max( xa, xb ) + glm::max( ya, yb ) + glm::max( za, zb ) + glm::vec3( m[ 4 - 1 ][ 1 - 1 ], m[ 4 - 1 ][ 2 - 1 ], m[ 4 - 1 ][ 3 - 1 ] );
 }
 
-Renderer::Texture * LoadTexture( const char * _type, const aiString & _path, const std::string & _folder, const bool _loadAsSRGB = false )
+Renderer::Image * LoadTexture( const char * _type, const aiString & _path, const std::string & _folder, const bool _loadAsSRGB = false )
 {
   std::string filename( _path.data, _path.length );
 
@@ -64,18 +57,17 @@ Renderer::Texture * LoadTexture( const char * _type, const aiString & _path, con
 
   printf( "[geometry] Loading %s texture: '%s'\n", _type, filename.c_str() );
 
-  Renderer::Texture * texture = Renderer::CreateRGBA8TextureFromFile( filename.c_str() );
-  if ( texture )
+  Renderer::Image * image = new Renderer::Image();
+  if ( Renderer::LoadImageFromFile( filename.c_str(), *image ) )
   {
-    return texture;
+    return image;
   }
 
   filename = _folder + filename;
 
-  texture = Renderer::CreateRGBA8TextureFromFile( filename.c_str(), _loadAsSRGB );
-  if ( texture )
+  if ( Renderer::LoadImageFromFile( filename.c_str(), *image, _loadAsSRGB ) )
   {
-    return texture;
+    return image;
   }
 
   std::string extless = filename.substr( 0, filename.find_last_of( '.' ) );
@@ -84,27 +76,42 @@ Renderer::Texture * LoadTexture( const char * _type, const aiString & _path, con
   for ( int i = 0; extensions[ i ]; i++ )
   {
     std::string replacementFilename = extless + extensions[ i ];
-    texture = Renderer::CreateRGBA8TextureFromFile( replacementFilename.c_str(), _loadAsSRGB );
-    if ( texture )
+    if ( Renderer::LoadImageFromFile( replacementFilename.c_str(), *image, _loadAsSRGB ) )
     {
       printf( "[geometry] Replacement %s texture found: '%s'\n", _type, replacementFilename.c_str() );
-      return texture;
+      return image;
     }
   }
 
   printf( "[geometry] WARNING: Texture loading (%s) failed: '%s'\n", _type, filename.c_str() );
+  delete image;
   return NULL;
 }
 
-bool LoadColorMap( aiMaterial * _material, Geometry::ColorMap & _colorMap, aiTextureType _semantic, const char * _semanticText, const std::string & _folder, bool _loadAsSRGB = false )
+// A texture referenced by a material; they're all decoded in one go once every material has been read
+struct TextureLoad
+{
+  Geometry::ColorMap * mColorMap;
+  const char * mType;
+  aiString mPath;
+  bool mLoadAsSRGB;
+};
+
+bool LoadColorMap( aiMaterial * _material, Geometry::ColorMap & _colorMap, aiTextureType _semantic, const char * _semanticText, std::vector<TextureLoad> & _textureLoads, bool _loadAsSRGB = false )
 {
   bool success = false;
   _colorMap.mTexture = NULL;
+  _colorMap.mImage = NULL;
 
   aiString str;
   if ( aiGetMaterialString( _material, AI_MATKEY_TEXTURE( _semantic, 0 ), &str ) == AI_SUCCESS )
   {
-    _colorMap.mTexture = LoadTexture( _semanticText, str, _folder, _loadAsSRGB );
+    TextureLoad load;
+    load.mColorMap = &_colorMap;
+    load.mType = _semanticText;
+    load.mPath = str;
+    load.mLoadAsSRGB = _loadAsSRGB;
+    _textureLoads.push_back( load );
     _colorMap.mValid = true;
     success = true;
   }
@@ -133,6 +140,19 @@ bool LoadColorMap( aiMaterial * _material, Geometry::ColorMap & _colorMap, aiTex
   return success;
 }
 
+const int COLORMAP_COUNT = 8;
+void GetColorMaps( Geometry::Material & _material, Geometry::ColorMap * _colorMaps[ COLORMAP_COUNT ] )
+{
+  _colorMaps[ 0 ] = &_material.mColorMapDiffuse;
+  _colorMaps[ 1 ] = &_material.mColorMapNormals;
+  _colorMaps[ 2 ] = &_material.mColorMapSpecular;
+  _colorMaps[ 3 ] = &_material.mColorMapAlbedo;
+  _colorMaps[ 4 ] = &_material.mColorMapRoughness;
+  _colorMaps[ 5 ] = &_material.mColorMapMetallic;
+  _colorMaps[ 6 ] = &_material.mColorMapAO;
+  _colorMaps[ 7 ] = &_material.mColorMapAmbient;
+}
+
 int gNodeCount = 0;
 void ParseNode( Geometry * _geometry, const aiScene * scene, aiNode * sceneNode, int nParentIndex )
 {
@@ -157,6 +177,128 @@ void ParseNode( Geometry * _geometry, const aiScene * scene, aiNode * sceneNode,
   }
 }
 
+// Meshes above this size are left alone; merging them saves little and makes them expensive to pick apart
+const int STATIC_BATCH_MAX_VERTICES = 4096;
+
+// Pre-transforms every small mesh that is referenced by exactly one node into world space,
+// and concatenates them into one mesh per material. The source meshes stay in the mesh list
+// (for the node tree) but aren't drawn; each batch keeps the node / mesh of every range in it.
+void MergeStaticMeshes( Geometry * _geometry, std::vector<Geometry::Vertex> & _vertices, std::vector<unsigned int> & _indices, int _firstBatchIndex )
+{
+  std::map<int, int> referenceCount;
+  std::map<int, int> referencingNode;
+  for ( std::map<int, Geometry::Node>::iterator it = _geometry->mNodes.begin(); it != _geometry->mNodes.end(); it++ )
+  {
+    for ( int i = 0; i < it->second.mMeshes.size(); i++ )
+    {
+      referenceCount[ it->second.mMeshes[ i ] ]++;
+      referencingNode[ it->second.mMeshes[ i ] ] = it->second.mID;
+    }
+  }
+
+  std::map<int, std::vector<int>> meshesByMaterial;
+  for ( std::map<int, Geometry::Mesh>::iterator it = _geometry->mMeshes.begin(); it != _geometry->mMeshes.end(); it++ )
+  {
+    if ( referenceCount[ it->first ] == 1 && it->second.mVertexCount <= STATIC_BATCH_MAX_VERTICES )
+    {
+      meshesByMaterial[ it->second.mMaterialIndex ].push_back( it->first );
+    }
+  }
+
+  std::vector<Geometry::Vertex> vertices;
+  std::vector<unsigned int> indices;
+  vertices.reserve( _vertices.size() );
+  indices.reserve( _indices.size() );
+
+  // Compact the meshes that stay as they are...
+  for ( std::map<int, Geometry::Mesh>::iterator it = _geometry->mMeshes.begin(); it != _geometry->mMeshes.end(); it++ )
+  {
+    Geometry::Mesh & mesh = it->second;
+    std::vector<int> & candidates = meshesByMaterial[ mesh.mMaterialIndex ];
+    if ( candidates.size() > 1 && std::find( candidates.begin(), candidates.end(), it->first ) != candidates.end() )
+    {
+      continue;
+    }
+
+    int baseVertex = (int) vertices.size();
+    int firstIndex = (int) indices.size();
+    vertices.insert( vertices.end(), _vertices.begin() + mesh.mBaseVertex, _vertices.begin() + mesh.mBaseVertex + mesh.mVertexCount );
+    indices.insert( indices.end(), _indices.begin() + mesh.mFirstIndex, _indices.begin() + mesh.mFirstIndex + mesh.mTriangleCount * 3 );
+    mesh.mBaseVertex = baseVertex;
+    mesh.mFirstIndex = firstIndex;
+  }
+
+  // ...and append the batches after them
+  int batchIndex = _firstBatchIndex;
+  int mergedCount = 0;
+  for ( std::map<int, std::vector<int>>::iterator it = meshesByMaterial.begin(); it != meshesByMaterial.end(); it++ )
+  {
+    if ( it->second.size() < 2 )
+    {
+      continue;
+    }
+
+    Geometry::Mesh batch;
+    batch.mVertexArrayObject = 0;
+    batch.mBatchMeshIndex = -1;
+    batch.mMaterialIndex = it->first;
+    batch.mBaseVertex = (int) vertices.size();
+    batch.mFirstIndex = (int) indices.size();
+    batch.mVertexCount = 0;
+    batch.mTriangleCount = 0;
+    batch.mFirstInstance = 0;
+    batch.mInstanceCount = 0;
+
+    for ( int i = 0; i < it->second.size(); i++ )
+    {
+      Geometry::Mesh & mesh = _geometry->mMeshes[ it->second[ i ] ];
+      const glm::mat4x4 & world = _geometry->mMatrices[ referencingNode[ it->second[ i ] ] ];
+      const glm::mat3x3 rotation( world );
+
+      Geometry::SourceRange range;
+      range.mNodeID = referencingNode[ it->second[ i ] ];
+      range.mMeshIndex = it->second[ i ];
+      range.mFirstTriangle = batch.mTriangleCount;
+      range.mTriangleCount = mesh.mTriangleCount;
+      batch.mSourceRanges.push_back( range );
+
+      for ( int j = 0; j < mesh.mVertexCount; j++ )
+      {
+        Geometry::Vertex vertex = _vertices[ mesh.mBaseVertex + j ];
+        vertex.v3Vector = glm::vec3( world * glm::vec4( vertex.v3Vector, 1.0f ) );
+        vertex.v3Normal = glm::normalize( rotation * vertex.v3Normal );
+        vertex.v3Tangent = rotation * vertex.v3Tangent;
+        vertex.v3Binormal = rotation * vertex.v3Binormal;
+        if ( batch.mVertexCount == 0 && j == 0 )
+        {
+          batch.mAABBMin = batch.mAABBMax = vertex.v3Vector;
+        }
+        batch.mAABBMin = glm::min( batch.mAABBMin, vertex.v3Vector );
+        batch.mAABBMax = glm::max( batch.mAABBMax, vertex.v3Vector );
+        vertices.push_back( vertex );
+      }
+      for ( int j = 0; j < mesh.mTriangleCount * 3; j++ )
+      {
+        indices.push_back( _indices[ mesh.mFirstIndex + j ] + batch.mVertexCount );
+      }
+
+      batch.mVertexCount += mesh.mVertexCount;
+      batch.mTriangleCount += mesh.mTriangleCount;
+
+      mesh.mBatchMeshIndex = batchIndex;
+      mergedCount++;
+    }
+
+    _geometry->mMeshes.insert( { batchIndex, batch } );
+    batchIndex++;
+  }
+
+  printf( "[geometry] Merged %d static meshes into %d batches\n", mergedCount, batchIndex - _firstBatchIndex );
+
+  _vertices.swap( vertices );
+  _indices.swap( indices );
+}
+
 class GeometryLogging : public Assimp::LogStream
 {
 public:
@@ -167,7 +309,20 @@ public:
 };
 
 Geometry::Geometry()
-  : mMatrices( NULL )
+  : mMergeStaticMeshes( false )
+  , mMatrices( NULL )
+  , mVertexBufferObject( 0 )
+  , mIndexBufferObject( 0 )
+  , mVertexArrayObject( 0 )
+  , mInstanceBufferObject( 0 )
+  , mIndirectBufferObject( 0 )
+  , mUseMultiDrawIndirect( true )
+  , mStaging( NULL )
+  , mCommandListShader( NULL )
+  , mCommandListProgram( 0 )
+  , mCommandListVariants( NULL )
+  , mCommandListFeatures( 0 )
+  , mCommandListMultiDrawIndirect( false )
   , mAABBMin( 0.0f )
   , mAABBMax( 0.0f )
 {
@@ -182,6 +337,24 @@ bool Geometry::LoadMesh( const char * _path )
 {
   UnloadMesh();
 
+  Geometry imported;
+  imported.mMergeStaticMeshes = mMergeStaticMeshes;
+  {
+    Profiler::CPUScope scope( "Import" );
+    if ( !imported.ImportMesh( _path ) )
+    {
+      return false;
+    }
+  }
+
+  Profiler::CPUScope scope( "Upload" );
+  UploadMesh( imported );
+
+  return true;
+}
+
+bool Geometry::ImportMesh( const char * _path )
+{
   std::string path = _path;
   std::string folder;
   if ( path.find( '\\' ) != -1 )
@@ -245,6 +418,12 @@ bool Geometry::LoadMesh( const char * _path )
   }
 
   printf( "[geometry] Loading %d meshes\n", scene->mNumMeshes );
+
+  // Every mesh lives in one shared vertex and index buffer, so the whole model can
+  // also be submitted with a handful of multi-draw calls
+  mStaging = new Staging();
+  std::vector<Vertex> & vertices = mStaging->mVertices;
+  std::vector<unsigned int> & indices = mStaging->mIndices;
   for ( unsigned int i = 0; i < scene->mNumMeshes; i++ )
   {
     aiMesh * sceneMesh = scene->mMeshes[ i ];
@@ -256,72 +435,66 @@ bool Geometry::LoadMesh( const char * _path )
 
     Mesh mesh;
 
-    glGenVertexArrays( 1, &mesh.mVertexArrayObject );
-    glGenBuffers( 1, &mesh.mVertexBufferObject );
-    glGenBuffers( 1, &mesh.mIndexBufferObject );
-
-    glBindVertexArray( mesh.mVertexArrayObject );
-    glBindBuffer( GL_ARRAY_BUFFER, mesh.mVertexBufferObject );
-    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.mIndexBufferObject );
-
+    mesh.mVertexArrayObject = 0;
+    mesh.mBatchMeshIndex = -1;
     mesh.mVertexCount = sceneMesh->mNumVertices;
+    mesh.mBaseVertex = (int) vertices.size();
+    vertices.resize( vertices.size() + mesh.mVertexCount );
 
-    Vertex * vertices = new Vertex[ mesh.mVertexCount ];
+    Vertex * meshVertices = &vertices[ mesh.mBaseVertex ];
     for ( unsigned int j = 0; j < sceneMesh->mNumVertices; j++ )
     {
-      vertices[ j ].v3Vector.x = sceneMesh->mVertices[ j ].x;
-      vertices[ j ].v3Vector.y = sceneMesh->mVertices[ j ].y;
-      vertices[ j ].v3Vector.z = sceneMesh->mVertices[ j ].z;
-      vertices[ j ].v3Normal.x = sceneMesh->mNormals[ j ].x;
-      vertices[ j ].v3Normal.y = sceneMesh->mNormals[ j ].y;
-      vertices[ j ].v3Normal.z = sceneMesh->mNormals[ j ].z;
-      vertices[ j ].v3Tangent.x = 0.0f;
-      vertices[ j ].v3Tangent.y = 0.0f;
-      vertices[ j ].v3Tangent.z = 0.0f;
+      meshVertices[ j ].v3Vector.x = sceneMesh->mVertices[ j ].x;
+      meshVertices[ j ].v3Vector.y = sceneMesh->mVertices[ j ].y;
+      meshVertices[ j ].v3Vector.z = sceneMesh->mVertices[ j ].z;
+      meshVertices[ j ].v3Normal.x = sceneMesh->mNormals[ j ].x;
+      meshVertices[ j ].v3Normal.y = sceneMesh->mNormals[ j ].y;
+      meshVertices[ j ].v3Normal.z = sceneMesh->mNormals[ j ].z;
+      meshVertices[ j ].v3Tangent.x = 0.0f;
+      meshVertices[ j ].v3Tangent.y = 0.0f;
+      meshVertices[ j ].v3Tangent.z = 0.0f;
       if ( sceneMesh->mTangents )
       {
-        vertices[ j ].v3Tangent.x = sceneMesh->mTangents[ j ].x;
-        vertices[ j ].v3Tangent.y = sceneMesh->mTangents[ j ].y;
-        vertices[ j ].v3Tangent.z = sceneMesh->mTangents[ j ].z;
+        meshVertices[ j ].v3Tangent.x = sceneMesh->mTangents[ j ].x;
+        meshVertices[ j ].v3Tangent.y = sceneMesh->mTangents[ j ].y;
+        meshVertices[ j ].v3Tangent.z = sceneMesh->mTangents[ j ].z;
       }
-      vertices[ j ].v3Binormal.x = 0.0f;
-      vertices[ j ].v3Binormal.y = 0.0f;
-      vertices[ j ].v3Binormal.z = 0.0f;
+      meshVertices[ j ].v3Binormal.x = 0.0f;
+      meshVertices[ j ].v3Binormal.y = 0.0f;
+      meshVertices[ j ].v3Binormal.z = 0.0f;
       if ( sceneMesh->mBitangents )
       {
-        vertices[ j ].v3Binormal.x = sceneMesh->mBitangents[ j ].x;
-        vertices[ j ].v3Binormal.y = sceneMesh->mBitangents[ j ].y;
-        vertices[ j ].v3Binormal.z = sceneMesh->mBitangents[ j ].z;
+        meshVertices[ j ].v3Binormal.x = sceneMesh->mBitangents[ j ].x;
+        meshVertices[ j ].v3Binormal.y = sceneMesh->mBitangents[ j ].y;
+        meshVertices[ j ].v3Binormal.z = sceneMesh->mBitangents[ j ].z;
       }
       if ( sceneMesh->GetNumUVChannels() )
       {
-        vertices[ j ].fTexcoord.x = sceneMesh->mTextureCoords[ 0 ][ j ].x;
-        vertices[ j ].fTexcoord.y = sceneMesh->mTextureCoords[ 0 ][ j ].y;
+        meshVertices[ j ].fTexcoord.x = sceneMesh->mTextureCoords[ 0 ][ j ].x;
+        meshVertices[ j ].fTexcoord.y = sceneMesh->mTextureCoords[ 0 ][ j ].y;
       }
       else
       {
-        vertices[ j ].fTexcoord.x = 0.0f;
-        vertices[ j ].fTexcoord.y = 0.0f;
+        meshVertices[ j ].fTexcoord.x = 0.0f;
+        meshVertices[ j ].fTexcoord.y = 0.0f;
       }
 
       if ( j == 0 )
       {
-        mesh.mAABBMin = mesh.mAABBMax = vertices[ j ].v3Vector;
+        mesh.mAABBMin = mesh.mAABBMax = meshVertices[ j ].v3Vector;
       }
       else
       {
-        mesh.mAABBMin = glm::min( mesh.mAABBMin, vertices[ j ].v3Vector );
-        mesh.mAABBMax = glm::max( mesh.mAABBMax, vertices[ j ].v3Vector );
+        mesh.mAABBMin = glm::min( mesh.mAABBMin, meshVertices[ j ].v3Vector );
+        mesh.mAABBMax = glm::max( mesh.mAABBMax, meshVertices[ j ].v3Vector );
       }
     }
 
-    glBufferData( GL_ARRAY_BUFFER, sizeof( Vertex ) * mesh.mVertexCount, vertices, GL_STATIC_DRAW );
-
-    delete[] vertices;
-
     mesh.mTriangleCount = sceneMesh->mNumFaces;
+    mesh.mFirstIndex = (int) indices.size();
+    indices.resize( indices.size() + sceneMesh->mNumFaces * 3 );
 
-    unsigned int * faces = new unsigned int[ sceneMesh->mNumFaces * 3 ];
+    unsigned int * faces = &indices[ mesh.mFirstIndex ];
 
     for ( unsigned int j = 0; j < sceneMesh->mNumFaces; j++ )
     {
@@ -330,15 +503,90 @@ bool Geometry::LoadMesh( const char * _path )
       faces[ j * 3 + 2 ] = sceneMesh->mFaces[ j ].mIndices[ 2 ];
     }
 
-    glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof( unsigned int ) * sceneMesh->mNumFaces * 3, faces, GL_STATIC_DRAW );
-
-    delete[] faces;
-
     mesh.mMaterialIndex = sceneMesh->mMaterialIndex;
+    mesh.mFirstInstance = 0;
+    mesh.mInstanceCount = 0;
 
     mMeshes.insert( { i, mesh } );
   }
 
+  if ( mMergeStaticMeshes )
+  {
+    MergeStaticMeshes( this, vertices, indices, scene->mNumMeshes );
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+  // Gather the world matrices of every node referencing a mesh, so that
+  // meshes used by many nodes can be drawn with a single instanced call
+  std::map<int, std::vector<glm::mat4x4>> instances;
+  for ( std::map<int, Geometry::Node>::iterator it = mNodes.begin(); it != mNodes.end(); it++ )
+  {
+    for ( int i = 0; i < it->second.mMeshes.size(); i++ )
+    {
+      std::map<int, Geometry::Mesh>::iterator mesh = mMeshes.find( it->second.mMeshes[ i ] );
+      if ( mesh != mMeshes.end() && mesh->second.mBatchMeshIndex < 0 )
+      {
+        instances[ it->second.mMeshes[ i ] ].push_back( mMatrices[ it->second.mID ] );
+      }
+    }
+  }
+  for ( std::map<int, Geometry::Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+  {
+    if ( it->second.mSourceRanges.size() )
+    {
+      // Static batches are already in world space
+      instances[ it->first ].push_back( glm::mat4x4( 1.0f ) );
+    }
+  }
+
+  std::vector<glm::mat4x4> & instanceMatrices = mStaging->mInstanceMatrices;
+  int sharedMeshCount = 0;
+  for ( std::map<int, std::vector<glm::mat4x4>>::iterator it = instances.begin(); it != instances.end(); it++ )
+  {
+    Mesh & mesh = mMeshes[ it->first ];
+    mesh.mFirstInstance = (int) instanceMatrices.size();
+    mesh.mInstanceCount = (int) it->second.size();
+    instanceMatrices.insert( instanceMatrices.end(), it->second.begin(), it->second.end() );
+    if ( mesh.mInstanceCount > 1 )
+    {
+      sharedMeshCount++;
+    }
+  }
+  printf( "[geometry] %d meshes are shared between nodes, %d instances in total\n", sharedMeshCount, (int) instanceMatrices.size() );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Build the indirect draw commands, grouped into one batch per material.
+  // The base instance points each draw at its range of the instance buffer.
+  std::map<int, std::vector<DrawElementsIndirectCommand>> batches;
+  for ( std::map<int, Geometry::Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+  {
+    const Geometry::Mesh & mesh = it->second;
+    if ( !mesh.mInstanceCount )
+    {
+      continue;
+    }
+
+    DrawElementsIndirectCommand command;
+    command.mCount = mesh.mTriangleCount * 3;
+    command.mInstanceCount = mesh.mInstanceCount;
+    command.mFirstIndex = mesh.mFirstIndex;
+    command.mBaseVertex = mesh.mBaseVertex;
+    command.mBaseInstance = mesh.mFirstInstance;
+    batches[ mesh.mMaterialIndex ].push_back( command );
+  }
+
+  std::vector<DrawElementsIndirectCommand> & commands = mStaging->mCommands;
+  for ( std::map<int, std::vector<DrawElementsIndirectCommand>>::iterator it = batches.begin(); it != batches.end(); it++ )
+  {
+    DrawBatch batch;
+    batch.mMaterialIndex = it->first;
+    batch.mFirstCommand = (int) commands.size();
+    batch.mCommandCount = (int) it->second.size();
+    mDrawBatches.push_back( batch );
+
+    commands.insert( commands.end(), it->second.begin(), it->second.end() );
+  }
+
   printf( "[geometry] Calculating AABB\n" );
   bool aabbSet = false;
   for ( std::map<int, Geometry::Node>::iterator it = mNodes.begin(); it != mNodes.end(); it++ )
@@ -365,9 +613,10 @@ bool Geometry::LoadMesh( const char * _path )
   printf( "[geometry] Calculated AABB: (%.3f, %.3f, %.3f), (%.3f, %.3f, %.3f)\n", mAABBMin.x, mAABBMin.y, mAABBMin.z, mAABBMax.x, mAABBMax.y, mAABBMax.z );
 
   printf( "[geometry] Loading %d materials\n", scene->mNumMaterials );
+  std::vector<TextureLoad> textureLoads;
   for ( unsigned int i = 0; i < scene->mNumMaterials; i++ )
   {
-    Material material;
+    Material & material = mMaterials[ i ];
 
     aiString str = scene->mMaterials[ i ]->GetName();
     material.mName = std::string( str.data, str.length );
@@ -382,20 +631,20 @@ bool Geometry::LoadMesh( const char * _path )
     material.mColorMapAO.mColor = glm::vec4( 1.0f );
     material.mColorMapAmbient.mColor = glm::vec4( 1.0f );
 
-    LoadColorMap( scene->mMaterials[ i ], material.mColorMapDiffuse, aiTextureType_DIFFUSE, "diffuse", folder, true );
-    if ( !LoadColorMap( scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMAL_CAMERA, "normals", folder ) )
+    LoadColorMap( scene->mMaterials[ i ], material.mColorMapDiffuse, aiTextureType_DIFFUSE, "diffuse", textureLoads, true );
+    if ( !LoadColorMap( scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMAL_CAMERA, "normals", textureLoads ) )
     {
-      LoadColorMap( scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMALS, "normals", folder );
+      LoadColorMap( scene->mMaterials[ i ], material.mColorMapNormals, aiTextureType_NORMALS, "normals", textureLoads );
     }
-    LoadColorMap( scene->mMaterials[ i ], material.mColorMapSpecular, aiTextureType_SPECULAR, "specular", folder );
-    LoadColorMap( scene->mMaterials[ i ], material.mColorMapAlbedo, aiTextureType_BASE_COLOR, "albedo", folder );
-    if ( !LoadColorMap( scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_DIFFUSE_ROUGHNESS, "roughness", folder ) )
+    LoadColorMap( scene->mMaterials[ i ], material.mColorMapSpecular, aiTextureType_SPECULAR, "specular", textureLoads );
+    LoadColorMap( scene->mMaterials[ i ], material.mColorMapAlbedo, aiTextureType_BASE_COLOR, "albedo", textureLoads );
+    if ( !LoadColorMap( scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_DIFFUSE_ROUGHNESS, "roughness", textureLoads ) )
     {
-      LoadColorMap( scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_SHININESS, "roughness (from shininess)", folder );
+      LoadColorMap( scene->mMaterials[ i ], material.mColorMapRoughness, aiTextureType_SHININESS, "roughness (from shininess)", textureLoads );
     }
-    LoadColorMap( scene->mMaterials[ i ], material.mColorMapMetallic, aiTextureType_METALNESS, "metallic", folder );
-    LoadColorMap( scene->mMaterials[ i ], material.mColorMapAO, aiTextureType_AMBIENT_OCCLUSION, "AO", folder );
-    LoadColorMap( scene->mMaterials[ i ], material.mColorMapAmbient, aiTextureType_AMBIENT, "ambient", folder );
+    LoadColorMap( scene->mMaterials[ i ], material.mColorMapMetallic, aiTextureType_METALNESS, "metallic", textureLoads );
+    LoadColorMap( scene->mMaterials[ i ], material.mColorMapAO, aiTextureType_AMBIENT_OCCLUSION, "AO", textureLoads );
+    LoadColorMap( scene->mMaterials[ i ], material.mColorMapAmbient, aiTextureType_AMBIENT, "ambient", textureLoads );
 
     float f = 0.0f;
 
@@ -404,10 +653,15 @@ bool Geometry::LoadMesh( const char * _path )
     {
       material.mSpecularShininess = f;
     }
-
-    mMaterials.insert( { i, material } );
   }
 
+  // Decoding is most of the load time of a textured model, and the textures don't depend on each other
+  Parallel::For( (int) textureLoads.size(), [ & ]( int _index )
+  {
+    TextureLoad & load = textureLoads[ _index ];
+    load.mColorMap->mImage = LoadTexture( load.mType, load.mPath, folder, load.mLoadAsSRGB );
+  } );
+
   mGlobalAmbient = glm::vec4( 0.3f );
   for ( unsigned int i = 0; i < scene->mNumLights; i++ )
   {
@@ -427,8 +681,91 @@ bool Geometry::LoadMesh( const char * _path )
   return true;
 }
 
+void Geometry::UploadMesh( Geometry & _imported )
+{
+  UnloadMesh();
+
+  mNodes.swap( _imported.mNodes );
+  mMeshes.swap( _imported.mMeshes );
+  mMaterials.swap( _imported.mMaterials );
+  mDrawBatches.swap( _imported.mDrawBatches );
+  std::swap( mMatrices, _imported.mMatrices );
+  std::swap( mStaging, _imported.mStaging );
+  mAABBMin = _imported.mAABBMin;
+  mAABBMax = _imported.mAABBMax;
+  mGlobalAmbient = _imported.mGlobalAmbient;
+
+  if ( !mStaging )
+  {
+    return;
+  }
+
+  const std::vector<Vertex> & vertices = mStaging->mVertices;
+  const std::vector<unsigned int> & indices = mStaging->mIndices;
+  const std::vector<glm::mat4x4> & instanceMatrices = mStaging->mInstanceMatrices;
+  const std::vector<DrawElementsIndirectCommand> & commands = mStaging->mCommands;
+
+  for ( std::map<int, Geometry::Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+  {
+    if ( it->second.mBatchMeshIndex < 0 )
+    {
+      glGenVertexArrays( 1, &it->second.mVertexArrayObject );
+    }
+  }
+
+  if ( vertices.size() )
+  {
+    glGenVertexArrays( 1, &mVertexArrayObject );
+    glGenBuffers( 1, &mVertexBufferObject );
+    glGenBuffers( 1, &mIndexBufferObject );
+
+    Renderer::BindVertexArray( mVertexArrayObject );
+    Renderer::BindBuffer( GL_ARRAY_BUFFER, mVertexBufferObject );
+    Renderer::BindBuffer( GL_ELEMENT_ARRAY_BUFFER, mIndexBufferObject );
+
+    glBufferData( GL_ARRAY_BUFFER, sizeof( Vertex ) * vertices.size(), &vertices[ 0 ], GL_STATIC_DRAW );
+    glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof( unsigned int ) * indices.size(), &indices[ 0 ], GL_STATIC_DRAW );
+  }
+
+  if ( instanceMatrices.size() )
+  {
+    glGenBuffers( 1, &mInstanceBufferObject );
+    Renderer::BindBuffer( GL_ARRAY_BUFFER, mInstanceBufferObject );
+    glBufferData( GL_ARRAY_BUFFER, sizeof( glm::mat4x4 ) * instanceMatrices.size(), &instanceMatrices[ 0 ], GL_STATIC_DRAW );
+  }
+
+  SetupVertexArrays();
+
+  if ( commands.size() && Renderer::SupportsMultiDrawIndirect() )
+  {
+    glGenBuffers( 1, &mIndirectBufferObject );
+    Renderer::BindBuffer( GL_DRAW_INDIRECT_BUFFER, mIndirectBufferObject );
+    glBufferData( GL_DRAW_INDIRECT_BUFFER, sizeof( DrawElementsIndirectCommand ) * commands.size(), &commands[ 0 ], GL_STATIC_DRAW );
+  }
+
+  for ( std::map<int, Material>::iterator it = mMaterials.begin(); it != mMaterials.end(); it++ )
+  {
+    ColorMap * colorMaps[ COLORMAP_COUNT ];
+    GetColorMaps( it->second, colorMaps );
+    for ( int i = 0; i < COLORMAP_COUNT; i++ )
+    {
+      if ( colorMaps[ i ]->mImage )
+      {
+        colorMaps[ i ]->mTexture = Renderer::CreateTextureFromImage( *colorMaps[ i ]->mImage );
+        delete colorMaps[ i ]->mImage;
+        colorMaps[ i ]->mImage = NULL;
+      }
+    }
+  }
+
+  delete mStaging;
+  mStaging = NULL;
+}
+
 void Geometry::UnloadMesh()
 {
+  InvalidateCommandList();
+
   if ( mMatrices )
   {
     delete[] mMatrices;
@@ -437,8 +774,23 @@ void Geometry::UnloadMesh()
 
   mNodes.clear();
 
+  if ( mStaging )
+  {
+    delete mStaging;
+    mStaging = NULL;
+  }
+
   for ( std::map<int, Material>::iterator it = mMaterials.begin(); it != mMaterials.end(); it++ )
   {
+    // Decoded images are only left over if the model was imported but never uploaded
+    ColorMap * colorMaps[ COLORMAP_COUNT ];
+    GetColorMaps( it->second, colorMaps );
+    for ( int i = 0; i < COLORMAP_COUNT; i++ )
+    {
+      delete colorMaps[ i ]->mImage;
+      colorMaps[ i ]->mImage = NULL;
+    }
+
     if ( it->second.mColorMapDiffuse.mTexture)
     {
       Renderer::ReleaseTexture( it->second.mColorMapDiffuse.mTexture);
@@ -474,84 +826,346 @@ void Geometry::UnloadMesh()
   }
   mMaterials.clear();
 
+  // Unbind first so the state cache doesn't hold on to names the driver is about to recycle. A model that was
+  // only imported has nothing in GL, which may not even be there (see Rasterizer).
+  if ( mVertexBufferObject )
+  {
+    Renderer::BindVertexArray( 0 );
+    Renderer::BindBuffer( GL_ARRAY_BUFFER, 0 );
+    Renderer::BindBuffer( GL_DRAW_INDIRECT_BUFFER, 0 );
+  }
+
   for ( std::map<int, Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
   {
-    glDeleteBuffers( 1, &it->second.mIndexBufferObject );
-    glDeleteBuffers( 1, &it->second.mVertexBufferObject );
-    glDeleteVertexArrays( 1, &it->second.mVertexArrayObject );
+    if ( it->second.mVertexArrayObject )
+    {
+      glDeleteVertexArrays( 1, &it->second.mVertexArrayObject );
+    }
   }
   mMeshes.clear();
+  mDrawBatches.clear();
+
+  if ( mVertexArrayObject )
+  {
+    glDeleteVertexArrays( 1, &mVertexArrayObject );
+    mVertexArrayObject = 0;
+  }
+  if ( mVertexBufferObject )
+  {
+    glDeleteBuffers( 1, &mVertexBufferObject );
+    mVertexBufferObject = 0;
+  }
+  if ( mIndexBufferObject )
+  {
+    glDeleteBuffers( 1, &mIndexBufferObject );
+    mIndexBufferObject = 0;
+  }
+  if ( mInstanceBufferObject )
+  {
+    glDeleteBuffers( 1, &mInstanceBufferObject );
+    mInstanceBufferObject = 0;
+  }
+  if ( mIndirectBufferObject )
+  {
+    glDeleteBuffers( 1, &mIndirectBufferObject );
+    mIndirectBufferObject = 0;
+  }
 
   gImporter.FreeScene();
 }
 
 void Geometry::Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader )
 {
-  Renderer::SetShader( _shader );
+  RenderWithCommandList( _worldRootMatrix, _shader, NULL, 0 );
+}
+
+void Geometry::Render( const glm::mat4x4 & _worldRootMatrix, Renderer::ShaderVariants * _variants, uint32_t _features )
+{
+  RenderWithCommandList( _worldRootMatrix, NULL, _variants, _features );
+}
+
+void Geometry::RenderWithCommandList( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader, Renderer::ShaderVariants * _variants, uint32_t _features )
+{
+  // Nothing the traversal does depends on per-frame data, so as long as its inputs
+  // are the same, replaying the last recording gives the exact same result
+  unsigned int program = _shader ? _shader->mProgram : 0;
+  if ( mCommandList.mValid
+    && mCommandListShader == _shader
+    && mCommandListProgram == program
+    && mCommandListVariants == _variants
+    && mCommandListFeatures == _features
+    && mCommandListRootMatrix == _worldRootMatrix
+    && mCommandListMultiDrawIndirect == mUseMultiDrawIndirect )
+  {
+    Renderer::ExecuteCommandList( &mCommandList );
+    return;
+  }
+
+  if ( _variants )
+  {
+    // Doesn't wait: what isn't built yet is drawn with a stand-in, and the recording is dropped once it's in
+    PrepareShaderVariants( _variants, _features, false );
+  }
+
+  mCommandListShader = _shader;
+  mCommandListProgram = program;
+  mCommandListVariants = _variants;
+  mCommandListFeatures = _features;
+  mCommandListRootMatrix = _worldRootMatrix;
+  mCommandListMultiDrawIndirect = mUseMultiDrawIndirect;
+
+  Renderer::BeginCommandList( &mCommandList );
+  __Render( _worldRootMatrix, _shader, _variants, _features );
+  Renderer::EndCommandList();
+}
+
+void Geometry::InvalidateCommandList()
+{
+  mCommandList.Clear();
+}
+
+uint32_t Geometry::GetShaderFeatures( const Material & _material )
+{
+  uint32_t features = 0;
+  features |= _material.mColorMapAlbedo.mTexture ? Renderer::SHADERFEATURE_MAP_ALBEDO : 0;
+  features |= _material.mColorMapDiffuse.mTexture ? Renderer::SHADERFEATURE_MAP_DIFFUSE : 0;
+  features |= _material.mColorMapNormals.mTexture ? Renderer::SHADERFEATURE_MAP_NORMALS : 0;
+  features |= _material.mColorMapSpecular.mTexture ? Renderer::SHADERFEATURE_MAP_SPECULAR : 0;
+  features |= _material.mColorMapRoughness.mTexture ? Renderer::SHADERFEATURE_MAP_ROUGHNESS : 0;
+  features |= _material.mColorMapMetallic.mTexture ? Renderer::SHADERFEATURE_MAP_METALLIC : 0;
+  features |= _material.mColorMapAO.mTexture ? Renderer::SHADERFEATURE_MAP_AO : 0;
+  features |= _material.mColorMapAmbient.mTexture ? Renderer::SHADERFEATURE_MAP_AMBIENT : 0;
+  return features;
+}
+
+void Geometry::GetShaderVariantFeatures( uint32_t _features, std::vector<uint32_t> & _variantFeatures )
+{
+  // The bare variant is also the one used to look at the shader's inputs
+  _variantFeatures.assign( 1, _features );
+  for ( std::map<int, Material>::iterator it = mMaterials.begin(); it != mMaterials.end(); it++ )
+  {
+    _variantFeatures.push_back( _features | GetShaderFeatures( it->second ) );
+  }
+}
+
+void Geometry::PrepareShaderVariants( Renderer::ShaderVariants * _variants, uint32_t _features, bool _wait )
+{
+  std::vector<uint32_t> features;
+  GetShaderVariantFeatures( _features, features );
+
+  for ( int i = 0; i < features.size(); i++ )
+  {
+    if ( _wait )
+    {
+      _variants->Get( features[ i ] );
+    }
+    else
+    {
+      _variants->Request( features[ i ] );
+    }
+  }
+}
+
+Renderer::Shader * Geometry::BindMaterial( Renderer::Shader * _shader, Renderer::ShaderVariants * _variants, uint32_t _features, const Material & _material )
+{
+  // Until the material's own variant is built, the bare one draws it without its maps
+  Renderer::Shader * shader = _variants ? _variants->Find( _features | GetShaderFeatures( _material ), _features ) : _shader;
+  if ( shader )
+  {
+    Renderer::SetShader( shader );
+    SetMaterial( shader, _material );
+  }
+  return shader;
+}
+
+void Geometry::__Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader, Renderer::ShaderVariants * _variants, uint32_t _features )
+{
+  // Nothing is drawn until at least the bare variant is built
+  Renderer::Shader * baseShader = _variants ? _variants->Find( _features, _features ) : _shader;
+  if ( !baseShader )
+  {
+    return;
+  }
+
+  if ( _variants )
+  {
+    _variants->SetConstant( "global_ambient", mGlobalAmbient );
+  }
+  else
+  {
+    _shader->SetConstant( "global_ambient", mGlobalAmbient );
+  }
+
+  if ( baseShader->mHasInstanceInput )
+  {
+    // The shader takes the node transforms from the instance buffer; one draw per mesh
+    if ( _variants )
+    {
+      _variants->SetConstant( "mat_world", _worldRootMatrix );
+    }
+    else
+    {
+      _shader->SetConstant( "mat_world", _worldRootMatrix );
+    }
+
+    if ( mUseMultiDrawIndirect && mIndirectBufferObject )
+    {
+      // One multi-draw per material, over the shared buffers
+      Renderer::BindVertexArray( mVertexArrayObject );
+      Renderer::BindBuffer( GL_DRAW_INDIRECT_BUFFER, mIndirectBufferObject );
+
+      for ( int i = 0; i < mDrawBatches.size(); i++ )
+      {
+        const DrawBatch & batch = mDrawBatches[ i ];
+
+        if ( !BindMaterial( _shader, _variants, _features, mMaterials[ batch.mMaterialIndex ] ) )
+        {
+          continue;
+        }
+
+        Renderer::MultiDrawElementsIndirect( batch.mFirstCommand, batch.mCommandCount );
+      }
+      return;
+    }
+
+    for ( std::map<int, Geometry::Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+    {
+      const Geometry::Mesh & mesh = it->second;
+      if ( !mesh.mInstanceCount )
+      {
+        continue;
+      }
+
+      if ( !BindMaterial( _shader, _variants, _features, mMaterials[ mesh.mMaterialIndex ] ) )
+      {
+        continue;
+      }
+
+      Renderer::BindVertexArray( mesh.mVertexArrayObject );
+
+      Renderer::DrawElementsInstanced( mesh.mTriangleCount * 3, mesh.mFirstIndex, mesh.mInstanceCount );
+    }
+    return;
+  }
 
-  _shader->SetConstant( "global_ambient", mGlobalAmbient );
   for ( std::map<int, Geometry::Node>::iterator it = mNodes.begin(); it != mNodes.end(); it++ )
   {
     const Geometry::Node & node = it->second;
 
-    _shader->SetConstant( "mat_world", mMatrices[ node.mID ] * _worldRootMatrix );
-
     for ( int i = 0; i < it->second.mMeshes.size(); i++ )
     {
       const Geometry::Mesh & mesh = mMeshes[ it->second.mMeshes[ i ] ];
-      const Geometry::Material & material = mMaterials[ mesh.mMaterialIndex ];
+      if ( mesh.mBatchMeshIndex >= 0 )
+      {
+        // Already in world space, drawn below
+        continue;
+      }
 
-      _shader->SetConstant( "specular_shininess", material.mSpecularShininess );
+      Renderer::Shader * shader = BindMaterial( _shader, _variants, _features, mMaterials[ mesh.mMaterialIndex ] );
+      if ( !shader )
+      {
+        continue;
+      }
+      shader->SetConstant( "mat_world", mMatrices[ node.mID ] * _worldRootMatrix );
 
-      SetColorMap( _shader, "map_diffuse", material.mColorMapDiffuse );
-      SetColorMap( _shader, "map_normals", material.mColorMapNormals );
-      SetColorMap( _shader, "map_specular", material.mColorMapSpecular );
-      SetColorMap( _shader, "map_albedo", material.mColorMapAlbedo );
-      SetColorMap( _shader, "map_roughness", material.mColorMapRoughness );
-      SetColorMap( _shader, "map_metallic", material.mColorMapMetallic );
-      SetColorMap( _shader, "map_ao", material.mColorMapAO );
-      SetColorMap( _shader, "map_ambient", material.mColorMapAmbient );
+      Renderer::BindVertexArray( mesh.mVertexArrayObject );
 
-      glBindVertexArray( mesh.mVertexArrayObject );
+      Renderer::DrawElements( mesh.mTriangleCount * 3, mesh.mFirstIndex );
+    }
+  }
 
-      glDrawElements( GL_TRIANGLES, mesh.mTriangleCount * 3, GL_UNSIGNED_INT, NULL );
+  for ( std::map<int, Geometry::Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+  {
+    const Geometry::Mesh & mesh = it->second;
+    if ( !mesh.mSourceRanges.size() )
+    {
+      continue;
+    }
+
+    Renderer::Shader * shader = BindMaterial( _shader, _variants, _features, mMaterials[ mesh.mMaterialIndex ] );
+    if ( !shader )
+    {
+      continue;
     }
+    shader->SetConstant( "mat_world", _worldRootMatrix );
+
+    Renderer::BindVertexArray( mesh.mVertexArrayObject );
+
+    Renderer::DrawElements( mesh.mTriangleCount * 3, mesh.mFirstIndex );
   }
 }
 
-void Geometry::__SetupVertexArray( Renderer::Shader * _shader, const char * name, int sizeInFloats, int & offsetInFloats )
+void Geometry::__SetupVertexArray( Renderer::VERTEXATTRIBUTE _location, int sizeInFloats, int & offsetInFloats, int baseVertex )
 {
   unsigned int stride = sizeof( float ) * 14;
 
-  GLint location = glGetAttribLocation( _shader->mProgram, name );
-  if ( location >= 0 )
-  {
-    glVertexAttribPointer( location, sizeInFloats, GL_FLOAT, GL_FALSE, stride, (GLvoid *) ( offsetInFloats * sizeof( GLfloat ) ) );
-    glEnableVertexAttribArray( location );
-  }
+  glVertexAttribPointer( _location, sizeInFloats, GL_FLOAT, GL_FALSE, stride, (GLvoid *) ( baseVertex * stride + offsetInFloats * sizeof( GLfloat ) ) );
+  glEnableVertexAttribArray( _location );
 
   offsetInFloats += sizeInFloats;
 }
 
-void Geometry::RebindVertexArray( Renderer::Shader * _shader )
+void Geometry::SetupVertexArray( GLuint _vertexArrayObject, int _baseVertex, int _firstInstance )
 {
-  for ( int i = 0; i < mMeshes.size(); i++ )
+  Renderer::BindVertexArray( _vertexArrayObject );
+  Renderer::BindBuffer( GL_ARRAY_BUFFER, mVertexBufferObject );
+  Renderer::BindBuffer( GL_ELEMENT_ARRAY_BUFFER, mIndexBufferObject );
+
+  int offset = 0;
+  __SetupVertexArray( Renderer::VERTEXATTRIBUTE_POSITION, 3, offset, _baseVertex );
+  __SetupVertexArray( Renderer::VERTEXATTRIBUTE_NORMAL, 3, offset, _baseVertex );
+  __SetupVertexArray( Renderer::VERTEXATTRIBUTE_TANGENT, 3, offset, _baseVertex );
+  __SetupVertexArray( Renderer::VERTEXATTRIBUTE_BINORMAL, 3, offset, _baseVertex );
+  __SetupVertexArray( Renderer::VERTEXATTRIBUTE_TEXCOORD, 2, offset, _baseVertex );
+
+  if ( mInstanceBufferObject )
   {
-    const Geometry::Mesh & mesh = mMeshes[ i ];
+    // A mat4 attribute takes up four consecutive locations, one per column
+    Renderer::BindBuffer( GL_ARRAY_BUFFER, mInstanceBufferObject );
+    for ( int i = 0; i < 4; i++ )
+    {
+      GLvoid * columnOffset = (GLvoid *) ( sizeof( glm::mat4x4 ) * _firstInstance + sizeof( glm::vec4 ) * i );
+      glVertexAttribPointer( Renderer::VERTEXATTRIBUTE_INSTANCE_WORLD + i, 4, GL_FLOAT, GL_FALSE, sizeof( glm::mat4x4 ), columnOffset );
+      glVertexAttribDivisor( Renderer::VERTEXATTRIBUTE_INSTANCE_WORLD + i, 1 );
+      glEnableVertexAttribArray( Renderer::VERTEXATTRIBUTE_INSTANCE_WORLD + i );
+    }
+  }
+}
+
+void Geometry::SetupVertexArrays()
+{
+  // Attribute locations are fixed for every shader (see Renderer::VERTEXATTRIBUTE), so this only needs to happen once at load
 
-    glBindVertexArray( mesh.mVertexArrayObject );
-    glBindBuffer( GL_ARRAY_BUFFER, mesh.mVertexBufferObject );
-    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.mIndexBufferObject );
+  // Per-mesh arrays point straight at the mesh's vertices and instances, so they work without base vertex / base instance draws
+  for ( std::map<int, Geometry::Mesh>::iterator it = mMeshes.begin(); it != mMeshes.end(); it++ )
+  {
+    if ( it->second.mVertexArrayObject )
+    {
+      SetupVertexArray( it->second.mVertexArrayObject, it->second.mBaseVertex, it->second.mFirstInstance );
+    }
+  }
 
-    int offset = 0;
-    __SetupVertexArray( _shader, "in_pos", 3, offset );
-    __SetupVertexArray( _shader, "in_normal", 3, offset );
-    __SetupVertexArray( _shader, "in_tangent", 3, offset );
-    __SetupVertexArray( _shader, "in_binormal", 3, offset );
-    __SetupVertexArray( _shader, "in_texcoord", 2, offset );
+  // The model-wide array is used by the multi-draw path, which offsets through the command parameters instead
+  if ( mVertexArrayObject )
+  {
+    SetupVertexArray( mVertexArrayObject, 0, 0 );
   }
 }
 
+void Geometry::SetMaterial( Renderer::Shader * _shader, const Material & _material )
+{
+  _shader->SetConstant( "specular_shininess", _material.mSpecularShininess );
+
+  SetColorMap( _shader, "map_diffuse", _material.mColorMapDiffuse );
+  SetColorMap( _shader, "map_normals", _material.mColorMapNormals );
+  SetColorMap( _shader, "map_specular", _material.mColorMapSpecular );
+  SetColorMap( _shader, "map_albedo", _material.mColorMapAlbedo );
+  SetColorMap( _shader, "map_roughness", _material.mColorMapRoughness );
+  SetColorMap( _shader, "map_metallic", _material.mColorMapMetallic );
+  SetColorMap( _shader, "map_ao", _material.mColorMapAO );
+  SetColorMap( _shader, "map_ambient", _material.mColorMapAmbient );
+}
+
 void Geometry::SetColorMap( Renderer::Shader * _shader, const char * _name, const ColorMap & _colorMap )
 {
   char sz[ 64 ];
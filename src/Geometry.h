@@ -21,23 +21,67 @@ public:
     unsigned int mParentID;
     glm::mat4x4 mTransformation;
   };
+  // Part of a static batch that came from a given node / mesh
+  struct SourceRange
+  {
+    unsigned int mNodeID;
+    int mMeshIndex;
+    int mFirstTriangle;
+    int mTriangleCount;
+  };
   struct Mesh
   {
     int mVertexCount;
-    GLuint mVertexBufferObject;
+    int mBaseVertex;
     int mTriangleCount;
-    GLuint mIndexBufferObject;
+    int mFirstIndex;
     int mMaterialIndex;
     GLuint mVertexArrayObject;
 
+    // Range in the instance buffer holding the world matrix of every node that references this mesh
+    int mFirstInstance;
+    int mInstanceCount;
+
+    // Set on meshes that were merged into a static batch at load time; they're not drawn on their own
+    int mBatchMeshIndex;
+    // Set on static batches, to map triangles back to the nodes they came from
+    std::vector<SourceRange> mSourceRanges;
+
     glm::vec3 mAABBMin;
     glm::vec3 mAABBMax;
   };
+  // Layout mandated by glMultiDrawElementsIndirect
+  struct DrawElementsIndirectCommand
+  {
+    GLuint mCount;
+    GLuint mInstanceCount;
+    GLuint mFirstIndex;
+    GLint mBaseVertex;
+    GLuint mBaseInstance;
+  };
+  // One vertex of the shared vertex buffer
+#pragma pack(1)
+  struct Vertex
+  {
+    glm::vec3 v3Vector;
+    glm::vec3 v3Normal;
+    glm::vec3 v3Tangent;
+    glm::vec3 v3Binormal;
+    glm::vec2 fTexcoord;
+  };
+#pragma pack()
+  struct DrawBatch
+  {
+    int mMaterialIndex;
+    int mFirstCommand;
+    int mCommandCount;
+  };
   struct ColorMap
   {
-    ColorMap() : mValid( false ), mTexture( nullptr ), mColor( 0.0f ) {}
+    ColorMap() : mValid( false ), mTexture( nullptr ), mImage( nullptr ), mColor( 0.0f ) {}
     bool mValid;
     Renderer::Texture * mTexture;
+    Renderer::Image * mImage; // decoded by ImportMesh(), turned into mTexture by UploadMesh()
     glm::vec4 mColor;
   };
   struct Material
@@ -61,19 +105,66 @@ public:
   bool LoadMesh( const char * _path );
   void UnloadMesh();
 
+  // LoadMesh() in two halves, so the slow one can run on a worker thread: ImportMesh() reads the file, builds the
+  // buffer contents and decodes the textures into an empty Geometry without touching GL, then UploadMesh() on the
+  // GL thread replaces this model with the imported one, leaving _imported empty
+  bool ImportMesh( const char * _path );
+  void UploadMesh( Geometry & _imported );
+
   void Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader );
+  void Render( const glm::mat4x4 & _worldRootMatrix, Renderer::ShaderVariants * _variants, uint32_t _features );
+  void RenderWithCommandList( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader, Renderer::ShaderVariants * _variants, uint32_t _features );
+  void __Render( const glm::mat4x4 & _worldRootMatrix, Renderer::Shader * _shader, Renderer::ShaderVariants * _variants, uint32_t _features );
+  void InvalidateCommandList();
 
-  void __SetupVertexArray( Renderer::Shader * _shader, const char * name, int sizeInFloats, int & offsetInFloats);
-  void RebindVertexArray( Renderer::Shader * _shader );
+  // Every material is drawn with the variant matching the maps it has, on top of the scene-wide _features
+  static uint32_t GetShaderFeatures( const Material & _material );
+  void GetShaderVariantFeatures( uint32_t _features, std::vector<uint32_t> & _variantFeatures );
+  void PrepareShaderVariants( Renderer::ShaderVariants * _variants, uint32_t _features, bool _wait );
+  Renderer::Shader * BindMaterial( Renderer::Shader * _shader, Renderer::ShaderVariants * _variants, uint32_t _features, const Material & _material );
+
+  void __SetupVertexArray( Renderer::VERTEXATTRIBUTE _location, int sizeInFloats, int & offsetInFloats, int baseVertex );
+  void SetupVertexArray( GLuint _vertexArrayObject, int _baseVertex, int _firstInstance );
+  void SetupVertexArrays();
 
   void SetColorMap( Renderer::Shader * _shader, const char * _name, const ColorMap & _colorMap );
+  void SetMaterial( Renderer::Shader * _shader, const Material & _material );
 
   static std::string GetSupportedExtensions();
 
+  bool mMergeStaticMeshes;
+
   std::map<int, Node> mNodes;
   std::map<int, Mesh> mMeshes;
   std::map<int, Material> mMaterials;
   glm::mat4x4 * mMatrices;
+  GLuint mVertexBufferObject;
+  GLuint mIndexBufferObject;
+  GLuint mVertexArrayObject;
+  GLuint mInstanceBufferObject;
+  GLuint mIndirectBufferObject;
+  std::vector<DrawBatch> mDrawBatches;
+  bool mUseMultiDrawIndirect;
+
+  // Buffer contents built by ImportMesh() that UploadMesh() hasn't uploaded yet; NULL otherwise.
+  // An imported model can also be drawn from these directly, without GL (see Rasterizer).
+  struct Staging
+  {
+    std::vector<Vertex> mVertices;
+    std::vector<unsigned int> mIndices;
+    std::vector<glm::mat4x4> mInstanceMatrices;
+    std::vector<DrawElementsIndirectCommand> mCommands;
+  };
+  Staging * mStaging;
+
+  // Recording of the last Render(); needs invalidating when anything it captured (materials) is edited
+  Renderer::CommandList mCommandList;
+  Renderer::Shader * mCommandListShader;
+  unsigned int mCommandListProgram;
+  Renderer::ShaderVariants * mCommandListVariants;
+  uint32_t mCommandListFeatures;
+  glm::mat4x4 mCommandListRootMatrix;
+  bool mCommandListMultiDrawIndirect;
   glm::vec3 mAABBMin;
   glm::vec3 mAABBMax;
   glm::vec4 mGlobalAmbient;
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <functional>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define HDRIMAGE_SSE
+#include <emmintrin.h>
+#endif
+
+#include "stb_image.h"
+
+#include "HDRImage.h"
+#include "Parallel.h"
+
+namespace HDRImage
+{
+
+// Largest finite values of the 11 bit (6 bit mantissa) and 10 bit (5 bit mantissa) floats
+const float MAX_FLOAT11 = 65024.0f;
+const float MAX_FLOAT10 = 64512.0f;
+
+// Exponent field of 2^-112: multiplying by it moves a float from bias 127 to bias 15, the bias of the
+// small floats, and lets the FPU produce their denormals for us; what's left is dropping mantissa bits.
+const uint32_t REBIAS_BITS = 15 << 23;
+// 2^112, which undoes it
+const uint32_t UNBIAS_BITS = 239 << 23;
+
+//////////////////////////////////////////////////////////////////////////
+// Packing
+
+inline uint32_t PackChannel( float _value, float _max, int _shift )
+{
+  // Written so NaN fails the first comparison
+  _value = _value > 0.0f ? ( _value < _max ? _value : _max ) : 0.0f;
+  float rebias = 0.0f;
+  memcpy( &rebias, &REBIAS_BITS, sizeof( float ) );
+  _value *= rebias;
+  uint32_t bits = 0;
+  memcpy( &bits, &_value, sizeof( float ) );
+  return ( bits + ( 1 << ( _shift - 1 ) ) ) >> _shift;
+}
+
+inline uint32_t PackTexel( float _r, float _g, float _b )
+{
+  return PackChannel( _r, MAX_FLOAT11, 17 ) | ( PackChannel( _g, MAX_FLOAT11, 17 ) << 11 ) | ( PackChannel( _b, MAX_FLOAT10, 18 ) << 22 );
+}
+
+// RGBE stores an 8 bit mantissa per channel and a shared exponent, same scale as stb_image's decoder
+inline float GetRGBEScale( unsigned char _exponent )
+{
+  if ( _exponent < 10 )
+  {
+    return 0.0f;
+  }
+  uint32_t scaleBits = ( _exponent - 9 ) << 23;
+  float scale = 0.0f;
+  memcpy( &scale, &scaleBits, sizeof( float ) );
+  return scale;
+}
+
+#ifdef HDRIMAGE_SSE
+// Four texels at once, one channel per register
+inline __m128i PackChannels( __m128 _value, float _max, int _shift )
+{
+  _value = _mm_min_ps( _mm_max_ps( _value, _mm_setzero_ps() ), _mm_set1_ps( _max ) );
+  _value = _mm_mul_ps( _value, _mm_castsi128_ps( _mm_set1_epi32( REBIAS_BITS ) ) );
+  __m128i bits = _mm_add_epi32( _mm_castps_si128( _value ), _mm_set1_epi32( 1 << ( _shift - 1 ) ) );
+  return _mm_srl_epi32( bits, _mm_cvtsi32_si128( _shift ) );
+}
+
+inline __m128i PackTexels( __m128 _r, __m128 _g, __m128 _b )
+{
+  __m128i r = PackChannels( _r, MAX_FLOAT11, 17 );
+  __m128i g = _mm_slli_epi32( PackChannels( _g, MAX_FLOAT11, 17 ), 11 );
+  __m128i b = _mm_slli_epi32( PackChannels( _b, MAX_FLOAT10, 18 ), 22 );
+  return _mm_or_si128( r, _mm_or_si128( g, b ) );
+}
+
+// Four RGBE texels to one register per channel
+inline void ConvertRGBE4( const unsigned char * _rgbe, __m128 & _r, __m128 & _g, __m128 & _b )
+{
+  __m128i texels = _mm_loadu_si128( (const __m128i *) _rgbe );
+  __m128i mask = _mm_set1_epi32( 0xFF );
+  __m128i exponent = _mm_srli_epi32( texels, 24 );
+  __m128i scaleBits = _mm_slli_epi32( _mm_sub_epi32( exponent, _mm_set1_epi32( 9 ) ), 23 );
+  __m128 scale = _mm_castsi128_ps( _mm_and_si128( scaleBits, _mm_cmpgt_epi32( exponent, _mm_set1_epi32( 9 ) ) ) );
+  _r = _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( texels, mask ) ), scale );
+  _g = _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( texels, 8 ), mask ) ), scale );
+  _b = _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( texels, 16 ), mask ) ), scale );
+}
+#endif
+
+void PackR11G11B10F( const float * _rgb, int _count, uint32_t * _texels )
+{
+  int i = 0;
+#ifdef HDRIMAGE_SSE
+  for ( ; i + 4 <= _count; i += 4 )
+  {
+    const float * rgb = _rgb + i * 3;
+    __m128 r = _mm_set_ps( rgb[ 9 ], rgb[ 6 ], rgb[ 3 ], rgb[ 0 ] );
+    __m128 g = _mm_set_ps( rgb[ 10 ], rgb[ 7 ], rgb[ 4 ], rgb[ 1 ] );
+    __m128 b = _mm_set_ps( rgb[ 11 ], rgb[ 8 ], rgb[ 5 ], rgb[ 2 ] );
+    _mm_storeu_si128( (__m128i *) ( _texels + i ), PackTexels( r, g, b ) );
+  }
+#endif
+  for ( ; i < _count; i++ )
+  {
+    _texels[ i ] = PackTexel( _rgb[ i * 3 + 0 ], _rgb[ i * 3 + 1 ], _rgb[ i * 3 + 2 ] );
+  }
+}
+
+inline float UnpackChannel( uint32_t _bits, int _shift )
+{
+  uint32_t bits = _bits << _shift;
+  float value = 0.0f;
+  float unbias = 0.0f;
+  memcpy( &value, &bits, sizeof( float ) );
+  memcpy( &unbias, &UNBIAS_BITS, sizeof( float ) );
+  return value * unbias;
+}
+
+void UnpackR11G11B10F( const uint32_t * _texels, int _count, float * _rgb )
+{
+  for ( int i = 0; i < _count; i++ )
+  {
+    _rgb[ i * 3 + 0 ] = UnpackChannel( _texels[ i ] & 0x7FF, 17 );
+    _rgb[ i * 3 + 1 ] = UnpackChannel( ( _texels[ i ] >> 11 ) & 0x7FF, 17 );
+    _rgb[ i * 3 + 2 ] = UnpackChannel( _texels[ i ] >> 22, 18 );
+  }
+}
+
+void PackRGBEScanline( const unsigned char * _rgbe, int _count, uint32_t * _texels )
+{
+  int i = 0;
+#ifdef HDRIMAGE_SSE
+  for ( ; i + 4 <= _count; i += 4 )
+  {
+    __m128 r, g, b;
+    ConvertRGBE4( _rgbe + i * 4, r, g, b );
+    _mm_storeu_si128( (__m128i *) ( _texels + i ), PackTexels( r, g, b ) );
+  }
+#endif
+  for ( ; i < _count; i++ )
+  {
+    float scale = GetRGBEScale( _rgbe[ i * 4 + 3 ] );
+    _texels[ i ] = PackTexel( _rgbe[ i * 4 + 0 ] * scale, _rgbe[ i * 4 + 1 ] * scale, _rgbe[ i * 4 + 2 ] * scale );
+  }
+}
+
+// Same layout stbi_loadf() gives with STBI_rgb_alpha
+void ConvertRGBEScanline( const unsigned char * _rgbe, int _count, float * _rgba )
+{
+  int i = 0;
+#ifdef HDRIMAGE_SSE
+  for ( ; i + 4 <= _count; i += 4 )
+  {
+    __m128 r, g, b;
+    __m128 a = _mm_set1_ps( 1.0f );
+    ConvertRGBE4( _rgbe + i * 4, r, g, b );
+    _MM_TRANSPOSE4_PS( r, g, b, a );
+    _mm_storeu_ps( _rgba + i * 4 + 0, r );
+    _mm_storeu_ps( _rgba + i * 4 + 4, g );
+    _mm_storeu_ps( _rgba + i * 4 + 8, b );
+    _mm_storeu_ps( _rgba + i * 4 + 12, a );
+  }
+#endif
+  for ( ; i < _count; i++ )
+  {
+    float scale = GetRGBEScale( _rgbe[ i * 4 + 3 ] );
+    _rgba[ i * 4 + 0 ] = _rgbe[ i * 4 + 0 ] * scale;
+    _rgba[ i * 4 + 1 ] = _rgbe[ i * 4 + 1 ] * scale;
+    _rgba[ i * 4 + 2 ] = _rgbe[ i * 4 + 2 ] * scale;
+    _rgba[ i * 4 + 3 ] = 1.0f;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Radiance files
+
+struct MappedFile
+{
+  const unsigned char * mData = NULL;
+  size_t mSize = 0;
+#ifdef _WIN32
+  HANDLE mFile = INVALID_HANDLE_VALUE;
+  HANDLE mMapping = NULL;
+#endif
+};
+
+void UnmapFile( MappedFile & _file )
+{
+#ifdef _WIN32
+  if ( _file.mData ) UnmapViewOfFile( _file.mData );
+  if ( _file.mMapping ) CloseHandle( _file.mMapping );
+  if ( _file.mFile != INVALID_HANDLE_VALUE ) CloseHandle( _file.mFile );
+  _file.mMapping = NULL;
+  _file.mFile = INVALID_HANDLE_VALUE;
+#else
+  if ( _file.mData ) munmap( (void *) _file.mData, _file.mSize );
+#endif
+  _file.mData = NULL;
+  _file.mSize = 0;
+}
+
+bool MapFile( const char * _path, MappedFile & _file )
+{
+#ifdef _WIN32
+  _file.mFile = CreateFileA( _path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+  if ( _file.mFile == INVALID_HANDLE_VALUE )
+  {
+    return false;
+  }
+  LARGE_INTEGER size;
+  GetFileSizeEx( _file.mFile, &size );
+  _file.mSize = (size_t) size.QuadPart;
+  _file.mMapping = _file.mSize ? CreateFileMappingA( _file.mFile, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+  _file.mData = _file.mMapping ? (const unsigned char *) MapViewOfFile( _file.mMapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+#else
+  int descriptor = open( _path, O_RDONLY );
+  if ( descriptor < 0 )
+  {
+    return false;
+  }
+  struct stat status;
+  _file.mSize = fstat( descriptor, &status ) == 0 ? (size_t) status.st_size : 0;
+  void * data = _file.mSize ? mmap( NULL, _file.mSize, PROT_READ, MAP_PRIVATE, descriptor, 0 ) : MAP_FAILED;
+  close( descriptor );
+  _file.mData = data != MAP_FAILED ? (const unsigned char *) data : NULL;
+#endif
+  if ( !_file.mData )
+  {
+    UnmapFile( _file );
+    return false;
+  }
+  return true;
+}
+
+bool ReadLine( const MappedFile & _file, size_t & _offset, std::string & _line )
+{
+  _line.clear();
+  while ( _offset < _file.mSize )
+  {
+    char c = _file.mData[ _offset++ ];
+    if ( c == '\n' )
+    {
+      return true;
+    }
+    _line += c;
+  }
+  return false;
+}
+
+// Reads one scanline as RGBE bytes, either adaptive run length encoded or flat; with _rgbe NULL it only
+// validates the scanline and skips over it, which is how the scanline offsets are found up front
+bool DecodeScanline( const MappedFile & _file, size_t & _offset, int _width, unsigned char * _rgbe )
+{
+  const unsigned char * data = _file.mData;
+  size_t size = _file.mSize;
+
+  bool encoded = _width >= 8 && _width < 32768 && _offset + 4 <= size
+    && data[ _offset ] == 2 && data[ _offset + 1 ] == 2 && ( ( data[ _offset + 2 ] << 8 ) | data[ _offset + 3 ] ) == _width;
+  if ( !encoded )
+  {
+    if ( _offset + _width * 4 > size )
+    {
+      return false;
+    }
+    if ( _rgbe )
+    {
+      memcpy( _rgbe, data + _offset, _width * 4 );
+    }
+    _offset += _width * 4;
+    return true;
+  }
+
+  // Every channel is stored separately: runs are a count above 128 followed by one byte, literals a count followed by that many bytes
+  _offset += 4;
+  for ( int channel = 0; channel < 4; channel++ )
+  {
+    int x = 0;
+    while ( x < _width )
+    {
+      if ( _offset >= size )
+      {
+        return false;
+      }
+      int count = data[ _offset++ ];
+      if ( count > 128 )
+      {
+        count -= 128;
+        if ( x + count > _width || _offset >= size )
+        {
+          return false;
+        }
+        unsigned char value = data[ _offset++ ];
+        for ( int i = 0; _rgbe && i < count; i++ )
+        {
+          _rgbe[ ( x + i ) * 4 + channel ] = value;
+        }
+        x += count;
+      }
+      else
+      {
+        if ( count == 0 || x + count > _width || _offset + count > size )
+        {
+          return false;
+        }
+        for ( int i = 0; _rgbe && i < count; i++ )
+        {
+          _rgbe[ ( x + i ) * 4 + channel ] = data[ _offset + i ];
+        }
+        x += count;
+        _offset += count;
+      }
+    }
+  }
+  return true;
+}
+
+// Parses the header and finds where every scanline starts
+bool OpenRadiance( const char * _path, const MappedFile & _file, int & _width, int & _height, std::vector<size_t> & _scanlines )
+{
+  size_t offset = 0;
+  std::string line;
+  if ( !ReadLine( _file, offset, line ) || ( line != "#?RADIANCE" && line != "#?RGBE" ) )
+  {
+    return false;
+  }
+  while ( ReadLine( _file, offset, line ) && !line.empty() )
+  {
+    if ( line.compare( 0, 7, "FORMAT=" ) == 0 && line != "FORMAT=32-bit_rle_rgbe" )
+    {
+      printf( "[HDRImage] Unsupported format '%s' in '%s'\n", line.c_str() + 7, _path );
+      return false;
+    }
+  }
+
+  // Only the usual top-to-bottom, left-to-right orientation
+  if ( !ReadLine( _file, offset, line ) || sscanf( line.c_str(), "-Y %d +X %d", &_height, &_width ) != 2 || _width <= 0 || _height <= 0 )
+  {
+    printf( "[HDRImage] Unsupported resolution line in '%s'\n", _path );
+    return false;
+  }
+
+  // Run length encoded scanlines differ in size, so this pass has to be serial; it only reads the run headers though
+  _scanlines.resize( _height );
+  for ( int y = 0; y < _height; y++ )
+  {
+    _scanlines[ y ] = offset;
+    if ( !DecodeScanline( _file, offset, _width, NULL ) )
+    {
+      printf( "[HDRImage] '%s' is truncated or corrupt at scanline %d\n", _path, y );
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decodes the scanlines on all cores, handing each one to _output( y, rgbe ) as RGBE bytes, once _allocate( texel count ) returned
+bool Decode( const char * _path, int & _width, int & _height, const std::function<void( int )> & _allocate, const std::function<void( int, const unsigned char * )> & _output )
+{
+  MappedFile file;
+  if ( !MapFile( _path, file ) )
+  {
+    return false;
+  }
+
+  std::vector<size_t> scanlines;
+  if ( !OpenRadiance( _path, file, _width, _height, scanlines ) )
+  {
+    UnmapFile( file );
+    return false;
+  }
+  _allocate( _width * _height );
+
+  const int rowsPerBlock = 16;
+  int width = _width;
+  int height = _height;
+  Parallel::For( ( height + rowsPerBlock - 1 ) / rowsPerBlock, [ & ]( int block )
+  {
+    std::vector<unsigned char> rgbe( width * 4 );
+    for ( int y = block * rowsPerBlock; y < height && y < ( block + 1 ) * rowsPerBlock; y++ )
+    {
+      size_t offset = scanlines[ y ];
+      DecodeScanline( file, offset, width, &rgbe[ 0 ] );
+      _output( y, &rgbe[ 0 ] );
+    }
+  } );
+
+  UnmapFile( file );
+  return true;
+}
+
+bool LoadR11G11B10F( const char * _path, int & _width, int & _height, std::vector<uint32_t> & _texels )
+{
+  return Decode( _path, _width, _height,
+    [ & ]( int _count ) { _texels.resize( _count ); },
+    [ & ]( int _y, const unsigned char * _rgbe ) { PackRGBEScanline( _rgbe, _width, &_texels[ (size_t) _y * _width ] ); } );
+}
+
+bool LoadRGBA32F( const char * _path, int & _width, int & _height, std::vector<float> & _texels )
+{
+  return Decode( _path, _width, _height,
+    [ & ]( int _count ) { _texels.resize( (size_t) _count * 4 ); },
+    [ & ]( int _y, const unsigned char * _rgbe ) { ConvertRGBEScanline( _rgbe, _width, &_texels[ (size_t) _y * _width * 4 ] ); } );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+double GetTime()
+{
+  return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void Benchmark( const char * _path, int _runs )
+{
+  printf( "[HDRImage] Benchmarking '%s', best of %d runs, %d threads\n", _path, _runs, Parallel::GetThreadCount() );
+
+  double best[ 3 ] = { 1e30, 1e30, 1e30 };
+  int width = 0;
+  int height = 0;
+  for ( int run = 0; run < _runs; run++ )
+  {
+    double start = GetTime();
+    int comp = 0;
+    float * data = stbi_loadf( _path, &width, &height, &comp, STBI_rgb_alpha );
+    double end = GetTime();
+    if ( !data )
+    {
+      printf( "[HDRImage] stbi_loadf can't load '%s'\n", _path );
+      return;
+    }
+    stbi_image_free( data );
+    best[ 0 ] = end - start < best[ 0 ] ? end - start : best[ 0 ];
+
+    std::vector<float> floats;
+    start = GetTime();
+    bool loaded = LoadRGBA32F( _path, width, height, floats );
+    end = GetTime();
+    best[ 1 ] = end - start < best[ 1 ] ? end - start : best[ 1 ];
+
+    std::vector<uint32_t> packed;
+    start = GetTime();
+    loaded = LoadR11G11B10F( _path, width, height, packed ) && loaded;
+    end = GetTime();
+    best[ 2 ] = end - start < best[ 2 ] ? end - start : best[ 2 ];
+
+    if ( !loaded )
+    {
+      printf( "[HDRImage] Can't decode '%s'\n", _path );
+      return;
+    }
+  }
+
+  printf( "[HDRImage] %d x %d\n", width, height );
+  printf( "[HDRImage]   stbi_loadf (RGBA32F)     %8.2f ms\n", best[ 0 ] );
+  printf( "[HDRImage]   LoadRGBA32F              %8.2f ms (%.1fx)\n", best[ 1 ], best[ 0 ] / best[ 1 ] );
+  printf( "[HDRImage]   LoadR11G11B10F           %8.2f ms (%.1fx)\n", best[ 2 ], best[ 0 ] / best[ 2 ] );
+}
+
+}
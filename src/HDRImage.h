@@ -0,0 +1,19 @@
+#include <stdint.h>
+#include <vector>
+
+// Radiance .hdr loading and compact GPU storage for HDR images: textures end up as GL_R11F_G11F_B10F
+// texels (GL_UNSIGNED_INT_10F_11F_11F_REV), a quarter of the size of RGBA32F.
+namespace HDRImage
+{
+  // Decodes a Radiance .hdr file straight from RGBE into packed texels, without a float copy of the image;
+  // the file is memory mapped and its scanlines are decoded on all cores
+  bool LoadR11G11B10F( const char * _path, int & _width, int & _height, std::vector<uint32_t> & _texels );
+  // Same decoder with float output, laid out like stbi_loadf() with STBI_rgb_alpha
+  bool LoadRGBA32F( const char * _path, int & _width, int & _height, std::vector<float> & _texels );
+  // Packs _count RGB float triplets; negative values and NaNs become zero, too large values are clamped
+  void PackR11G11B10F( const float * _rgb, int _count, uint32_t * _texels );
+  // The other way around, exact
+  void UnpackR11G11B10F( const uint32_t * _texels, int _count, float * _rgb );
+  // Times both decoders against stbi_loadf() and prints the results
+  void Benchmark( const char * _path, int _runs );
+}
@@ -1,8 +1,21 @@
 #include <stdio.h>
 #include <algorithm>
+#include <chrono>
 
 #include "Geometry.h"
 #include "SetupDialog.h"
+#include "FileWatcher.h"
+#include "SkyCache.h"
+#include "SkyPrefilter.h"
+#include "HDRImage.h"
+#include "Parallel.h"
+#include "Rasterizer.h"
+#include "PathTracer.h"
+#include "Startup.h"
+#include "Capture.h"
+#include "Batch.h"
+#include "Regression.h"
+#include "Profiler.h"
 
 #define IMGUI_IMPL_OPENGL_LOADER_GLEW
 #include <imgui.h>
@@ -16,75 +29,357 @@
 
 #include <jsonxx.h>
 
-Renderer::Shader * LoadShader( const char * vsPath, const char * fsPath )
+// Read on a worker during startup, so the GL thread only has to compile them. Each entry is used once,
+// hot reloads read the file again.
+std::map<std::string, std::string> gPrefetchedShaderSources;
+
+void PrefetchShaderSource( const std::string & path )
+{
+  FILE * file = fopen( path.c_str(), "rb" );
+  if ( !file )
+  {
+    // Reported once it's loaded for real
+    return;
+  }
+
+  std::string source;
+  char buffer[ 4096 ];
+  for ( size_t read = fread( buffer, 1, sizeof( buffer ), file ); read > 0; read = fread( buffer, 1, sizeof( buffer ), file ) )
+  {
+    source.append( buffer, read );
+  }
+  fclose( file );
+
+  gPrefetchedShaderSources[ path ] = source;
+}
+
+bool ReadShaderSource( const char * path, char * buffer, int bufferSize )
+{
+  memset( buffer, 0, bufferSize );
+
+  std::map<std::string, std::string>::iterator prefetched = gPrefetchedShaderSources.find( path );
+  if ( prefetched != gPrefetchedShaderSources.end() )
+  {
+    memcpy( buffer, prefetched->second.c_str(), std::min( (int) prefetched->second.size(), bufferSize - 1 ) );
+    gPrefetchedShaderSources.erase( prefetched );
+    return true;
+  }
+
+  FILE * file = fopen( path, "rb" );
+  if ( !file )
+  {
+    return false;
+  }
+  fread( buffer, 1, bufferSize - 1, file );
+  fclose( file );
+
+  return true;
+}
+
+bool LoadShaderSources( const char * vsPath, const char * fsPath, char * vertexShader, char * fragmentShader, int bufferSize )
 {
-  char vertexShader[ 16 * 1024 ] = { 0 };
-  FILE * fileVS = fopen( vsPath, "rb" );
-  if ( !fileVS )
+  if ( !ReadShaderSource( vsPath, vertexShader, bufferSize ) )
   {
     printf( "Vertex shader load failed: '%s'\n", vsPath );
-    return NULL;
+    return false;
   }
-  fread( vertexShader, 1, 16 * 1024, fileVS );
-  fclose( fileVS );
 
-  char fragmentShader[ 16 * 1024 ] = { 0 };
-  FILE * fileFS = fopen( fsPath, "rb" );
-  if ( !fileFS )
+  if ( !ReadShaderSource( fsPath, fragmentShader, bufferSize ) )
   {
     printf( "Fragment shader load failed: '%s'\n", fsPath );
+    return false;
+  }
+
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Hot reload: the sources of every loaded shader are watched, and a changed shader is rebuilt
+// in the background with all the variants it had. It's only swapped in once all of them linked.
+
+struct ShaderReload
+{
+  Renderer::ShaderVariants * mVariants;
+  std::string mVertexShaderPath;
+  std::string mFragmentShaderPath;
+  Renderer::ShaderVariants * mReplacement; // NULL unless a rebuild is in progress
+};
+
+std::vector<ShaderReload> gShaderReloads;
+std::string gShaderReloadErrors;
+
+Renderer::ShaderVariants * LoadShaderVariants( const char * vsPath, const char * fsPath )
+{
+  char vertexShader[ 16 * 1024 ];
+  char fragmentShader[ 16 * 1024 ];
+  if ( !LoadShaderSources( vsPath, fsPath, vertexShader, fragmentShader, 16 * 1024 ) )
+  {
     return NULL;
   }
-  fread( fragmentShader, 1, 16 * 1024, fileFS );
-  fclose( fileFS );
 
-  char error[ 4096 ];
-  Renderer::Shader * shader = Renderer::CreateShader( vertexShader, (int) strlen( vertexShader ), fragmentShader, (int) strlen( fragmentShader ), error, 4096 );
-  if ( !shader )
+  ShaderReload reload;
+  reload.mVariants = Renderer::CreateShaderVariants( vertexShader, fragmentShader );
+  reload.mVertexShaderPath = vsPath;
+  reload.mFragmentShaderPath = fsPath;
+  reload.mReplacement = NULL;
+  gShaderReloads.push_back( reload );
+
+  FileWatcher::Watch( vsPath );
+  FileWatcher::Watch( fsPath );
+
+  return reload.mVariants;
+}
+
+// Returns true if any shader was swapped, i.e. recorded draws using the old programs are stale
+bool UpdateShaderReloads()
+{
+  std::vector<std::string> changedPaths;
+  FileWatcher::PollChanges( changedPaths );
+
+  bool swapped = false;
+  for ( int i = 0; i < gShaderReloads.size(); i++ )
+  {
+    ShaderReload & reload = gShaderReloads[ i ];
+
+    if ( std::find( changedPaths.begin(), changedPaths.end(), reload.mVertexShaderPath ) != changedPaths.end()
+      || std::find( changedPaths.begin(), changedPaths.end(), reload.mFragmentShaderPath ) != changedPaths.end() )
+    {
+      printf( "[Main] Reloading '%s' / '%s'\n", reload.mVertexShaderPath.c_str(), reload.mFragmentShaderPath.c_str() );
+
+      // Restart if a rebuild is already underway, the sources changed again
+      if ( reload.mReplacement )
+      {
+        Renderer::ReleaseShaderVariants( reload.mReplacement );
+        delete reload.mReplacement;
+        reload.mReplacement = NULL;
+      }
+
+      char vertexShader[ 16 * 1024 ];
+      char fragmentShader[ 16 * 1024 ];
+      if ( LoadShaderSources( reload.mVertexShaderPath.c_str(), reload.mFragmentShaderPath.c_str(), vertexShader, fragmentShader, 16 * 1024 ) )
+      {
+        reload.mReplacement = Renderer::CreateShaderVariants( vertexShader, fragmentShader );
+        for ( std::map<uint32_t, Renderer::Shader *>::iterator it = reload.mVariants->mVariants.begin(); it != reload.mVariants->mVariants.end(); it++ )
+        {
+          reload.mReplacement->Request( it->first );
+        }
+        for ( std::map<uint32_t, Renderer::Shader *>::iterator it = reload.mVariants->mPending.begin(); it != reload.mVariants->mPending.end(); it++ )
+        {
+          reload.mReplacement->Request( it->first );
+        }
+      }
+    }
+
+    if ( !reload.mReplacement )
+    {
+      continue;
+    }
+
+    reload.mReplacement->Poll();
+    if ( reload.mReplacement->IsPending() )
+    {
+      continue;
+    }
+
+    if ( reload.mReplacement->mErrors.empty() )
+    {
+      Renderer::ReplaceShaderVariants( reload.mVariants, reload.mReplacement );
+      gShaderReloadErrors.clear();
+      swapped = true;
+    }
+    else
+    {
+      // Keep running the old programs
+      gShaderReloadErrors = reload.mFragmentShaderPath + ":\n" + reload.mReplacement->mErrors;
+      Renderer::ReleaseShaderVariants( reload.mReplacement );
+      delete reload.mReplacement;
+    }
+    reload.mReplacement = NULL;
+  }
+
+  return swapped;
+}
+
+void ReleaseShaderReloads()
+{
+  for ( int i = 0; i < gShaderReloads.size(); i++ )
   {
-    printf( "Shader build failed: %s\n", error );
+    if ( gShaderReloads[ i ].mReplacement )
+    {
+      Renderer::ReleaseShaderVariants( gShaderReloads[ i ].mReplacement );
+      delete gShaderReloads[ i ].mReplacement;
+    }
+    Renderer::ReleaseShaderVariants( gShaderReloads[ i ].mVariants );
+    delete gShaderReloads[ i ].mVariants;
   }
+  gShaderReloads.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Configured shaders are built as variant families: one program per material feature set
+// the current model needs, compiled in the background; the menu only offers families that are done
 
-  return shader;
+std::map<const jsonxx::Object *, Renderer::ShaderVariants *> gShaderConfigVariants;
+uint32_t gSceneShaderFeatures = 0;
+
+void BeginLoadShaderConfigs( const jsonxx::Array & _shaders )
+{
+  for ( int i = 0; i < _shaders.size(); i++ )
+  {
+    const jsonxx::Object * config = &_shaders.get<jsonxx::Object>( i );
+
+    Renderer::ShaderVariants * variants = LoadShaderVariants( config->get<jsonxx::String>( "vertexShader" ).c_str(), config->get<jsonxx::String>( "fragmentShader" ).c_str() );
+    if ( variants )
+    {
+      variants->Request( gSceneShaderFeatures );
+    }
+    gShaderConfigVariants[ config ] = variants;
+  }
 }
 
 const jsonxx::Object * gCurrentShaderConfig = NULL;
-Renderer::Shader * gCurrentShader = NULL;
+Renderer::ShaderVariants * gCurrentShaderVariants = NULL;
+Geometry gModel;
+
+// Starts building whatever the model needs with the current scene features, for every configured shader
+void RequestShaderVariants()
+{
+  for ( std::map<const jsonxx::Object *, Renderer::ShaderVariants *>::iterator it = gShaderConfigVariants.begin(); it != gShaderConfigVariants.end(); it++ )
+  {
+    if ( it->second )
+    {
+      gModel.PrepareShaderVariants( it->second, gSceneShaderFeatures, false );
+    }
+  }
+}
+
+// Releases the variants the previous model needed and this one doesn't, rebuilds underway included
+void ReleaseUnusedShaderVariants()
+{
+  std::vector<uint32_t> features;
+  gModel.GetShaderVariantFeatures( gSceneShaderFeatures, features );
+
+  for ( std::map<const jsonxx::Object *, Renderer::ShaderVariants *>::iterator it = gShaderConfigVariants.begin(); it != gShaderConfigVariants.end(); it++ )
+  {
+    if ( !it->second )
+    {
+      continue;
+    }
+    it->second->ReleaseUnused( features );
+
+    for ( int i = 0; i < gShaderReloads.size(); i++ )
+    {
+      if ( gShaderReloads[ i ].mVariants == it->second && gShaderReloads[ i ].mReplacement )
+      {
+        gShaderReloads[ i ].mReplacement->ReleaseUnused( features );
+      }
+    }
+  }
+}
+
+void PollShaderConfigs()
+{
+  for ( std::map<const jsonxx::Object *, Renderer::ShaderVariants *>::iterator it = gShaderConfigVariants.begin(); it != gShaderConfigVariants.end(); it++ )
+  {
+    if ( !it->second || !it->second->Poll() )
+    {
+      continue;
+    }
+    if ( it->second == gCurrentShaderVariants )
+    {
+      // The recorded draws used a stand-in for what just got built
+      gModel.InvalidateCommandList();
+    }
+    if ( !Renderer::SupportsParallelShaderCompile() )
+    {
+      // Finishing may block here, so only take one program per frame
+      break;
+    }
+  }
+}
+
+// Returns NULL once the shader can be used, otherwise why it can't
+const char * GetShaderConfigStatus( const jsonxx::Object * _shader )
+{
+  std::map<const jsonxx::Object *, Renderer::ShaderVariants *>::iterator it = gShaderConfigVariants.find( _shader );
+  if ( it == gShaderConfigVariants.end() )
+  {
+    return "loading";
+  }
+  if ( !it->second )
+  {
+    return "failed";
+  }
+  // The bare variant is enough to draw with, the material ones get used as they come in
+  std::map<uint32_t, Renderer::Shader *>::iterator base = it->second->mVariants.find( gSceneShaderFeatures );
+  if ( base == it->second->mVariants.end() )
+  {
+    return "compiling";
+  }
+  if ( !base->second )
+  {
+    return "failed";
+  }
+  return NULL;
+}
+
 bool LoadShaderConfig( const jsonxx::Object * _shader )
 {
-  Renderer::Shader * newShader = LoadShader( _shader->get<jsonxx::String>( "vertexShader" ).c_str(), _shader->get<jsonxx::String>( "fragmentShader" ).c_str() );
-  if ( !newShader )
+  std::map<const jsonxx::Object *, Renderer::ShaderVariants *>::iterator it = gShaderConfigVariants.find( _shader );
+  if ( it == gShaderConfigVariants.end() || !it->second )
   {
     return false;
   }
 
-  gCurrentShaderConfig = _shader;
-
-  if ( gCurrentShader )
+  // Waits for the program if it's not there yet
+  if ( !it->second->Get( gSceneShaderFeatures ) )
   {
-    Renderer::ReleaseShader( gCurrentShader );
-    delete gCurrentShader;
+    return false;
   }
-  gCurrentShader = newShader;
+
+  gCurrentShaderConfig = _shader;
+  gCurrentShaderVariants = it->second;
+  gModel.InvalidateCommandList();
 
   return true;
 }
 
 glm::vec3 gCameraTarget( 0.0f, 0.0f, 0.0f );
 float gCameraDistance = 500.0f;
-Geometry gModel;
+
+// The model from the command line is imported on a worker during startup; this is the task that uploads it
+Geometry * gImportedModel = NULL;
+int gStartupModelTask = -1;
+
+// Frames the camera on the model that was just loaded, and starts building the shaders it needs
+void FinishLoadMesh()
+{
+  gCameraTarget = ( gModel.mAABBMin + gModel.mAABBMax ) / 2.0f;
+  gCameraDistance = glm::length( gCameraTarget - gModel.mAABBMin ) * 4.0f;
+
+  ReleaseUnusedShaderVariants();
+  RequestShaderVariants();
+}
 
 bool LoadMesh( const char * path )
 {
+  Profiler::CPUScope scope( "LoadMesh" );
+
+  // Let the startup model land first, or it'd replace this one when it does
+  if ( gStartupModelTask >= 0 )
+  {
+    Profiler::CPUScope waitScope( "Wait for startup model" );
+    Startup::Wait( gStartupModelTask );
+    gStartupModelTask = -1;
+  }
+
   if ( !gModel.LoadMesh( path ) )
   {
     return false;
   }
 
-  gModel.RebindVertexArray( gCurrentShader );
-
-  gCameraTarget = ( gModel.mAABBMin + gModel.mAABBMax ) / 2.0f;
-  gCameraDistance = glm::length( gCameraTarget - gModel.mAABBMin ) * 4.0f;
+  Profiler::CPUScope finishScope( "Finish" );
+  FinishLoadMesh();
 
   return true;
 }
@@ -100,7 +395,14 @@ void ShowNodeInImGui( int _parentID )
       for ( int i = 0; i < it->second.mMeshes.size(); i++ )
       {
         const Geometry::Mesh & mesh = gModel.mMeshes[ it->second.mMeshes[ i ] ];
-        ImGui::TextColored( ImVec4( 1.0f, 0.5f, 1.0f, 1.0f ), "Mesh %d: %d vertices, %d triangles", i + 1, mesh.mVertexCount, mesh.mTriangleCount );
+        if ( mesh.mBatchMeshIndex >= 0 )
+        {
+          ImGui::TextColored( ImVec4( 1.0f, 0.5f, 1.0f, 1.0f ), "Mesh %d: %d vertices, %d triangles (merged into batch #%d)", i + 1, mesh.mVertexCount, mesh.mTriangleCount, mesh.mBatchMeshIndex );
+        }
+        else
+        {
+          ImGui::TextColored( ImVec4( 1.0f, 0.5f, 1.0f, 1.0f ), "Mesh %d: %d vertices, %d triangles", i + 1, mesh.mVertexCount, mesh.mTriangleCount );
+        }
       }
 
       ShowNodeInImGui( it->second.mID );
@@ -109,16 +411,17 @@ void ShowNodeInImGui( int _parentID )
   }
 }
 
-void ShowColorMapInImGui( const char * _channel, Geometry::ColorMap & _colorMap )
+bool ShowColorMapInImGui( const char * _channel, Geometry::ColorMap & _colorMap )
 {
   if ( !_colorMap.mValid )
   {
-    return;
+    return false;
   }
 
+  bool changed = false;
   if ( ImGui::BeginTabItem( _channel ) )
   {
-    ImGui::ColorEdit4( "Color", (float *) &_colorMap.mColor, ImGuiColorEditFlags_AlphaPreviewHalf );
+    changed = ImGui::ColorEdit4( "Color", (float *) &_colorMap.mColor, ImGuiColorEditFlags_AlphaPreviewHalf );
     if ( _colorMap.mTexture )
     {
       ImGui::Text( "Texture: %s", _colorMap.mTexture->mFilename.c_str() );
@@ -127,17 +430,40 @@ void ShowColorMapInImGui( const char * _channel, Geometry::ColorMap & _colorMap
     }
     ImGui::EndTabItem();
   }
+  return changed;
 }
 
 Renderer::Texture* gBrdfLookupTable = NULL;
 
-void loadBrdfLookupTable()
+const int brdfLookupTableWidth = 256;
+const int brdfLookupTableHeight = 256;
+const char* brdfLookupTableFilename = "Skyboxes/brdf256.bin";
+
+// Doesn't touch GL, so it can run on a worker
+bool readBrdfLookupTable( std::vector<float> & table )
 {
-  const int width = 256;
-  const int height = 256;
   const int comp = 2;
-  const char* filename = "Skyboxes/brdf256.bin";
 
+  table.resize( brdfLookupTableWidth * brdfLookupTableHeight * comp );
+
+  FILE* fp = fopen( brdfLookupTableFilename, "rb" );
+  size_t read = 0;
+  if ( fp )
+  {
+    read = fread( &table[ 0 ], sizeof( float ), table.size(), fp );
+    fclose( fp );
+  }
+
+  if ( read != table.size() )
+  {
+    printf( "Couldn't load %dx%d BRDF lookup table '%s'!\n", brdfLookupTableWidth, brdfLookupTableHeight, brdfLookupTableFilename );
+    return false;
+  }
+  return true;
+}
+
+void loadBrdfLookupTable( const std::vector<float> & table )
+{
   if ( gBrdfLookupTable )
   {
     Renderer::ReleaseTexture( gBrdfLookupTable );
@@ -145,66 +471,419 @@ void loadBrdfLookupTable()
     gBrdfLookupTable = NULL;
   }
 
-  gBrdfLookupTable = Renderer::CreateRG32FTextureFromRawFile( filename, width, height );
-
-  if ( !gBrdfLookupTable )
-  {
-    printf( "Couldn't load %dx%d BRDF lookup table '%s'!\n", width, height, filename );
-  }
+  gBrdfLookupTable = Renderer::CreateRG32FTexture( brdfLookupTableFilename, brdfLookupTableWidth, brdfLookupTableHeight, &table[ 0 ] );
 }
 
 
 struct SkyImages
 {
   Renderer::Texture* reflection = NULL;
-  Renderer::Texture* env = NULL;
+  int reflectionRoughnessLevels = 0; // 0 if the reflection only has a box filtered mip chain
+  glm::vec3 irradianceSH[ 9 ];
 };
 
 SkyImages gSkyImages;
+int gSkyImagesIndex = -1;
+int gPendingSkyImagesIndex = -1; // picked in the menu, but not resident yet
 
-void loadSkyImages( const char* reflectionPath, const char* envPath )
+void applySkyImages( int index, const SkyCache::Sky * sky )
 {
-  if ( gSkyImages.reflection )
+  gSkyImages.reflection = sky->mReflection;
+  gSkyImages.reflectionRoughnessLevels = sky->mReflectionRoughnessLevels;
+  for ( int i = 0; i < 9; i++ )
   {
-    Renderer::ReleaseTexture( gSkyImages.reflection );
-    gSkyImages.reflection = NULL;
+    gSkyImages.irradianceSH[ i ] = sky->mIrradianceSH[ i ];
   }
-  gSkyImages.reflection = Renderer::CreateRGBA8TextureFromFile( reflectionPath );
+  gSkyImagesIndex = index;
+  gPendingSkyImagesIndex = -1;
+}
 
-  if ( gSkyImages.reflection )
+// Switches right away if the sky is resident; otherwise the current one stays up until the new one is
+void selectSkyImages( int index )
+{
+  const SkyCache::Sky * sky = SkyCache::Use( index );
+  if ( sky )
   {
-      glBindTexture( GL_TEXTURE_2D, gSkyImages.reflection->mGLTextureID );
+    applySkyImages( index, sky );
+    return;
+  }
+  gPendingSkyImagesIndex = index;
+  SkyCache::Request( index );
+}
 
-      glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-      glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
+void updateSkyImages()
+{
+  SkyCache::Update();
+  if ( gPendingSkyImagesIndex >= 0 )
+  {
+    const SkyCache::Sky * sky = SkyCache::Use( gPendingSkyImagesIndex );
+    if ( sky )
+    {
+      applySkyImages( gPendingSkyImagesIndex, sky );
+    }
   }
+}
 
-  if ( gSkyImages.env )
+struct CommandLine
+{
+  std::string mModelPath;
+  std::string mBatchInput; // a directory or a list of models
+  bool mHeadless = false;
+  std::string mOutputPath; // "foxotron.png", "turntable_%04d.png" for a turntable or "thumbnails" for a batch, if empty
+  int mTurntableFrames = 0; // a single image if 0
+  std::string mPipeCommand;
+  int mWidth = 1280;
+  int mHeight = 720;
+  std::string mShaderName; // the first configured one if empty
+  std::string mSky; // index into the configured skies, or a path; the first one if empty
+  float mCameraYaw = glm::pi<float>() / 4.0f;
+  float mCameraPitch = 0.25f;
+  bool mSoftware = false; // render on the CPU, without GL
+  bool mPathTrace = false; // with the path tracer rather than the rasterizer
+  int mSamples = 256; // per pixel, for the path tracer
+  int mThreadCount = 0; // of the software renderers, one per core if 0
+  int mBenchmarkRuns = 0;
+  std::string mGoldenPath; // checks the image against this one, and the timings against mHistoryPath
+  std::string mHistoryPath; // next to the golden image if empty
+  int mTimedFrames = 120;
+  float mImageTolerance = 0.001f; // of the pixels that may differ
+  float mMaxSlowdown = 0.2f;
+  bool mRebaseline = false; // the timings of this run become the new baseline
+};
+
+bool parseCommandLine( int argc, const char * argv[], CommandLine & commandLine )
+{
+  for ( int i = 1; i < argc; i++ )
   {
-    Renderer::ReleaseTexture( gSkyImages.env );
-    gSkyImages.env = NULL;
+    const char * arg = argv[ i ];
+    const char * value = i + 1 < argc ? argv[ i + 1 ] : NULL;
+    if ( strcmp( arg, "--headless" ) == 0 )
+    {
+      commandLine.mHeadless = true;
+      continue;
+    }
+    if ( strcmp( arg, "--software" ) == 0 )
+    {
+      commandLine.mSoftware = true;
+      commandLine.mHeadless = true;
+      continue;
+    }
+    if ( strcmp( arg, "--rebaseline" ) == 0 )
+    {
+      commandLine.mRebaseline = true;
+      continue;
+    }
+    if ( strcmp( arg, "--pathtrace" ) == 0 )
+    {
+      commandLine.mSoftware = true;
+      commandLine.mPathTrace = true;
+      commandLine.mHeadless = true;
+      continue;
+    }
+    if ( strncmp( arg, "--", 2 ) != 0 )
+    {
+      commandLine.mModelPath = arg;
+      continue;
+    }
+    if ( !value )
+    {
+      printf( "Missing value for '%s'\n", arg );
+      return false;
+    }
+    i++;
+    if ( strcmp( arg, "--output" ) == 0 )
+    {
+      commandLine.mOutputPath = value;
+    }
+    else if ( strcmp( arg, "--turntable" ) == 0 )
+    {
+      commandLine.mTurntableFrames = atoi( value );
+    }
+    else if ( strcmp( arg, "--pipe" ) == 0 )
+    {
+      commandLine.mPipeCommand = value;
+    }
+    else if ( strcmp( arg, "--batch" ) == 0 )
+    {
+      commandLine.mBatchInput = value;
+    }
+    else if ( strcmp( arg, "--width" ) == 0 )
+    {
+      commandLine.mWidth = atoi( value );
+    }
+    else if ( strcmp( arg, "--height" ) == 0 )
+    {
+      commandLine.mHeight = atoi( value );
+    }
+    else if ( strcmp( arg, "--shader" ) == 0 )
+    {
+      commandLine.mShaderName = value;
+    }
+    else if ( strcmp( arg, "--sky" ) == 0 )
+    {
+      commandLine.mSky = value;
+    }
+    else if ( strcmp( arg, "--yaw" ) == 0 )
+    {
+      commandLine.mCameraYaw = (float) atof( value );
+    }
+    else if ( strcmp( arg, "--pitch" ) == 0 )
+    {
+      commandLine.mCameraPitch = (float) atof( value );
+    }
+    else if ( strcmp( arg, "--threads" ) == 0 )
+    {
+      commandLine.mThreadCount = atoi( value );
+    }
+    else if ( strcmp( arg, "--bench" ) == 0 )
+    {
+      commandLine.mBenchmarkRuns = atoi( value );
+    }
+    else if ( strcmp( arg, "--samples" ) == 0 )
+    {
+      commandLine.mSamples = atoi( value );
+    }
+    else if ( strcmp( arg, "--golden" ) == 0 )
+    {
+      commandLine.mGoldenPath = value;
+    }
+    else if ( strcmp( arg, "--history" ) == 0 )
+    {
+      commandLine.mHistoryPath = value;
+    }
+    else if ( strcmp( arg, "--timed-frames" ) == 0 )
+    {
+      commandLine.mTimedFrames = atoi( value );
+    }
+    else if ( strcmp( arg, "--tolerance" ) == 0 )
+    {
+      commandLine.mImageTolerance = (float) atof( value ) / 100.0f;
+    }
+    else if ( strcmp( arg, "--max-slowdown" ) == 0 )
+    {
+      commandLine.mMaxSlowdown = (float) atof( value ) / 100.0f;
+    }
+    else
+    {
+      printf( "Unknown option '%s'\n", arg );
+      return false;
+    }
   }
 
-  if ( envPath )
+  if ( commandLine.mWidth <= 0 || commandLine.mHeight <= 0 )
   {
-    gSkyImages.env = Renderer::CreateRGBA8TextureFromFile( envPath );
+    printf( "Invalid image size %dx%d\n", commandLine.mWidth, commandLine.mHeight );
+    return false;
+  }
 
-    if ( gSkyImages.env )
+  // Turntables are always rendered offscreen, so the resolution stays fixed
+  if ( commandLine.mTurntableFrames > 0 || !commandLine.mPipeCommand.empty() )
+  {
+    commandLine.mHeadless = true;
+    commandLine.mTurntableFrames = commandLine.mTurntableFrames > 0 ? commandLine.mTurntableFrames : 360;
+  }
+  if ( !commandLine.mBatchInput.empty() )
+  {
+    if ( commandLine.mTurntableFrames > 0 || !commandLine.mModelPath.empty() )
     {
-      glBindTexture( GL_TEXTURE_2D, gSkyImages.env->mGLTextureID );
-
-      glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-      glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
+      printf( "A batch can't be combined with a turntable or another model\n" );
+      return false;
     }
-    else
+    commandLine.mHeadless = true;
+  }
+  if ( commandLine.mSoftware && ( commandLine.mTurntableFrames > 0 || !commandLine.mBatchInput.empty() || commandLine.mModelPath.empty() ) )
+  {
+    printf( "The software renderer only renders a single image of a model\n" );
+    return false;
+  }
+  if ( ( commandLine.mThreadCount > 0 || commandLine.mBenchmarkRuns > 0 ) && !commandLine.mSoftware )
+  {
+    printf( "'--threads' and '--bench' are only for the software renderer\n" );
+    return false;
+  }
+  if ( commandLine.mPathTrace && commandLine.mBenchmarkRuns > 0 )
+  {
+    printf( "'--bench' is only for the rasterizer, the path tracer prints its ray throughput anyway\n" );
+    return false;
+  }
+  if ( commandLine.mSamples <= 0 )
+  {
+    printf( "Invalid sample count %d\n", commandLine.mSamples );
+    return false;
+  }
+  if ( !commandLine.mGoldenPath.empty() )
+  {
+    if ( commandLine.mSoftware || commandLine.mTurntableFrames > 0 || !commandLine.mBatchInput.empty() || commandLine.mModelPath.empty() )
+    {
+      printf( "Regression checks are for a single image of a model rendered with GL\n" );
+      return false;
+    }
+    commandLine.mHeadless = true;
+    if ( commandLine.mHistoryPath.empty() )
     {
-      printf( "Couldn't load environment map '%s'!\n", envPath );
+      size_t extension = commandLine.mGoldenPath.rfind( '.' );
+      commandLine.mHistoryPath = commandLine.mGoldenPath.substr( 0, extension ) + ".history.json";
     }
   }
+  if ( commandLine.mOutputPath.empty() )
+  {
+    commandLine.mOutputPath = !commandLine.mBatchInput.empty() ? "thumbnails" : commandLine.mTurntableFrames > 0 ? "turntable_%04d.png" : "foxotron.png";
+  }
+  if ( commandLine.mTurntableFrames > 0 && commandLine.mPipeCommand.empty() && commandLine.mOutputPath.find( '%' ) == std::string::npos )
+  {
+    printf( "The output of a turntable needs a frame number pattern, e.g. 'turntable_%%04d.png'\n" );
+    return false;
+  }
+  return true;
+}
+
+// The same view converged by the path tracer: the image is written after every pass, so stopping it early still
+// leaves the best one so far
+int renderPathTraced( const CommandLine & commandLine, const Geometry & geometry, const Rasterizer::Model * model, const Rasterizer::Settings & rasterizerSettings )
+{
+  PathTracer::Scene * scene = PathTracer::Build( geometry, model, rasterizerSettings.mWorldRoot );
+  if ( !scene )
+  {
+    return -5;
+  }
+
+  PathTracer::Settings settings;
+  settings.mWidth = rasterizerSettings.mWidth;
+  settings.mHeight = rasterizerSettings.mHeight;
+  settings.mThreadCount = rasterizerSettings.mThreadCount;
+  settings.mView = rasterizerSettings.mView;
+  settings.mProjection = rasterizerSettings.mProjection;
+  for ( int i = 0; i < 3; i++ )
+  {
+    settings.mLights[ i ].mDirection = rasterizerSettings.mLights[ i ].mDirection;
+    settings.mLights[ i ].mColor = rasterizerSettings.mLights[ i ].mColor;
+  }
+  settings.mSky = rasterizerSettings.mSky;
+  settings.mDrawSky = rasterizerSettings.mDrawSky;
+  settings.mSkyRotation = rasterizerSettings.mSkyRotation;
+  settings.mSkyOpacity = rasterizerSettings.mSkyOpacity;
+  settings.mExposure = rasterizerSettings.mExposure;
+  settings.mBackgroundColor = rasterizerSettings.mBackgroundColor;
+  settings.mSamplesPerPixel = commandLine.mSamples;
+  settings.mSamplesPerPass = 16;
+  settings.mMaxBounces = 8;
+
+  std::vector<unsigned char> pixels( settings.mWidth * settings.mHeight * 4 );
+  PathTracer::Statistics statistics;
+  bool written = true;
+  PathTracer::Render( scene, settings, &pixels[ 0 ], statistics, [ & ]( const PathTracer::Statistics & _statistics )
+  {
+    printf( "[PathTracer] %d/%d samples per pixel, %.1f s, %.2f M rays/s\n", _statistics.mSamplesPerPixel, settings.mSamplesPerPixel,
+      _statistics.mTime / 1000.0, _statistics.mRays / std::max( _statistics.mTime, 1.0 ) / 1000.0 );
+    written = Capture::WritePNG( commandLine.mOutputPath.c_str(), settings.mWidth, settings.mHeight, &pixels[ 0 ] );
+    return written;
+  } );
+  PathTracer::Release( scene );
+
+  return written ? 0 : -6;
+}
+
+// The command line's model drawn by the rasterizer (or the path tracer) instead of GL, for machines without a usable
+// GPU; the camera, lights and sky are set up the same way the first frame of the frame loop does it
+int renderSoftware( const CommandLine & commandLine, const char * skyPath, bool showSky )
+{
+  Geometry geometry;
+  geometry.mMergeStaticMeshes = gModel.mMergeStaticMeshes;
+  if ( !geometry.ImportMesh( commandLine.mModelPath.c_str() ) )
+  {
+    printf( "Couldn't import '%s'\n", commandLine.mModelPath.c_str() );
+    return -5;
+  }
+
+  // Without the sky, it's lit by the analytic lights like in GL
+  SkyPrefilter::Result sky;
+  std::vector<float> brdfLookupTable;
+  bool skyLoaded = SkyPrefilter::Load( skyPath, sky ) && readBrdfLookupTable( brdfLookupTable );
+
+  glm::vec3 cameraTarget = ( geometry.mAABBMin + geometry.mAABBMax ) / 2.0f;
+  float cameraDistance = glm::length( cameraTarget - geometry.mAABBMin ) * 4.0f;
+  glm::vec3 cameraPosition( 0.0f, 0.0f, -1.0f );
+  cameraPosition = glm::rotateX( cameraPosition, commandLine.mCameraPitch );
+  cameraPosition = glm::rotateY( cameraPosition, commandLine.mCameraYaw );
+  cameraPosition *= cameraDistance;
+
+  glm::vec3 fillLightDirection( 0.0f, 0.0f, 1.0f );
+  fillLightDirection = glm::rotateX( fillLightDirection, -0.4f );
+  fillLightDirection = glm::rotateY( fillLightDirection, 0.8f );
+
+  Rasterizer::Settings settings;
+  settings.mWidth = commandLine.mWidth;
+  settings.mHeight = commandLine.mHeight;
+  settings.mThreadCount = commandLine.mThreadCount;
+  settings.mWorldRoot = glm::mat4x4( 1.0f );
+  settings.mView = glm::lookAtRH( cameraPosition + cameraTarget, cameraTarget, glm::vec3( 0.0f, 1.0f, 0.0f ) );
+  settings.mProjection = glm::perspective( 0.5f, commandLine.mWidth / (float) commandLine.mHeight, cameraDistance / 1000.0f, cameraDistance * 2.0f );
+  settings.mLights[ 0 ].mDirection = glm::vec3( 0.0f, 0.0f, 1.0f );
+  settings.mLights[ 0 ].mColor = glm::vec3( 1.0f );
+  settings.mLights[ 1 ].mDirection = fillLightDirection;
+  settings.mLights[ 1 ].mColor = glm::vec3( 0.5f );
+  settings.mLights[ 2 ].mDirection = -fillLightDirection;
+  settings.mLights[ 2 ].mColor = glm::vec3( 0.25f );
+  settings.mSky = skyLoaded ? &sky : NULL;
+  settings.mDrawSky = showSky;
+  settings.mSkyRotation = 0.0f;
+  settings.mSkyBlur = 0.0f;
+  settings.mSkyOpacity = 1.0f;
+  settings.mExposure = 1.0f;
+  settings.mBackgroundColor = glm::vec4( 0.5f, 0.5f, 0.5f, 1.0f );
+  settings.mBrdfLookupTable = skyLoaded ? &brdfLookupTable[ 0 ] : NULL;
+  settings.mBrdfLookupTableSize = brdfLookupTableWidth;
+  settings.mFrameCount = 0;
+
+  Rasterizer::Model * model = Rasterizer::Prepare( geometry );
+  if ( !model )
+  {
+    return -5;
+  }
+  if ( commandLine.mPathTrace )
+  {
+    int result = renderPathTraced( commandLine, geometry, model, settings );
+    Rasterizer::Release( model );
+    return result;
+  }
+
+  // With --bench, the best of the runs is what counts: the first one also pays for faulting the buffers in
+  std::vector<unsigned char> pixels( commandLine.mWidth * commandLine.mHeight * 4 );
+  Rasterizer::Statistics statistics;
+  double bestTime = 0.0;
+  for ( int run = 0; run < std::max( commandLine.mBenchmarkRuns, 1 ); run++ )
+  {
+    Rasterizer::Render( model, settings, &pixels[ 0 ], statistics );
+    double time = statistics.mGeometryTime + statistics.mRasterTime;
+    bestTime = run == 0 ? time : std::min( bestTime, time );
+    printf( "[Rasterizer] %d triangles (%d drawn), %d pixels shaded in %.2f ms (geometry %.2f ms, tiles %.2f ms)\n",
+      statistics.mTriangles, statistics.mTrianglesDrawn, statistics.mPixelsShaded, time, statistics.mGeometryTime, statistics.mRasterTime );
+  }
+  if ( commandLine.mBenchmarkRuns > 0 )
+  {
+    printf( "[Rasterizer] %dx%d on %d threads, best of %d: %.2f ms, %.2f M triangles/s, %.2f M pixels/s\n",
+      commandLine.mWidth, commandLine.mHeight, commandLine.mThreadCount > 0 ? commandLine.mThreadCount : Parallel::GetThreadCount(), commandLine.mBenchmarkRuns,
+      bestTime, statistics.mTriangles / bestTime / 1000.0, commandLine.mWidth * commandLine.mHeight / bestTime / 1000.0 );
+  }
+  Rasterizer::Release( model );
+
+  return Capture::WritePNG( commandLine.mOutputPath.c_str(), commandLine.mWidth, commandLine.mHeight, &pixels[ 0 ] ) ? 0 : -6;
 }
 
 int main( int argc, const char * argv[] )
 {
+  if ( argc >= 3 && strcmp( argv[ 1 ], "--bench-hdr" ) == 0 )
+  {
+    HDRImage::Benchmark( argv[ 2 ], argc >= 4 ? atoi( argv[ 3 ] ) : 5 );
+    return 0;
+  }
+
+  CommandLine commandLine;
+  if ( !parseCommandLine( argc, argv, commandLine ) )
+  {
+    return -12;
+  }
+
   jsonxx::Object options;
   FILE * configFile = fopen( "config.json", "rb" );
   if ( !configFile )
@@ -225,17 +904,178 @@ int main( int argc, const char * argv[] )
     return -11;
   }
 
+  const jsonxx::Array & shaderConfigs = options.get<jsonxx::Array>( "shaders" );
+  int shaderConfigIndex = 0;
+  if ( !commandLine.mShaderName.empty() )
+  {
+    shaderConfigIndex = -1;
+    for ( int i = 0; i < shaderConfigs.size(); i++ )
+    {
+      if ( shaderConfigs.get<jsonxx::Object>( i ).get<jsonxx::String>( "name" ) == commandLine.mShaderName )
+      {
+        shaderConfigIndex = i;
+      }
+    }
+    if ( shaderConfigIndex < 0 )
+    {
+      printf( "Shader '%s' not found in the config\n", commandLine.mShaderName.c_str() );
+      return -12;
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+  // Startup tasks: everything that doesn't need GL starts on the workers right away, overlapping
+  // the setup dialog and the window; the GL halves run on this thread from the frame loop, so the
+  // first frame doesn't wait for any of it
+
+  Startup::Begin();
+
+  std::vector<std::string> skyPaths;
+  for ( int i = 0; i < options.get<jsonxx::Array>( "skyImages" ).size(); i++ )
+  {
+    skyPaths.push_back( options.get<jsonxx::Array>( "skyImages" ).get<jsonxx::Object>( i ).get<jsonxx::String>( "reflection" ) );
+  }
+  // Either one of the configured skies by index or path, or another file, which joins the list
+  int skyIndex = 0;
+  if ( !commandLine.mSky.empty() )
+  {
+    char * end = NULL;
+    skyIndex = (int) strtol( commandLine.mSky.c_str(), &end, 10 );
+    if ( *end || skyIndex < 0 || skyIndex >= skyPaths.size() )
+    {
+      skyIndex = (int) ( std::find( skyPaths.begin(), skyPaths.end(), commandLine.mSky ) - skyPaths.begin() );
+      if ( skyIndex == skyPaths.size() )
+      {
+        skyPaths.push_back( commandLine.mSky );
+      }
+    }
+  }
+  // Nothing else of startup is needed without GL
+  if ( commandLine.mSoftware )
+  {
+    Startup::Close();
+    return renderSoftware( commandLine, skyPaths[ skyIndex ].c_str(), shaderConfigs.get<jsonxx::Object>( shaderConfigIndex ).get<jsonxx::Boolean>( "showSkybox" ) );
+  }
+
+  bool skyCubemaps = !options.has<jsonxx::Boolean>( "skyCubemaps" ) || options.get<jsonxx::Boolean>( "skyCubemaps" );
+  int skyResidentCount = (int) skyPaths.size();
+  int skyBudgetMB = 512;
+  if ( options.has<jsonxx::Object>( "skyCache" ) )
+  {
+    const jsonxx::Object & skyCache = options.get<jsonxx::Object>( "skyCache" );
+    skyResidentCount = skyCache.has<jsonxx::Number>( "residentCount" ) ? (int) skyCache.get<jsonxx::Number>( "residentCount" ) : skyResidentCount;
+    skyBudgetMB = skyCache.has<jsonxx::Number>( "budgetMB" ) ? (int) skyCache.get<jsonxx::Number>( "budgetMB" ) : skyBudgetMB;
+  }
+  SkyCache::Open( skyPaths, skyCubemaps, skyResidentCount, (size_t) skyBudgetMB * 1024 * 1024 );
+
+  int shaderSourcesTask = Startup::Add( "shader sources", Startup::TASKTHREAD_WORKER, {}, [ & ]()
+  {
+    for ( int i = 0; i < shaderConfigs.size(); i++ )
+    {
+      PrefetchShaderSource( shaderConfigs.get<jsonxx::Object>( i ).get<jsonxx::String>( "vertexShader" ) );
+      PrefetchShaderSource( shaderConfigs.get<jsonxx::Object>( i ).get<jsonxx::String>( "fragmentShader" ) );
+    }
+    PrefetchShaderSource( "Skyboxes/skysphere.vs" );
+    PrefetchShaderSource( "Skyboxes/skysphere.fs" );
+    return true;
+  } );
+
+  std::vector<float> brdfLookupTable;
+  int brdfReadTask = Startup::Add( "BRDF LUT read", Startup::TASKTHREAD_WORKER, {}, [ & ]()
+  {
+    return readBrdfLookupTable( brdfLookupTable );
+  } );
+
+  // The starting sky is needed right away, the rest keep loading in the background
+  int skyDecodeTask = Startup::Add( "sky decode", Startup::TASKTHREAD_WORKER, {}, [ skyIndex ]()
+  {
+    SkyCache::WaitDecoded( skyIndex );
+    return true;
+  } );
+
+  int modelImportTask = -1;
+  if ( !commandLine.mModelPath.empty() )
+  {
+    gImportedModel = new Geometry();
+    gImportedModel->mMergeStaticMeshes = gModel.mMergeStaticMeshes;
+    const char * modelPath = commandLine.mModelPath.c_str();
+    modelImportTask = Startup::Add( "model import", Startup::TASKTHREAD_WORKER, {}, [ modelPath ]()
+    {
+      return gImportedModel->ImportMesh( modelPath );
+    } );
+  }
+
+  int sceneShadersTask = Startup::Add( "scene shaders", Startup::TASKTHREAD_CONTEXT, { shaderSourcesTask }, [ & ]()
+  {
+    BeginLoadShaderConfigs( shaderConfigs );
+    return LoadShaderConfig( &shaderConfigs.get<jsonxx::Object>( shaderConfigIndex ) );
+  } );
+
+  Renderer::ShaderVariants * skysphereShader = NULL;
+  int skyShaderTask = Startup::Add( "sky shader", Startup::TASKTHREAD_CONTEXT, { shaderSourcesTask }, [ & ]()
+  {
+    skysphereShader = LoadShaderVariants( "Skyboxes/skysphere.vs", "Skyboxes/skysphere.fs" );
+    return skysphereShader && skysphereShader->Get( 0 ) && skysphereShader->Get( Renderer::SHADERFEATURE_SKY_CUBEMAP );
+  } );
+
+  Startup::Add( "BRDF LUT upload", Startup::TASKTHREAD_CONTEXT, { brdfReadTask }, [ & ]()
+  {
+    loadBrdfLookupTable( brdfLookupTable );
+    brdfLookupTable.clear();
+    return gBrdfLookupTable != NULL;
+  } );
+
+  Startup::Add( "sky upload", Startup::TASKTHREAD_CONTEXT, { skyDecodeTask }, [ skyIndex ]()
+  {
+    // Unless another one has been picked from the menu in the meantime
+    if ( gSkyImagesIndex >= 0 || gPendingSkyImagesIndex >= 0 )
+    {
+      return true;
+    }
+    const SkyCache::Sky * sky = SkyCache::Wait( skyIndex );
+    if ( !sky )
+    {
+      return false;
+    }
+    applySkyImages( skyIndex, sky );
+    return true;
+  } );
+
+  // The first models import while the rest of startup runs
+  if ( !commandLine.mBatchInput.empty() && !Batch::Open( commandLine.mBatchInput.c_str(), commandLine.mOutputPath.c_str(), commandLine.mWidth, commandLine.mHeight, gModel.mMergeStaticMeshes ) )
+  {
+    SkyCache::Close();
+    Startup::Close();
+    return -13;
+  }
+
+  if ( modelImportTask >= 0 )
+  {
+    // After the scene shaders, so that the ones the model needs get requested
+    gStartupModelTask = Startup::Add( "model upload", Startup::TASKTHREAD_CONTEXT, { modelImportTask, sceneShadersTask }, []()
+    {
+      gModel.UploadMesh( *gImportedModel );
+      delete gImportedModel;
+      gImportedModel = NULL;
+      FinishLoadMesh();
+      return true;
+    } );
+  }
+
   //////////////////////////////////////////////////////////////////////////
   // Init renderer
   RENDERER_SETTINGS settings;
   settings.mVsync = false;
-  settings.mWidth = 1280;
-  settings.mHeight = 720;
+  settings.mWidth = commandLine.mWidth;
+  settings.mHeight = commandLine.mHeight;
   settings.mWindowMode = RENDERER_WINDOWMODE_WINDOWED;
   settings.mMultisampling = false;
+  settings.mHeadless = commandLine.mHeadless;
 #ifndef _DEBUG
-  if ( !SetupDialog::Open( &settings ) )
+  if ( !commandLine.mHeadless && !SetupDialog::Open( &settings ) )
   {
+    SkyCache::Close();
+    Startup::Close();
     return -14;
   }
 #endif
@@ -243,8 +1083,18 @@ int main( int argc, const char * argv[] )
   if ( !Renderer::Open( &settings ) )
   {
     printf( "Renderer::Open failed\n" );
+    SkyCache::Close();
+    Startup::Close();
+    if ( !commandLine.mBatchInput.empty() )
+    {
+      Batch::Close();
+    }
     return -1;
   }
+  Startup::Milestone( "Window open" );
+  Profiler::Open();
+
+  FileWatcher::Open();
 
   //////////////////////////////////////////////////////////////////////////
   // Start up ImGui
@@ -254,35 +1104,30 @@ int main( int argc, const char * argv[] )
 
   ImGui::StyleColorsDark();
 
-  ImGui_ImplGlfw_InitForOpenGL( Renderer::mWindow, true );
-  ImGui_ImplOpenGL3_Init();
-
-  imgui_addons::ImGuiFileBrowser file_dialog;
-
-  //////////////////////////////////////////////////////////////////////////
-  // Bootstrap
-  if ( !LoadShaderConfig( &options.get<jsonxx::Array>( "shaders" ).get<jsonxx::Object>( 0 ) ) )
+  // Headless there's no window to take input from; the UI isn't drawn either
+  if ( !commandLine.mHeadless )
   {
-    return -4;
+    ImGui_ImplGlfw_InitForOpenGL( Renderer::mWindow, true );
   }
+  ImGui_ImplOpenGL3_Init();
 
-  if ( argc >= 2 )
-  {
-    LoadMesh( argv[ 1 ] );
-  }
+  imgui_addons::ImGuiFileBrowser file_dialog;
 
   //////////////////////////////////////////////////////////////////////////
   // Mainloop
   bool appWantsToQuit = false;
-  bool automaticCamera = false;
+  bool automaticCamera = commandLine.mTurntableFrames > 0;
+  const float automaticCameraSpeed = 0.3f; // radians per second
+  int capturedFrames = 0;
+  bool sequenceOpen = false;
   uint32_t frameCount = 0;
   glm::mat4x4 viewMatrix;
   glm::mat4x4 projectionMatrix;
   bool rotatingCamera = false;
   bool movingCamera = false;
   bool movingLight = false;
-  float cameraYaw = glm::pi<float>() / 4.0f;
-  float cameraPitch = 0.25f;
+  float cameraYaw = commandLine.mCameraYaw;
+  float cameraPitch = commandLine.mCameraPitch;
   float lightYaw = 0.0f;
   float lightPitch = 0.0f;
   float mouseClickPosX = 0.0f;
@@ -292,8 +1137,10 @@ int main( int argc, const char * argv[] )
   float skysphereOpacity = 1.0f;
   float skysphereBlur = 0.0f;
   float exposure = 1.0f;
-  bool showImGui = true;
+  bool showImGui = !commandLine.mHeadless;
   bool edgedFaces = false;
+  bool debugShaderMaps = false;
+  bool debugShaderAmbient = false;
 
   bool xzySpace = false;
   const glm::mat4x4 xzyMatrix(
@@ -302,35 +1149,77 @@ int main( int argc, const char * argv[] )
     0.0f,-1.0f, 0.0f, 0.0f,
     0.0f, 0.0f, 0.0f, 1.0f );
 
-  auto firstSkyImages = options.get<jsonxx::Array>( "skyImages" ).get<jsonxx::Object>( 0 );
-  loadSkyImages(
-    firstSkyImages.get<jsonxx::String>( "reflection" ).c_str(),
-    firstSkyImages.has<jsonxx::String>( "env" ) ? firstSkyImages.get<jsonxx::String>( "env" ).c_str() : NULL );
-
-  loadBrdfLookupTable();
-
-  Geometry skysphere;
-  skysphere.LoadMesh( "Skyboxes/skysphere.fbx" );
+  int exitCode = 0;
 
-  Renderer::Shader * skysphereShader = LoadShader( "Skyboxes/skysphere.vs", "Skyboxes/skysphere.fs" );
-  if ( !skysphereShader )
-  {
-    return -8;
-  }
-  skysphere.RebindVertexArray( skysphereShader );
+  // A regression check times frames before taking the image; the first few still pay for first use on the driver
+  const int warmUpFrames = 10;
+  int timedFrameCount = 0;
+  std::vector<double> frameTimes;
 
   while ( !Renderer::WantsToQuit() && !appWantsToQuit )
   {
+    std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+    Profiler::BeginFrame();
+
+    Profiler::BeginCPU( "Reloads" );
+    PollShaderConfigs();
+    updateSkyImages();
+    if ( UpdateShaderReloads() )
+    {
+      gModel.InvalidateCommandList();
+    }
+    Profiler::EndCPU();
+
+    // Headless, the image is taken from the first frame that starts with everything loaded
+    bool captureFrame = commandLine.mHeadless && Startup::IsComplete();
+    bool timedFrame = captureFrame && !commandLine.mGoldenPath.empty() && timedFrameCount < warmUpFrames + commandLine.mTimedFrames;
+    captureFrame = captureFrame && !timedFrame;
+
+    // A batch renders one model per frame, framed like any other loaded model
+    std::string thumbnailPath;
+    if ( captureFrame && !commandLine.mBatchInput.empty() )
+    {
+      if ( !sequenceOpen )
+      {
+        sequenceOpen = Capture::OpenSequence( NULL, NULL, Renderer::nWidth, Renderer::nHeight );
+        exitCode = sequenceOpen ? exitCode : -6;
+      }
+      Geometry * model = sequenceOpen ? Batch::Next( thumbnailPath ) : NULL;
+      if ( model )
+      {
+        gModel.UploadMesh( *model );
+        delete model;
+        FinishLoadMesh();
+      }
+      else
+      {
+        captureFrame = false;
+        appWantsToQuit = true;
+      }
+    }
+
     Renderer::StartFrame( clearColor );
 
     //////////////////////////////////////////////////////////////////////////
     // ImGui windows etc.
+    Profiler::BeginCPU( "ImGui" );
     ImGui_ImplOpenGL3_NewFrame();
-    ImGui_ImplGlfw_NewFrame();
+    if ( commandLine.mHeadless )
+    {
+      io.DisplaySize = ImVec2( (float) settings.mWidth, (float) settings.mHeight );
+      // A turntable is the idle camera at a fixed time step, one full turn over its frames
+      io.DeltaTime = commandLine.mTurntableFrames > 0 ? glm::two_pi<float>() / automaticCameraSpeed / commandLine.mTurntableFrames : 1.0f / 60.0f;
+    }
+    else
+    {
+      ImGui_ImplGlfw_NewFrame();
+    }
     ImGui::NewFrame();
 
     bool openFileDialog = false;
     static bool showModelInfo = false;
+    static bool showRenderStatistics = false;
+    static bool showProfiler = false;
 
     if ( ImGui::IsKeyPressed( GLFW_KEY_F, false ) )
     {
@@ -363,6 +1252,7 @@ int main( int argc, const char * argv[] )
         if ( ImGui::BeginMenu( "Model" ) )
         {
           ImGui::MenuItem( "Show model info", NULL, &showModelInfo );
+          ImGui::MenuItem( "Merge small static meshes on load", NULL, &gModel.mMergeStaticMeshes );
           ImGui::Separator();
 
           bool xyzSpace = !xzySpace;
@@ -376,6 +1266,9 @@ int main( int argc, const char * argv[] )
         if ( ImGui::BeginMenu( "View" ) )
         {
           ImGui::MenuItem( "Wireframe / Edged faces", NULL, &edgedFaces );
+          ImGui::MenuItem( "Show render statistics", NULL, &showRenderStatistics );
+          ImGui::MenuItem( "Show profiler", NULL, &showProfiler );
+          ImGui::MenuItem( "Use multi-draw indirect", NULL, &gModel.mUseMultiDrawIndirect, Renderer::SupportsMultiDrawIndirect() );
           ImGui::Separator();
 
           ImGui::MenuItem( "Enable idle camera", NULL, &automaticCamera );
@@ -398,6 +1291,9 @@ int main( int argc, const char * argv[] )
           ImGui::DragFloat3( "Camera Target", (float *) &gCameraTarget );
           ImGui::DragFloat( "Light Yaw", &lightYaw, 0.01f );
           ImGui::DragFloat( "Light Pitch", &lightPitch, 0.01f );
+          ImGui::Separator();
+          ImGui::MenuItem( "Debug material maps", NULL, &debugShaderMaps );
+          ImGui::MenuItem( "Debug image based lighting", NULL, &debugShaderAmbient );
 #endif
           ImGui::EndMenu();
         }
@@ -409,11 +1305,12 @@ int main( int argc, const char * argv[] )
             const std::string & name = options.get<jsonxx::Array>( "shaders" ).get<jsonxx::Object>( i ).get<jsonxx::String>( "name" );
 
             bool selected = &shaderConfig == gCurrentShaderConfig;
-            if ( ImGui::MenuItem( name.c_str(), NULL, &selected ) )
+            const char * status = GetShaderConfigStatus( &shaderConfig );
+            std::string label = status ? name + " (" + status + ")" : name;
+            if ( ImGui::MenuItem( label.c_str(), NULL, &selected, status == NULL ) )
             {
               LoadShaderConfig( &shaderConfig );
             }
-            gModel.RebindVertexArray( gCurrentShader );
           }
           if ( gCurrentShaderConfig && gCurrentShaderConfig->get<jsonxx::Boolean>( "showSkybox" ) )
           {
@@ -423,12 +1320,11 @@ int main( int argc, const char * argv[] )
               const auto & images = options.get<jsonxx::Array>( "skyImages" ).get<jsonxx::Object>( i );
               const std::string & filename = images.get<jsonxx::String>( "reflection" );
 
-              bool selected = ( gSkyImages.reflection && gSkyImages.reflection->mFilename == filename );
-              if ( ImGui::MenuItem( filename.c_str(), NULL, &selected ) )
+              bool selected = i == gSkyImagesIndex;
+              std::string label = i == gPendingSkyImagesIndex ? filename + " (loading)" : filename;
+              if ( ImGui::MenuItem( label.c_str(), NULL, &selected ) )
               {
-                loadSkyImages(
-                  images.get<jsonxx::String>( "reflection" ).c_str(),
-                  images.has<jsonxx::String>( "env" ) ? images.get<jsonxx::String>( "env" ).c_str() : NULL );
+                selectSkyImages( i );
               }
             }
           }
@@ -455,14 +1351,29 @@ int main( int argc, const char * argv[] )
       ImGui::BeginTabBar( "model" );
       if ( ImGui::BeginTabItem( "Summary" ) )
       {
+        // Merged meshes stay listed next to their static batch, their triangles are counted there
         int triCount = 0;
+        int meshCount = 0;
+        int batchCount = 0;
         for ( std::map<int, Geometry::Mesh>::iterator it = gModel.mMeshes.begin(); it != gModel.mMeshes.end(); it++ )
         {
-          triCount += it->second.mTriangleCount;
+          if ( it->second.mBatchMeshIndex < 0 )
+          {
+            triCount += it->second.mTriangleCount;
+          }
+          if ( it->second.mSourceRanges.empty() )
+          {
+            meshCount++;
+          }
+          else
+          {
+            batchCount++;
+          }
         }
 
         ImGui::Text( "Triangle count: %d", triCount );
-        ImGui::Text( "Mesh count: %d", gModel.mMeshes.size() );
+        ImGui::Text( "Mesh count: %d", meshCount );
+        ImGui::Text( "Static batch count: %d", batchCount );
 
         ImGui::EndTabItem();
       }
@@ -484,14 +1395,19 @@ int main( int argc, const char * argv[] )
             ImGui::Text( "Specular shininess: %g", it->second.mSpecularShininess );
             if ( ImGui::BeginTabBar( it->second.mName.c_str() ) )
             {
-              ShowColorMapInImGui( "Ambient", it->second.mColorMapAmbient );
-              ShowColorMapInImGui( "Diffuse", it->second.mColorMapDiffuse );
-              ShowColorMapInImGui( "Normals", it->second.mColorMapNormals );
-              ShowColorMapInImGui( "Specular", it->second.mColorMapSpecular );
-              ShowColorMapInImGui( "Albedo", it->second.mColorMapAlbedo );
-              ShowColorMapInImGui( "Metallic", it->second.mColorMapMetallic );
-              ShowColorMapInImGui( "Roughness", it->second.mColorMapRoughness );
-              ShowColorMapInImGui( "AO", it->second.mColorMapAO );
+              bool changed = false;
+              changed |= ShowColorMapInImGui( "Ambient", it->second.mColorMapAmbient );
+              changed |= ShowColorMapInImGui( "Diffuse", it->second.mColorMapDiffuse );
+              changed |= ShowColorMapInImGui( "Normals", it->second.mColorMapNormals );
+              changed |= ShowColorMapInImGui( "Specular", it->second.mColorMapSpecular );
+              changed |= ShowColorMapInImGui( "Albedo", it->second.mColorMapAlbedo );
+              changed |= ShowColorMapInImGui( "Metallic", it->second.mColorMapMetallic );
+              changed |= ShowColorMapInImGui( "Roughness", it->second.mColorMapRoughness );
+              changed |= ShowColorMapInImGui( "AO", it->second.mColorMapAO );
+              if ( changed )
+              {
+                gModel.InvalidateCommandList();
+              }
               ImGui::EndTabBar();
             }
             ImGui::Unindent();
@@ -504,11 +1420,41 @@ int main( int argc, const char * argv[] )
       ImGui::End();
     }
 
+    if ( !gShaderReloadErrors.empty() )
+    {
+      ImGui::SetNextWindowBgAlpha( 0.8f );
+      ImGui::Begin( "Shader errors", NULL, ImGuiWindowFlags_AlwaysAutoResize );
+      ImGui::TextColored( ImVec4( 1.0f, 0.4f, 0.4f, 1.0f ), "%s", gShaderReloadErrors.c_str() );
+      if ( ImGui::Button( "Dismiss" ) )
+      {
+        gShaderReloadErrors.clear();
+      }
+      ImGui::End();
+    }
+
+    if ( showRenderStatistics )
+    {
+      const Renderer::StateStatistics & stateStatistics = Renderer::GetStateStatistics();
+
+      ImGui::Begin( "Render statistics", &showRenderStatistics, ImGuiWindowFlags_AlwaysAutoResize );
+      ImGui::Text( "State changes issued: %d", stateStatistics.mIssuedCalls );
+      ImGui::Text( "State changes filtered: %d", stateStatistics.mFilteredCalls );
+      ImGui::Text( "Draw calls: %d", stateStatistics.mDrawCalls );
+      ImGui::End();
+    }
+
+    if ( showProfiler )
+    {
+      Profiler::ShowWindow( &showProfiler );
+    }
+
     ImGui::Render();
+    Profiler::EndCPU();
 
     //////////////////////////////////////////////////////////////////////////
     // Drag'n'drop
 
+    Profiler::BeginCPU( "Input" );
     for ( int i = 0; i < Renderer::dropEventBufferCount; i++ )
     {
       std::string & path = Renderer::dropEventBuffer[ i ];
@@ -614,13 +1560,15 @@ int main( int argc, const char * argv[] )
       }
     }
     Renderer::mouseEventBufferCount = 0;
+    Profiler::EndCPU();
 
     //////////////////////////////////////////////////////////////////////////
     // Camera and lights
 
-    if ( automaticCamera )
+    // Headless, the camera only turns between captured frames, so the first one is at the requested angle
+    if ( automaticCamera && ( !commandLine.mHeadless || capturedFrames > 0 ) )
     {
-      cameraYaw += io.DeltaTime * 0.3f;
+      cameraYaw += io.DeltaTime * automaticCameraSpeed;
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -631,142 +1579,278 @@ int main( int argc, const char * argv[] )
     cameraPosition = glm::rotateY( cameraPosition, cameraYaw );
 
     static glm::mat4x4 worldRootXYZ( 1.0f );
-    if ( gCurrentShaderConfig->get<jsonxx::Boolean>( "showSkybox" ) )
-    {
-      float verticalFovInRadian = 0.5f;
-      projectionMatrix = glm::perspective( verticalFovInRadian, settings.mWidth / (float) settings.mHeight, 0.001f, 2.0f );
-      skysphereShader->SetConstant( "mat_projection", projectionMatrix );
+    bool skyIsCubemap = gSkyImages.reflection && gSkyImages.reflection->mType == Renderer::TEXTURETYPE_CUBE;
 
-      viewMatrix = glm::lookAtRH( cameraPosition * 0.15f, glm::vec3( 0.0f, 0.0f, 0.0f ), glm::vec3( 0.0f, 1.0f, 0.0f ) );
-      skysphereShader->SetConstant( "mat_view", viewMatrix );
+    //////////////////////////////////////////////////////////////////////////
+    // Mesh render
 
-      skysphereShader->SetConstant( "has_tex_skysphere", gSkyImages.reflection != NULL );
-      skysphereShader->SetConstant( "has_tex_skyenv", gSkyImages.env != NULL );
+    uint32_t sceneShaderFeatures = 0;
+    sceneShaderFeatures |= gSkyImages.reflection ? Renderer::SHADERFEATURE_IBL : 0;
+    sceneShaderFeatures |= skyIsCubemap ? Renderer::SHADERFEATURE_SKY_CUBEMAP : 0;
+    sceneShaderFeatures |= debugShaderMaps ? Renderer::SHADERFEATURE_DEBUG_MAPS : 0;
+    sceneShaderFeatures |= debugShaderAmbient ? Renderer::SHADERFEATURE_DEBUG_AMBIENT : 0;
+    if ( sceneShaderFeatures != gSceneShaderFeatures )
+    {
+      gSceneShaderFeatures = sceneShaderFeatures;
+      RequestShaderVariants();
+    }
 
-      if ( gSkyImages.reflection )
+    float verticalFovInRadian = 0.5f;
+    projectionMatrix = glm::perspective( verticalFovInRadian, settings.mWidth / (float) settings.mHeight, gCameraDistance / 1000.0f, gCameraDistance * 2.0f );
+    cameraPosition *= gCameraDistance;
+    viewMatrix = glm::lookAtRH( cameraPosition + gCameraTarget, gCameraTarget, glm::vec3( 0.0f, 1.0f, 0.0f ) );
+
+    // Nothing to draw the scene with until the startup shaders are in
+    if ( gCurrentShaderVariants )
+    {
+      // Interactively, the variants still building are polled at the start of the frame and stood in for until
+      // then; a captured frame has to show the model as it is, so wait for them
+      if ( commandLine.mHeadless )
       {
-        skysphereShader->SetTexture( "tex_skysphere", gSkyImages.reflection );
+        gModel.PrepareShaderVariants( gCurrentShaderVariants, gSceneShaderFeatures, true );
       }
 
-      if ( gSkyImages.env )
+      gCurrentShaderVariants->SetConstant( "mat_projection", projectionMatrix );
+      gCurrentShaderVariants->SetConstant( "camera_position", cameraPosition );
+
+      glm::vec3 lightDirection( 0.0f, 0.0f, 1.0f );
+      lightDirection = glm::rotateX( lightDirection, lightPitch );
+      lightDirection = glm::rotateY( lightDirection, lightYaw );
+
+      glm::vec3 fillLightDirection( 0.0f, 0.0f, 1.0f );
+      fillLightDirection = glm::rotateX( fillLightDirection, lightPitch - 0.4f );
+      fillLightDirection = glm::rotateY( fillLightDirection, lightYaw + 0.8f );
+
+      gCurrentShaderVariants->SetConstant( "lights[0].direction", lightDirection );
+      gCurrentShaderVariants->SetConstant( "lights[0].color", glm::vec3( 1.0f ) );
+      gCurrentShaderVariants->SetConstant( "lights[1].direction", fillLightDirection );
+      gCurrentShaderVariants->SetConstant( "lights[1].color", glm::vec3( 0.5f ) );
+      gCurrentShaderVariants->SetConstant( "lights[2].direction", -fillLightDirection );
+      gCurrentShaderVariants->SetConstant( "lights[2].color", glm::vec3( 0.25f ) );
+
+      gCurrentShaderVariants->SetConstant( "skysphere_rotation", lightYaw );
+
+      gCurrentShaderVariants->SetConstant( "mat_view", viewMatrix );
+      gCurrentShaderVariants->SetConstant( "mat_view_inverse", glm::inverse( viewMatrix ) );
+
+      gCurrentShaderVariants->SetConstant( "has_tex_skysphere", gSkyImages.reflection != NULL );
+      for ( int i = 0; i < 9; i++ )
+      {
+        char name[ 32 ];
+        snprintf( name, 32, "sh_irradiance[%d]", i );
+        gCurrentShaderVariants->SetConstant( name, gSkyImages.irradianceSH[ i ] );
+      }
+      if ( gSkyImages.reflection )
       {
-        skysphereShader->SetTexture( "tex_skyenv", gSkyImages.env );
+        // With a prefiltered chain, each mip is one roughness step
+        float mipCount = gSkyImages.reflectionRoughnessLevels ? gSkyImages.reflectionRoughnessLevels - 1.0f : floor( log2( gSkyImages.reflection->mHeight ) );
+        gCurrentShaderVariants->SetTexture( "tex_skysphere", gSkyImages.reflection );
+        gCurrentShaderVariants->SetConstant( "skysphere_mip_count", mipCount );
       }
+      gCurrentShaderVariants->SetTexture( "tex_brdf_lut", gBrdfLookupTable );
+      gCurrentShaderVariants->SetConstant( "exposure", exposure );
+      gCurrentShaderVariants->SetConstant( "frame_count", frameCount );
 
-      skysphereShader->SetConstant( "background_color", clearColor );
-      skysphereShader->SetConstant( "skysphere_blur", skysphereBlur );
-      skysphereShader->SetConstant( "skysphere_opacity", skysphereOpacity );
-      skysphereShader->SetConstant( "skysphere_rotation", lightYaw );
-      skysphereShader->SetConstant( "exposure", exposure );
-      skysphereShader->SetConstant( "frame_count", frameCount );
+      //////////////////////////////////////////////////////////////////////////
+      // Mesh render
+
+      Profiler::BeginCPU( "Mesh render" );
+      Profiler::BeginGPU( "Mesh" );
+      gModel.Render( xzySpace ? xzyMatrix : worldRootXYZ, gCurrentShaderVariants, gSceneShaderFeatures );
+      Profiler::EndGPU();
 
-      skysphere.Render( worldRootXYZ, skysphereShader );
+      if ( edgedFaces )
+      {
+        Profiler::BeginGPU( "Wireframe" );
+        Renderer::SetPolygonMode( GL_LINE );
+        Renderer::SetDepthFunc( GL_LEQUAL );
+
+        gCurrentShaderVariants->SetConstant( "exposure", 100.0f );
+        gModel.Render( xzySpace ? xzyMatrix : worldRootXYZ, gCurrentShaderVariants, gSceneShaderFeatures );
 
-      glClear( GL_DEPTH_BUFFER_BIT );
+        Renderer::SetPolygonMode( GL_FILL );
+        Renderer::SetDepthFunc( GL_LESS );
+        Profiler::EndGPU();
+      }
+      Profiler::EndCPU();
     }
 
     //////////////////////////////////////////////////////////////////////////
-    // Mesh render
+    // Sky render
 
-    float verticalFovInRadian = 0.5f;
-    projectionMatrix = glm::perspective( verticalFovInRadian, settings.mWidth / (float) settings.mHeight, gCameraDistance / 1000.0f, gCameraDistance * 2.0f );
-    gCurrentShader->SetConstant( "mat_projection", projectionMatrix );
+    // Drawn last on the far plane, so the depth test leaves only the pixels the mesh didn't cover; also while the
+    // scene shader is still being built, before there's a config that could turn it off
+    if ( skysphereShader && ( !gCurrentShaderConfig || gCurrentShaderConfig->get<jsonxx::Boolean>( "showSkybox" ) ) )
+    {
+      Profiler::CPUScope skyScope( "Sky render" );
+      Renderer::Shader * skysphereVariant = skysphereShader->Get( skyIsCubemap ? Renderer::SHADERFEATURE_SKY_CUBEMAP : 0 );
 
-    cameraPosition *= gCameraDistance;
-    gCurrentShader->SetConstant( "camera_position", cameraPosition );
+      // Only the direction of the view rays matters, so the mesh camera works as is
+      skysphereShader->SetConstant( "mat_view_projection_inverse", glm::inverse( projectionMatrix * viewMatrix ) );
 
-    glm::vec3 lightDirection( 0.0f, 0.0f, 1.0f );
-    lightDirection = glm::rotateX( lightDirection, lightPitch );
-    lightDirection = glm::rotateY( lightDirection, lightYaw );
+      skysphereShader->SetConstant( "has_tex_skysphere", gSkyImages.reflection != NULL );
+
+      if ( gSkyImages.reflection )
+      {
+        skysphereShader->SetTexture( "tex_skysphere", gSkyImages.reflection );
+      }
 
-    glm::vec3 fillLightDirection( 0.0f, 0.0f, 1.0f );
-    fillLightDirection = glm::rotateX( fillLightDirection, lightPitch - 0.4f );
-    fillLightDirection = glm::rotateY( fillLightDirection, lightYaw + 0.8f );
+      skysphereShader->SetConstant( "background_color", clearColor );
+      skysphereShader->SetConstant( "skysphere_blur", skysphereBlur );
+      skysphereShader->SetConstant( "skysphere_opacity", skysphereOpacity );
+      skysphereShader->SetConstant( "skysphere_rotation", lightYaw );
+      skysphereShader->SetConstant( "exposure", exposure );
+      skysphereShader->SetConstant( "frame_count", frameCount );
 
-    gCurrentShader->SetConstant( "lights[0].direction", lightDirection );
-    gCurrentShader->SetConstant( "lights[0].color", glm::vec3( 1.0f ) );
-    gCurrentShader->SetConstant( "lights[1].direction", fillLightDirection );
-    gCurrentShader->SetConstant( "lights[1].color", glm::vec3( 0.5f ) );
-    gCurrentShader->SetConstant( "lights[2].direction", -fillLightDirection );
-    gCurrentShader->SetConstant( "lights[2].color", glm::vec3( 0.25f ) );
+      if ( skysphereVariant )
+      {
+        Profiler::GPUScope skyPassScope( "Sky" );
+        Renderer::SetDepthFunc( GL_LEQUAL );
+        Renderer::SetDepthMask( false );
 
-    gCurrentShader->SetConstant( "skysphere_rotation", lightYaw );
+        Renderer::SetShader( skysphereVariant );
+        Renderer::RenderFullscreenQuad();
 
-    viewMatrix = glm::lookAtRH( cameraPosition + gCameraTarget, gCameraTarget, glm::vec3( 0.0f, 1.0f, 0.0f ) );
-    gCurrentShader->SetConstant( "mat_view", viewMatrix );
-    gCurrentShader->SetConstant( "mat_view_inverse", glm::inverse( viewMatrix ) );
+        Renderer::SetDepthMask( true );
+        Renderer::SetDepthFunc( GL_LESS );
+      }
+    }
 
-    gCurrentShader->SetConstant( "has_tex_skysphere", gSkyImages.reflection != NULL );
-    gCurrentShader->SetConstant( "has_tex_skyenv", gSkyImages.env != NULL );
-    if ( gSkyImages.reflection )
+    if ( captureFrame && !commandLine.mBatchInput.empty() )
     {
-      float mipCount = floor( log2( gSkyImages.reflection->mHeight ) );
-      gCurrentShader->SetTexture( "tex_skysphere", gSkyImages.reflection );
-      gCurrentShader->SetConstant( "skysphere_mip_count", mipCount );
+      Capture::CaptureFrame( thumbnailPath.c_str() );
+      Batch::Rendered( gModel );
     }
-    if ( gSkyImages.env )
+    else if ( captureFrame && commandLine.mTurntableFrames > 0 )
     {
-      gCurrentShader->SetTexture( "tex_skyenv", gSkyImages.env );
+      if ( capturedFrames == 0 )
+      {
+        sequenceOpen = Capture::OpenSequence( commandLine.mOutputPath.c_str(), commandLine.mPipeCommand.c_str(), Renderer::nWidth, Renderer::nHeight );
+        exitCode = sequenceOpen ? exitCode : -6;
+      }
+      if ( sequenceOpen )
+      {
+        // Only queues the copy; the pixels are picked up a few frames later
+        Capture::CaptureFrame();
+        capturedFrames++;
+      }
+      appWantsToQuit = !sequenceOpen || capturedFrames == commandLine.mTurntableFrames;
     }
-    gCurrentShader->SetTexture( "tex_brdf_lut", gBrdfLookupTable );
-    gCurrentShader->SetConstant( "exposure", exposure );
-    gCurrentShader->SetConstant( "frame_count", frameCount );
-
-    //////////////////////////////////////////////////////////////////////////
-    // Mesh render
-
-    gModel.Render( xzySpace ? xzyMatrix : worldRootXYZ, gCurrentShader );
-
-    if ( edgedFaces )
+    else if ( captureFrame )
     {
-      glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
-      glDepthFunc( GL_LEQUAL );
-
-      gCurrentShader->SetConstant( "exposure", 100.0f );
-      gModel.Render( xzySpace ? xzyMatrix : worldRootXYZ, gCurrentShader );
-
-      glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
-      glDepthFunc( GL_LESS );
+      std::vector<unsigned char> pixels( Renderer::nWidth * Renderer::nHeight * 4 );
+      Renderer::ReadPixels( &pixels[ 0 ] );
+      if ( !Capture::WritePNG( commandLine.mOutputPath.c_str(), Renderer::nWidth, Renderer::nHeight, &pixels[ 0 ] ) )
+      {
+        exitCode = -6;
+      }
+      else if ( !commandLine.mGoldenPath.empty() )
+      {
+        Regression::Timings timings;
+        timings.mImportTime = Startup::GetDuration( modelImportTask );
+        timings.mUploadTime = Startup::GetDuration( gStartupModelTask );
+        Regression::GetFrameTimes( frameTimes, timings );
+
+        std::string diffPath = commandLine.mOutputPath.substr( 0, commandLine.mOutputPath.rfind( '.' ) ) + ".diff.png";
+        bool imagePassed = Regression::CompareImage( commandLine.mGoldenPath.c_str(), diffPath.c_str(), Renderer::nWidth, Renderer::nHeight, &pixels[ 0 ], commandLine.mImageTolerance );
+        bool timingsPassed = Regression::CheckTimings( commandLine.mHistoryPath.c_str(), timings, commandLine.mMaxSlowdown, commandLine.mRebaseline );
+        exitCode = imagePassed && timingsPassed ? exitCode : -15;
+      }
+      appWantsToQuit = true;
     }
 
     //////////////////////////////////////////////////////////////////////////
     // End frame
-    ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
+    // Headless there's no UI in the image; otherwise F11 only hides the menu bar, the open windows stay
+    if ( !commandLine.mHeadless )
+    {
+      Profiler::CPUScope imguiScope( "ImGui render" );
+      Profiler::GPUScope imguiPassScope( "ImGui" );
+      ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
+    }
+    Profiler::BeginCPU( "Swap" );
     Renderer::EndFrame();
+    Profiler::EndCPU();
+    if ( timedFrame )
+    {
+      // Waits for the GPU, or only the submission would be timed
+      glFinish();
+      if ( timedFrameCount++ >= warmUpFrames )
+      {
+        frameTimes.push_back( std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - frameStart ).count() );
+      }
+    }
+    if ( frameCount == 0 )
+    {
+      Startup::Milestone( "First frame" );
+    }
     frameCount++;
+
+    // After the frame, so startup work only ever delays the next one
+    Startup::Poll();
+    if ( Startup::HasFailed( sceneShadersTask ) )
+    {
+      exitCode = -4;
+      appWantsToQuit = true;
+    }
+    if ( Startup::HasFailed( skyShaderTask ) )
+    {
+      exitCode = -8;
+      appWantsToQuit = true;
+    }
+    // An image without the model is no use
+    if ( commandLine.mHeadless && gStartupModelTask >= 0 && Startup::HasFailed( gStartupModelTask ) )
+    {
+      exitCode = -5;
+      appWantsToQuit = true;
+    }
   }
 
   //////////////////////////////////////////////////////////////////////////
   // Cleanup
 
-  if ( gCurrentShader )
-  {
-    Renderer::ReleaseShader( gCurrentShader );
-    delete gCurrentShader;
-  }
-  if ( skysphereShader )
+  // Still has the last few frames in flight
+  std::vector<std::string> failedFramePaths;
+  if ( sequenceOpen && !Capture::CloseSequence( &failedFramePaths ) && !exitCode )
   {
-    Renderer::ReleaseShader( skysphereShader );
-    delete skysphereShader;
+    exitCode = -6;
   }
-  if ( gSkyImages.reflection )
+  if ( !commandLine.mBatchInput.empty() )
   {
-    Renderer::ReleaseTexture( gSkyImages.reflection );
-    gSkyImages.reflection = NULL;
+    // The manifest shouldn't list a model as rendered if its thumbnail never made it to disk
+    Batch::ThumbnailsFailed( failedFramePaths );
+    if ( !Batch::Close() && !exitCode )
+    {
+      exitCode = -6;
+    }
   }
-  if ( gSkyImages.env )
+
+  // Owns every shader family, including the configured ones
+  ReleaseShaderReloads();
+  FileWatcher::Close();
+
+  // Owns the sky textures; closed before the startup workers, one of them may be waiting on it
+  SkyCache::Close();
+  gSkyImages.reflection = NULL;
+
+  Startup::Close();
+  if ( gImportedModel )
   {
-    Renderer::ReleaseTexture( gSkyImages.env );
-    gSkyImages.env = NULL;
+    delete gImportedModel;
+    gImportedModel = NULL;
   }
 
+  Profiler::Close();
   ImGui_ImplOpenGL3_Shutdown();
-  ImGui_ImplGlfw_Shutdown();
+  if ( !commandLine.mHeadless )
+  {
+    ImGui_ImplGlfw_Shutdown();
+  }
   ImGui::DestroyContext();
 
   gModel.UnloadMesh();
 
   Renderer::Close();
 
-  return 0;
+  return exitCode;
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "Parallel.h"
+
+namespace Parallel
+{
+
+int GetThreadCount()
+{
+  unsigned int count = std::thread::hardware_concurrency();
+  return count ? (int) count : 4;
+}
+
+void For( int _count, const std::function<void( int )> & _body )
+{
+  For( _count, GetThreadCount(), _body );
+}
+
+void For( int _count, int _threadCount, const std::function<void( int )> & _body )
+{
+  int threadCount = _threadCount;
+  if ( threadCount > _count )
+  {
+    threadCount = _count;
+  }
+  if ( threadCount <= 1 )
+  {
+    for ( int i = 0; i < _count; i++ )
+    {
+      _body( i );
+    }
+    return;
+  }
+
+  // Items are handed out one at a time, so uneven items (e.g. rows near the poles) still balance out
+  std::atomic<int> next( 0 );
+  std::vector<std::thread> threads;
+  for ( int i = 0; i < threadCount - 1; i++ )
+  {
+    threads.push_back( std::thread( [ & ]()
+    {
+      for ( int item = next++; item < _count; item = next++ )
+      {
+        _body( item );
+      }
+    } ) );
+  }
+
+  // The calling thread works too
+  for ( int item = next++; item < _count; item = next++ )
+  {
+    _body( item );
+  }
+
+  for ( int i = 0; i < threads.size(); i++ )
+  {
+    threads[ i ].join();
+  }
+}
+
+}
@@ -0,0 +1,11 @@
+#include <functional>
+
+// Splits CPU-heavy loading work over all cores
+namespace Parallel
+{
+  int GetThreadCount();
+  // Calls _body( i ) for every i in [0, _count) from a set of worker threads and returns once all calls are done
+  void For( int _count, const std::function<void( int )> & _body );
+  // Same, with at most _threadCount threads
+  void For( int _count, int _threadCount, const std::function<void( int )> & _body );
+}
@@ -0,0 +1,928 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "Geometry.h"
+#include "SkyPrefilter.h"
+#include "Parallel.h"
+#include "Rasterizer.h"
+#include "PathTracer.h"
+
+namespace PathTracer
+{
+
+const float PI = 3.1415926536f;
+
+const int TILE_SIZE = 32;
+const int BIN_COUNT = 16;
+const int MAX_LEAF_SIZE = 4;
+// Larger leaves are still made when no split is cheaper
+const int MAX_LARGE_LEAF_SIZE = 16;
+const int STACK_SIZE = 128;
+// Below this, GGX turns into a mirror that float can't represent well
+const float MIN_ROUGHNESS = 0.05f;
+// Paths are only cut short by Russian roulette after this many bounces
+const int ROULETTE_BOUNCES = 2;
+
+//////////////////////////////////////////////////////////////////////////
+// Scene
+
+struct Node
+{
+  glm::vec3 mMin;
+  int mFirst; // leaves: the first triangle; inner nodes: the second child, the first one follows this node
+  glm::vec3 mMax;
+  int mCount; // 0 for inner nodes
+};
+
+// Stored as edges for the intersection test
+struct Triangle
+{
+  glm::vec3 mVertex;
+  glm::vec3 mEdge1;
+  glm::vec3 mEdge2;
+};
+
+struct TriangleAttributes
+{
+  glm::vec3 mNormals[ 3 ];
+  glm::vec3 mTangents[ 3 ];
+  glm::vec2 mTexcoords[ 3 ];
+  int mMaterial;
+};
+
+struct Scene
+{
+  const Rasterizer::Model * mMaterials;
+  std::vector<Node> mNodes;
+  std::vector<Triangle> mTriangles;
+  std::vector<TriangleAttributes> mAttributes;
+  float mEpsilon; // how far bounce and shadow rays start off the surface, relative to the scene size
+};
+
+struct Bounds
+{
+  glm::vec3 mMin;
+  glm::vec3 mMax;
+};
+
+inline void Grow( Bounds & _bounds, const glm::vec3 & _point )
+{
+  _bounds.mMin = glm::min( _bounds.mMin, _point );
+  _bounds.mMax = glm::max( _bounds.mMax, _point );
+}
+
+inline void Grow( Bounds & _bounds, const Bounds & _other )
+{
+  _bounds.mMin = glm::min( _bounds.mMin, _other.mMin );
+  _bounds.mMax = glm::max( _bounds.mMax, _other.mMax );
+}
+
+inline Bounds EmptyBounds()
+{
+  Bounds bounds;
+  bounds.mMin = glm::vec3( INFINITY );
+  bounds.mMax = glm::vec3( -INFINITY );
+  return bounds;
+}
+
+inline float SurfaceArea( const Bounds & _bounds )
+{
+  glm::vec3 size = _bounds.mMax - _bounds.mMin;
+  if ( size.x < 0.0f )
+  {
+    return 0.0f;
+  }
+  return 2.0f * ( size.x * size.y + size.y * size.z + size.z * size.x );
+}
+
+// Binned SAH over the triangles order[ _first, _first + _count ); appends the subtree below _nodeIndex
+void Subdivide( std::vector<Node> & _nodes, int _nodeIndex, const std::vector<Bounds> & _bounds, const std::vector<glm::vec3> & _centers, std::vector<int> & _order, int _first, int _count )
+{
+  Bounds bounds = EmptyBounds();
+  Bounds centerBounds = EmptyBounds();
+  for ( int i = _first; i < _first + _count; i++ )
+  {
+    Grow( bounds, _bounds[ _order[ i ] ] );
+    Grow( centerBounds, _centers[ _order[ i ] ] );
+  }
+  _nodes[ _nodeIndex ].mMin = bounds.mMin;
+  _nodes[ _nodeIndex ].mMax = bounds.mMax;
+  _nodes[ _nodeIndex ].mFirst = _first;
+  _nodes[ _nodeIndex ].mCount = _count;
+  if ( _count <= MAX_LEAF_SIZE )
+  {
+    return;
+  }
+
+  glm::vec3 extent = centerBounds.mMax - centerBounds.mMin;
+  int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+  int split = _first + _count / 2;
+  if ( extent[ axis ] > 0.0f )
+  {
+    Bounds binBounds[ BIN_COUNT ];
+    int binCounts[ BIN_COUNT ];
+    for ( int i = 0; i < BIN_COUNT; i++ )
+    {
+      binBounds[ i ] = EmptyBounds();
+      binCounts[ i ] = 0;
+    }
+    float scale = BIN_COUNT / extent[ axis ];
+    for ( int i = _first; i < _first + _count; i++ )
+    {
+      int bin = std::min( (int) ( ( _centers[ _order[ i ] ][ axis ] - centerBounds.mMin[ axis ] ) * scale ), BIN_COUNT - 1 );
+      Grow( binBounds[ bin ], _bounds[ _order[ i ] ] );
+      binCounts[ bin ]++;
+    }
+
+    // Cost of splitting after each bin, from both sides
+    float costs[ BIN_COUNT - 1 ];
+    Bounds left = EmptyBounds();
+    int leftCount = 0;
+    for ( int i = 0; i < BIN_COUNT - 1; i++ )
+    {
+      Grow( left, binBounds[ i ] );
+      leftCount += binCounts[ i ];
+      costs[ i ] = SurfaceArea( left ) * leftCount;
+    }
+    Bounds right = EmptyBounds();
+    int rightCount = 0;
+    for ( int i = BIN_COUNT - 1; i > 0; i-- )
+    {
+      Grow( right, binBounds[ i ] );
+      rightCount += binCounts[ i ];
+      costs[ i - 1 ] += SurfaceArea( right ) * rightCount;
+    }
+    int bestBin = 0;
+    for ( int i = 1; i < BIN_COUNT - 1; i++ )
+    {
+      bestBin = costs[ i ] < costs[ bestBin ] ? i : bestBin;
+    }
+    if ( costs[ bestBin ] >= SurfaceArea( bounds ) * _count && _count <= MAX_LARGE_LEAF_SIZE )
+    {
+      return;
+    }
+
+    int * middle = std::partition( &_order[ _first ], &_order[ _first ] + _count, [ & ]( int _triangle )
+    {
+      return std::min( (int) ( ( _centers[ _triangle ][ axis ] - centerBounds.mMin[ axis ] ) * scale ), BIN_COUNT - 1 ) <= bestBin;
+    } );
+    int partitioned = (int) ( middle - &_order[ 0 ] );
+    if ( partitioned > _first && partitioned < _first + _count )
+    {
+      split = partitioned;
+    }
+  }
+  if ( split == _first + _count / 2 )
+  {
+    // All centers in one place, or in one bin: halves by count
+    std::nth_element( &_order[ _first ], &_order[ split ], &_order[ _first ] + _count, [ & ]( int _a, int _b )
+    {
+      return _centers[ _a ][ axis ] < _centers[ _b ][ axis ];
+    } );
+  }
+
+  _nodes[ _nodeIndex ].mCount = 0;
+  int leftIndex = (int) _nodes.size();
+  _nodes.push_back( Node() );
+  Subdivide( _nodes, leftIndex, _bounds, _centers, _order, _first, split - _first );
+  int rightIndex = (int) _nodes.size();
+  _nodes.push_back( Node() );
+  _nodes[ _nodeIndex ].mFirst = rightIndex;
+  Subdivide( _nodes, rightIndex, _bounds, _centers, _order, split, _first + _count - split );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Ray queries
+
+struct Hit
+{
+  float mDistance;
+  float mU;
+  float mV;
+  int mTriangle;
+};
+
+// Möller-Trumbore
+inline bool IntersectTriangle( const Triangle & _triangle, const glm::vec3 & _origin, const glm::vec3 & _direction, float _maxDistance, float & _distance, float & _u, float & _v )
+{
+  glm::vec3 p = glm::cross( _direction, _triangle.mEdge2 );
+  float determinant = glm::dot( _triangle.mEdge1, p );
+  if ( fabsf( determinant ) < 1e-20f )
+  {
+    return false;
+  }
+  float inverse = 1.0f / determinant;
+  glm::vec3 s = _origin - _triangle.mVertex;
+  float u = glm::dot( s, p ) * inverse;
+  if ( u < 0.0f || u > 1.0f )
+  {
+    return false;
+  }
+  glm::vec3 q = glm::cross( s, _triangle.mEdge1 );
+  float v = glm::dot( _direction, q ) * inverse;
+  if ( v < 0.0f || u + v > 1.0f )
+  {
+    return false;
+  }
+  float distance = glm::dot( _triangle.mEdge2, q ) * inverse;
+  if ( distance <= 0.0f || distance >= _maxDistance )
+  {
+    return false;
+  }
+  _distance = distance;
+  _u = u;
+  _v = v;
+  return true;
+}
+
+// Distance to where the ray enters the box, INFINITY if it misses it or only gets there after _maxDistance
+inline float IntersectBounds( const Node & _node, const glm::vec3 & _origin, const glm::vec3 & _inverseDirection, float _maxDistance )
+{
+  glm::vec3 t0 = ( _node.mMin - _origin ) * _inverseDirection;
+  glm::vec3 t1 = ( _node.mMax - _origin ) * _inverseDirection;
+  glm::vec3 near = glm::min( t0, t1 );
+  glm::vec3 far = glm::max( t0, t1 );
+  float enter = std::max( std::max( near.x, near.y ), std::max( near.z, 0.0f ) );
+  float exit = std::min( std::min( far.x, far.y ), std::min( far.z, _maxDistance ) );
+  return enter <= exit ? enter : INFINITY;
+}
+
+// The closest hit if _anyHit is false, otherwise whichever is found first
+bool Intersect( const Scene & _scene, const glm::vec3 & _origin, const glm::vec3 & _direction, float _maxDistance, bool _anyHit, Hit & _hit )
+{
+  if ( _scene.mNodes.empty() )
+  {
+    return false;
+  }
+  glm::vec3 inverseDirection( 1.0f / _direction.x, 1.0f / _direction.y, 1.0f / _direction.z );
+  _hit.mDistance = _maxDistance;
+  _hit.mTriangle = -1;
+
+  int stack[ STACK_SIZE ];
+  int stackSize = 0;
+  int index = 0;
+  if ( IntersectBounds( _scene.mNodes[ 0 ], _origin, inverseDirection, _maxDistance ) == INFINITY )
+  {
+    return false;
+  }
+  while ( true )
+  {
+    const Node & node = _scene.mNodes[ index ];
+    if ( node.mCount )
+    {
+      for ( int i = node.mFirst; i < node.mFirst + node.mCount; i++ )
+      {
+        if ( IntersectTriangle( _scene.mTriangles[ i ], _origin, _direction, _hit.mDistance, _hit.mDistance, _hit.mU, _hit.mV ) )
+        {
+          _hit.mTriangle = i;
+          if ( _anyHit )
+          {
+            return true;
+          }
+        }
+      }
+      if ( !stackSize )
+      {
+        break;
+      }
+      index = stack[ --stackSize ];
+      continue;
+    }
+
+    // Nearer child first
+    int first = index + 1;
+    int second = node.mFirst;
+    float firstDistance = IntersectBounds( _scene.mNodes[ first ], _origin, inverseDirection, _hit.mDistance );
+    float secondDistance = IntersectBounds( _scene.mNodes[ second ], _origin, inverseDirection, _hit.mDistance );
+    if ( secondDistance < firstDistance )
+    {
+      std::swap( first, second );
+      std::swap( firstDistance, secondDistance );
+    }
+    if ( firstDistance == INFINITY )
+    {
+      if ( !stackSize )
+      {
+        break;
+      }
+      index = stack[ --stackSize ];
+      continue;
+    }
+    index = first;
+    if ( secondDistance != INFINITY && stackSize < STACK_SIZE )
+    {
+      stack[ stackSize++ ] = second;
+    }
+  }
+  return _hit.mTriangle >= 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sampling
+
+// PCG hash, seeded per pixel and sample so that the image doesn't depend on which thread renders what
+struct Random
+{
+  uint32_t mState;
+
+  float Next()
+  {
+    mState = mState * 747796405u + 2891336453u;
+    uint32_t word = ( ( mState >> ( ( mState >> 28u ) + 4u ) ) ^ mState ) * 277803737u;
+    word = ( word >> 22u ) ^ word;
+    return ( word >> 8 ) * ( 1.0f / 16777216.0f );
+  }
+};
+
+inline uint32_t Hash( uint32_t _h )
+{
+  _h ^= _h >> 16;
+  _h *= 0x85ebca6b;
+  _h ^= _h >> 13;
+  _h *= 0xc2b2ae35;
+  _h ^= _h >> 16;
+  return _h;
+}
+
+inline float Luminance( const glm::vec3 & _color )
+{
+  return 0.2126f * _color.x + 0.7152f * _color.y + 0.0722f * _color.z;
+}
+
+// Orthonormal basis around _n (Duff et al., "Building an Orthonormal Basis, Revisited")
+inline void GetBasis( const glm::vec3 & _n, glm::vec3 & _tangent, glm::vec3 & _bitangent )
+{
+  float sign = _n.z >= 0.0f ? 1.0f : -1.0f;
+  float a = -1.0f / ( sign + _n.z );
+  float b = _n.x * _n.y * a;
+  _tangent = glm::vec3( 1.0f + sign * _n.x * _n.x * a, sign * b, -sign * _n.x );
+  _bitangent = glm::vec3( b, sign + _n.y * _n.y * a, -_n.y );
+}
+
+// The sky panorama as a piecewise constant distribution over its texels, weighted by luminance and by the solid
+// angle of their row
+struct SkyDistribution
+{
+  int mWidth;
+  int mHeight;
+  const float * mTexels;
+  std::vector<float> mRowCdf; // mHeight + 1 entries
+  std::vector<float> mColumnCdfs; // mWidth + 1 entries per row
+  std::vector<float> mRowWeights;
+  float mTotal;
+};
+
+void BuildSkyDistribution( const SkyPrefilter::Result & _sky, SkyDistribution & _distribution )
+{
+  _distribution.mWidth = _sky.mWidth;
+  _distribution.mHeight = _sky.mHeight;
+  _distribution.mTexels = &_sky.mLevels[ 0 ][ 0 ];
+  _distribution.mColumnCdfs.resize( ( _sky.mWidth + 1 ) * _sky.mHeight );
+  _distribution.mRowWeights.resize( _sky.mHeight );
+  _distribution.mRowCdf.resize( _sky.mHeight + 1 );
+
+  Parallel::For( _sky.mHeight, [ & ]( int _row )
+  {
+    float sinTheta = sinf( ( _row + 0.5f ) / _sky.mHeight * PI );
+    float * cdf = &_distribution.mColumnCdfs[ _row * ( _sky.mWidth + 1 ) ];
+    cdf[ 0 ] = 0.0f;
+    for ( int column = 0; column < _sky.mWidth; column++ )
+    {
+      const float * texel = _distribution.mTexels + ( _row * _sky.mWidth + column ) * 3;
+      cdf[ column + 1 ] = cdf[ column ] + Luminance( glm::vec3( texel[ 0 ], texel[ 1 ], texel[ 2 ] ) ) * sinTheta;
+    }
+    _distribution.mRowWeights[ _row ] = cdf[ _sky.mWidth ];
+  } );
+
+  _distribution.mRowCdf[ 0 ] = 0.0f;
+  for ( int row = 0; row < _sky.mHeight; row++ )
+  {
+    _distribution.mRowCdf[ row + 1 ] = _distribution.mRowCdf[ row ] + _distribution.mRowWeights[ row ];
+  }
+  _distribution.mTotal = _distribution.mRowCdf[ _sky.mHeight ];
+}
+
+// Finds i with _cdf[ i ] <= _value < _cdf[ i + 1 ], skipping empty entries
+inline int FindInterval( const float * _cdf, int _count, float _value )
+{
+  int index = (int) ( std::upper_bound( _cdf, _cdf + _count + 1, _value ) - _cdf ) - 1;
+  return std::min( std::max( index, 0 ), _count - 1 );
+}
+
+inline void GetSkyTexel( const Settings & _settings, const SkyDistribution & _distribution, const glm::vec3 & _direction, int & _column, int & _row )
+{
+  float u = atan2f( _direction.z, _direction.x ) / PI / 2.0f + 0.5f + _settings.mSkyRotation;
+  float v = acosf( std::min( std::max( _direction.y, -1.0f ), 1.0f ) ) / PI;
+  u -= floorf( u );
+  _column = std::min( (int) ( u * _distribution.mWidth ), _distribution.mWidth - 1 );
+  _row = std::min( (int) ( v * _distribution.mHeight ), _distribution.mHeight - 1 );
+}
+
+// Nearest texel, to match the distribution exactly
+glm::vec3 GetSkyRadiance( const Settings & _settings, const SkyDistribution & _distribution, const glm::vec3 & _direction )
+{
+  int column = 0;
+  int row = 0;
+  GetSkyTexel( _settings, _distribution, _direction, column, row );
+  const float * texel = _distribution.mTexels + ( row * _distribution.mWidth + column ) * 3;
+  return glm::vec3( texel[ 0 ], texel[ 1 ], texel[ 2 ] );
+}
+
+// Per unit solid angle
+float GetSkyPdf( const Settings & _settings, const SkyDistribution & _distribution, const glm::vec3 & _direction )
+{
+  int column = 0;
+  int row = 0;
+  GetSkyTexel( _settings, _distribution, _direction, column, row );
+  const float * cdf = &_distribution.mColumnCdfs[ row * ( _distribution.mWidth + 1 ) ];
+  float probability = ( cdf[ column + 1 ] - cdf[ column ] ) / _distribution.mTotal;
+  float sinTheta = sinf( ( row + 0.5f ) / _distribution.mHeight * PI );
+  return probability * _distribution.mWidth * _distribution.mHeight / ( 2.0f * PI * PI * sinTheta );
+}
+
+glm::vec3 SampleSky( const Settings & _settings, const SkyDistribution & _distribution, Random & _random, float & _pdf )
+{
+  float rowValue = _random.Next() * _distribution.mTotal;
+  int row = FindInterval( &_distribution.mRowCdf[ 0 ], _distribution.mHeight, rowValue );
+  const float * cdf = &_distribution.mColumnCdfs[ row * ( _distribution.mWidth + 1 ) ];
+  float columnValue = _random.Next() * cdf[ _distribution.mWidth ];
+  int column = FindInterval( cdf, _distribution.mWidth, columnValue );
+
+  float columnWeight = cdf[ column + 1 ] - cdf[ column ];
+  float u = ( column + ( columnWeight > 0.0f ? ( columnValue - cdf[ column ] ) / columnWeight : 0.5f ) ) / _distribution.mWidth;
+  float v = ( row + _random.Next() ) / _distribution.mHeight;
+
+  float phi = ( u - 0.5f - _settings.mSkyRotation ) * 2.0f * PI;
+  float theta = v * PI;
+  float sinTheta = sinf( theta );
+  glm::vec3 direction( sinTheta * cosf( phi ), cosf( theta ), sinTheta * sinf( phi ) );
+
+  float probability = columnWeight / _distribution.mTotal;
+  float rowSinTheta = sinf( ( row + 0.5f ) / _distribution.mHeight * PI );
+  _pdf = probability * _distribution.mWidth * _distribution.mHeight / ( 2.0f * PI * PI * rowSinTheta );
+  return direction;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Material, the terms of pbr.fs
+
+struct Surface
+{
+  glm::vec3 mNormal;
+  glm::vec3 mBaseColor;
+  float mRoughness;
+  float mMetallic;
+  glm::vec3 mF0;
+  float mSpecularProbability; // of sampling the GGX lobe rather than the diffuse one
+};
+
+glm::vec3 FresnelSchlick( float _cosTheta, const glm::vec3 & _f0 )
+{
+  float cosTheta = std::min( std::max( _cosTheta, 0.0f ), 1.0f );
+  return _f0 + ( glm::vec3( 1.0f ) - _f0 ) * powf( 1.0f - cosTheta, 5.0f );
+}
+
+float DistributionGGX( float _NdotH, float _roughness )
+{
+  float a = _roughness * _roughness;
+  float a2 = a * a;
+  float NdotH = std::max( 0.0f, _NdotH );
+  float factor = NdotH * NdotH * ( a2 - 1.0f ) + 1.0f;
+  return a2 / ( PI * factor * factor );
+}
+
+float GeometrySmith( float _NdotV, float _NdotL, float _roughness )
+{
+  float r = _roughness + 1.0f;
+  float k = ( r * r ) / 8.0f;
+  float NdotV = std::max( 0.0f, _NdotV );
+  float NdotL = std::max( 0.0f, _NdotL );
+  return ( NdotV / ( NdotV * ( 1.0f - k ) + k ) ) * ( NdotL / ( NdotL * ( 1.0f - k ) + k ) );
+}
+
+// BRDF times the cosine term, the per-light body of pbr.fs
+glm::vec3 EvaluateBRDF( const Surface & _surface, const glm::vec3 & _v, const glm::vec3 & _l )
+{
+  float NdotL = glm::dot( _surface.mNormal, _l );
+  if ( NdotL <= 0.0f )
+  {
+    return glm::vec3( 0.0f );
+  }
+  float NdotV = glm::dot( _surface.mNormal, _v );
+  glm::vec3 h = glm::normalize( _v + _l );
+
+  glm::vec3 F = FresnelSchlick( glm::dot( h, _v ), _surface.mF0 );
+  glm::vec3 kD = ( glm::vec3( 1.0f ) - F ) * ( 1.0f - _surface.mMetallic );
+  float D = DistributionGGX( glm::dot( _surface.mNormal, h ), _surface.mRoughness );
+  float G = GeometrySmith( NdotV, NdotL, _surface.mRoughness );
+  float denominator = 4.0f * std::max( 0.0f, NdotV ) * NdotL;
+  glm::vec3 specular = F * ( D * G / std::max( 0.001f, denominator ) );
+
+  return ( kD * ( _surface.mBaseColor / PI ) + specular ) * NdotL;
+}
+
+float GetBRDFPdf( const Surface & _surface, const glm::vec3 & _v, const glm::vec3 & _l )
+{
+  float NdotL = glm::dot( _surface.mNormal, _l );
+  if ( NdotL <= 0.0f )
+  {
+    return 0.0f;
+  }
+  glm::vec3 h = glm::normalize( _v + _l );
+  float NdotH = glm::dot( _surface.mNormal, h );
+  float VdotH = std::max( glm::dot( _v, h ), 1e-6f );
+  float specularPdf = DistributionGGX( NdotH, _surface.mRoughness ) * std::max( NdotH, 0.0f ) / ( 4.0f * VdotH );
+  float diffusePdf = NdotL / PI;
+  return _surface.mSpecularProbability * specularPdf + ( 1.0f - _surface.mSpecularProbability ) * diffusePdf;
+}
+
+// Picks a lobe, then a half vector from the GGX distribution or a cosine weighted direction
+bool SampleBRDF( const Surface & _surface, const glm::vec3 & _v, Random & _random, glm::vec3 & _l, float & _pdf )
+{
+  glm::vec3 tangent;
+  glm::vec3 bitangent;
+  GetBasis( _surface.mNormal, tangent, bitangent );
+
+  float lobe = _random.Next();
+  float u1 = _random.Next();
+  float u2 = _random.Next();
+  float phi = 2.0f * PI * u1;
+  if ( lobe < _surface.mSpecularProbability )
+  {
+    float a = _surface.mRoughness * _surface.mRoughness;
+    float cosTheta = sqrtf( ( 1.0f - u2 ) / ( 1.0f + ( a * a - 1.0f ) * u2 ) );
+    float sinTheta = sqrtf( std::max( 0.0f, 1.0f - cosTheta * cosTheta ) );
+    glm::vec3 h = tangent * ( sinTheta * cosf( phi ) ) + bitangent * ( sinTheta * sinf( phi ) ) + _surface.mNormal * cosTheta;
+    _l = 2.0f * glm::dot( _v, h ) * h - _v;
+  }
+  else
+  {
+    float radius = sqrtf( u2 );
+    _l = tangent * ( radius * cosf( phi ) ) + bitangent * ( radius * sinf( phi ) ) + _surface.mNormal * sqrtf( std::max( 0.0f, 1.0f - u2 ) );
+  }
+  _pdf = GetBRDFPdf( _surface, _v, _l );
+  return _pdf > 0.0f;
+}
+
+inline float PowerHeuristic( float _pdf, float _otherPdf )
+{
+  return _pdf * _pdf / ( _pdf * _pdf + _otherPdf * _otherPdf );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Paths
+
+struct Context
+{
+  const Scene * mScene;
+  const Settings * mSettings;
+  const SkyDistribution * mSky; // NULL without a sky, or a black one
+  glm::mat4x4 mViewProjectionInverse;
+};
+
+void GetSurface( const Context & _context, const Hit & _hit, const glm::vec3 & _direction, Surface & _surface, glm::vec3 & _geometricNormal )
+{
+  const Triangle & triangle = _context.mScene->mTriangles[ _hit.mTriangle ];
+  const TriangleAttributes & attributes = _context.mScene->mAttributes[ _hit.mTriangle ];
+  float w = 1.0f - _hit.mU - _hit.mV;
+
+  // Two sided, like in GL: the geometric normal faces the ray, and the shading normal its side
+  _geometricNormal = glm::normalize( glm::cross( triangle.mEdge1, triangle.mEdge2 ) );
+  if ( glm::dot( _geometricNormal, _direction ) > 0.0f )
+  {
+    _geometricNormal = -_geometricNormal;
+  }
+
+  glm::vec3 normal = attributes.mNormals[ 0 ] * w + attributes.mNormals[ 1 ] * _hit.mU + attributes.mNormals[ 2 ] * _hit.mV;
+  glm::vec3 tangent = attributes.mTangents[ 0 ] * w + attributes.mTangents[ 1 ] * _hit.mU + attributes.mTangents[ 2 ] * _hit.mV;
+  glm::vec2 texcoord = attributes.mTexcoords[ 0 ] * w + attributes.mTexcoords[ 1 ] * _hit.mU + attributes.mTexcoords[ 2 ] * _hit.mV;
+
+  // Full resolution textures: averaging the samples of a pixel filters them. AO is left out, the paths find
+  // the occlusion themselves.
+  Rasterizer::Surface material;
+  Rasterizer::GetSurface( _context.mScene->mMaterials, attributes.mMaterial, texcoord, 0.0f, material );
+  if ( material.mHasNormalMap )
+  {
+    glm::vec3 bitangent = glm::cross( normal, tangent );
+    normal = material.mNormal.x * tangent + material.mNormal.y * bitangent + material.mNormal.z * normal;
+  }
+  normal = glm::normalize( normal );
+  if ( glm::dot( normal, _geometricNormal ) < 0.0f )
+  {
+    normal = -normal;
+  }
+
+  _surface.mNormal = normal;
+  _surface.mBaseColor = material.mBaseColor;
+  _surface.mRoughness = std::max( material.mRoughness, MIN_ROUGHNESS );
+  _surface.mMetallic = material.mMetallic;
+  _surface.mF0 = glm::mix( glm::vec3( 0.04f ), material.mBaseColor, material.mMetallic );
+
+  float specularWeight = Luminance( FresnelSchlick( glm::dot( normal, -_direction ), _surface.mF0 ) );
+  float diffuseWeight = Luminance( material.mBaseColor ) * ( 1.0f - material.mMetallic ) * ( 1.0f - specularWeight );
+  _surface.mSpecularProbability = std::max( specularWeight / std::max( specularWeight + diffuseWeight, 1e-6f ), 0.1f );
+}
+
+// Radiance along a camera ray; _covered is false if it sees the background color rather than the model or the sky
+glm::vec3 TracePath( const Context & _context, glm::vec3 _origin, glm::vec3 _direction, Random & _random, bool & _covered, uint64_t & _rays )
+{
+  const Settings & settings = *_context.mSettings;
+  const Scene & scene = *_context.mScene;
+  glm::vec3 radiance( 0.0f );
+  glm::vec3 throughput( 1.0f );
+  float brdfPdf = 0.0f;
+  _covered = true;
+
+  for ( int bounce = 0; ; bounce++ )
+  {
+    Hit hit;
+    _rays++;
+    if ( !Intersect( scene, _origin, _direction, INFINITY, false, hit ) )
+    {
+      if ( bounce == 0 )
+      {
+        // Like Skyboxes/skysphere.fs
+        if ( settings.mSky && settings.mDrawSky )
+        {
+          glm::vec3 sky = _context.mSky ? GetSkyRadiance( settings, *_context.mSky, _direction ) : glm::vec3( 0.0f );
+          return glm::mix( glm::vec3( settings.mBackgroundColor ), sky, settings.mSkyOpacity ) * settings.mExposure;
+        }
+        _covered = false;
+      }
+      else if ( _context.mSky )
+      {
+        float weight = PowerHeuristic( brdfPdf, GetSkyPdf( settings, *_context.mSky, _direction ) );
+        radiance += throughput * GetSkyRadiance( settings, *_context.mSky, _direction ) * ( settings.mExposure * weight );
+      }
+      break;
+    }
+    if ( bounce >= settings.mMaxBounces )
+    {
+      break;
+    }
+
+    Surface surface;
+    glm::vec3 geometricNormal;
+    GetSurface( _context, hit, _direction, surface, geometricNormal );
+    glm::vec3 position = _origin + _direction * hit.mDistance + geometricNormal * scene.mEpsilon;
+    glm::vec3 v = -_direction;
+
+    // Next event estimation
+    Hit shadowHit;
+    if ( _context.mSky )
+    {
+      float lightPdf = 0.0f;
+      glm::vec3 l = SampleSky( settings, *_context.mSky, _random, lightPdf );
+      if ( lightPdf > 0.0f && glm::dot( l, geometricNormal ) > 0.0f )
+      {
+        glm::vec3 brdf = EvaluateBRDF( surface, v, l );
+        if ( brdf.x + brdf.y + brdf.z > 0.0f )
+        {
+          _rays++;
+          if ( !Intersect( scene, position, l, INFINITY, true, shadowHit ) )
+          {
+            float weight = PowerHeuristic( lightPdf, GetBRDFPdf( surface, v, l ) );
+            radiance += throughput * brdf * GetSkyRadiance( settings, *_context.mSky, l ) * ( settings.mExposure * weight / lightPdf );
+          }
+        }
+      }
+    }
+    else if ( !settings.mSky )
+    {
+      for ( int i = 0; i < 3; i++ )
+      {
+        glm::vec3 l = -glm::normalize( settings.mLights[ i ].mDirection );
+        if ( glm::dot( l, geometricNormal ) <= 0.0f )
+        {
+          continue;
+        }
+        _rays++;
+        if ( !Intersect( scene, position, l, INFINITY, true, shadowHit ) )
+        {
+          radiance += throughput * EvaluateBRDF( surface, v, l ) * settings.mLights[ i ].mColor;
+        }
+      }
+    }
+
+    glm::vec3 l;
+    if ( !SampleBRDF( surface, v, _random, l, brdfPdf ) || glm::dot( l, geometricNormal ) <= 0.0f )
+    {
+      break;
+    }
+    throughput = throughput * EvaluateBRDF( surface, v, l ) / brdfPdf;
+
+    if ( bounce >= ROULETTE_BOUNCES )
+    {
+      float survival = std::min( std::max( std::max( throughput.x, throughput.y ), throughput.z ), 0.95f );
+      if ( _random.Next() >= survival )
+      {
+        break;
+      }
+      throughput = throughput / survival;
+    }
+
+    _origin = position;
+    _direction = l;
+  }
+  return radiance;
+}
+
+// Tonemapped and gamma corrected like pbr.fs; the background color shows through uncovered samples
+void Resolve( const Settings & _settings, const std::vector<glm::vec4> & _accumulation, int _samples, unsigned char * _rgba )
+{
+  Parallel::For( _settings.mHeight, _settings.mThreadCount > 0 ? _settings.mThreadCount : Parallel::GetThreadCount(), [ & ]( int _y )
+  {
+    for ( int x = 0; x < _settings.mWidth; x++ )
+    {
+      const glm::vec4 & sum = _accumulation[ _y * _settings.mWidth + x ];
+      float coverage = sum.w / _samples;
+      glm::vec3 color = sum.w > 0.0f ? glm::vec3( sum ) / sum.w : glm::vec3( 0.0f );
+      unsigned char * out = _rgba + ( _y * _settings.mWidth + x ) * 4;
+      for ( int i = 0; i < 3; i++ )
+      {
+        float value = powf( color[ i ] / ( 1.0f + color[ i ] ), 1.0f / 2.2f );
+        value = value * coverage + _settings.mBackgroundColor[ i ] * ( 1.0f - coverage );
+        out[ i ] = (unsigned char) ( std::min( std::max( value, 0.0f ), 1.0f ) * 255.0f + 0.5f );
+      }
+      out[ 3 ] = 255;
+    }
+  } );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interface
+
+Scene * Build( const Geometry & _geometry, const Rasterizer::Model * _materials, const glm::mat4x4 & _worldRoot )
+{
+  if ( !_geometry.mStaging )
+  {
+    printf( "[PathTracer] The model has to be imported, but not uploaded\n" );
+    return NULL;
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const Geometry::Staging & staging = *_geometry.mStaging;
+
+  Scene * scene = new Scene();
+  scene->mMaterials = _materials;
+
+  // Every instance in world space, transformed like in pbr.vs
+  std::vector<Triangle> triangles;
+  std::vector<TriangleAttributes> attributes;
+  for ( std::map<int, Geometry::Mesh>::const_iterator it = _geometry.mMeshes.begin(); it != _geometry.mMeshes.end(); it++ )
+  {
+    const Geometry::Mesh & mesh = it->second;
+    for ( int instance = 0; instance < mesh.mInstanceCount; instance++ )
+    {
+      glm::mat4x4 world = staging.mInstanceMatrices[ mesh.mFirstInstance + instance ] * _worldRoot;
+      glm::mat3x3 world3x3( world );
+      for ( int i = 0; i < mesh.mTriangleCount; i++ )
+      {
+        glm::vec3 positions[ 3 ];
+        TriangleAttributes triangleAttributes;
+        triangleAttributes.mMaterial = mesh.mMaterialIndex;
+        for ( int j = 0; j < 3; j++ )
+        {
+          const Geometry::Vertex & vertex = staging.mVertices[ mesh.mBaseVertex + staging.mIndices[ mesh.mFirstIndex + i * 3 + j ] ];
+          positions[ j ] = glm::vec3( world * glm::vec4( vertex.v3Vector, 1.0f ) );
+          triangleAttributes.mNormals[ j ] = glm::normalize( world3x3 * vertex.v3Normal );
+          triangleAttributes.mTangents[ j ] = glm::normalize( world3x3 * vertex.v3Tangent );
+          triangleAttributes.mTexcoords[ j ] = vertex.fTexcoord;
+        }
+        Triangle triangle;
+        triangle.mVertex = positions[ 0 ];
+        triangle.mEdge1 = positions[ 1 ] - positions[ 0 ];
+        triangle.mEdge2 = positions[ 2 ] - positions[ 0 ];
+        triangles.push_back( triangle );
+        attributes.push_back( triangleAttributes );
+      }
+    }
+  }
+
+  std::vector<Bounds> bounds( triangles.size() );
+  std::vector<glm::vec3> centers( triangles.size() );
+  std::vector<int> order( triangles.size() );
+  Bounds sceneBounds = EmptyBounds();
+  for ( int i = 0; i < triangles.size(); i++ )
+  {
+    bounds[ i ] = EmptyBounds();
+    Grow( bounds[ i ], triangles[ i ].mVertex );
+    Grow( bounds[ i ], triangles[ i ].mVertex + triangles[ i ].mEdge1 );
+    Grow( bounds[ i ], triangles[ i ].mVertex + triangles[ i ].mEdge2 );
+    centers[ i ] = ( bounds[ i ].mMin + bounds[ i ].mMax ) * 0.5f;
+    order[ i ] = i;
+    Grow( sceneBounds, bounds[ i ] );
+  }
+
+  if ( !triangles.empty() )
+  {
+    scene->mNodes.reserve( triangles.size() * 2 / MAX_LEAF_SIZE + 1 );
+    scene->mNodes.push_back( Node() );
+    Subdivide( scene->mNodes, 0, bounds, centers, order, 0, (int) triangles.size() );
+  }
+
+  // Leaves point at runs of the reordered triangles
+  scene->mTriangles.resize( triangles.size() );
+  scene->mAttributes.resize( triangles.size() );
+  for ( int i = 0; i < order.size(); i++ )
+  {
+    scene->mTriangles[ i ] = triangles[ order[ i ] ];
+    scene->mAttributes[ i ] = attributes[ order[ i ] ];
+  }
+  scene->mEpsilon = triangles.empty() ? 0.0f : glm::length( sceneBounds.mMax - sceneBounds.mMin ) * 1e-5f;
+
+  printf( "[PathTracer] BVH of %d triangles, %d nodes built in %.1f ms\n", (int) triangles.size(), (int) scene->mNodes.size(),
+    std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count() );
+  return scene;
+}
+
+void Release( Scene * _scene )
+{
+  delete _scene;
+}
+
+void Render( const Scene * _scene, const Settings & _settings, unsigned char * _rgba, Statistics & _statistics, const std::function<bool( const Statistics & )> & _onPass )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int threadCount = _settings.mThreadCount > 0 ? _settings.mThreadCount : Parallel::GetThreadCount();
+
+  SkyDistribution sky;
+  Context context;
+  context.mScene = _scene;
+  context.mSettings = &_settings;
+  context.mSky = NULL;
+  context.mViewProjectionInverse = glm::inverse( _settings.mProjection * _settings.mView );
+  if ( _settings.mSky )
+  {
+    BuildSkyDistribution( *_settings.mSky, sky );
+    context.mSky = sky.mTotal > 0.0f ? &sky : NULL;
+  }
+
+  // Radiance sums of the covered samples, and their count
+  std::vector<glm::vec4> accumulation( _settings.mWidth * _settings.mHeight, glm::vec4( 0.0f ) );
+  int tilesX = ( _settings.mWidth + TILE_SIZE - 1 ) / TILE_SIZE;
+  int tilesY = ( _settings.mHeight + TILE_SIZE - 1 ) / TILE_SIZE;
+
+  _statistics.mSamplesPerPixel = 0;
+  _statistics.mRays = 0;
+  _statistics.mTime = 0.0;
+  while ( _statistics.mSamplesPerPixel < _settings.mSamplesPerPixel )
+  {
+    int firstSample = _statistics.mSamplesPerPixel;
+    int sampleCount = std::min( std::max( _settings.mSamplesPerPass, 1 ), _settings.mSamplesPerPixel - firstSample );
+    std::atomic<uint64_t> rays( 0 );
+
+    // Tiles are handed out one by one, so the cheap ones (only sky) balance out the expensive ones
+    Parallel::For( tilesX * tilesY, threadCount, [ & ]( int _tile )
+    {
+      int tileX = ( _tile % tilesX ) * TILE_SIZE;
+      int tileY = ( _tile / tilesX ) * TILE_SIZE;
+      uint64_t tileRays = 0;
+      for ( int y = tileY; y < std::min( tileY + TILE_SIZE, _settings.mHeight ); y++ )
+      {
+        for ( int x = tileX; x < std::min( tileX + TILE_SIZE, _settings.mWidth ); x++ )
+        {
+          glm::vec4 & sum = accumulation[ y * _settings.mWidth + x ];
+          for ( int sample = firstSample; sample < firstSample + sampleCount; sample++ )
+          {
+            Random random;
+            random.mState = Hash( ( y * _settings.mWidth + x ) ^ Hash( sample * 0x9E3779B9u ) );
+
+            // A random point of the pixel, from the near plane to the far plane
+            float ndcX = ( x + random.Next() ) / _settings.mWidth * 2.0f - 1.0f;
+            float ndcY = 1.0f - ( y + random.Next() ) / _settings.mHeight * 2.0f;
+            glm::vec4 nearPoint = context.mViewProjectionInverse * glm::vec4( ndcX, ndcY, -1.0f, 1.0f );
+            glm::vec4 farPoint = context.mViewProjectionInverse * glm::vec4( ndcX, ndcY, 1.0f, 1.0f );
+            glm::vec3 origin = glm::vec3( nearPoint ) / nearPoint.w;
+            glm::vec3 direction = glm::normalize( glm::vec3( farPoint ) / farPoint.w - origin );
+
+            bool covered = false;
+            glm::vec3 radiance = TracePath( context, origin, direction, random, covered, tileRays );
+            // A rare NaN or infinity would stick to the pixel for good
+            if ( covered && radiance.x == radiance.x && radiance.y == radiance.y && radiance.z == radiance.z && std::max( std::max( radiance.x, radiance.y ), radiance.z ) < INFINITY )
+            {
+              sum += glm::vec4( radiance, 1.0f );
+            }
+          }
+        }
+      }
+      rays += tileRays;
+    } );
+
+    _statistics.mSamplesPerPixel += sampleCount;
+    _statistics.mRays += rays;
+    _statistics.mTime = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    Resolve( _settings, accumulation, _statistics.mSamplesPerPixel, _rgba );
+    if ( _onPass && !_onPass( _statistics ) )
+    {
+      break;
+    }
+  }
+}
+
+}
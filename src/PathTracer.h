@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <functional>
+
+// Reference renders on the CPU: a unidirectional path tracer over a BVH of the model's triangles, lit by the sky
+// panorama (importance sampled, with multiple importance sampling against the BRDF) and shaded with the GGX
+// model and material inputs of Shaders/pbr.fs. The image converges progressively, in passes over screen tiles.
+namespace PathTracer
+{
+  struct Light
+  {
+    glm::vec3 mDirection;
+    glm::vec3 mColor;
+  };
+
+  struct Settings
+  {
+    int mWidth;
+    int mHeight;
+    int mThreadCount; // one per core if 0
+
+    glm::mat4x4 mView;
+    glm::mat4x4 mProjection;
+
+    // Only used without a sky, like in pbr.fs
+    Light mLights[ 3 ];
+
+    const SkyPrefilter::Result * mSky; // only level 0 is used; lit by mLights if NULL
+    bool mDrawSky; // mBackgroundColor behind the model otherwise, the sky still lights it
+    float mSkyRotation;
+    float mSkyOpacity;
+    float mExposure;
+    glm::vec4 mBackgroundColor;
+
+    int mSamplesPerPixel; // the budget
+    int mSamplesPerPass;
+    int mMaxBounces;
+  };
+
+  struct Statistics
+  {
+    int mSamplesPerPixel; // done so far
+    uint64_t mRays; // camera, bounce and shadow rays
+    double mTime; // milliseconds
+  };
+
+  struct Scene;
+
+  // Flattens every instance of an imported model into world space triangles and builds their BVH; _materials
+  // provides the textures (see Rasterizer::Prepare()) and has to outlive the scene
+  Scene * Build( const Geometry & _geometry, const Rasterizer::Model * _materials, const glm::mat4x4 & _worldRoot );
+  void Release( Scene * _scene );
+
+  // Adds passes of mSamplesPerPass samples per pixel until mSamplesPerPixel is reached, tonemapping the image so
+  // far into _rgba (mWidth * mHeight RGBA8 pixels, top row first) after each; _onPass can stop early by returning
+  // false. The result only depends on the settings, not on the thread count.
+  void Render( const Scene * _scene, const Settings & _settings, unsigned char * _rgba, Statistics & _statistics, const std::function<bool( const Statistics & )> & _onPass );
+}
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#define GLEW_NO_GLU
+#include "GL/glew.h"
+
+#include "Profiler.h"
+
+#include <imgui.h>
+
+namespace Profiler
+{
+
+// Milliseconds of frames kept for the graph and the trace
+const double HISTORY_TIME = 10000.0;
+const int GRAPH_FRAMES = 300;
+// Query results are read back this many frames after they were issued; by then the GPU is done with them
+const int QUERY_LATENCY = 2;
+const int MAX_DEPTH = 32;
+// Frames this many times longer than the median are hitches
+const float HITCH_FACTOR = 2.0f;
+
+struct Event
+{
+  const char * mName;
+  double mStart; // milliseconds since the program started
+  double mDuration;
+  int mThread; // 0 is the GPU
+};
+
+struct Frame
+{
+  double mStart;
+  double mDuration; // 0 while it's the current one
+  double mGPUTime; // of its passes, negative until their queries are read back
+};
+
+struct Query
+{
+  GLuint mQuery;
+  const char * mName;
+  double mIssueTime;
+};
+
+struct QuerySet
+{
+  std::vector<Query> mQueries;
+  int mCount;
+  uint64_t mFrame;
+};
+
+struct OpenScope
+{
+  const char * mName;
+  double mStart;
+};
+
+std::chrono::steady_clock::time_point beginTime = std::chrono::steady_clock::now();
+std::mutex mutex;
+std::deque<Event> events;
+std::deque<Frame> frames;
+uint64_t frameIndex = 0; // of frames.back()
+std::atomic<int> threadCount( 0 );
+std::string lastExportPath;
+
+// GL state, only touched from the context thread
+bool open = false;
+bool hasTimerQueries = false;
+bool hasDebugGroups = false;
+QuerySet querySets[ QUERY_LATENCY ];
+int gpuDepth = 0;
+double gpuTrackEnd = 0.0;
+
+thread_local int threadIndex = 0;
+thread_local OpenScope scopeStack[ MAX_DEPTH ];
+thread_local int scopeDepth = 0;
+
+double GetTime()
+{
+  return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - beginTime ).count();
+}
+
+int GetThreadIndex()
+{
+  if ( !threadIndex )
+  {
+    threadIndex = ++threadCount;
+  }
+  return threadIndex;
+}
+
+void Open()
+{
+  // The context thread comes first in the trace
+  GetThreadIndex();
+
+  hasTimerQueries = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+  hasDebugGroups = GLEW_VERSION_4_3 || GLEW_KHR_debug;
+  for ( int i = 0; i < QUERY_LATENCY; i++ )
+  {
+    querySets[ i ].mCount = 0;
+    querySets[ i ].mFrame = 0;
+  }
+  gpuDepth = 0;
+  open = true;
+  printf( "[Profiler] GPU timer queries %s, debug groups %s\n", hasTimerQueries ? "on" : "not supported", hasDebugGroups ? "on" : "not supported" );
+}
+
+void Close()
+{
+  for ( int i = 0; i < QUERY_LATENCY; i++ )
+  {
+    for ( int j = 0; j < querySets[ i ].mQueries.size(); j++ )
+    {
+      glDeleteQueries( 1, &querySets[ i ].mQueries[ j ].mQuery );
+    }
+    querySets[ i ].mQueries.clear();
+  }
+  open = false;
+
+  std::lock_guard<std::mutex> lock( mutex );
+  events.clear();
+  frames.clear();
+}
+
+// Results that aren't there yet are dropped rather than waited for
+void ResolveQueries( QuerySet & _set )
+{
+  std::vector<Event> resolved;
+  double gpuTime = 0.0;
+  for ( int i = 0; i < _set.mCount; i++ )
+  {
+    const Query & query = _set.mQueries[ i ];
+    GLint available = 0;
+    glGetQueryObjectiv( query.mQuery, GL_QUERY_RESULT_AVAILABLE, &available );
+    if ( !available )
+    {
+      continue;
+    }
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v( query.mQuery, GL_QUERY_RESULT, &nanoseconds );
+
+    // Only durations are measured; the passes are laid out one after the other from when they were issued
+    Event event;
+    event.mName = query.mName;
+    event.mStart = std::max( query.mIssueTime, gpuTrackEnd );
+    event.mDuration = nanoseconds / 1000000.0;
+    event.mThread = 0;
+    gpuTrackEnd = event.mStart + event.mDuration;
+    gpuTime += event.mDuration;
+    resolved.push_back( event );
+  }
+  _set.mCount = 0;
+
+  std::lock_guard<std::mutex> lock( mutex );
+  events.insert( events.end(), resolved.begin(), resolved.end() );
+  uint64_t firstFrame = frameIndex + 1 - frames.size();
+  if ( _set.mFrame >= firstFrame && _set.mFrame <= frameIndex )
+  {
+    frames[ (size_t) ( _set.mFrame - firstFrame ) ].mGPUTime = gpuTime;
+  }
+}
+
+void BeginFrame()
+{
+  double now = GetTime();
+
+  // The set this frame reuses still holds the passes of QUERY_LATENCY frames ago
+  QuerySet & set = querySets[ ( frameIndex + 1 ) % QUERY_LATENCY ];
+  if ( open )
+  {
+    ResolveQueries( set );
+  }
+
+  std::lock_guard<std::mutex> lock( mutex );
+  if ( !frames.empty() )
+  {
+    frames.back().mDuration = now - frames.back().mStart;
+  }
+  Frame frame;
+  frame.mStart = now;
+  frame.mDuration = 0.0;
+  frame.mGPUTime = -1.0;
+  frames.push_back( frame );
+  frameIndex++;
+  set.mFrame = frameIndex;
+
+  while ( frames.front().mStart < now - HISTORY_TIME )
+  {
+    frames.pop_front();
+  }
+  while ( !events.empty() && events.front().mStart < frames.front().mStart )
+  {
+    events.pop_front();
+  }
+}
+
+void BeginCPU( const char * _name )
+{
+  if ( scopeDepth < MAX_DEPTH )
+  {
+    scopeStack[ scopeDepth ].mName = _name;
+    scopeStack[ scopeDepth ].mStart = GetTime();
+  }
+  scopeDepth++;
+}
+
+void EndCPU()
+{
+  scopeDepth--;
+  if ( scopeDepth < 0 || scopeDepth >= MAX_DEPTH )
+  {
+    scopeDepth = std::max( scopeDepth, 0 );
+    return;
+  }
+  Event event;
+  event.mName = scopeStack[ scopeDepth ].mName;
+  event.mStart = scopeStack[ scopeDepth ].mStart;
+  event.mDuration = GetTime() - event.mStart;
+  event.mThread = GetThreadIndex();
+
+  std::lock_guard<std::mutex> lock( mutex );
+  events.push_back( event );
+}
+
+void BeginGPU( const char * _name )
+{
+  if ( !open )
+  {
+    return;
+  }
+  if ( hasDebugGroups )
+  {
+    glPushDebugGroup( GL_DEBUG_SOURCE_APPLICATION, 0, -1, _name );
+  }
+  if ( hasTimerQueries && gpuDepth++ == 0 )
+  {
+    QuerySet & set = querySets[ frameIndex % QUERY_LATENCY ];
+    if ( set.mCount == set.mQueries.size() )
+    {
+      Query query;
+      glGenQueries( 1, &query.mQuery );
+      set.mQueries.push_back( query );
+    }
+    Query & query = set.mQueries[ set.mCount++ ];
+    query.mName = _name;
+    query.mIssueTime = GetTime();
+    glBeginQuery( GL_TIME_ELAPSED, query.mQuery );
+  }
+}
+
+void EndGPU()
+{
+  if ( !open )
+  {
+    return;
+  }
+  if ( hasTimerQueries && --gpuDepth == 0 )
+  {
+    glEndQuery( GL_TIME_ELAPSED );
+  }
+  if ( hasDebugGroups )
+  {
+    glPopDebugGroup();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// UI
+
+float GetPercentile( const std::vector<float> & _sorted, float _percentile )
+{
+  size_t index = (size_t) ( _percentile / 100.0f * ( _sorted.size() - 1 ) + 0.5f );
+  return _sorted[ std::min( index, _sorted.size() - 1 ) ];
+}
+
+struct ScopeStatistics
+{
+  double mTotal;
+  double mMax;
+  bool mGPU;
+};
+
+void ShowWindow( bool * _open )
+{
+  if ( !ImGui::Begin( "Profiler", _open, ImGuiWindowFlags_AlwaysAutoResize ) )
+  {
+    ImGui::End();
+    return;
+  }
+
+  bool exportTrace = false;
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+
+    // The finished frames, the current one is still running
+    int frameCount = std::min( (int) frames.size() - 1, GRAPH_FRAMES );
+    int firstFrame = (int) frames.size() - 1 - frameCount;
+    if ( frameCount <= 0 )
+    {
+      ImGui::Text( "No frames yet" );
+      ImGui::End();
+      return;
+    }
+    std::vector<float> times( frameCount );
+    for ( int i = 0; i < frameCount; i++ )
+    {
+      times[ i ] = (float) frames[ firstFrame + i ].mDuration;
+    }
+    std::vector<float> sorted = times;
+    std::sort( sorted.begin(), sorted.end() );
+    float median = GetPercentile( sorted, 50.0f );
+    float p95 = GetPercentile( sorted, 95.0f );
+    float p99 = GetPercentile( sorted, 99.0f );
+    float hitchTime = median * HITCH_FACTOR;
+    int hitchCount = (int) ( sorted.end() - std::upper_bound( sorted.begin(), sorted.end(), hitchTime ) );
+
+    ImGui::Text( "Frame time: median %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms", median, p95, p99, sorted.back() );
+    ImGui::Text( "Hitches (over %.2f ms): %d in the last %d frames", hitchTime, hitchCount, frameCount );
+
+    // Bars scaled to leave room above the p99, anything longer is cut off
+    const ImVec2 size( 600.0f, 120.0f );
+    const float barWidth = size.x / GRAPH_FRAMES;
+    float top = std::max( std::max( p99, hitchTime ) * 1.25f, 1.0f );
+    ImVec2 origin = ImGui::GetCursorScreenPos();
+    ImGui::Dummy( size );
+    ImDrawList * drawList = ImGui::GetWindowDrawList();
+    drawList->AddRectFilled( origin, ImVec2( origin.x + size.x, origin.y + size.y ), IM_COL32( 20, 20, 20, 255 ) );
+    for ( int i = 0; i < frameCount; i++ )
+    {
+      float x = origin.x + ( GRAPH_FRAMES - frameCount + i ) * barWidth;
+      float height = std::min( times[ i ] / top, 1.0f ) * size.y;
+      bool hitch = times[ i ] > hitchTime;
+      drawList->AddRectFilled( ImVec2( x, origin.y + size.y - height ), ImVec2( x + barWidth, origin.y + size.y ), hitch ? IM_COL32( 255, 60, 60, 255 ) : IM_COL32( 90, 200, 90, 255 ) );
+      if ( hitch )
+      {
+        drawList->AddLine( ImVec2( x, origin.y ), ImVec2( x, origin.y + size.y ), IM_COL32( 255, 60, 60, 96 ) );
+      }
+    }
+    const float lines[] = { median, p99 };
+    const char * labels[] = { "median", "p99" };
+    for ( int i = 0; i < 2; i++ )
+    {
+      float y = origin.y + size.y - std::min( lines[ i ] / top, 1.0f ) * size.y;
+      drawList->AddLine( ImVec2( origin.x, y ), ImVec2( origin.x + size.x, y ), IM_COL32( 255, 255, 255, 128 ) );
+      drawList->AddText( ImVec2( origin.x + 2.0f, y - 14.0f ), IM_COL32( 255, 255, 255, 192 ), labels[ i ] );
+    }
+    if ( ImGui::IsItemHovered() )
+    {
+      int index = (int) ( ( ImGui::GetIO().MousePos.x - origin.x ) / barWidth ) - ( GRAPH_FRAMES - frameCount );
+      if ( index >= 0 && index < frameCount )
+      {
+        const Frame & frame = frames[ firstFrame + index ];
+        if ( frame.mGPUTime >= 0.0 )
+        {
+          ImGui::SetTooltip( "%.2f ms, GPU passes %.2f ms", frame.mDuration, frame.mGPUTime );
+        }
+        else
+        {
+          ImGui::SetTooltip( "%.2f ms", frame.mDuration );
+        }
+      }
+    }
+
+    // Per frame averages of the scopes over the graph's frames
+    std::map<std::string, ScopeStatistics> scopes;
+    double graphStart = frames[ firstFrame ].mStart;
+    for ( std::deque<Event>::const_iterator it = events.begin(); it != events.end(); it++ )
+    {
+      if ( it->mStart < graphStart || ( it->mThread != 0 && it->mThread != 1 ) )
+      {
+        continue;
+      }
+      std::string name = std::string( it->mThread == 0 ? "GPU " : "CPU " ) + it->mName;
+      std::map<std::string, ScopeStatistics>::iterator scope = scopes.find( name );
+      if ( scope == scopes.end() )
+      {
+        ScopeStatistics statistics = { 0.0, 0.0, it->mThread == 0 };
+        scope = scopes.insert( std::make_pair( name, statistics ) ).first;
+      }
+      scope->second.mTotal += it->mDuration;
+      scope->second.mMax = std::max( scope->second.mMax, it->mDuration );
+    }
+    ImGui::Separator();
+    ImGui::Text( "%-24s %10s %10s", "Scope (main thread)", "avg ms", "max ms" );
+    for ( std::map<std::string, ScopeStatistics>::const_iterator it = scopes.begin(); it != scopes.end(); it++ )
+    {
+      ImGui::Text( "%-24s %10.3f %10.3f", it->first.c_str(), it->second.mTotal / frameCount, it->second.mMax );
+    }
+    if ( !hasTimerQueries )
+    {
+      ImGui::Text( "No GPU timings, the driver lacks timer queries" );
+    }
+    ImGui::Separator();
+
+    exportTrace = ImGui::Button( "Export Chrome trace" );
+    if ( !lastExportPath.empty() )
+    {
+      ImGui::SameLine();
+      ImGui::Text( "Last written to '%s'", lastExportPath.c_str() );
+    }
+  }
+
+  if ( exportTrace )
+  {
+    char path[ 64 ];
+    time_t now = time( NULL );
+    strftime( path, sizeof( path ), "foxotron_trace_%Y%m%d_%H%M%S.json", localtime( &now ) );
+    if ( ExportChromeTrace( path ) )
+    {
+      lastExportPath = path;
+    }
+  }
+
+  ImGui::End();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Export
+
+bool ExportChromeTrace( const char * _path )
+{
+  FILE * file = fopen( _path, "wb" );
+  if ( !file )
+  {
+    printf( "[Profiler] Failed to write '%s'\n", _path );
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock( mutex );
+
+  // Timestamps in microseconds
+  fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+  fprintf( file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Foxotron\"}},\n" );
+  fprintf( file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}},\n" );
+  for ( int i = 1; i <= threadCount; i++ )
+  {
+    if ( i == 1 )
+    {
+      fprintf( file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"Main\"}},\n" );
+    }
+    else
+    {
+      fprintf( file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}},\n", i, i - 1 );
+    }
+  }
+
+  // Frames on the main thread, so its scopes nest under them
+  uint64_t firstFrame = frameIndex + 1 - frames.size();
+  for ( size_t i = 0; i + 1 < frames.size(); i++ )
+  {
+    fprintf( file, "{\"name\":\"Frame %llu\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1},\n",
+      (unsigned long long) ( firstFrame + i ), frames[ i ].mStart * 1000.0, frames[ i ].mDuration * 1000.0 );
+  }
+  for ( std::deque<Event>::const_iterator it = events.begin(); it != events.end(); it++ )
+  {
+    fprintf( file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d},\n",
+      it->mName, it->mThread == 0 ? "gpu" : "cpu", it->mStart * 1000.0, it->mDuration * 1000.0, it->mThread );
+  }
+  // JSON has no trailing commas
+  fprintf( file, "{\"name\":\"export\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":1,\"tid\":1}\n]}\n", GetTime() * 1000.0 );
+  fclose( file );
+
+  printf( "[Profiler] Wrote %d frames and %d scopes to '%s'\n", (int) frames.size(), (int) events.size(), _path );
+  return true;
+}
+
+}
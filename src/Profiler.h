@@ -0,0 +1,39 @@
+// Frame profiling: CPU scopes on any thread, GPU passes timed with GL_TIME_ELAPSED queries (read back a couple of
+// frames later, so waiting on them never stalls) and labelled with KHR_debug groups for frame debuggers. The last
+// few seconds are kept for a live frame time graph and can be exported as a Chrome trace (chrome://tracing, Perfetto).
+namespace Profiler
+{
+  // Needs the GL context; the queries and debug groups are left out where the driver lacks them
+  void Open();
+  void Close();
+
+  // Starts the next frame, and collects the GPU timings that have come in; call first thing in the main loop
+  void BeginFrame();
+
+  // _name has to outlive the profiler, e.g. a string literal. Scopes on a thread nest.
+  void BeginCPU( const char * _name );
+  void EndCPU();
+
+  // GL passes, on the context thread; unlike CPU scopes they can't nest, timer queries can't overlap
+  void BeginGPU( const char * _name );
+  void EndGPU();
+
+  struct CPUScope
+  {
+    CPUScope( const char * _name ) { BeginCPU( _name ); }
+    ~CPUScope() { EndCPU(); }
+  };
+
+  struct GPUScope
+  {
+    GPUScope( const char * _name ) { BeginGPU( _name ); }
+    ~GPUScope() { EndGPU(); }
+  };
+
+  // The frame time graph with its percentiles, frames well above the median marked as hitches, and a table of
+  // the scopes
+  void ShowWindow( bool * _open );
+
+  // Every frame still kept, CPU scopes per thread and GPU passes on a track of their own
+  bool ExportChromeTrace( const char * _path );
+}
@@ -0,0 +1,1117 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define RASTERIZER_SSE
+#include <emmintrin.h>
+#endif
+
+#include "Geometry.h"
+#include "SkyPrefilter.h"
+#include "HDRImage.h"
+#include "Parallel.h"
+#include "Rasterizer.h"
+
+namespace Rasterizer
+{
+
+const float PI = 3.1415926536f;
+
+// Triangles are binned into square tiles of this many pixels; a tile is rasterized and shaded by one thread
+const int TILE_SIZE = 64;
+// Work items of the geometry stages
+const int VERTEX_CHUNK_SIZE = 4096;
+const int TRIANGLE_CHUNK_SIZE = 8192;
+
+const uint32_t NO_TRIANGLE = 0xFFFFFFFF;
+
+//////////////////////////////////////////////////////////////////////////
+// Textures
+
+// A color map with its box filtered mip chain, in the format it was decoded to
+struct Texture
+{
+  bool mHDR; // texels are packed R11G11B10F rather than RGBA8
+  bool mSRGB;
+  std::vector<int> mWidths;
+  std::vector<int> mHeights;
+  std::vector< std::vector<uint32_t> > mLevels;
+};
+
+const float * GetSRGBTable()
+{
+  static float table[ 256 ];
+  static bool initialized = []()
+  {
+    for ( int i = 0; i < 256; i++ )
+    {
+      float value = i / 255.0f;
+      table[ i ] = value <= 0.04045f ? value / 12.92f : powf( ( value + 0.055f ) / 1.055f, 2.4f );
+    }
+    return true;
+  }();
+  (void) initialized;
+  return table;
+}
+
+inline uint32_t EncodeSRGB( float _linear )
+{
+  float value = _linear <= 0.0031308f ? _linear * 12.92f : 1.055f * powf( _linear, 1.0f / 2.4f ) - 0.055f;
+  return (uint32_t) ( std::min( std::max( value, 0.0f ), 1.0f ) * 255.0f + 0.5f );
+}
+
+inline glm::vec4 FetchTexel( const Texture & _texture, int _level, int _x, int _y )
+{
+  uint32_t texel = _texture.mLevels[ _level ][ _y * _texture.mWidths[ _level ] + _x ];
+  if ( _texture.mHDR )
+  {
+    float rgb[ 3 ];
+    HDRImage::UnpackR11G11B10F( &texel, 1, rgb );
+    return glm::vec4( rgb[ 0 ], rgb[ 1 ], rgb[ 2 ], 1.0f );
+  }
+  if ( _texture.mSRGB )
+  {
+    const float * srgb = GetSRGBTable();
+    return glm::vec4( srgb[ texel & 0xFF ], srgb[ ( texel >> 8 ) & 0xFF ], srgb[ ( texel >> 16 ) & 0xFF ], ( texel >> 24 ) / 255.0f );
+  }
+  return glm::vec4( texel & 0xFF, ( texel >> 8 ) & 0xFF, ( texel >> 16 ) & 0xFF, texel >> 24 ) / 255.0f;
+}
+
+// Same filter as glGenerateMipmap() for the odd sizes too: the last row / column is used twice
+void BuildMipChain( Texture & _texture )
+{
+  while ( _texture.mWidths.back() > 1 || _texture.mHeights.back() > 1 )
+  {
+    int level = (int) _texture.mLevels.size() - 1;
+    int width = _texture.mWidths[ level ];
+    int height = _texture.mHeights[ level ];
+    int nextWidth = std::max( width / 2, 1 );
+    int nextHeight = std::max( height / 2, 1 );
+
+    std::vector<uint32_t> next( nextWidth * nextHeight );
+    for ( int y = 0; y < nextHeight; y++ )
+    {
+      for ( int x = 0; x < nextWidth; x++ )
+      {
+        int x0 = std::min( x * 2, width - 1 );
+        int x1 = std::min( x * 2 + 1, width - 1 );
+        int y0 = std::min( y * 2, height - 1 );
+        int y1 = std::min( y * 2 + 1, height - 1 );
+        glm::vec4 average = ( FetchTexel( _texture, level, x0, y0 ) + FetchTexel( _texture, level, x1, y0 ) + FetchTexel( _texture, level, x0, y1 ) + FetchTexel( _texture, level, x1, y1 ) ) * 0.25f;
+
+        uint32_t & texel = next[ y * nextWidth + x ];
+        if ( _texture.mHDR )
+        {
+          HDRImage::PackR11G11B10F( &average.x, 1, &texel );
+        }
+        else if ( _texture.mSRGB )
+        {
+          texel = EncodeSRGB( average.x ) | ( EncodeSRGB( average.y ) << 8 ) | ( EncodeSRGB( average.z ) << 16 ) | ( (uint32_t) ( average.w * 255.0f + 0.5f ) << 24 );
+        }
+        else
+        {
+          glm::vec4 bytes = average * 255.0f + 0.5f;
+          texel = (uint32_t) bytes.x | ( (uint32_t) bytes.y << 8 ) | ( (uint32_t) bytes.z << 16 ) | ( (uint32_t) bytes.w << 24 );
+        }
+      }
+    }
+
+    _texture.mLevels.push_back( std::move( next ) );
+    _texture.mWidths.push_back( nextWidth );
+    _texture.mHeights.push_back( nextHeight );
+  }
+}
+
+inline int Wrap( int _value, int _size )
+{
+  return _value < 0 ? _value + _size : _value >= _size ? _value - _size : _value;
+}
+
+// Bilinear with GL_REPEAT
+glm::vec4 SampleLevel( const Texture & _texture, int _level, float _u, float _v )
+{
+  int width = _texture.mWidths[ _level ];
+  int height = _texture.mHeights[ _level ];
+  float x = ( _u - floorf( _u ) ) * width - 0.5f;
+  float y = ( _v - floorf( _v ) ) * height - 0.5f;
+  float fx = floorf( x );
+  float fy = floorf( y );
+  int x0 = Wrap( (int) fx, width );
+  int y0 = Wrap( (int) fy, height );
+  int x1 = Wrap( x0 + 1, width );
+  int y1 = Wrap( y0 + 1, height );
+  float tx = x - fx;
+  float ty = y - fy;
+
+  glm::vec4 top = glm::mix( FetchTexel( _texture, _level, x0, y0 ), FetchTexel( _texture, _level, x1, y0 ), tx );
+  glm::vec4 bottom = glm::mix( FetchTexel( _texture, _level, x0, y1 ), FetchTexel( _texture, _level, x1, y1 ), tx );
+  return glm::mix( top, bottom, ty );
+}
+
+// GL_LINEAR_MIPMAP_LINEAR
+glm::vec4 Sample( const Texture & _texture, const glm::vec2 & _texcoord, float _lod )
+{
+  float lod = std::min( std::max( _lod, 0.0f ), (float) _texture.mLevels.size() - 1.0f );
+  int level = (int) lod;
+  float blend = lod - level;
+  glm::vec4 color = SampleLevel( _texture, level, _texcoord.x, _texcoord.y );
+  if ( blend > 0.0f )
+  {
+    color = glm::mix( color, SampleLevel( _texture, level + 1, _texcoord.x, _texcoord.y ), blend );
+  }
+  return color;
+}
+
+// The level of detail GL picks from the screen space derivatives of the texture coordinates
+inline float GetLod( const Texture & _texture, const glm::vec2 & _dx, const glm::vec2 & _dy )
+{
+  float width = (float) _texture.mWidths[ 0 ];
+  float height = (float) _texture.mHeights[ 0 ];
+  float x = ( _dx.x * width ) * ( _dx.x * width ) + ( _dx.y * height ) * ( _dx.y * height );
+  float y = ( _dy.x * width ) * ( _dy.x * width ) + ( _dy.y * height ) * ( _dy.y * height );
+  return 0.5f * log2f( std::max( std::max( x, y ), 1e-20f ) );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Model
+
+// Material inputs in the form pbr.fs reads them: a texture if there is one, the constant otherwise
+struct Material
+{
+  const Texture * mBaseColorMap; // albedo, or diffuse
+  const Texture * mRoughnessMap;
+  const Texture * mMetallicMap;
+  const Texture * mNormalMap;
+  const Texture * mAOMap; // AO, or ambient
+  const Texture * mAmbientMap;
+  glm::vec3 mBaseColor;
+  float mRoughness;
+  float mMetallic;
+  glm::vec3 mAmbient;
+};
+
+struct Model
+{
+  const Geometry * mGeometry;
+  std::vector<Texture *> mTextures;
+  std::map<int, Material> mMaterials;
+  Material mDefaultMaterial;
+};
+
+const Texture * GetTexture( Model * _model, std::map<const Renderer::Image *, Texture *> & _textures, const Geometry::ColorMap & _colorMap )
+{
+  const Renderer::Image * image = _colorMap.mImage;
+  if ( !image )
+  {
+    return NULL;
+  }
+  std::map<const Renderer::Image *, Texture *>::iterator it = _textures.find( image );
+  if ( it != _textures.end() )
+  {
+    return it->second;
+  }
+
+  Texture * texture = new Texture();
+  texture->mHDR = image->mHDR;
+  texture->mSRGB = image->mSRGB;
+  texture->mWidths.push_back( image->mWidth );
+  texture->mHeights.push_back( image->mHeight );
+  texture->mLevels.push_back( image->mTexels );
+  _model->mTextures.push_back( texture );
+  _textures[ image ] = texture;
+  return texture;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Geometry stages
+
+struct ShadedVertex
+{
+  glm::vec4 mClip;
+  glm::vec3 mWorld;
+  glm::vec3 mNormal;
+  glm::vec3 mTangent;
+  glm::vec2 mTexcoord;
+};
+
+// One instance of a mesh
+struct Draw
+{
+  const Geometry::Mesh * mMesh;
+  const Material * mMaterial;
+  glm::mat4x4 mWorld;
+  int mFirstVertex; // in the frame's transformed vertices
+  int mFirstTriangle; // in the frame's triangle numbering
+};
+
+struct Triangle
+{
+  // Normalized edge functions: the barycentric coordinate of vertex i at pixel center ( x, y ) is
+  // mEdgeA[ i ] * x + mEdgeB[ i ] * y + mEdgeC[ i ]
+  float mEdgeA[ 3 ];
+  float mEdgeB[ 3 ];
+  float mEdgeC[ 3 ];
+  // Window space depth, the same way
+  float mDepthA;
+  float mDepthB;
+  float mDepthC;
+  float mInvW[ 3 ];
+  const ShadedVertex * mVertices[ 3 ];
+  const Material * mMaterial;
+  // Pixel bounds, inclusive
+  int mMinX;
+  int mMinY;
+  int mMaxX;
+  int mMaxY;
+};
+
+// A run of triangles set up by one thread, with its own bins so the submission order stays deterministic
+struct TriangleChunk
+{
+  std::vector<Triangle> mTriangles;
+  std::deque<ShadedVertex> mClippedVertices; // deque, so the triangles can point into it while it grows
+  std::vector< std::vector<int> > mBins; // triangle indices per tile
+};
+
+struct Frame
+{
+  const Settings * mSettings;
+  int mTilesX;
+  int mTilesY;
+  std::vector<Draw> mDraws;
+  std::vector<ShadedVertex> mVertices;
+  int mTriangleCount;
+  std::vector<TriangleChunk> mChunks;
+  std::vector<const Triangle *> mTriangles; // by the IDs in the visibility buffer
+};
+
+void TransformVertices( const Model * _model, const glm::mat4x4 & _viewProjection, const Draw & _draw, int _first, int _count, ShadedVertex * _out )
+{
+  const std::vector<Geometry::Vertex> & vertices = _model->mGeometry->mStaging->mVertices;
+  glm::mat4x4 worldViewProjection = _viewProjection * _draw.mWorld;
+  glm::mat3x3 world3x3( _draw.mWorld );
+
+  for ( int i = 0; i < _count; i++ )
+  {
+    const Geometry::Vertex & vertex = vertices[ _draw.mMesh->mBaseVertex + _first + i ];
+    ShadedVertex & out = _out[ i ];
+    glm::vec4 position( vertex.v3Vector, 1.0f );
+    out.mClip = worldViewProjection * position;
+    out.mWorld = glm::vec3( _draw.mWorld * position );
+    out.mNormal = glm::normalize( world3x3 * vertex.v3Normal );
+    out.mTangent = glm::normalize( world3x3 * vertex.v3Tangent );
+    out.mTexcoord = vertex.fTexcoord;
+  }
+}
+
+ShadedVertex Lerp( const ShadedVertex & _a, const ShadedVertex & _b, float _t )
+{
+  ShadedVertex out;
+  out.mClip = glm::mix( _a.mClip, _b.mClip, _t );
+  out.mWorld = glm::mix( _a.mWorld, _b.mWorld, _t );
+  out.mNormal = glm::mix( _a.mNormal, _b.mNormal, _t );
+  out.mTangent = glm::mix( _a.mTangent, _b.mTangent, _t );
+  out.mTexcoord = glm::mix( _a.mTexcoord, _b.mTexcoord, _t );
+  return out;
+}
+
+// Projects a triangle that is in front of the near plane and bins it; false if it covers no pixel center
+bool SetupTriangle( const Frame & _frame, const ShadedVertex * _a, const ShadedVertex * _b, const ShadedVertex * _c, const Material * _material, Triangle & _triangle )
+{
+  const Settings & settings = *_frame.mSettings;
+  const ShadedVertex * vertices[ 3 ] = { _a, _b, _c };
+  float x[ 3 ];
+  float y[ 3 ];
+  float z[ 3 ];
+  for ( int i = 0; i < 3; i++ )
+  {
+    const glm::vec4 & clip = vertices[ i ]->mClip;
+    _triangle.mVertices[ i ] = vertices[ i ];
+    _triangle.mInvW[ i ] = 1.0f / clip.w;
+    // Rows go top to bottom, unlike in GL
+    x[ i ] = ( clip.x * _triangle.mInvW[ i ] * 0.5f + 0.5f ) * settings.mWidth;
+    y[ i ] = ( 0.5f - clip.y * _triangle.mInvW[ i ] * 0.5f ) * settings.mHeight;
+    z[ i ] = clip.z * _triangle.mInvW[ i ] * 0.5f + 0.5f;
+  }
+
+  float area = ( x[ 1 ] - x[ 0 ] ) * ( y[ 2 ] - y[ 0 ] ) - ( x[ 2 ] - x[ 0 ] ) * ( y[ 1 ] - y[ 0 ] );
+  if ( fabsf( area ) < 1e-8f )
+  {
+    return false;
+  }
+
+  float minX = std::min( std::min( x[ 0 ], x[ 1 ] ), x[ 2 ] );
+  float maxX = std::max( std::max( x[ 0 ], x[ 1 ] ), x[ 2 ] );
+  float minY = std::min( std::min( y[ 0 ], y[ 1 ] ), y[ 2 ] );
+  float maxY = std::max( std::max( y[ 0 ], y[ 1 ] ), y[ 2 ] );
+  // Pixels whose center is inside the bounds
+  _triangle.mMinX = std::max( (int) ceilf( minX - 0.5f ), 0 );
+  _triangle.mMinY = std::max( (int) ceilf( minY - 0.5f ), 0 );
+  _triangle.mMaxX = std::min( (int) floorf( maxX - 0.5f ), settings.mWidth - 1 );
+  _triangle.mMaxY = std::min( (int) floorf( maxY - 0.5f ), settings.mHeight - 1 );
+  if ( _triangle.mMinX > _triangle.mMaxX || _triangle.mMinY > _triangle.mMaxY )
+  {
+    return false;
+  }
+
+  float invArea = 1.0f / area;
+  _triangle.mDepthA = 0.0f;
+  _triangle.mDepthB = 0.0f;
+  _triangle.mDepthC = 0.0f;
+  for ( int i = 0; i < 3; i++ )
+  {
+    int j = ( i + 1 ) % 3;
+    int k = ( i + 2 ) % 3;
+    _triangle.mEdgeA[ i ] = ( y[ j ] - y[ k ] ) * invArea;
+    _triangle.mEdgeB[ i ] = ( x[ k ] - x[ j ] ) * invArea;
+    _triangle.mEdgeC[ i ] = ( x[ j ] * y[ k ] - x[ k ] * y[ j ] ) * invArea;
+    _triangle.mDepthA += _triangle.mEdgeA[ i ] * z[ i ];
+    _triangle.mDepthB += _triangle.mEdgeB[ i ] * z[ i ];
+    _triangle.mDepthC += _triangle.mEdgeC[ i ] * z[ i ];
+  }
+  _triangle.mMaterial = _material;
+  return true;
+}
+
+void AddTriangle( const Frame & _frame, TriangleChunk & _chunk, const ShadedVertex * _a, const ShadedVertex * _b, const ShadedVertex * _c, const Material * _material )
+{
+  Triangle triangle;
+  if ( !SetupTriangle( _frame, _a, _b, _c, _material, triangle ) )
+  {
+    return;
+  }
+
+  int index = (int) _chunk.mTriangles.size();
+  _chunk.mTriangles.push_back( triangle );
+  for ( int tileY = triangle.mMinY / TILE_SIZE; tileY <= triangle.mMaxY / TILE_SIZE; tileY++ )
+  {
+    for ( int tileX = triangle.mMinX / TILE_SIZE; tileX <= triangle.mMaxX / TILE_SIZE; tileX++ )
+    {
+      _chunk.mBins[ tileY * _frame.mTilesX + tileX ].push_back( index );
+    }
+  }
+}
+
+// Everything behind the near plane ( z < -w ) is cut off, which can leave a quad
+void ClipTriangle( const Frame & _frame, TriangleChunk & _chunk, const ShadedVertex * _vertices[ 3 ], const Material * _material )
+{
+  float distances[ 3 ];
+  int outsideNear = 0;
+  int outside[ 5 ] = { 0, 0, 0, 0, 0 };
+  for ( int i = 0; i < 3; i++ )
+  {
+    const glm::vec4 & clip = _vertices[ i ]->mClip;
+    distances[ i ] = clip.z + clip.w;
+    outsideNear += distances[ i ] < 0.0f ? 1 : 0;
+    outside[ 0 ] += clip.x > clip.w ? 1 : 0;
+    outside[ 1 ] += clip.x < -clip.w ? 1 : 0;
+    outside[ 2 ] += clip.y > clip.w ? 1 : 0;
+    outside[ 3 ] += clip.y < -clip.w ? 1 : 0;
+    outside[ 4 ] += clip.z > clip.w ? 1 : 0;
+  }
+  if ( outsideNear == 3 || outside[ 0 ] == 3 || outside[ 1 ] == 3 || outside[ 2 ] == 3 || outside[ 3 ] == 3 || outside[ 4 ] == 3 )
+  {
+    return;
+  }
+  if ( outsideNear == 0 )
+  {
+    AddTriangle( _frame, _chunk, _vertices[ 0 ], _vertices[ 1 ], _vertices[ 2 ], _material );
+    return;
+  }
+
+  const ShadedVertex * polygon[ 4 ];
+  int count = 0;
+  for ( int i = 0; i < 3; i++ )
+  {
+    int next = ( i + 1 ) % 3;
+    if ( distances[ i ] >= 0.0f )
+    {
+      polygon[ count++ ] = _vertices[ i ];
+    }
+    if ( ( distances[ i ] >= 0.0f ) != ( distances[ next ] >= 0.0f ) )
+    {
+      float t = distances[ i ] / ( distances[ i ] - distances[ next ] );
+      _chunk.mClippedVertices.push_back( Lerp( *_vertices[ i ], *_vertices[ next ], t ) );
+      polygon[ count++ ] = &_chunk.mClippedVertices.back();
+    }
+  }
+  for ( int i = 2; i < count; i++ )
+  {
+    AddTriangle( _frame, _chunk, polygon[ 0 ], polygon[ i - 1 ], polygon[ i ], _material );
+  }
+}
+
+void SetupTriangles( const Model * _model, const Frame & _frame, int _first, int _count, TriangleChunk & _chunk )
+{
+  const std::vector<unsigned int> & indices = _model->mGeometry->mStaging->mIndices;
+
+  // The draw holding the first triangle, then on from there
+  int drawIndex = 0;
+  while ( drawIndex + 1 < _frame.mDraws.size() && _frame.mDraws[ drawIndex + 1 ].mFirstTriangle <= _first )
+  {
+    drawIndex++;
+  }
+
+  for ( int triangle = _first; triangle < _first + _count; triangle++ )
+  {
+    while ( triangle >= _frame.mDraws[ drawIndex ].mFirstTriangle + _frame.mDraws[ drawIndex ].mMesh->mTriangleCount )
+    {
+      drawIndex++;
+    }
+    const Draw & draw = _frame.mDraws[ drawIndex ];
+    int firstIndex = draw.mMesh->mFirstIndex + ( triangle - draw.mFirstTriangle ) * 3;
+
+    const ShadedVertex * vertices[ 3 ];
+    for ( int i = 0; i < 3; i++ )
+    {
+      vertices[ i ] = &_frame.mVertices[ draw.mFirstVertex + indices[ firstIndex + i ] ];
+    }
+    ClipTriangle( _frame, _chunk, vertices, draw.mMaterial );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shading, after Shaders/pbr.fs and Skyboxes/skysphere.fs
+
+// MurMurHash 3 finalizer, like the shaders' dither
+inline uint32_t Hash( uint32_t _h )
+{
+  _h ^= _h >> 16;
+  _h *= 0x85ebca6b;
+  _h ^= _h >> 13;
+  _h *= 0xc2b2ae35;
+  _h ^= _h >> 16;
+  return _h;
+}
+
+inline uint32_t FloatBits( float _value )
+{
+  uint32_t bits = 0;
+  memcpy( &bits, &_value, sizeof( float ) );
+  return bits;
+}
+
+// random( uvec3( floatBitsToUint( gl_FragCoord.xy ), frame_count ) ), so the noise is the same as on the GPU
+inline float Dither( int _x, int _y, const Settings & _settings )
+{
+  // gl_FragCoord counts rows from the bottom
+  uint32_t m = Hash( FloatBits( _x + 0.5f ) ^ Hash( FloatBits( _settings.mHeight - _y - 0.5f ) ) ^ Hash( _settings.mFrameCount ) );
+  uint32_t bits = ( m & 0x007FFFFF ) | 0x3f800000;
+  float value = 0.0f;
+  memcpy( &value, &bits, sizeof( float ) );
+  return value - 1.0f;
+}
+
+// Tonemap, gamma and dither
+inline void WritePixel( glm::vec3 _color, float _dither, unsigned char * _out )
+{
+  for ( int i = 0; i < 3; i++ )
+  {
+    float value = powf( _color[ i ] / ( 1.0f + _color[ i ] ), 1.0f / 2.2f ) + _dither;
+    _out[ i ] = (unsigned char) ( std::min( std::max( value, 0.0f ), 1.0f ) * 255.0f + 0.5f );
+  }
+  _out[ 3 ] = 255;
+}
+
+inline glm::vec3 ToSkySpace( const glm::vec3 & _dir, float _rotation )
+{
+  float angle = _rotation * 2.0f * PI;
+  return glm::vec3( cosf( angle ) * _dir.x - sinf( angle ) * _dir.z, _dir.y, sinf( angle ) * _dir.x + cosf( angle ) * _dir.z );
+}
+
+glm::vec3 SampleSkyLevel( const SkyPrefilter::Result & _sky, int _level, float _u, float _v )
+{
+  int width = std::max( _sky.mWidth >> _level, 1 );
+  int height = std::max( _sky.mHeight >> _level, 1 );
+  const float * texels = &_sky.mLevels[ _level ][ 0 ];
+  float x = ( _u - floorf( _u ) ) * width - 0.5f;
+  float y = ( _v - floorf( _v ) ) * height - 0.5f;
+  float fx = floorf( x );
+  float fy = floorf( y );
+  int x0 = Wrap( (int) fx, width );
+  int y0 = Wrap( (int) fy, height );
+  int x1 = Wrap( x0 + 1, width );
+  int y1 = Wrap( y0 + 1, height );
+  float tx = x - fx;
+  float ty = y - fy;
+
+  const float * t00 = texels + ( y0 * width + x0 ) * 3;
+  const float * t10 = texels + ( y0 * width + x1 ) * 3;
+  const float * t01 = texels + ( y1 * width + x0 ) * 3;
+  const float * t11 = texels + ( y1 * width + x1 ) * 3;
+  glm::vec3 color;
+  for ( int i = 0; i < 3; i++ )
+  {
+    float top = t00[ i ] + ( t10[ i ] - t00[ i ] ) * tx;
+    float bottom = t01[ i ] + ( t11[ i ] - t01[ i ] ) * tx;
+    color[ i ] = top + ( bottom - top ) * ty;
+  }
+  return color;
+}
+
+// sample_sky_lod() of the panorama
+glm::vec3 SampleSky( const Settings & _settings, const glm::vec3 & _dir, float _lod )
+{
+  const SkyPrefilter::Result & sky = *_settings.mSky;
+  glm::vec3 dir = glm::normalize( _dir );
+  float u = atan2f( dir.z, dir.x ) / PI / 2.0f + 0.5f + _settings.mSkyRotation;
+  float v = acosf( std::min( std::max( dir.y, -1.0f ), 1.0f ) ) / PI;
+
+  float lod = std::min( std::max( _lod, 0.0f ), (float) sky.mLevels.size() - 1.0f );
+  int level = (int) lod;
+  float blend = lod - level;
+  glm::vec3 color = SampleSkyLevel( sky, level, u, v );
+  if ( blend > 0.0f )
+  {
+    color = glm::mix( color, SampleSkyLevel( sky, level + 1, u, v ), blend );
+  }
+  return color;
+}
+
+glm::vec2 SampleBrdf( const Settings & _settings, float _u, float _v )
+{
+  int size = _settings.mBrdfLookupTableSize;
+  float x = std::min( std::max( _u * size - 0.5f, 0.0f ), size - 1.0f );
+  float y = std::min( std::max( _v * size - 0.5f, 0.0f ), size - 1.0f );
+  int x0 = (int) x;
+  int y0 = (int) y;
+  int x1 = std::min( x0 + 1, size - 1 );
+  int y1 = std::min( y0 + 1, size - 1 );
+  float tx = x - x0;
+  float ty = y - y0;
+
+  const float * table = _settings.mBrdfLookupTable;
+  glm::vec2 t00( table[ ( y0 * size + x0 ) * 2 ], table[ ( y0 * size + x0 ) * 2 + 1 ] );
+  glm::vec2 t10( table[ ( y0 * size + x1 ) * 2 ], table[ ( y0 * size + x1 ) * 2 + 1 ] );
+  glm::vec2 t01( table[ ( y1 * size + x0 ) * 2 ], table[ ( y1 * size + x0 ) * 2 + 1 ] );
+  glm::vec2 t11( table[ ( y1 * size + x1 ) * 2 ], table[ ( y1 * size + x1 ) * 2 + 1 ] );
+  return glm::mix( glm::mix( t00, t10, tx ), glm::mix( t01, t11, tx ), ty );
+}
+
+glm::vec3 FresnelSchlick( const glm::vec3 & _h, const glm::vec3 & _v, const glm::vec3 & _f0 )
+{
+  float cosTheta = std::min( std::max( glm::dot( _h, _v ), 0.0f ), 1.0f );
+  return _f0 + ( glm::vec3( 1.0f ) - _f0 ) * powf( 1.0f - cosTheta, 5.0f );
+}
+
+glm::vec3 FresnelSchlickRoughness( const glm::vec3 & _h, const glm::vec3 & _v, const glm::vec3 & _f0, float _roughness )
+{
+  float cosTheta = std::min( std::max( glm::dot( _h, _v ), 0.0f ), 1.0f );
+  return _f0 + ( glm::max( glm::vec3( 1.0f - _roughness ), _f0 ) - _f0 ) * powf( 1.0f - cosTheta, 5.0f );
+}
+
+float DistributionGGX( const glm::vec3 & _n, const glm::vec3 & _h, float _roughness )
+{
+  float a = _roughness * _roughness;
+  float a2 = a * a;
+  float NdotH = std::max( 0.0f, glm::dot( _n, _h ) );
+  float factor = NdotH * NdotH * ( a2 - 1.0f ) + 1.0f;
+  return a2 / ( PI * factor * factor );
+}
+
+float GeometrySchlickGGX( const glm::vec3 & _n, const glm::vec3 & _v, float _k )
+{
+  float NdotV = std::max( 0.0f, glm::dot( _n, _v ) );
+  return NdotV / ( NdotV * ( 1.0f - _k ) + _k );
+}
+
+float GeometrySmith( const glm::vec3 & _n, const glm::vec3 & _v, const glm::vec3 & _l, float _roughness )
+{
+  float r = _roughness + 1.0f;
+  float k = ( r * r ) / 8.0f;
+  return GeometrySchlickGGX( _n, _v, k ) * GeometrySchlickGGX( _n, _l, k );
+}
+
+glm::vec3 SampleIrradiance( const Settings & _settings, const glm::vec3 & _normal )
+{
+  const float ( *sh )[ 3 ] = _settings.mSky->mIrradianceSH;
+  glm::vec3 n = ToSkySpace( glm::normalize( _normal ), _settings.mSkyRotation );
+  float basis[ 9 ] =
+  {
+    0.282095f,
+    0.488603f * n.y,
+    0.488603f * n.z,
+    0.488603f * n.x,
+    1.092548f * n.x * n.y,
+    1.092548f * n.y * n.z,
+    0.315392f * ( 3.0f * n.z * n.z - 1.0f ),
+    1.092548f * n.x * n.z,
+    0.546274f * ( n.x * n.x - n.y * n.y ),
+  };
+  glm::vec3 irradiance( 0.0f );
+  for ( int i = 0; i < 9; i++ )
+  {
+    irradiance += glm::vec3( sh[ i ][ 0 ], sh[ i ][ 1 ], sh[ i ][ 2 ] ) * basis[ i ];
+  }
+  return glm::max( irradiance, glm::vec3( 0.0f ) ) * _settings.mExposure;
+}
+
+glm::vec3 SpecularIBL( const Settings & _settings, const glm::vec3 & _v, const glm::vec3 & _n, float _roughness, const glm::vec3 & _fresnel )
+{
+  glm::vec3 r = 2.0f * glm::dot( _v, _n ) * _n - _v;
+
+  // One roughness step per mip of the prefiltered chain
+  float mip = ( _settings.mSky->mLevels.size() - 1.0f ) * _roughness;
+  glm::vec3 prefiltered = SampleSky( _settings, r, mip ) * _settings.mExposure;
+
+  // Wraparound specular
+  float NdotV = glm::dot( _n, _v ) * 0.9f + 0.1f;
+  NdotV = std::min( 0.99f, std::max( 0.01f, NdotV ) );
+
+  glm::vec2 envBRDF = SampleBrdf( _settings, NdotV, _roughness );
+  return prefiltered * ( _fresnel * envBRDF.x + glm::vec3( envBRDF.y ) );
+}
+
+// The interpolated vertex outputs at a pixel, plus the texture coordinate derivatives texture() would use
+struct Fragment
+{
+  glm::vec3 mWorld;
+  glm::vec3 mNormal;
+  glm::vec3 mTangent;
+  glm::vec2 mTexcoord;
+  glm::vec2 mTexcoordDx;
+  glm::vec2 mTexcoordDy;
+};
+
+void Interpolate( const Triangle & _triangle, float _x, float _y, Fragment & _fragment )
+{
+  // Perspective correct weights: the barycentrics over w, normalized
+  float weights[ 3 ];
+  float sum = 0.0f;
+  float sumDx = 0.0f;
+  float sumDy = 0.0f;
+  for ( int i = 0; i < 3; i++ )
+  {
+    weights[ i ] = ( _triangle.mEdgeA[ i ] * _x + _triangle.mEdgeB[ i ] * _y + _triangle.mEdgeC[ i ] ) * _triangle.mInvW[ i ];
+    sum += weights[ i ];
+    sumDx += _triangle.mEdgeA[ i ] * _triangle.mInvW[ i ];
+    sumDy += _triangle.mEdgeB[ i ] * _triangle.mInvW[ i ];
+  }
+  float invSum = 1.0f / sum;
+
+  _fragment.mWorld = glm::vec3( 0.0f );
+  _fragment.mNormal = glm::vec3( 0.0f );
+  _fragment.mTangent = glm::vec3( 0.0f );
+  _fragment.mTexcoord = glm::vec2( 0.0f );
+  glm::vec2 texcoordDx( 0.0f );
+  glm::vec2 texcoordDy( 0.0f );
+  for ( int i = 0; i < 3; i++ )
+  {
+    const ShadedVertex & vertex = *_triangle.mVertices[ i ];
+    float weight = weights[ i ] * invSum;
+    _fragment.mWorld += vertex.mWorld * weight;
+    _fragment.mNormal += vertex.mNormal * weight;
+    _fragment.mTangent += vertex.mTangent * weight;
+    _fragment.mTexcoord += vertex.mTexcoord * weight;
+    texcoordDx += vertex.mTexcoord * ( _triangle.mEdgeA[ i ] * _triangle.mInvW[ i ] );
+    texcoordDy += vertex.mTexcoord * ( _triangle.mEdgeB[ i ] * _triangle.mInvW[ i ] );
+  }
+  // Quotient rule on ( sum of weighted texcoords ) / ( sum of weights )
+  _fragment.mTexcoordDx = ( texcoordDx - _fragment.mTexcoord * sumDx ) * invSum;
+  _fragment.mTexcoordDy = ( texcoordDy - _fragment.mTexcoord * sumDy ) * invSum;
+}
+
+glm::vec3 ShadeFragment( const Settings & _settings, const glm::vec3 & _cameraPosition, const Material & _material, const Fragment & _fragment )
+{
+  const glm::vec2 & texcoord = _fragment.mTexcoord;
+  const glm::vec2 & dx = _fragment.mTexcoordDx;
+  const glm::vec2 & dy = _fragment.mTexcoordDy;
+
+  glm::vec3 baseColor = _material.mBaseColorMap ? glm::vec3( Sample( *_material.mBaseColorMap, texcoord, GetLod( *_material.mBaseColorMap, dx, dy ) ) ) : _material.mBaseColor;
+  float roughness = _material.mRoughnessMap ? Sample( *_material.mRoughnessMap, texcoord, GetLod( *_material.mRoughnessMap, dx, dy ) ).x : _material.mRoughness;
+  float metallic = _material.mMetallicMap ? Sample( *_material.mMetallicMap, texcoord, GetLod( *_material.mMetallicMap, dx, dy ) ).x : _material.mMetallic;
+  float ao = _material.mAOMap ? Sample( *_material.mAOMap, texcoord, GetLod( *_material.mAOMap, dx, dy ) ).x : 1.0f;
+
+  glm::vec3 normal = _fragment.mNormal;
+  if ( _material.mNormalMap )
+  {
+    float lod = GetLod( *_material.mNormalMap, dx, dy );
+    glm::vec3 normalmap = glm::vec3( Sample( *_material.mNormalMap, texcoord, lod ) ) * 2.0f - glm::vec3( 1.0f );
+    float normalmapLength = glm::length( normalmap );
+    normalmap /= normalmapLength;
+
+    glm::vec3 bi = glm::cross( _fragment.mNormal, _fragment.mTangent );
+    normal = normalmap.x * _fragment.mTangent + normalmap.y * bi + normalmap.z * _fragment.mNormal;
+
+    // Minified normal maps with a lot of variation turn rough
+    float variation = 1.0f - powf( normalmapLength, 8.0f );
+    float minification = std::min( std::max( lod - 2.0f, 0.0f ), 1.0f );
+    roughness = roughness + ( 1.0f - roughness ) * variation * minification;
+  }
+  normal = glm::normalize( normal );
+
+  glm::vec3 N = normal;
+  glm::vec3 V = glm::normalize( _cameraPosition - _fragment.mWorld );
+  glm::vec3 F0 = glm::mix( glm::vec3( 0.04f ), baseColor, metallic );
+
+  glm::vec3 ambient = _material.mAmbientMap ? glm::vec3( Sample( *_material.mAmbientMap, texcoord, GetLod( *_material.mAmbientMap, dx, dy ) ) ) : _material.mAmbient;
+  glm::vec3 Lo( 0.0f );
+
+  if ( !_settings.mSky )
+  {
+    for ( int i = 0; i < 3; i++ )
+    {
+      glm::vec3 L = -glm::normalize( _settings.mLights[ i ].mDirection );
+      glm::vec3 H = glm::normalize( V + L );
+
+      glm::vec3 F = FresnelSchlick( H, V, F0 );
+      glm::vec3 kD = ( glm::vec3( 1.0f ) - F ) * ( 1.0f - metallic );
+
+      float D = DistributionGGX( N, H, roughness );
+      float G = GeometrySmith( N, V, L, roughness );
+      float denom = 4.0f * std::max( 0.0f, glm::dot( N, V ) ) * std::max( 0.0f, glm::dot( N, L ) );
+      glm::vec3 specular = F * ( D * F * G / std::max( 0.001f, denom ) );
+
+      float NdotL = std::max( 0.0f, glm::dot( N, L ) );
+      Lo += ( kD * ( baseColor / PI ) + specular ) * _settings.mLights[ i ].mColor * NdotL;
+    }
+  }
+  else
+  {
+    glm::vec3 irradiance = SampleIrradiance( _settings, normal );
+    glm::vec3 F = FresnelSchlickRoughness( N, V, F0, roughness );
+    glm::vec3 kD = ( glm::vec3( 1.0f ) - F ) * ( 1.0f - metallic );
+    glm::vec3 diffuseAmbient = irradiance * baseColor;
+    glm::vec3 specularAmbient = SpecularIBL( _settings, V, normal, roughness, F );
+    ambient = ao * ( kD * diffuseAmbient + specularAmbient );
+  }
+
+  return ambient + Lo;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Tiles
+
+// Depth tests one triangle against the tile and keeps its ID where it's in front
+void RasterizeTriangle( const Triangle & _triangle, uint32_t _id, int _tileX, int _tileY, float * _depth, uint32_t * _ids )
+{
+  int minX = std::max( _triangle.mMinX, _tileX );
+  int maxX = std::min( _triangle.mMaxX, _tileX + TILE_SIZE - 1 );
+  int minY = std::max( _triangle.mMinY, _tileY );
+  int maxY = std::min( _triangle.mMaxY, _tileY + TILE_SIZE - 1 );
+
+  for ( int y = minY; y <= maxY; y++ )
+  {
+    float centerY = y + 0.5f;
+    float rowEdges[ 3 ];
+    for ( int i = 0; i < 3; i++ )
+    {
+      rowEdges[ i ] = _triangle.mEdgeB[ i ] * centerY + _triangle.mEdgeC[ i ];
+    }
+    float rowDepth = _triangle.mDepthB * centerY + _triangle.mDepthC;
+    float * depth = _depth + ( y - _tileY ) * TILE_SIZE;
+    uint32_t * ids = _ids + ( y - _tileY ) * TILE_SIZE;
+
+    int x = minX;
+#ifdef RASTERIZER_SSE
+    // The buffers have 4 spare pixels at the end, so the last group of a row can run over
+    const __m128 laneOffsets = _mm_set_ps( 3.5f, 2.5f, 1.5f, 0.5f );
+    const __m128i lanes = _mm_set_epi32( 3, 2, 1, 0 );
+    const __m128i end = _mm_set1_epi32( maxX + 1 );
+    const __m128i id = _mm_set1_epi32( (int) _id );
+    for ( ; x <= maxX; x += 4 )
+    {
+      __m128 centerX = _mm_add_ps( _mm_set1_ps( (float) x ), laneOffsets );
+      __m128 inside = _mm_castsi128_ps( _mm_cmplt_epi32( _mm_add_epi32( _mm_set1_epi32( x ), lanes ), end ) );
+      for ( int i = 0; i < 3; i++ )
+      {
+        __m128 edge = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( _triangle.mEdgeA[ i ] ), centerX ), _mm_set1_ps( rowEdges[ i ] ) );
+        inside = _mm_and_ps( inside, _mm_cmpge_ps( edge, _mm_setzero_ps() ) );
+      }
+      __m128 z = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( _triangle.mDepthA ), centerX ), _mm_set1_ps( rowDepth ) );
+      __m128 oldZ = _mm_loadu_ps( depth + x - _tileX );
+      __m128 pass = _mm_and_ps( inside, _mm_cmplt_ps( z, oldZ ) );
+      if ( !_mm_movemask_ps( pass ) )
+      {
+        continue;
+      }
+      _mm_storeu_ps( depth + x - _tileX, _mm_or_ps( _mm_and_ps( pass, z ), _mm_andnot_ps( pass, oldZ ) ) );
+      __m128i passBits = _mm_castps_si128( pass );
+      __m128i oldIds = _mm_loadu_si128( (const __m128i *) ( ids + x - _tileX ) );
+      _mm_storeu_si128( (__m128i *) ( ids + x - _tileX ), _mm_or_si128( _mm_and_si128( passBits, id ), _mm_andnot_si128( passBits, oldIds ) ) );
+    }
+#else
+    for ( ; x <= maxX; x++ )
+    {
+      float centerX = x + 0.5f;
+      bool inside = true;
+      for ( int i = 0; i < 3; i++ )
+      {
+        inside = inside && _triangle.mEdgeA[ i ] * centerX + rowEdges[ i ] >= 0.0f;
+      }
+      float z = _triangle.mDepthA * centerX + rowDepth;
+      if ( inside && z < depth[ x - _tileX ] )
+      {
+        depth[ x - _tileX ] = z;
+        ids[ x - _tileX ] = _id;
+      }
+    }
+#endif
+  }
+}
+
+int RenderTile( const Model * _model, const Frame & _frame, int _tile, const glm::vec3 & _cameraPosition, const glm::mat4x4 & _viewProjectionInverse, unsigned char * _rgba )
+{
+  const Settings & settings = *_frame.mSettings;
+  int tileX = ( _tile % _frame.mTilesX ) * TILE_SIZE;
+  int tileY = ( _tile / _frame.mTilesX ) * TILE_SIZE;
+  int width = std::min( TILE_SIZE, settings.mWidth - tileX );
+  int height = std::min( TILE_SIZE, settings.mHeight - tileY );
+
+  // Visibility first, shading after, so every pixel is shaded once
+  float depth[ TILE_SIZE * TILE_SIZE + 4 ];
+  uint32_t ids[ TILE_SIZE * TILE_SIZE + 4 ];
+  std::fill( depth, depth + TILE_SIZE * TILE_SIZE + 4, 1.0f );
+  std::fill( ids, ids + TILE_SIZE * TILE_SIZE + 4, NO_TRIANGLE );
+
+  uint32_t firstId = 0;
+  for ( int c = 0; c < _frame.mChunks.size(); c++ )
+  {
+    const TriangleChunk & chunk = _frame.mChunks[ c ];
+    const std::vector<int> & bin = chunk.mBins[ _tile ];
+    for ( int i = 0; i < bin.size(); i++ )
+    {
+      RasterizeTriangle( chunk.mTriangles[ bin[ i ] ], firstId + bin[ i ], tileX, tileY, depth, ids );
+    }
+    firstId += (uint32_t) chunk.mTriangles.size();
+  }
+
+  int shaded = 0;
+  for ( int y = 0; y < height; y++ )
+  {
+    for ( int x = 0; x < width; x++ )
+    {
+      int pixelX = tileX + x;
+      int pixelY = tileY + y;
+      unsigned char * out = _rgba + ( pixelY * settings.mWidth + pixelX ) * 4;
+      uint32_t id = ids[ y * TILE_SIZE + x ];
+      if ( id != NO_TRIANGLE )
+      {
+        const Triangle & triangle = *_frame.mTriangles[ id ];
+        Fragment fragment;
+        Interpolate( triangle, pixelX + 0.5f, pixelY + 0.5f, fragment );
+        glm::vec3 color = ShadeFragment( settings, _cameraPosition, *triangle.mMaterial, fragment );
+        WritePixel( color, ( -1.0f / 256.0f ) + ( 2.0f / 256.0f ) * Dither( pixelX, pixelY, settings ), out );
+        shaded++;
+      }
+      else if ( settings.mSky && settings.mDrawSky )
+      {
+        // The view ray through the pixel, from the near to the far plane
+        float ndcX = ( pixelX + 0.5f ) / settings.mWidth * 2.0f - 1.0f;
+        float ndcY = 1.0f - ( pixelY + 0.5f ) / settings.mHeight * 2.0f;
+        glm::vec4 nearPoint = _viewProjectionInverse * glm::vec4( ndcX, ndcY, -1.0f, 1.0f );
+        glm::vec4 farPoint = _viewProjectionInverse * glm::vec4( ndcX, ndcY, 1.0f, 1.0f );
+        glm::vec3 dir = glm::vec3( farPoint ) / farPoint.w - glm::vec3( nearPoint ) / nearPoint.w;
+
+        glm::vec3 sky = SampleSky( settings, dir, settings.mSkyBlur );
+        glm::vec3 color = glm::mix( glm::vec3( settings.mBackgroundColor ), sky, settings.mSkyOpacity ) * settings.mExposure;
+        WritePixel( color, ( -1.5f / 256.0f ) + ( 3.0f / 256.0f ) * Dither( pixelX, pixelY, settings ), out );
+      }
+      else
+      {
+        for ( int i = 0; i < 4; i++ )
+        {
+          out[ i ] = (unsigned char) ( std::min( std::max( settings.mBackgroundColor[ i ], 0.0f ), 1.0f ) * 255.0f + 0.5f );
+        }
+      }
+    }
+  }
+  return shaded;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interface
+
+Model * Prepare( const Geometry & _geometry )
+{
+  if ( !_geometry.mStaging )
+  {
+    printf( "[Rasterizer] The model has to be imported, but not uploaded\n" );
+    return NULL;
+  }
+
+  Model * model = new Model();
+  model->mGeometry = &_geometry;
+
+  // Meshes without a material get the zero constants, the same as from Geometry::BindMaterial()
+  Material & fallback = model->mDefaultMaterial;
+  fallback.mBaseColorMap = NULL;
+  fallback.mRoughnessMap = NULL;
+  fallback.mMetallicMap = NULL;
+  fallback.mNormalMap = NULL;
+  fallback.mAOMap = NULL;
+  fallback.mAmbientMap = NULL;
+  fallback.mBaseColor = glm::vec3( 0.0f );
+  fallback.mRoughness = 0.0f;
+  fallback.mMetallic = 0.0f;
+  fallback.mAmbient = glm::vec3( 0.0f );
+
+  // Textures shared between materials are only prepared once
+  std::map<const Renderer::Image *, Texture *> textures;
+  for ( std::map<int, Geometry::Material>::const_iterator it = _geometry.mMaterials.begin(); it != _geometry.mMaterials.end(); it++ )
+  {
+    const Geometry::Material & source = it->second;
+    Material material;
+    material.mBaseColorMap = GetTexture( model, textures, source.mColorMapAlbedo.mImage ? source.mColorMapAlbedo : source.mColorMapDiffuse );
+    material.mRoughnessMap = GetTexture( model, textures, source.mColorMapRoughness );
+    material.mMetallicMap = GetTexture( model, textures, source.mColorMapMetallic );
+    material.mNormalMap = GetTexture( model, textures, source.mColorMapNormals );
+    material.mAOMap = GetTexture( model, textures, source.mColorMapAO.mImage ? source.mColorMapAO : source.mColorMapAmbient );
+    material.mAmbientMap = GetTexture( model, textures, source.mColorMapAmbient );
+    material.mBaseColor = glm::vec3( source.mColorMapDiffuse.mColor );
+    material.mRoughness = source.mColorMapRoughness.mColor.x;
+    material.mMetallic = source.mColorMapMetallic.mColor.x;
+    material.mAmbient = glm::vec3( source.mColorMapAmbient.mColor );
+    model->mMaterials[ it->first ] = material;
+  }
+
+  std::vector<Texture *> & prepared = model->mTextures;
+  Parallel::For( (int) prepared.size(), [ & ]( int _index )
+  {
+    BuildMipChain( *prepared[ _index ] );
+  } );
+  printf( "[Rasterizer] Prepared %d materials, %d textures\n", (int) model->mMaterials.size(), (int) prepared.size() );
+
+  return model;
+}
+
+void Release( Model * _model )
+{
+  if ( !_model )
+  {
+    return;
+  }
+  for ( int i = 0; i < _model->mTextures.size(); i++ )
+  {
+    delete _model->mTextures[ i ];
+  }
+  delete _model;
+}
+
+void Render( const Model * _model, const Settings & _settings, unsigned char * _rgba, Statistics & _statistics )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int threadCount = _settings.mThreadCount > 0 ? _settings.mThreadCount : Parallel::GetThreadCount();
+  const Geometry & geometry = *_model->mGeometry;
+  const Geometry::Staging & staging = *geometry.mStaging;
+
+  Frame frame;
+  frame.mSettings = &_settings;
+  frame.mTilesX = ( _settings.mWidth + TILE_SIZE - 1 ) / TILE_SIZE;
+  frame.mTilesY = ( _settings.mHeight + TILE_SIZE - 1 ) / TILE_SIZE;
+
+  // Every instance of every mesh, in the order Geometry::Render() draws them
+  int vertexCount = 0;
+  frame.mTriangleCount = 0;
+  for ( std::map<int, Geometry::Mesh>::const_iterator it = geometry.mMeshes.begin(); it != geometry.mMeshes.end(); it++ )
+  {
+    const Geometry::Mesh & mesh = it->second;
+    std::map<int, Material>::const_iterator material = _model->mMaterials.find( mesh.mMaterialIndex );
+    for ( int i = 0; i < mesh.mInstanceCount; i++ )
+    {
+      Draw draw;
+      draw.mMesh = &mesh;
+      draw.mMaterial = material != _model->mMaterials.end() ? &material->second : &_model->mDefaultMaterial;
+      // Like in pbr.vs: the instance's node transform, followed by the model root transform
+      draw.mWorld = staging.mInstanceMatrices[ mesh.mFirstInstance + i ] * _settings.mWorldRoot;
+      draw.mFirstVertex = vertexCount;
+      draw.mFirstTriangle = frame.mTriangleCount;
+      frame.mDraws.push_back( draw );
+      vertexCount += mesh.mVertexCount;
+      frame.mTriangleCount += mesh.mTriangleCount;
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+  // Vertices
+
+  glm::mat4x4 viewProjection = _settings.mProjection * _settings.mView;
+  std::vector< std::pair<int, int> > vertexChunks; // draw and first vertex
+  for ( int i = 0; i < frame.mDraws.size(); i++ )
+  {
+    for ( int first = 0; first < frame.mDraws[ i ].mMesh->mVertexCount; first += VERTEX_CHUNK_SIZE )
+    {
+      vertexChunks.push_back( std::make_pair( i, first ) );
+    }
+  }
+  frame.mVertices.resize( vertexCount );
+  Parallel::For( (int) vertexChunks.size(), threadCount, [ & ]( int _index )
+  {
+    const Draw & draw = frame.mDraws[ vertexChunks[ _index ].first ];
+    int first = vertexChunks[ _index ].second;
+    int count = std::min( VERTEX_CHUNK_SIZE, draw.mMesh->mVertexCount - first );
+    TransformVertices( _model, viewProjection, draw, first, count, &frame.mVertices[ draw.mFirstVertex + first ] );
+  } );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Triangle setup and binning
+
+  int tileCount = frame.mTilesX * frame.mTilesY;
+  frame.mChunks.resize( ( frame.mTriangleCount + TRIANGLE_CHUNK_SIZE - 1 ) / TRIANGLE_CHUNK_SIZE );
+  Parallel::For( (int) frame.mChunks.size(), threadCount, [ & ]( int _index )
+  {
+    TriangleChunk & chunk = frame.mChunks[ _index ];
+    chunk.mBins.resize( tileCount );
+    int first = _index * TRIANGLE_CHUNK_SIZE;
+    SetupTriangles( _model, frame, first, std::min( TRIANGLE_CHUNK_SIZE, frame.mTriangleCount - first ), chunk );
+  } );
+
+  // The IDs in the visibility buffer number the triangles chunk after chunk
+  for ( int c = 0; c < frame.mChunks.size(); c++ )
+  {
+    for ( int i = 0; i < frame.mChunks[ c ].mTriangles.size(); i++ )
+    {
+      frame.mTriangles.push_back( &frame.mChunks[ c ].mTriangles[ i ] );
+    }
+  }
+
+  std::chrono::steady_clock::time_point geometryEnd = std::chrono::steady_clock::now();
+
+  //////////////////////////////////////////////////////////////////////////
+  // Tiles
+
+  glm::mat4x4 viewInverse = glm::inverse( _settings.mView );
+  glm::vec3 cameraPosition( viewInverse[ 3 ] );
+  glm::mat4x4 viewProjectionInverse = glm::inverse( viewProjection );
+
+  std::atomic<int> shaded( 0 );
+  Parallel::For( tileCount, threadCount, [ & ]( int _tile )
+  {
+    shaded += RenderTile( _model, frame, _tile, cameraPosition, viewProjectionInverse, _rgba );
+  } );
+
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+  _statistics.mTriangles = frame.mTriangleCount;
+  _statistics.mTrianglesDrawn = (int) frame.mTriangles.size();
+  _statistics.mPixelsShaded = shaded;
+  _statistics.mGeometryTime = std::chrono::duration<double, std::milli>( geometryEnd - start ).count();
+  _statistics.mRasterTime = std::chrono::duration<double, std::milli>( end - geometryEnd ).count();
+}
+
+void GetSurface( const Model * _model, int _materialIndex, const glm::vec2 & _texcoord, float _lod, Surface & _surface )
+{
+  std::map<int, Material>::const_iterator it = _model->mMaterials.find( _materialIndex );
+  const Material & material = it != _model->mMaterials.end() ? it->second : _model->mDefaultMaterial;
+
+  _surface.mBaseColor = material.mBaseColorMap ? glm::vec3( Sample( *material.mBaseColorMap, _texcoord, _lod ) ) : material.mBaseColor;
+  _surface.mRoughness = material.mRoughnessMap ? Sample( *material.mRoughnessMap, _texcoord, _lod ).x : material.mRoughness;
+  _surface.mMetallic = material.mMetallicMap ? Sample( *material.mMetallicMap, _texcoord, _lod ).x : material.mMetallic;
+  _surface.mAO = material.mAOMap ? Sample( *material.mAOMap, _texcoord, _lod ).x : 1.0f;
+  _surface.mHasNormalMap = material.mNormalMap != NULL;
+  _surface.mNormal = glm::vec3( 0.0f, 0.0f, 1.0f );
+  if ( material.mNormalMap )
+  {
+    _surface.mNormal = glm::normalize( glm::vec3( Sample( *material.mNormalMap, _texcoord, _lod ) ) * 2.0f - glm::vec3( 1.0f ) );
+  }
+}
+
+}
@@ -0,0 +1,73 @@
+#include <stdint.h>
+
+// Renders models without a GPU: an imported model is drawn straight from its staging buffers (see
+// Geometry::ImportMesh()) with the lighting of Shaders/pbr.fs and the sky of Skyboxes/skysphere.fs, so the
+// result matches the GL view. Triangles are binned into screen tiles, and the tiles are rasterized 4 pixels
+// at a time and shaded in parallel.
+namespace Rasterizer
+{
+  struct Light
+  {
+    glm::vec3 mDirection;
+    glm::vec3 mColor;
+  };
+
+  struct Settings
+  {
+    int mWidth;
+    int mHeight;
+    int mThreadCount; // one per core if 0
+
+    glm::mat4x4 mWorldRoot;
+    glm::mat4x4 mView;
+    glm::mat4x4 mProjection;
+
+    // Only used without a sky, like in pbr.fs
+    Light mLights[ 3 ];
+
+    const SkyPrefilter::Result * mSky; // lit by mLights and a flat background if NULL
+    bool mDrawSky; // mBackgroundColor behind the model otherwise, the sky still lights it
+    float mSkyRotation;
+    float mSkyBlur;
+    float mSkyOpacity;
+    float mExposure;
+    glm::vec4 mBackgroundColor;
+
+    const float * mBrdfLookupTable; // RG floats, mBrdfLookupTableSize x mBrdfLookupTableSize; required with a sky
+    int mBrdfLookupTableSize;
+
+    uint32_t mFrameCount; // seeds the dither
+  };
+
+  struct Statistics
+  {
+    int mTriangles; // submitted, instances included
+    int mTrianglesDrawn; // left after clipping and culling
+    int mPixelsShaded; // covered by the model
+    double mGeometryTime; // milliseconds spent on vertices, setup and binning
+    double mRasterTime; // and on the tiles
+  };
+
+  struct Model;
+
+  // Builds what rendering needs on top of an imported model, e.g. the mip chains of its textures; _geometry
+  // has to stay imported (not uploaded) and alive as long as the result is used
+  Model * Prepare( const Geometry & _geometry );
+  void Release( Model * _model );
+
+  // Renders a frame into _rgba, mWidth * mHeight RGBA8 pixels, top row first
+  void Render( const Model * _model, const Settings & _settings, unsigned char * _rgba, Statistics & _statistics );
+
+  // The material inputs of pbr.fs at a point of a surface with one of the model's materials: sampled from its maps
+  // at mip level _lod, or its constants. For other renderers of the same model (see PathTracer).
+  struct Surface
+  {
+    glm::vec3 mBaseColor;
+    float mRoughness;
+    float mMetallic;
+    float mAO;
+    bool mHasNormalMap;
+    glm::vec3 mNormal; // tangent space, normalized
+  };
+  void GetSurface( const Model * _model, int _materialIndex, const glm::vec2 & _texcoord, float _lod, Surface & _surface );
+}
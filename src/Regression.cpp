@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "Regression.h"
+#include "Capture.h"
+
+#include "stb_image.h"
+#include <jsonxx.h>
+
+namespace Regression
+{
+
+// CIE76 distance between colors that are just about told apart
+const float JUST_NOTICEABLE_DIFFERENCE = 2.3f;
+// The baseline is the median of this many of the last passing runs, so one noisy run doesn't move it much
+const int BASELINE_RUNS = 5;
+// Milliseconds any timing may be off by regardless of the threshold, for timings too short to measure reliably
+const double TIMING_SLACK = 0.1;
+
+void GetFrameTimes( std::vector<double> _frameTimes, Timings & _timings )
+{
+  if ( _frameTimes.empty() )
+  {
+    _timings.mMedianFrameTime = 0.0;
+    _timings.mP99FrameTime = 0.0;
+    return;
+  }
+  std::sort( _frameTimes.begin(), _frameTimes.end() );
+  _timings.mMedianFrameTime = _frameTimes[ _frameTimes.size() / 2 ];
+  _timings.mP99FrameTime = _frameTimes[ std::min( (size_t) ceil( _frameTimes.size() * 0.99 ) - 1, _frameTimes.size() - 1 ) ];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Images
+
+// sRGB pixels to CIE L*a*b* (D65)
+void ToLab( const unsigned char * _rgba, int _count, std::vector<float> & _lab )
+{
+  float linear[ 256 ];
+  for ( int i = 0; i < 256; i++ )
+  {
+    float value = i / 255.0f;
+    linear[ i ] = value <= 0.04045f ? value / 12.92f : powf( ( value + 0.055f ) / 1.055f, 2.4f );
+  }
+
+  _lab.resize( _count * 3 );
+  for ( int i = 0; i < _count; i++ )
+  {
+    float r = linear[ _rgba[ i * 4 + 0 ] ];
+    float g = linear[ _rgba[ i * 4 + 1 ] ];
+    float b = linear[ _rgba[ i * 4 + 2 ] ];
+    float xyz[ 3 ] =
+    {
+      ( 0.4124f * r + 0.3576f * g + 0.1805f * b ) / 0.95047f,
+      0.2126f * r + 0.7152f * g + 0.0722f * b,
+      ( 0.0193f * r + 0.1192f * g + 0.9505f * b ) / 1.08883f,
+    };
+    for ( int j = 0; j < 3; j++ )
+    {
+      xyz[ j ] = xyz[ j ] > 0.008856f ? cbrtf( xyz[ j ] ) : 7.787f * xyz[ j ] + 16.0f / 116.0f;
+    }
+    _lab[ i * 3 + 0 ] = 116.0f * xyz[ 1 ] - 16.0f;
+    _lab[ i * 3 + 1 ] = 500.0f * ( xyz[ 0 ] - xyz[ 1 ] );
+    _lab[ i * 3 + 2 ] = 200.0f * ( xyz[ 1 ] - xyz[ 2 ] );
+  }
+}
+
+bool CompareImage( const char * _goldenPath, const char * _diffPath, int _width, int _height, const unsigned char * _rgba, float _tolerance )
+{
+  int width = 0;
+  int height = 0;
+  int comp = 0;
+  unsigned char * golden = stbi_load( _goldenPath, &width, &height, &comp, STBI_rgb_alpha );
+  if ( !golden )
+  {
+    printf( "[Regression] No golden image at '%s' yet, this render becomes it\n", _goldenPath );
+    return Capture::WritePNG( _goldenPath, _width, _height, _rgba );
+  }
+  if ( width != _width || height != _height )
+  {
+    printf( "[Regression] The golden image is %dx%d, the render %dx%d\n", width, height, _width, _height );
+    stbi_image_free( golden );
+    return false;
+  }
+
+  std::vector<float> goldenLab;
+  std::vector<float> renderLab;
+  ToLab( golden, width * height, goldenLab );
+  ToLab( _rgba, width * height, renderLab );
+
+  const float threshold = JUST_NOTICEABLE_DIFFERENCE * JUST_NOTICEABLE_DIFFERENCE;
+  std::vector<bool> differs( width * height, false );
+  int differentCount = 0;
+  float maxDifference = 0.0f;
+  for ( int y = 0; y < height; y++ )
+  {
+    for ( int x = 0; x < width; x++ )
+    {
+      const float * render = &renderLab[ ( y * width + x ) * 3 ];
+      float closest = INFINITY;
+      for ( int neighbourY = std::max( y - 1, 0 ); neighbourY <= std::min( y + 1, height - 1 ); neighbourY++ )
+      {
+        for ( int neighbourX = std::max( x - 1, 0 ); neighbourX <= std::min( x + 1, width - 1 ); neighbourX++ )
+        {
+          const float * neighbour = &goldenLab[ ( neighbourY * width + neighbourX ) * 3 ];
+          float l = render[ 0 ] - neighbour[ 0 ];
+          float a = render[ 1 ] - neighbour[ 1 ];
+          float b = render[ 2 ] - neighbour[ 2 ];
+          closest = std::min( closest, l * l + a * a + b * b );
+        }
+      }
+      maxDifference = std::max( maxDifference, closest );
+      if ( closest > threshold )
+      {
+        differs[ y * width + x ] = true;
+        differentCount++;
+      }
+    }
+  }
+
+  float differentFraction = differentCount / (float) ( width * height );
+  bool passed = differentFraction <= _tolerance;
+  printf( "[Regression] %d pixels (%.3f%%) differ from '%s', the most by %.1f; %s\n", differentCount, differentFraction * 100.0f, _goldenPath,
+    sqrtf( maxDifference ), passed ? "passed" : "failed" );
+
+  // Differing pixels in red over a dimmed gray golden image
+  if ( !passed && _diffPath )
+  {
+    std::vector<unsigned char> diff( width * height * 4 );
+    for ( int i = 0; i < width * height; i++ )
+    {
+      unsigned char gray = (unsigned char) ( ( golden[ i * 4 + 0 ] + golden[ i * 4 + 1 ] + golden[ i * 4 + 2 ] ) / 3 / 3 );
+      diff[ i * 4 + 0 ] = differs[ i ] ? 255 : gray;
+      diff[ i * 4 + 1 ] = differs[ i ] ? 0 : gray;
+      diff[ i * 4 + 2 ] = differs[ i ] ? 0 : gray;
+      diff[ i * 4 + 3 ] = 255;
+    }
+    Capture::WritePNG( _diffPath, width, height, &diff[ 0 ] );
+  }
+
+  stbi_image_free( golden );
+  return passed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Timings
+
+struct Metric
+{
+  const char * mName;
+  double Timings::* mValue;
+};
+
+const Metric metrics[] =
+{
+  { "importMs", &Timings::mImportTime },
+  { "uploadMs", &Timings::mUploadTime },
+  { "medianFrameMs", &Timings::mMedianFrameTime },
+  { "p99FrameMs", &Timings::mP99FrameTime },
+};
+
+bool CheckTimings( const char * _historyPath, const Timings & _timings, float _maxSlowdown, bool _rebaseline )
+{
+  jsonxx::Object history;
+  FILE * file = fopen( _historyPath, "rb" );
+  if ( file )
+  {
+    std::string data;
+    char buffer[ 4096 ];
+    for ( size_t read = fread( buffer, 1, sizeof( buffer ), file ); read > 0; read = fread( buffer, 1, sizeof( buffer ), file ) )
+    {
+      data.append( buffer, read );
+    }
+    fclose( file );
+    if ( !history.parse( data ) )
+    {
+      printf( "[Regression] Couldn't parse the history in '%s', starting a new one\n", _historyPath );
+    }
+  }
+  jsonxx::Array runs = history.has<jsonxx::Array>( "runs" ) ? history.get<jsonxx::Array>( "runs" ) : jsonxx::Array();
+
+  // The most recent passing runs, newest first; none from before the last rebaseline
+  std::vector<const jsonxx::Object *> baselineRuns;
+  for ( int i = (int) runs.size() - 1; i >= 0 && baselineRuns.size() < BASELINE_RUNS; i-- )
+  {
+    if ( !runs.has<jsonxx::Object>( i ) )
+    {
+      continue;
+    }
+    const jsonxx::Object & run = runs.get<jsonxx::Object>( i );
+    if ( run.has<jsonxx::Boolean>( "passed" ) && run.get<jsonxx::Boolean>( "passed" ) )
+    {
+      baselineRuns.push_back( &run );
+    }
+    if ( run.has<jsonxx::Boolean>( "rebaseline" ) && run.get<jsonxx::Boolean>( "rebaseline" ) )
+    {
+      break;
+    }
+  }
+
+  bool passed = true;
+  for ( int i = 0; i < sizeof( metrics ) / sizeof( metrics[ 0 ] ); i++ )
+  {
+    const Metric & metric = metrics[ i ];
+    double value = _timings.*metric.mValue;
+    std::vector<double> values;
+    for ( int j = 0; j < baselineRuns.size(); j++ )
+    {
+      if ( baselineRuns[ j ]->has<jsonxx::Number>( metric.mName ) )
+      {
+        values.push_back( (double) baselineRuns[ j ]->get<jsonxx::Number>( metric.mName ) );
+      }
+    }
+    if ( values.empty() || value < 0.0 )
+    {
+      printf( "[Regression] %s: %.2f\n", metric.mName, value );
+      continue;
+    }
+    std::sort( values.begin(), values.end() );
+    double baseline = values[ values.size() / 2 ];
+    bool slower = value > baseline * ( 1.0 + _maxSlowdown ) + TIMING_SLACK;
+    printf( "[Regression] %s: %.2f, baseline %.2f (%+.1f%%)%s\n", metric.mName, value, baseline, baseline > 0.0 ? ( value / baseline - 1.0 ) * 100.0 : 0.0,
+      slower ? " - too slow" : "" );
+    passed = passed && !slower;
+  }
+  if ( _rebaseline )
+  {
+    printf( "[Regression] Rebaselining: these timings replace the previous runs as the baseline\n" );
+    passed = true;
+  }
+
+  char timestamp[ 32 ];
+  time_t now = time( NULL );
+  strftime( timestamp, sizeof( timestamp ), "%Y-%m-%d %H:%M:%S", localtime( &now ) );
+
+  jsonxx::Object run;
+  run << "time" << timestamp;
+  for ( int i = 0; i < sizeof( metrics ) / sizeof( metrics[ 0 ] ); i++ )
+  {
+    run << metrics[ i ].mName << _timings.*metrics[ i ].mValue;
+  }
+  run << "passed" << passed;
+  if ( _rebaseline )
+  {
+    run << "rebaseline" << true;
+  }
+  runs << run;
+  jsonxx::Object output;
+  output << "runs" << runs;
+
+  file = fopen( _historyPath, "wb" );
+  if ( !file )
+  {
+    printf( "[Regression] Failed to write '%s'\n", _historyPath );
+    return false;
+  }
+  std::string json = output.json();
+  fwrite( json.c_str(), 1, json.size(), file );
+  fclose( file );
+  return passed;
+}
+
+}
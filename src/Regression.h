@@ -0,0 +1,29 @@
+#include <vector>
+
+// Checks a headless render against a stored golden image and its timings against the run history next to it, so
+// shader and loader changes that alter the image or slow things down get caught (see FXTRN_REGRESSION_TESTS).
+namespace Regression
+{
+  struct Timings
+  {
+    double mImportTime; // milliseconds
+    double mUploadTime;
+    double mMedianFrameTime;
+    double mP99FrameTime;
+  };
+
+  // Median and 99th percentile of a set of frame times
+  void GetFrameTimes( std::vector<double> _frameTimes, Timings & _timings );
+
+  // Compares top-down RGBA8 pixels with the golden image; a pixel differs if no pixel of the golden image's 3x3
+  // neighbourhood around it is within a just noticeable difference (CIE76 in Lab), which forgives dither and
+  // one pixel shifts of edges. Passes if at most _tolerance (a fraction) of the pixels differ; otherwise the
+  // differing pixels are marked in _diffPath. A missing golden image is written from the pixels, and passes.
+  bool CompareImage( const char * _goldenPath, const char * _diffPath, int _width, int _height, const unsigned char * _rgba, float _tolerance );
+
+  // Appends the run to the JSON history at _historyPath. Fails if any timing is more than _maxSlowdown (a
+  // fraction) above the median of the last passing runs; the failing run is recorded but not used as a baseline.
+  // With _rebaseline the run passes regardless, and the runs before it stop counting towards the baseline, for
+  // after an intended slowdown.
+  bool CheckTimings( const char * _historyPath, const Timings & _timings, float _maxSlowdown, bool _rebaseline );
+}
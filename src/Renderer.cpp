@@ -1,9 +1,13 @@
 
 #include <cstdio>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/stat.h>
 #endif
 
 #define GLEW_NO_GLU
@@ -13,19 +17,118 @@
 #endif
 
 #include "Renderer.h"
+#include "HDRImage.h"
 #include <string.h>
 
 #include "stb_image.h"
 
+#ifdef FXTRN_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+// glewInit() without its GLX part: this GLEW's glxewInit() queries the GLX version of the current X display, which
+// crashes when there is none. Not declared by glew.h outside of GLEW_MX builds.
+extern "C" GLenum GLEWAPIENTRY glewContextInit( void );
+#endif
+
 namespace Renderer
 {
 
 GLFWwindow * mWindow = NULL;
 bool run = true;
 
+bool headless = false;
+GLuint headlessFramebuffer = 0;
+GLuint headlessColorBuffer = 0;
+GLuint headlessDepthBuffer = 0;
+
 int nWidth = 0;
 int nHeight = 0;
 
+bool supportsMultiDrawIndirect = false;
+bool supportsParallelShaderCompile = false;
+bool supportsProgramBinary = false;
+
+// Fullscreen passes take their positions from gl_VertexID, but the core profile still wants a vertex array bound
+GLuint fullscreenVertexArray = 0;
+
+#define SHADER_CACHE_DIRECTORY "ShaderCache"
+
+#define STATECACHE_UNKNOWN 0xFFFFFFFF
+#define STATECACHE_BUFFER_TARGETS 6
+#define STATECACHE_TEXTURE_TARGETS 3
+#define STATECACHE_TEXTURE_UNITS 32
+
+struct StateCache
+{
+  bool mValid;
+  unsigned int mProgram;
+  unsigned int mVertexArray;
+  unsigned int mBuffers[ STATECACHE_BUFFER_TARGETS ];
+  int mActiveTextureUnit;
+  unsigned int mTextures[ STATECACHE_TEXTURE_UNITS ][ STATECACHE_TEXTURE_TARGETS ];
+  bool mDepthTest;
+  unsigned int mDepthFunc;
+  bool mDepthMask;
+  bool mBlend;
+  unsigned int mBlendSrc;
+  unsigned int mBlendDst;
+  unsigned int mPolygonMode;
+  int mViewport[ 4 ];
+};
+
+StateCache stateCache = { false };
+StateStatistics stateStatistics = { 0, 0, 0 };
+StateStatistics lastFrameStateStatistics = { 0, 0, 0 };
+
+enum COMMANDTYPE
+{
+  COMMANDTYPE_BIND_PROGRAM = 0,
+  COMMANDTYPE_BIND_VERTEX_ARRAY,
+  COMMANDTYPE_BIND_BUFFER,
+  COMMANDTYPE_BIND_TEXTURE,
+  COMMANDTYPE_UNIFORM_1I,
+  COMMANDTYPE_UNIFORM_1UI,
+  COMMANDTYPE_UNIFORM_FLOATS,
+  COMMANDTYPE_DRAW_ELEMENTS,
+  COMMANDTYPE_DRAW_ELEMENTS_INSTANCED,
+  COMMANDTYPE_MULTI_DRAW_ELEMENTS_INDIRECT,
+  COMMANDTYPE_RENDER_FULLSCREEN_QUAD,
+};
+
+CommandList * recordingCommandList = NULL;
+
+void RecordCommand( unsigned char _type, unsigned int _object, int _param0 = 0, int _param1 = 0, int _param2 = 0 )
+{
+  if ( !recordingCommandList )
+  {
+    return;
+  }
+
+  CommandList::Command command;
+  command.mType = _type;
+  command.mObject = _object;
+  command.mParams[ 0 ] = _param0;
+  command.mParams[ 1 ] = _param1;
+  command.mParams[ 2 ] = _param2;
+  recordingCommandList->mCommands.push_back( command );
+}
+
+void RecordUniform( unsigned int _program, int _location, const float * _values, int _count )
+{
+  if ( !recordingCommandList )
+  {
+    return;
+  }
+
+  int offset = (int) recordingCommandList->mData.size();
+  recordingCommandList->mData.insert( recordingCommandList->mData.end(), _values, _values + _count );
+  RecordCommand( COMMANDTYPE_UNIFORM_FLOATS, _program, _location, offset, _count );
+}
+
 static void error_callback( int error, const char * description )
 {
   switch ( error )
@@ -44,7 +147,7 @@ void mouse_button_callback( GLFWwindow * window, int button, int action, int mod
 void scroll_callback( GLFWwindow * window, double xoffset, double yoffset );
 void drop_callback( GLFWwindow * window, int path_count, const char * paths[] );
 
-bool Open( RENDERER_SETTINGS * _settings )
+bool OpenWindow( RENDERER_SETTINGS * _settings )
 {
   glfwSetErrorCallback( error_callback );
 
@@ -59,9 +162,6 @@ bool Open( RENDERER_SETTINGS * _settings )
   }
   printf( "[GLFW] Version String: %s\n", glfwGetVersionString() );
 
-  nWidth = _settings->mWidth;
-  nHeight = _settings->mHeight;
-
   glfwWindowHint( GLFW_RED_BITS, 8 );
   glfwWindowHint( GLFW_GREEN_BITS, 8 );
   glfwWindowHint( GLFW_BLUE_BITS, 8 );
@@ -92,7 +192,10 @@ bool Open( RENDERER_SETTINGS * _settings )
   // Prevent fullscreen window minimize on focus loss
   glfwWindowHint( GLFW_AUTO_ICONIFY, GL_FALSE );
 
-  GLFWmonitor * monitor = _settings->mWindowMode == RENDERER_WINDOWMODE_FULLSCREEN ? glfwGetPrimaryMonitor() : NULL;
+  // A headless run without EGL still gets a window, it's just never shown
+  glfwWindowHint( GLFW_VISIBLE, headless ? GLFW_FALSE : GLFW_TRUE );
+
+  GLFWmonitor * monitor = _settings->mWindowMode == RENDERER_WINDOWMODE_FULLSCREEN && !headless ? glfwGetPrimaryMonitor() : NULL;
 
   mWindow = glfwCreateWindow( nWidth, nHeight, "FOXOTRON is a thing", monitor, NULL );
   if ( !mWindow )
@@ -129,24 +232,236 @@ bool Open( RENDERER_SETTINGS * _settings )
   }
 #endif
 
+  return true;
+}
+
+#ifdef FXTRN_EGL
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+EGLSurface eglSurface = EGL_NO_SURFACE;
+
+void CloseEGLContext()
+{
+  if ( eglDisplay == EGL_NO_DISPLAY )
+  {
+    return;
+  }
+  eglMakeCurrent( eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+  if ( eglSurface != EGL_NO_SURFACE )
+  {
+    eglDestroySurface( eglDisplay, eglSurface );
+    eglSurface = EGL_NO_SURFACE;
+  }
+  if ( eglContext != EGL_NO_CONTEXT )
+  {
+    eglDestroyContext( eglDisplay, eglContext );
+    eglContext = EGL_NO_CONTEXT;
+  }
+  eglTerminate( eglDisplay );
+  eglDisplay = EGL_NO_DISPLAY;
+}
+
+// A context without any window system: Mesa's surfaceless platform when it's there (no X or Wayland needed,
+// which is what llvmpipe on a render node wants), otherwise the default display with a dummy pbuffer
+bool OpenEGLContext()
+{
+  const char * clientExtensions = eglQueryString( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+  if ( getPlatformDisplay && clientExtensions && strstr( clientExtensions, "EGL_MESA_platform_surfaceless" ) )
+  {
+    eglDisplay = getPlatformDisplay( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+  }
+  if ( eglDisplay == EGL_NO_DISPLAY )
+  {
+    eglDisplay = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+  }
+
+  EGLint major = 0;
+  EGLint minor = 0;
+  if ( eglDisplay == EGL_NO_DISPLAY || !eglInitialize( eglDisplay, &major, &minor ) )
+  {
+    printf( "[EGL] No display available\n" );
+    eglDisplay = EGL_NO_DISPLAY;
+    return false;
+  }
+  printf( "[EGL] Version %d.%d (%s)\n", major, minor, eglQueryString( eglDisplay, EGL_VENDOR ) );
+
+  const char * displayExtensions = eglQueryString( eglDisplay, EGL_EXTENSIONS );
+  bool surfaceless = displayExtensions && strstr( displayExtensions, "EGL_KHR_surfaceless_context" );
+
+  const EGLint configAttributes[] =
+  {
+    EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint configCount = 0;
+  if ( !eglChooseConfig( eglDisplay, configAttributes, &config, 1, &configCount ) || !configCount || !eglBindAPI( EGL_OPENGL_API ) )
+  {
+    printf( "[EGL] No desktop OpenGL config\n" );
+    CloseEGLContext();
+    return false;
+  }
+
+  const EGLint contextAttributes[] =
+  {
+    EGL_CONTEXT_MAJOR_VERSION_KHR, 4,
+    EGL_CONTEXT_MINOR_VERSION_KHR, 1,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+    EGL_NONE
+  };
+  eglContext = eglCreateContext( eglDisplay, config, EGL_NO_CONTEXT, contextAttributes );
+  if ( eglContext == EGL_NO_CONTEXT )
+  {
+    printf( "[EGL] OpenGL 4.1 (the minimum requirement) is not available\n" );
+    CloseEGLContext();
+    return false;
+  }
+
+  if ( !surfaceless )
+  {
+    const EGLint pbufferAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    eglSurface = eglCreatePbufferSurface( eglDisplay, config, pbufferAttributes );
+  }
+  if ( !eglMakeCurrent( eglDisplay, eglSurface, eglSurface, eglContext ) )
+  {
+    printf( "[EGL] Making the context current failed\n" );
+    CloseEGLContext();
+    return false;
+  }
+
+  // The entry points GLEW looks up through GLX are dispatch stubs that follow whichever context is current, EGL's
+  // too. Only the GL part is initialized: there's no X display for the GLX extensions, and glewInit() would crash
+  // asking it for its version.
+  glewExperimental = GL_TRUE;
+  GLenum err = glewContextInit();
+  if ( GLEW_OK != err )
+  {
+    printf( "[EGL] glewContextInit failed: %s\n", glewGetErrorString( err ) );
+    CloseEGLContext();
+    return false;
+  }
+  glGetError(); // reset glew error
+
+  return true;
+}
+#endif
+
+bool OpenHeadlessContext( RENDERER_SETTINGS * _settings )
+{
+#ifdef FXTRN_EGL
+  if ( OpenEGLContext() )
+  {
+    return true;
+  }
+  printf( "[Renderer] Falling back to a hidden window\n" );
+#endif
+  return OpenWindow( _settings );
+}
+
+// Stands in for the default framebuffer, so everything renders exactly as it would into a window
+bool CreateHeadlessFramebuffer()
+{
+  glGenRenderbuffers( 1, &headlessColorBuffer );
+  glBindRenderbuffer( GL_RENDERBUFFER, headlessColorBuffer );
+  glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA8, nWidth, nHeight );
+
+  glGenRenderbuffers( 1, &headlessDepthBuffer );
+  glBindRenderbuffer( GL_RENDERBUFFER, headlessDepthBuffer );
+  glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, nWidth, nHeight );
+
+  glGenFramebuffers( 1, &headlessFramebuffer );
+  glBindFramebuffer( GL_FRAMEBUFFER, headlessFramebuffer );
+  glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headlessColorBuffer );
+  glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, headlessDepthBuffer );
+
+  if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+  {
+    printf( "[Renderer] Offscreen framebuffer is incomplete\n" );
+    return false;
+  }
+  return true;
+}
+
+bool Open( RENDERER_SETTINGS * _settings )
+{
+  headless = _settings->mHeadless;
+
+  nWidth = _settings->mWidth;
+  nHeight = _settings->mHeight;
+
+  if ( !( headless ? OpenHeadlessContext( _settings ) : OpenWindow( _settings ) ) )
+  {
+    return false;
+  }
+
   printf( "[GLFW] OpenGL Version %s, GLSL %s\n", glGetString( GL_VERSION ), glGetString( GL_SHADING_LANGUAGE_VERSION ) );
 
-  // Now, since OpenGL is behaving a lot in fullscreen modes, lets collect the real obtained size!
-  printf( "[GLFW] Requested framebuffer size: %d x %d\n", nWidth, nHeight );
-  int fbWidth = 1;
-  int fbHeight = 1;
-  glfwGetFramebufferSize( mWindow, &fbWidth, &fbHeight );
-  nWidth = _settings->mWidth = fbWidth;
-  nHeight = _settings->mHeight = fbHeight;
-  printf( "[GLFW] Obtained framebuffer size: %d x %d\n", fbWidth, fbHeight );
+  // We only ask for 4.1, but most drivers hand out the newest core profile anyway
+  supportsMultiDrawIndirect = GLEW_VERSION_4_3 || ( GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance );
+  printf( "[Renderer] Multi-draw indirect: %s\n", supportsMultiDrawIndirect ? "supported" : "not supported" );
+
+  supportsParallelShaderCompile = GLEW_ARB_parallel_shader_compile;
+  if ( supportsParallelShaderCompile )
+  {
+    // Let the driver pick as many compiler threads as it sees fit
+    glMaxShaderCompilerThreadsARB( 0xFFFFFFFF );
+  }
+  printf( "[Renderer] Parallel shader compile: %s\n", supportsParallelShaderCompile ? "supported" : "not supported" );
+
+  GLint binaryFormatCount = 0;
+  if ( GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary )
+  {
+    glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormatCount );
+  }
+  supportsProgramBinary = binaryFormatCount > 0;
+  printf( "[Renderer] Program binary cache: %s\n", supportsProgramBinary ? "supported" : "not supported" );
+
+  // Core since 3.2; filters across cube face edges instead of clamping at them, which matters most on the blurry mips
+  glEnable( GL_TEXTURE_CUBE_MAP_SEAMLESS );
+
+  glGenVertexArrays( 1, &fullscreenVertexArray );
+
+  if ( headless )
+  {
+    if ( !CreateHeadlessFramebuffer() )
+    {
+      Close();
+      return false;
+    }
+    printf( "[Renderer] Rendering offscreen at %d x %d\n", nWidth, nHeight );
+  }
+  else
+  {
+    // Now, since OpenGL is behaving a lot in fullscreen modes, lets collect the real obtained size!
+    printf( "[GLFW] Requested framebuffer size: %d x %d\n", nWidth, nHeight );
+    int fbWidth = 1;
+    int fbHeight = 1;
+    glfwGetFramebufferSize( mWindow, &fbWidth, &fbHeight );
+    nWidth = _settings->mWidth = fbWidth;
+    nHeight = _settings->mHeight = fbHeight;
+    printf( "[GLFW] Obtained framebuffer size: %d x %d\n", fbWidth, fbHeight );
+  }
 
-  glViewport( 0, 0, nWidth, nHeight );
+  InvalidateStateCache();
+  SetViewport( 0, 0, nWidth, nHeight );
 
   run = true;
 
   return true;
 }
 
+bool SupportsMultiDrawIndirect()
+{
+  return supportsMultiDrawIndirect;
+}
+
+bool SupportsParallelShaderCompile()
+{
+  return supportsParallelShaderCompile;
+}
+
 MouseEvent mouseEventBuffer[ 512 ];
 int mouseEventBufferCount = 0;
 std::string dropEventBuffer[ 512 ];
@@ -201,10 +516,18 @@ void drop_callback( GLFWwindow * window, int path_count, const char * paths[] )
 
 void StartFrame( glm::vec4 & clearColor )
 {
+  lastFrameStateStatistics = stateStatistics;
+  stateStatistics.mIssuedCalls = 0;
+  stateStatistics.mFilteredCalls = 0;
+  stateStatistics.mDrawCalls = 0;
+
+  // glClear obeys the depth write mask, so make sure it's on
+  SetDepthMask( true );
+
   glClearColor( clearColor.r, clearColor.g, clearColor.b, clearColor.a );
   glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT );
 
-  glEnable( GL_DEPTH_TEST );
+  SetDepthTest( true );
 }
 
 
@@ -212,215 +535,668 @@ void EndFrame()
 {
   mouseEventBufferCount = 0;
   dropEventBufferCount = 0;
+  if ( headless )
+  {
+    // Nothing to present; the frame stays in the offscreen framebuffer until the next one clears it
+    return;
+  }
   glfwSwapBuffers( mWindow );
   glfwPollEvents();
 }
 
-bool WantsToQuit()
-{
-  return glfwWindowShouldClose( mWindow ) || !run;
-}
-void Close()
-{
-  glfwDestroyWindow( mWindow );
-  glfwTerminate();
-}
-
-Shader * CreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize, char * szErrorBuffer, int nErrorBufferSize )
+void ReadPixels( unsigned char * _rgba )
 {
-  Shader * shader = new Shader;
+  glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+  glReadPixels( 0, 0, nWidth, nHeight, GL_RGBA, GL_UNSIGNED_BYTE, _rgba );
 
-  shader->mProgram = glCreateProgram();
-
-  shader->mVertexShader = glCreateShader( GL_VERTEX_SHADER );
-  GLint size = 0;
-  GLint result = 0;
-
-  //////////////////////////////////////////////////////////////////////////
-  // Vertex shader
-  glShaderSource( shader->mVertexShader, 1, (const GLchar **) &szVertexShaderCode, &nVertexShaderCodeSize );
-  glCompileShader( shader->mVertexShader );
-  glGetShaderInfoLog( shader->mVertexShader, nErrorBufferSize, &size, szErrorBuffer );
-  glGetShaderiv( shader->mVertexShader, GL_COMPILE_STATUS, &result );
-  if ( !result )
+  // GL's rows go bottom up
+  std::vector<unsigned char> row( nWidth * 4 );
+  for ( int y = 0; y < nHeight / 2; y++ )
   {
-    glDeleteShader( shader->mVertexShader );
-    glDeleteProgram( shader->mProgram );
-    delete shader;
-    return NULL;
+    unsigned char * top = _rgba + y * nWidth * 4;
+    unsigned char * bottom = _rgba + ( nHeight - 1 - y ) * nWidth * 4;
+    memcpy( &row[ 0 ], top, nWidth * 4 );
+    memcpy( top, bottom, nWidth * 4 );
+    memcpy( bottom, &row[ 0 ], nWidth * 4 );
   }
+}
 
-  shader->mFragmentShader = glCreateShader( GL_FRAGMENT_SHADER );
+bool WantsToQuit()
+{
+  return ( mWindow && glfwWindowShouldClose( mWindow ) ) || !run;
+}
+void Close()
+{
+  glDeleteVertexArrays( 1, &fullscreenVertexArray );
+  fullscreenVertexArray = 0;
 
-  //////////////////////////////////////////////////////////////////////////
-  // Fragment shader
-  glShaderSource( shader->mFragmentShader, 1, (const GLchar **) &szFragmentShaderCode, &nFragmentShaderCodeSize );
-  glCompileShader( shader->mFragmentShader );
-  glGetShaderInfoLog( shader->mFragmentShader, nErrorBufferSize, &size, szErrorBuffer );
-  glGetShaderiv( shader->mFragmentShader, GL_COMPILE_STATUS, &result );
-  if ( !result )
+  if ( headlessFramebuffer )
   {
-    glDeleteShader( shader->mVertexShader );
-    glDeleteShader( shader->mFragmentShader );
-    glDeleteProgram( shader->mProgram );
-    delete shader;
-    return NULL;
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+    glDeleteFramebuffers( 1, &headlessFramebuffer );
+    glDeleteRenderbuffers( 1, &headlessColorBuffer );
+    glDeleteRenderbuffers( 1, &headlessDepthBuffer );
+    headlessFramebuffer = 0;
+    headlessColorBuffer = 0;
+    headlessDepthBuffer = 0;
   }
 
-  //////////////////////////////////////////////////////////////////////////
-  // Link shaders to program
-  glAttachShader( shader->mProgram, shader->mVertexShader );
-  glAttachShader( shader->mProgram, shader->mFragmentShader );
-  glLinkProgram( shader->mProgram );
-  glGetProgramInfoLog( shader->mProgram, nErrorBufferSize - size, &size, szErrorBuffer + size );
-  glGetProgramiv( shader->mProgram, GL_LINK_STATUS, &result );
-  if ( !result )
+#ifdef FXTRN_EGL
+  CloseEGLContext();
+#endif
+  if ( mWindow )
   {
-    glDeleteShader( shader->mVertexShader );
-    glDeleteShader( shader->mFragmentShader );
-    glDeleteProgram( shader->mProgram );
-    delete shader;
-    return NULL;
+    glfwDestroyWindow( mWindow );
+    mWindow = NULL;
+    glfwTerminate();
   }
-
-  return shader;
 }
 
-void ReleaseShader( Shader * _shader )
+Shader * CreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize, char * szErrorBuffer, int nErrorBufferSize )
 {
-  glDeleteShader( _shader->mVertexShader );
-  glDeleteShader( _shader->mFragmentShader );
-  glDeleteProgram( _shader->mProgram );
+  Shader * shader = BeginCreateShader( szVertexShaderCode, nVertexShaderCodeSize, szFragmentShaderCode, nFragmentShaderCodeSize );
+
+  return FinishCreateShader( shader, szErrorBuffer, nErrorBufferSize );
 }
 
-void Shader::SetConstant( const char * szConstName, bool x )
+//////////////////////////////////////////////////////////////////////////
+// Program binary cache
+// Linked programs are stored under a hash of their sources and the driver
+// that built them; a driver update simply results in new entries.
+
+uint64_t HashShaderSources( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  const char * parts[ 4 ] = { szVertexShaderCode, szFragmentShaderCode, (const char *) glGetString( GL_RENDERER ), (const char *) glGetString( GL_VERSION ) };
+  int sizes[ 4 ] = { nVertexShaderCodeSize, nFragmentShaderCodeSize, -1, -1 };
+  for ( int i = 0; i < 4; i++ )
   {
-    glProgramUniform1i( mProgram, location, x ? 1 : 0 );
+    if ( !parts[ i ] )
+    {
+      continue;
+    }
+    int size = sizes[ i ] >= 0 ? sizes[ i ] : (int) strlen( parts[ i ] );
+    for ( int j = 0; j < size; j++ )
+    {
+      hash ^= (unsigned char) parts[ i ][ j ];
+      hash *= 1099511628211ULL;
+    }
+    // Separator, so moving text from one part to the next changes the hash
+    hash ^= 0xFF;
+    hash *= 1099511628211ULL;
   }
+  return hash ? hash : 1;
 }
 
-void Shader::SetConstant( const char * szConstName, uint32_t x )
+std::string GetShaderCachePath( uint64_t _key )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
-  {
-    glProgramUniform1ui( mProgram, location, x );
-  }
+  char filename[ 64 ];
+  snprintf( filename, 64, SHADER_CACHE_DIRECTORY "/%016llx.bin", (unsigned long long) _key );
+  return filename;
 }
 
-void Shader::SetConstant( const char * szConstName, float x )
+bool LoadShaderFromCache( Shader * _shader, uint64_t _key )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  FILE * file = fopen( GetShaderCachePath( _key ).c_str(), "rb" );
+  if ( !file )
   {
-    glProgramUniform1f( mProgram, location, x );
+    return false;
   }
-}
 
-void Shader::SetConstant( const char * szConstName, float x, float y )
-{
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  GLenum format = 0;
+  std::vector<unsigned char> binary;
+  if ( fread( &format, sizeof( GLenum ), 1, file ) == 1 )
   {
-    glProgramUniform2f( mProgram, location, x, y );
+    fseek( file, 0, SEEK_END );
+    long size = ftell( file ) - (long) sizeof( GLenum );
+    fseek( file, sizeof( GLenum ), SEEK_SET );
+    if ( size > 0 )
+    {
+      binary.resize( size );
+      if ( fread( &binary[ 0 ], 1, size, file ) != (size_t) size )
+      {
+        binary.clear();
+      }
+    }
   }
-}
+  fclose( file );
 
-void Shader::SetConstant( const char * szConstName, const glm::vec3 & vector )
-{
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  if ( binary.empty() )
   {
-    glProgramUniform3f( mProgram, location, vector.x, vector.y, vector.z );
+    return false;
   }
+
+  // The driver is free to reject a binary (e.g. after an update), in which case it's rebuilt from source
+  GLint result = 0;
+  glProgramBinary( _shader->mProgram, format, &binary[ 0 ], (GLsizei) binary.size() );
+  glGetProgramiv( _shader->mProgram, GL_LINK_STATUS, &result );
+  return result != 0;
 }
 
-void Shader::SetConstant( const char * szConstName, const glm::vec4 & vector )
+void SaveShaderToCache( Shader * _shader )
 {
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  GLint size = 0;
+  glGetProgramiv( _shader->mProgram, GL_PROGRAM_BINARY_LENGTH, &size );
+  if ( size <= 0 )
   {
-    glProgramUniform4f( mProgram, location, vector.x, vector.y, vector.z, vector.w );
+    return;
   }
-}
 
-void Shader::SetConstant( const char * szConstName, const glm::mat4x4 & matrix )
-{
-  GLint location = glGetUniformLocation( mProgram, szConstName );
-  if ( location != -1 )
+  GLenum format = 0;
+  std::vector<unsigned char> binary( size );
+  glGetProgramBinary( _shader->mProgram, size, &size, &format, &binary[ 0 ] );
+
+#ifdef _WIN32
+  CreateDirectoryA( SHADER_CACHE_DIRECTORY, NULL );
+#else
+  mkdir( SHADER_CACHE_DIRECTORY, 0755 );
+#endif
+
+  FILE * file = fopen( GetShaderCachePath( _shader->mBinaryCacheKey ).c_str(), "wb" );
+  if ( !file )
   {
-    glProgramUniformMatrix4fv( mProgram, location, 1, 0, (float*)&matrix );
+    printf( "[Renderer] Can't write shader cache entry '%s'\n", GetShaderCachePath( _shader->mBinaryCacheKey ).c_str() );
+    return;
   }
+  fwrite( &format, sizeof( GLenum ), 1, file );
+  fwrite( &binary[ 0 ], 1, size, file );
+  fclose( file );
 }
 
-void Shader::SetTexture( const char * szTextureName, Texture * tex )
+Shader * BeginCreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize )
 {
-  if ( !tex )
-    return;
+  Shader * shader = new Shader;
 
-  GLint location = glGetUniformLocation( mProgram, szTextureName );
-  if ( location != -1 )
+  shader->mProgram = glCreateProgram();
+  shader->mVertexShader = 0;
+  shader->mFragmentShader = 0;
+  shader->mBinaryCacheKey = 0;
+  shader->mHasInstanceInput = false;
+
+  if ( supportsProgramBinary )
   {
-    glProgramUniform1i( mProgram, location, ( (Texture *) tex )->mGLTextureUnit );
-    glActiveTexture( GL_TEXTURE0 + ( (Texture *) tex )->mGLTextureUnit );
-    switch ( tex->mType )
+    uint64_t key = HashShaderSources( szVertexShaderCode, nVertexShaderCodeSize, szFragmentShaderCode, nFragmentShaderCodeSize );
+    if ( LoadShaderFromCache( shader, key ) )
     {
-      case TEXTURETYPE_1D: glBindTexture( GL_TEXTURE_1D, ( (Texture *) tex )->mGLTextureID ); break;
-      case TEXTURETYPE_2D: glBindTexture( GL_TEXTURE_2D, ( (Texture *) tex )->mGLTextureID ); break;
+      return shader;
     }
+
+    // A failed glProgramBinary leaves the program unusable, start over with a fresh one
+    glDeleteProgram( shader->mProgram );
+    shader->mProgram = glCreateProgram();
+    shader->mBinaryCacheKey = key;
+    glProgramParameteri( shader->mProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
   }
-}
+
+  //////////////////////////////////////////////////////////////////////////
+  // Vertex shader
+  shader->mVertexShader = glCreateShader( GL_VERTEX_SHADER );
+  glShaderSource( shader->mVertexShader, 1, (const GLchar **) &szVertexShaderCode, &nVertexShaderCodeSize );
+  glCompileShader( shader->mVertexShader );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Fragment shader
+  shader->mFragmentShader = glCreateShader( GL_FRAGMENT_SHADER );
+  glShaderSource( shader->mFragmentShader, 1, (const GLchar **) &szFragmentShaderCode, &nFragmentShaderCodeSize );
+  glCompileShader( shader->mFragmentShader );
+
+  //////////////////////////////////////////////////////////////////////////
+  // Link shaders to program
+  // No status is queried here; with parallel compilation the driver works on all of this in the background
+  glAttachShader( shader->mProgram, shader->mVertexShader );
+  glAttachShader( shader->mProgram, shader->mFragmentShader );
+  glBindAttribLocation( shader->mProgram, VERTEXATTRIBUTE_POSITION, "in_pos" );
+  glBindAttribLocation( shader->mProgram, VERTEXATTRIBUTE_NORMAL, "in_normal" );
+  glBindAttribLocation( shader->mProgram, VERTEXATTRIBUTE_TANGENT, "in_tangent" );
+  glBindAttribLocation( shader->mProgram, VERTEXATTRIBUTE_BINORMAL, "in_binormal" );
+  glBindAttribLocation( shader->mProgram, VERTEXATTRIBUTE_TEXCOORD, "in_texcoord" );
+  glBindAttribLocation( shader->mProgram, VERTEXATTRIBUTE_INSTANCE_WORLD, "in_instance_world" );
+  glLinkProgram( shader->mProgram );
+
+  return shader;
+}
+
+bool IsShaderReady( Shader * _shader )
+{
+  if ( !supportsParallelShaderCompile )
+  {
+    // Without the extension any status query blocks until the driver is done, so there's nothing to wait for
+    return true;
+  }
+
+  GLint completed = 0;
+  glGetProgramiv( _shader->mProgram, GL_COMPLETION_STATUS_ARB, &completed );
+  return completed != 0;
+}
+
+Shader * FinishCreateShader( Shader * _shader, char * szErrorBuffer, int nErrorBufferSize )
+{
+  GLint size = 0;
+  GLint result = 0;
+
+  szErrorBuffer[ 0 ] = 0;
+
+  if ( !_shader->mVertexShader )
+  {
+    // Loaded from the binary cache, already linked
+    _shader->mHasInstanceInput = glGetAttribLocation( _shader->mProgram, "in_instance_world" ) >= 0;
+    return _shader;
+  }
+
+  glGetShaderInfoLog( _shader->mVertexShader, nErrorBufferSize, &size, szErrorBuffer );
+  glGetShaderiv( _shader->mVertexShader, GL_COMPILE_STATUS, &result );
+  if ( !result )
+  {
+    ReleaseShader( _shader );
+    delete _shader;
+    return NULL;
+  }
+
+  glGetShaderInfoLog( _shader->mFragmentShader, nErrorBufferSize, &size, szErrorBuffer );
+  glGetShaderiv( _shader->mFragmentShader, GL_COMPILE_STATUS, &result );
+  if ( !result )
+  {
+    ReleaseShader( _shader );
+    delete _shader;
+    return NULL;
+  }
+
+  glGetProgramInfoLog( _shader->mProgram, nErrorBufferSize - size, &size, szErrorBuffer + size );
+  glGetProgramiv( _shader->mProgram, GL_LINK_STATUS, &result );
+  if ( !result )
+  {
+    ReleaseShader( _shader );
+    delete _shader;
+    return NULL;
+  }
+
+  _shader->mHasInstanceInput = glGetAttribLocation( _shader->mProgram, "in_instance_world" ) >= 0;
+
+  if ( _shader->mBinaryCacheKey )
+  {
+    SaveShaderToCache( _shader );
+  }
+
+  return _shader;
+}
+
+void ReleaseShader( Shader * _shader )
+{
+  glDeleteShader( _shader->mVertexShader );
+  glDeleteShader( _shader->mFragmentShader );
+  glDeleteProgram( _shader->mProgram );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shader variants
+
+const char * shaderFeatureDefines[ SHADERFEATURE_COUNT ] = {
+  "HAS_MAP_ALBEDO",
+  "HAS_MAP_DIFFUSE",
+  "HAS_MAP_NORMALS",
+  "HAS_MAP_SPECULAR",
+  "HAS_MAP_ROUGHNESS",
+  "HAS_MAP_METALLIC",
+  "HAS_MAP_AO",
+  "HAS_MAP_AMBIENT",
+  "USE_IBL",
+  "SKY_CUBEMAP",
+  "DEBUG_MAPS",
+  "DEBUG_AMBIENT",
+};
+
+// The defines have to go after #version, which must stay the first statement
+std::string InjectShaderDefines( const std::string & _source, uint32_t _features )
+{
+  std::string defines;
+  for ( int i = 0; i < SHADERFEATURE_COUNT; i++ )
+  {
+    if ( _features & ( 1 << i ) )
+    {
+      defines += std::string( "#define " ) + shaderFeatureDefines[ i ] + "\n";
+    }
+  }
+
+  size_t insertAt = 0;
+  int line = 1;
+  size_t version = _source.find( "#version" );
+  if ( version != std::string::npos )
+  {
+    insertAt = _source.find( '\n', version );
+    insertAt = insertAt == std::string::npos ? _source.length() : insertAt + 1;
+    for ( size_t i = 0; i < insertAt; i++ )
+    {
+      line += _source[ i ] == '\n' ? 1 : 0;
+    }
+  }
+
+  // Keep the line numbers in the compile errors matching the file
+  char lineDirective[ 32 ];
+  snprintf( lineDirective, 32, "#line %d\n", line );
+  defines += lineDirective;
+
+  return _source.substr( 0, insertAt ) + defines + _source.substr( insertAt );
+}
+
+ShaderVariants * CreateShaderVariants( const char * szVertexShaderCode, const char * szFragmentShaderCode )
+{
+  ShaderVariants * variants = new ShaderVariants;
+  variants->mVertexShaderCode = szVertexShaderCode;
+  variants->mFragmentShaderCode = szFragmentShaderCode;
+  return variants;
+}
+
+void ReleaseShaderVariants( ShaderVariants * _variants )
+{
+  for ( std::map<uint32_t, Shader *>::iterator it = _variants->mVariants.begin(); it != _variants->mVariants.end(); it++ )
+  {
+    if ( it->second )
+    {
+      ReleaseShader( it->second );
+      delete it->second;
+    }
+  }
+  for ( std::map<uint32_t, Shader *>::iterator it = _variants->mPending.begin(); it != _variants->mPending.end(); it++ )
+  {
+    ReleaseShader( it->second );
+    delete it->second;
+  }
+  _variants->mVariants.clear();
+  _variants->mPending.clear();
+}
+
+void ReplaceShaderVariants( ShaderVariants * _variants, ShaderVariants * _replacement )
+{
+  std::swap( _variants->mVertexShaderCode, _replacement->mVertexShaderCode );
+  std::swap( _variants->mFragmentShaderCode, _replacement->mFragmentShaderCode );
+  std::swap( _variants->mVariants, _replacement->mVariants );
+  std::swap( _variants->mPending, _replacement->mPending );
+  std::swap( _variants->mErrors, _replacement->mErrors );
+
+  ReleaseShaderVariants( _replacement );
+  delete _replacement;
+}
+
+void ShaderVariants::Request( uint32_t _features )
+{
+  if ( mVariants.find( _features ) != mVariants.end() || mPending.find( _features ) != mPending.end() )
+  {
+    return;
+  }
+
+  std::string vertexShader = InjectShaderDefines( mVertexShaderCode, _features );
+  std::string fragmentShader = InjectShaderDefines( mFragmentShaderCode, _features );
+  mPending[ _features ] = BeginCreateShader( vertexShader.c_str(), (int) vertexShader.length(), fragmentShader.c_str(), (int) fragmentShader.length() );
+}
+
+void FinishShaderVariant( ShaderVariants * _variants, uint32_t _features, Shader * _shader )
+{
+  char error[ 4096 ];
+  Shader * shader = FinishCreateShader( _shader, error, 4096 );
+  if ( !shader )
+  {
+    printf( "[Renderer] Shader variant %03x build failed: %s\n", _features, error );
+    _variants->mErrors += error;
+  }
+  _variants->mVariants[ _features ] = shader;
+}
+
+Shader * ShaderVariants::Get( uint32_t _features )
+{
+  std::map<uint32_t, Shader *>::iterator it = mVariants.find( _features );
+  if ( it != mVariants.end() )
+  {
+    return it->second;
+  }
+
+  Request( _features );
+
+  std::map<uint32_t, Shader *>::iterator pending = mPending.find( _features );
+  FinishShaderVariant( this, _features, pending->second );
+  mPending.erase( pending );
+
+  return mVariants[ _features ];
+}
+
+Shader * ShaderVariants::Find( uint32_t _features, uint32_t _fallback )
+{
+  std::map<uint32_t, Shader *>::iterator it = mVariants.find( _features );
+  if ( it == mVariants.end() )
+  {
+    it = mVariants.find( _fallback );
+  }
+  return it != mVariants.end() ? it->second : NULL;
+}
+
+bool ShaderVariants::Poll()
+{
+  bool finished = false;
+  std::map<uint32_t, Shader *>::iterator it = mPending.begin();
+  while ( it != mPending.end() )
+  {
+    if ( !IsShaderReady( it->second ) )
+    {
+      it++;
+      continue;
+    }
+
+    FinishShaderVariant( this, it->first, it->second );
+    it = mPending.erase( it );
+    finished = true;
+
+    if ( !supportsParallelShaderCompile )
+    {
+      // Finishing may have blocked, so only take one program per call
+      break;
+    }
+  }
+  return finished;
+}
+
+void ShaderVariants::ReleaseUnused( const std::vector<uint32_t> & _used )
+{
+  std::map<uint32_t, Shader *>::iterator it = mVariants.begin();
+  while ( it != mVariants.end() )
+  {
+    if ( std::find( _used.begin(), _used.end(), it->first ) != _used.end() )
+    {
+      it++;
+      continue;
+    }
+    if ( it->second )
+    {
+      ReleaseShader( it->second );
+      delete it->second;
+    }
+    it = mVariants.erase( it );
+  }
+
+  it = mPending.begin();
+  while ( it != mPending.end() )
+  {
+    if ( std::find( _used.begin(), _used.end(), it->first ) != _used.end() )
+    {
+      it++;
+      continue;
+    }
+    ReleaseShader( it->second );
+    delete it->second;
+    it = mPending.erase( it );
+  }
+}
+
+void ShaderVariants::SetTexture( const char * szTextureName, Texture * tex )
+{
+  for ( std::map<uint32_t, Shader *>::iterator it = mVariants.begin(); it != mVariants.end(); it++ )
+  {
+    if ( it->second )
+    {
+      it->second->SetTexture( szTextureName, tex );
+    }
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, bool x )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniform1i( mProgram, location, x ? 1 : 0 );
+    RecordCommand( COMMANDTYPE_UNIFORM_1I, mProgram, location, x ? 1 : 0 );
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, uint32_t x )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniform1ui( mProgram, location, x );
+    RecordCommand( COMMANDTYPE_UNIFORM_1UI, mProgram, location, (int) x );
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, float x )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniform1f( mProgram, location, x );
+    RecordUniform( mProgram, location, &x, 1 );
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, float x, float y )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniform2f( mProgram, location, x, y );
+    if ( recordingCommandList )
+    {
+      const float values[ 2 ] = { x, y };
+      RecordUniform( mProgram, location, values, 2 );
+    }
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, const glm::vec3 & vector )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniform3f( mProgram, location, vector.x, vector.y, vector.z );
+    RecordUniform( mProgram, location, &vector.x, 3 );
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, const glm::vec4 & vector )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniform4f( mProgram, location, vector.x, vector.y, vector.z, vector.w );
+    RecordUniform( mProgram, location, &vector.x, 4 );
+  }
+}
+
+void Shader::SetConstant( const char * szConstName, const glm::mat4x4 & matrix )
+{
+  GLint location = glGetUniformLocation( mProgram, szConstName );
+  if ( location != -1 )
+  {
+    glProgramUniformMatrix4fv( mProgram, location, 1, 0, (float*)&matrix );
+    RecordUniform( mProgram, location, (float*)&matrix, 16 );
+  }
+}
+
+void Shader::SetTexture( const char * szTextureName, Texture * tex )
+{
+  if ( !tex )
+    return;
+
+  GLint location = glGetUniformLocation( mProgram, szTextureName );
+  if ( location != -1 )
+  {
+    glProgramUniform1i( mProgram, location, ( (Texture *) tex )->mGLTextureUnit );
+    RecordCommand( COMMANDTYPE_UNIFORM_1I, mProgram, location, tex->mGLTextureUnit );
+    switch ( tex->mType )
+    {
+      case TEXTURETYPE_1D: BindTexture( tex->mGLTextureUnit, GL_TEXTURE_1D, tex->mGLTextureID ); break;
+      case TEXTURETYPE_2D: BindTexture( tex->mGLTextureUnit, GL_TEXTURE_2D, tex->mGLTextureID ); break;
+      case TEXTURETYPE_CUBE: BindTexture( tex->mGLTextureUnit, GL_TEXTURE_CUBE_MAP, tex->mGLTextureID ); break;
+    }
+  }
+}
 
 int textureUnit = 0;
 
-Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB /*= false*/ )
+bool LoadImageFromFile( const char * szFilename, Image & _image, const bool _loadAsSRGB /*= false*/ )
 {
   int comp = 0;
-  int width = 0;
-  int height = 0;
-  void * data = NULL;
-  GLenum internalFormat = _loadAsSRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8;
-  GLenum srcFormat = GL_RGBA;
-  GLenum format = GL_UNSIGNED_BYTE;
-  if ( stbi_is_hdr( szFilename ) )
+  _image.mFilename = szFilename;
+  _image.mSRGB = _loadAsSRGB;
+  _image.mHDR = stbi_is_hdr( szFilename ) != 0;
+  if ( _image.mHDR )
   {
-    internalFormat = GL_RGBA32F;
-    format = GL_FLOAT;
-    data = stbi_loadf( szFilename, &width, &height, &comp, STBI_rgb_alpha );
+    // HDR images are RGB only and don't need float precision, so they're decoded straight into packed floats
+    return HDRImage::LoadR11G11B10F( szFilename, _image.mWidth, _image.mHeight, _image.mTexels );
   }
-  else
+
+  unsigned char * data = stbi_load( szFilename, &_image.mWidth, &_image.mHeight, &comp, STBI_rgb_alpha );
+  if ( !data ) return false;
+
+  _image.mTexels.resize( (size_t) _image.mWidth * _image.mHeight );
+  memcpy( &_image.mTexels[ 0 ], data, _image.mTexels.size() * sizeof( uint32_t ) );
+  stbi_image_free( data );
+  return true;
+}
+
+Texture * CreateTextureFromImage( const Image & _image )
+{
+  GLenum internalFormat = _image.mSRGB ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+  GLenum srcFormat = GL_RGBA;
+  GLenum format = GL_UNSIGNED_BYTE;
+  if ( _image.mHDR )
   {
-    data = stbi_load( szFilename, &width, &height, &comp, STBI_rgb_alpha );
+    internalFormat = GL_R11F_G11F_B10F;
+    srcFormat = GL_RGB;
+    format = GL_UNSIGNED_INT_10F_11F_11F_REV;
   }
-  if ( !data ) return NULL;
 
   GLuint glTexId = 0;
   glGenTextures( 1, &glTexId );
-  glBindTexture( GL_TEXTURE_2D, glTexId );
+  BindTexture( textureUnit, GL_TEXTURE_2D, glTexId );
 
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR );
 
-  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, width, height, 0, srcFormat, format, data );
+  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, _image.mWidth, _image.mHeight, 0, srcFormat, format, &_image.mTexels[ 0 ] );
   glGenerateMipmap( GL_TEXTURE_2D );
 
-  stbi_image_free( data );
-
   Texture * tex = new Texture();
-  tex->mWidth = width;
-  tex->mHeight = height;
+  tex->mWidth = _image.mWidth;
+  tex->mHeight = _image.mHeight;
   tex->mType = TEXTURETYPE_2D;
-  tex->mFilename = szFilename;
+  tex->mFilename = _image.mFilename;
   tex->mGLTextureID = glTexId;
   tex->mGLTextureUnit = textureUnit++;
   return tex;
 }
 
+Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB /*= false*/ )
+{
+  Image image;
+  if ( !LoadImageFromFile( szFilename, image, _loadAsSRGB ) )
+  {
+    return NULL;
+  }
+  return CreateTextureFromImage( image );
+}
+
 Texture * CreateRG32FTextureFromRawFile( const char * szFilename, int width, int height)
 {
   const int comp = 2;
@@ -442,22 +1218,29 @@ Texture * CreateRG32FTextureFromRawFile( const char * szFilename, int width, int
     return NULL;
   }
 
+  Texture * tex = CreateRG32FTexture( szFilename, width, height, bytes );
+
+  delete[] bytes;
+
+  return tex;
+}
+
+Texture * CreateRG32FTexture( const char * szFilename, int width, int height, const float * _data )
+{
   GLenum internalFormat = GL_RG32F;
   GLenum srcFormat = GL_RG;
   GLenum format = GL_FLOAT;
 
   GLuint glTexId = 0;
   glGenTextures( 1, &glTexId );
-  glBindTexture( GL_TEXTURE_2D, glTexId );
+  BindTexture( textureUnit, GL_TEXTURE_2D, glTexId );
 
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, width, height, 0, srcFormat, format, (const void*)bytes );
-
-  delete[] bytes;
+  glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, width, height, 0, srcFormat, format, (const void*)_data );
 
   Renderer::Texture * tex = new Renderer::Texture();
   tex->mWidth = width;
@@ -469,21 +1252,480 @@ Texture * CreateRG32FTextureFromRawFile( const char * szFilename, int width, int
   return tex;
 }
 
+Texture * CreateR11G11B10FTextureFromMipLevels( const char * szFilename, int width, int height, const std::vector< std::vector<float> > & _levels )
+{
+  if ( _levels.empty() )
+  {
+    return NULL;
+  }
+
+  GLuint glTexId = 0;
+  glGenTextures( 1, &glTexId );
+  BindTexture( textureUnit, GL_TEXTURE_2D, glTexId );
+
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint) _levels.size() - 1 );
+
+  std::vector<uint32_t> texels;
+  for ( int i = 0; i < _levels.size(); i++ )
+  {
+    int count = ( width >> i ) * ( height >> i );
+    texels.resize( count );
+    HDRImage::PackR11G11B10F( &_levels[ i ][ 0 ], count, &texels[ 0 ] );
+    glTexImage2D( GL_TEXTURE_2D, i, GL_R11F_G11F_B10F, width >> i, height >> i, 0, GL_RGB, GL_UNSIGNED_INT_10F_11F_11F_REV, &texels[ 0 ] );
+  }
+
+  Texture * tex = new Texture();
+  tex->mWidth = width;
+  tex->mHeight = height;
+  tex->mType = TEXTURETYPE_2D;
+  tex->mFilename = szFilename;
+  tex->mGLTextureID = glTexId;
+  tex->mGLTextureUnit = textureUnit++;
+  return tex;
+}
+
+Texture * CreateR11G11B10FCubemapFromMipLevels( const char * szFilename, int size, const std::vector< std::vector<float> > & _levels )
+{
+  if ( _levels.empty() )
+  {
+    return NULL;
+  }
+
+  GLuint glTexId = 0;
+  glGenTextures( 1, &glTexId );
+  BindTexture( textureUnit, GL_TEXTURE_CUBE_MAP, glTexId );
+
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0 );
+  glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, (GLint) _levels.size() - 1 );
+
+  std::vector<uint32_t> texels;
+  for ( int i = 0; i < _levels.size(); i++ )
+  {
+    int faceSize = size >> i;
+    int count = faceSize * faceSize;
+    texels.resize( count );
+    for ( int face = 0; face < 6; face++ )
+    {
+      HDRImage::PackR11G11B10F( &_levels[ i ][ face * count * 3 ], count, &texels[ 0 ] );
+      glTexImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, i, GL_R11F_G11F_B10F, faceSize, faceSize, 0, GL_RGB, GL_UNSIGNED_INT_10F_11F_11F_REV, &texels[ 0 ] );
+    }
+  }
+
+  Texture * tex = new Texture();
+  tex->mWidth = size;
+  tex->mHeight = size;
+  tex->mType = TEXTURETYPE_CUBE;
+  tex->mFilename = szFilename;
+  tex->mGLTextureID = glTexId;
+  tex->mGLTextureUnit = textureUnit++;
+  return tex;
+}
+
 void ReleaseTexture( Texture * tex )
 {
   glDeleteTextures( 1, &( (Texture *) tex )->mGLTextureID );
+
+  // Deleting a texture resets every binding of it to zero, so the cache has to forget it too
+  for ( int i = 0; i < STATECACHE_TEXTURE_UNITS; i++ )
+  {
+    for ( int j = 0; j < STATECACHE_TEXTURE_TARGETS; j++ )
+    {
+      if ( stateCache.mTextures[ i ][ j ] == tex->mGLTextureID )
+      {
+        stateCache.mTextures[ i ][ j ] = 0;
+      }
+    }
+  }
 }
 
 void SetShader( Shader * _shader )
 {
-  glUseProgram( _shader->mProgram );
+  BindProgram( _shader->mProgram );
 }
 
 void CopyBackbufferToTexture( Texture * tex )
 {
-  glActiveTexture( GL_TEXTURE0 + ( (Texture *) tex )->mGLTextureUnit );
-  glBindTexture( GL_TEXTURE_2D, ( (Texture *) tex )->mGLTextureID );
+  BindTexture( tex->mGLTextureUnit, GL_TEXTURE_2D, tex->mGLTextureID );
   glCopyTexImage2D( GL_TEXTURE_2D, 0, GL_RGB, 0, 0, nWidth, nHeight, 0 );
 }
 
+//////////////////////////////////////////////////////////////////////////
+// State cache
+//
+// Every GL state change in the viewer goes through these, and a call is
+// only forwarded to the driver if it actually changes something. Anything
+// that touches GL state behind our back (ImGui restores what it changes)
+// has to call InvalidateStateCache() afterwards.
+
+bool IsStateRedundant( bool _redundant )
+{
+  if ( _redundant )
+  {
+    stateStatistics.mFilteredCalls++;
+  }
+  else
+  {
+    stateStatistics.mIssuedCalls++;
+  }
+  return _redundant;
+}
+
+int GetBufferSlot( unsigned int _target )
+{
+  switch ( _target )
+  {
+    case GL_ARRAY_BUFFER: return 0;
+    case GL_ELEMENT_ARRAY_BUFFER: return 1;
+    case GL_DRAW_INDIRECT_BUFFER: return 2;
+    case GL_PIXEL_PACK_BUFFER: return 3;
+    case GL_PIXEL_UNPACK_BUFFER: return 4;
+    case GL_UNIFORM_BUFFER: return 5;
+  }
+  return -1;
+}
+
+int GetTextureSlot( unsigned int _target )
+{
+  switch ( _target )
+  {
+    case GL_TEXTURE_1D: return 0;
+    case GL_TEXTURE_2D: return 1;
+    case GL_TEXTURE_CUBE_MAP: return 2;
+  }
+  return -1;
+}
+
+void BindProgram( unsigned int _program )
+{
+  RecordCommand( COMMANDTYPE_BIND_PROGRAM, _program );
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mProgram == _program ) )
+  {
+    return;
+  }
+  glUseProgram( _program );
+  stateCache.mProgram = _program;
+}
+
+void BindVertexArray( unsigned int _vertexArray )
+{
+  RecordCommand( COMMANDTYPE_BIND_VERTEX_ARRAY, _vertexArray );
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mVertexArray == _vertexArray ) )
+  {
+    return;
+  }
+  glBindVertexArray( _vertexArray );
+  stateCache.mVertexArray = _vertexArray;
+
+  // The element array binding is part of the VAO, so we don't know what it is anymore
+  stateCache.mBuffers[ GetBufferSlot( GL_ELEMENT_ARRAY_BUFFER ) ] = STATECACHE_UNKNOWN;
+}
+
+void BindBuffer( unsigned int _target, unsigned int _buffer )
+{
+  RecordCommand( COMMANDTYPE_BIND_BUFFER, _buffer, (int) _target );
+  int slot = GetBufferSlot( _target );
+  if ( slot < 0 )
+  {
+    glBindBuffer( _target, _buffer );
+    stateStatistics.mIssuedCalls++;
+    return;
+  }
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mBuffers[ slot ] == _buffer ) )
+  {
+    return;
+  }
+  glBindBuffer( _target, _buffer );
+  stateCache.mBuffers[ slot ] = _buffer;
+}
+
+void BindTexture( int _unit, unsigned int _target, unsigned int _texture )
+{
+  RecordCommand( COMMANDTYPE_BIND_TEXTURE, _texture, _unit, (int) _target );
+  int slot = GetTextureSlot( _target );
+  if ( slot < 0 || _unit < 0 || _unit >= STATECACHE_TEXTURE_UNITS )
+  {
+    glActiveTexture( GL_TEXTURE0 + _unit );
+    glBindTexture( _target, _texture );
+    stateCache.mActiveTextureUnit = _unit;
+    stateStatistics.mIssuedCalls++;
+    return;
+  }
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mTextures[ _unit ][ slot ] == _texture ) )
+  {
+    return;
+  }
+  if ( !stateCache.mValid || stateCache.mActiveTextureUnit != _unit )
+  {
+    glActiveTexture( GL_TEXTURE0 + _unit );
+    stateCache.mActiveTextureUnit = _unit;
+  }
+  glBindTexture( _target, _texture );
+  stateCache.mTextures[ _unit ][ slot ] = _texture;
+}
+
+void SetDepthTest( bool _enable )
+{
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mDepthTest == _enable ) )
+  {
+    return;
+  }
+  if ( _enable )
+  {
+    glEnable( GL_DEPTH_TEST );
+  }
+  else
+  {
+    glDisable( GL_DEPTH_TEST );
+  }
+  stateCache.mDepthTest = _enable;
+}
+
+void SetDepthFunc( unsigned int _func )
+{
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mDepthFunc == _func ) )
+  {
+    return;
+  }
+  glDepthFunc( _func );
+  stateCache.mDepthFunc = _func;
+}
+
+void SetDepthMask( bool _enable )
+{
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mDepthMask == _enable ) )
+  {
+    return;
+  }
+  glDepthMask( _enable ? GL_TRUE : GL_FALSE );
+  stateCache.mDepthMask = _enable;
+}
+
+void SetBlend( bool _enable )
+{
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mBlend == _enable ) )
+  {
+    return;
+  }
+  if ( _enable )
+  {
+    glEnable( GL_BLEND );
+  }
+  else
+  {
+    glDisable( GL_BLEND );
+  }
+  stateCache.mBlend = _enable;
+}
+
+void SetBlendFunc( unsigned int _src, unsigned int _dst )
+{
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mBlendSrc == _src && stateCache.mBlendDst == _dst ) )
+  {
+    return;
+  }
+  glBlendFunc( _src, _dst );
+  stateCache.mBlendSrc = _src;
+  stateCache.mBlendDst = _dst;
+}
+
+void SetPolygonMode( unsigned int _mode )
+{
+  if ( IsStateRedundant( stateCache.mValid && stateCache.mPolygonMode == _mode ) )
+  {
+    return;
+  }
+  glPolygonMode( GL_FRONT_AND_BACK, _mode );
+  stateCache.mPolygonMode = _mode;
+}
+
+void SetViewport( int _x, int _y, int _width, int _height )
+{
+  if ( IsStateRedundant( stateCache.mValid
+    && stateCache.mViewport[ 0 ] == _x && stateCache.mViewport[ 1 ] == _y
+    && stateCache.mViewport[ 2 ] == _width && stateCache.mViewport[ 3 ] == _height ) )
+  {
+    return;
+  }
+  glViewport( _x, _y, _width, _height );
+  stateCache.mViewport[ 0 ] = _x;
+  stateCache.mViewport[ 1 ] = _y;
+  stateCache.mViewport[ 2 ] = _width;
+  stateCache.mViewport[ 3 ] = _height;
+}
+
+void InvalidateStateCache()
+{
+  // Until every cached value has been set again, we can't filter anything; the
+  // simplest way to get there is to reset to the GL defaults and mark everything valid.
+  stateCache.mValid = false;
+
+  glUseProgram( 0 );
+  glBindVertexArray( 0 );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  glBindBuffer( GL_DRAW_INDIRECT_BUFFER, 0 );
+  glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+  glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+  stateCache.mProgram = 0;
+  stateCache.mVertexArray = 0;
+  for ( int i = 0; i < STATECACHE_BUFFER_TARGETS; i++ )
+  {
+    stateCache.mBuffers[ i ] = 0;
+  }
+  stateCache.mBuffers[ GetBufferSlot( GL_ELEMENT_ARRAY_BUFFER ) ] = STATECACHE_UNKNOWN;
+  for ( int i = 0; i < STATECACHE_TEXTURE_UNITS; i++ )
+  {
+    for ( int j = 0; j < STATECACHE_TEXTURE_TARGETS; j++ )
+    {
+      stateCache.mTextures[ i ][ j ] = STATECACHE_UNKNOWN;
+    }
+  }
+  glActiveTexture( GL_TEXTURE0 );
+  stateCache.mActiveTextureUnit = 0;
+
+  glDisable( GL_DEPTH_TEST );
+  glDepthFunc( GL_LESS );
+  glDepthMask( GL_TRUE );
+  glDisable( GL_BLEND );
+  glBlendFunc( GL_ONE, GL_ZERO );
+  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+  stateCache.mDepthTest = false;
+  stateCache.mDepthFunc = GL_LESS;
+  stateCache.mDepthMask = true;
+  stateCache.mBlend = false;
+  stateCache.mBlendSrc = GL_ONE;
+  stateCache.mBlendDst = GL_ZERO;
+  stateCache.mPolygonMode = GL_FILL;
+
+  GLint viewport[ 4 ] = { 0 };
+  glGetIntegerv( GL_VIEWPORT, viewport );
+  for ( int i = 0; i < 4; i++ )
+  {
+    stateCache.mViewport[ i ] = viewport[ i ];
+  }
+
+  stateCache.mValid = true;
+}
+
+const StateStatistics & GetStateStatistics()
+{
+  return lastFrameStateStatistics;
+}
+
+void RenderFullscreenQuad()
+{
+  // A single triangle past the screen corners rather than two: no diagonal seam to shade twice
+  BindVertexArray( fullscreenVertexArray );
+  RecordCommand( COMMANDTYPE_RENDER_FULLSCREEN_QUAD, 0 );
+  glDrawArrays( GL_TRIANGLES, 0, 3 );
+  stateStatistics.mDrawCalls++;
+}
+
+void DrawElements( int _indexCount, int _firstIndex )
+{
+  RecordCommand( COMMANDTYPE_DRAW_ELEMENTS, 0, _indexCount, _firstIndex );
+  glDrawElements( GL_TRIANGLES, _indexCount, GL_UNSIGNED_INT, (GLvoid *) ( sizeof( GLuint ) * _firstIndex ) );
+  stateStatistics.mDrawCalls++;
+}
+
+void DrawElementsInstanced( int _indexCount, int _firstIndex, int _instanceCount )
+{
+  RecordCommand( COMMANDTYPE_DRAW_ELEMENTS_INSTANCED, 0, _indexCount, _firstIndex, _instanceCount );
+  glDrawElementsInstanced( GL_TRIANGLES, _indexCount, GL_UNSIGNED_INT, (GLvoid *) ( sizeof( GLuint ) * _firstIndex ), _instanceCount );
+  stateStatistics.mDrawCalls++;
+}
+
+void MultiDrawElementsIndirect( int _firstCommand, int _commandCount )
+{
+  // Indirect commands are five GLuints each (count, instance count, first index, base vertex, base instance)
+  RecordCommand( COMMANDTYPE_MULTI_DRAW_ELEMENTS_INDIRECT, 0, _firstCommand, _commandCount );
+  glMultiDrawElementsIndirect( GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid *) ( sizeof( GLuint ) * 5 * _firstCommand ), _commandCount, 0 );
+  stateStatistics.mDrawCalls++;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Command lists
+
+void CommandList::Clear()
+{
+  mCommands.clear();
+  mData.clear();
+  mValid = false;
+}
+
+void BeginCommandList( CommandList * _list )
+{
+  _list->Clear();
+  recordingCommandList = _list;
+}
+
+void EndCommandList()
+{
+  recordingCommandList->mValid = true;
+  recordingCommandList = NULL;
+}
+
+void ExecuteCommandList( const CommandList * _list )
+{
+  for ( int i = 0; i < _list->mCommands.size(); i++ )
+  {
+    const CommandList::Command & command = _list->mCommands[ i ];
+    switch ( command.mType )
+    {
+      case COMMANDTYPE_BIND_PROGRAM:
+        BindProgram( command.mObject );
+        break;
+      case COMMANDTYPE_BIND_VERTEX_ARRAY:
+        BindVertexArray( command.mObject );
+        break;
+      case COMMANDTYPE_BIND_BUFFER:
+        BindBuffer( command.mParams[ 0 ], command.mObject );
+        break;
+      case COMMANDTYPE_BIND_TEXTURE:
+        BindTexture( command.mParams[ 0 ], command.mParams[ 1 ], command.mObject );
+        break;
+      case COMMANDTYPE_UNIFORM_1I:
+        glProgramUniform1i( command.mObject, command.mParams[ 0 ], command.mParams[ 1 ] );
+        break;
+      case COMMANDTYPE_UNIFORM_1UI:
+        glProgramUniform1ui( command.mObject, command.mParams[ 0 ], (GLuint) command.mParams[ 1 ] );
+        break;
+      case COMMANDTYPE_UNIFORM_FLOATS:
+        {
+          const float * values = &_list->mData[ command.mParams[ 1 ] ];
+          switch ( command.mParams[ 2 ] )
+          {
+            case 1: glProgramUniform1f( command.mObject, command.mParams[ 0 ], values[ 0 ] ); break;
+            case 2: glProgramUniform2f( command.mObject, command.mParams[ 0 ], values[ 0 ], values[ 1 ] ); break;
+            case 3: glProgramUniform3f( command.mObject, command.mParams[ 0 ], values[ 0 ], values[ 1 ], values[ 2 ] ); break;
+            case 4: glProgramUniform4f( command.mObject, command.mParams[ 0 ], values[ 0 ], values[ 1 ], values[ 2 ], values[ 3 ] ); break;
+            case 16: glProgramUniformMatrix4fv( command.mObject, command.mParams[ 0 ], 1, 0, values ); break;
+          }
+        } break;
+      case COMMANDTYPE_DRAW_ELEMENTS:
+        DrawElements( command.mParams[ 0 ], command.mParams[ 1 ] );
+        break;
+      case COMMANDTYPE_DRAW_ELEMENTS_INSTANCED:
+        DrawElementsInstanced( command.mParams[ 0 ], command.mParams[ 1 ], command.mParams[ 2 ] );
+        break;
+      case COMMANDTYPE_MULTI_DRAW_ELEMENTS_INDIRECT:
+        MultiDrawElementsIndirect( command.mParams[ 0 ], command.mParams[ 1 ] );
+        break;
+      case COMMANDTYPE_RENDER_FULLSCREEN_QUAD:
+        RenderFullscreenQuad();
+        break;
+    }
+  }
+}
+
 }// namespace Renderer
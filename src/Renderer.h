@@ -2,6 +2,8 @@
 #include "GLFW/glfw3.h"
 
 #include <string>
+#include <vector>
+#include <map>
 #include <glm.hpp>
 
 typedef enum
@@ -18,6 +20,7 @@ typedef struct
   RENDERER_WINDOWMODE mWindowMode;
   bool mVsync;
   bool mMultisampling;
+  bool mHeadless; // no window; frames are rendered into an offscreen framebuffer, see ReadPixels()
 } RENDERER_SETTINGS;
 
 namespace Renderer
@@ -26,6 +29,7 @@ enum TEXTURETYPE
 {
   TEXTURETYPE_1D = 1,
   TEXTURETYPE_2D = 2,
+  TEXTURETYPE_CUBE = 3,
 };
 
 struct Texture
@@ -38,11 +42,36 @@ struct Texture
   int mGLTextureUnit;
 };
 
+// A texture file decoded on the CPU, so the decode can happen on any thread and only the upload on the GL thread
+struct Image
+{
+  std::string mFilename;
+  int mWidth;
+  int mHeight;
+  bool mSRGB;
+  bool mHDR; // texels are packed R11G11B10F rather than RGBA8
+  std::vector<uint32_t> mTexels;
+};
+
+// Every program gets its vertex inputs bound to these locations before linking,
+// so vertex arrays can be set up once and shared by all shaders
+enum VERTEXATTRIBUTE
+{
+  VERTEXATTRIBUTE_POSITION = 0,
+  VERTEXATTRIBUTE_NORMAL = 1,
+  VERTEXATTRIBUTE_TANGENT = 2,
+  VERTEXATTRIBUTE_BINORMAL = 3,
+  VERTEXATTRIBUTE_TEXCOORD = 4,
+  VERTEXATTRIBUTE_INSTANCE_WORLD = 5, // mat4x4, takes up locations 5 to 8
+};
+
 struct Shader
 {
   unsigned int mProgram;
   unsigned int mVertexShader;
   unsigned int mFragmentShader;
+  uint64_t mBinaryCacheKey; // 0 if the program didn't come from source, or can't be cached
+  bool mHasInstanceInput; // takes its world matrix from in_instance_world; set once the program is linked
   void SetConstant( const char * szConstName, bool x );
   void SetConstant( const char * szConstName, uint32_t x );
   void SetConstant( const char * szConstName, float x );
@@ -61,6 +90,10 @@ extern int nHeight;
 extern GLFWwindow * mWindow;
 
 bool Open( RENDERER_SETTINGS * settings );
+// Reads back the frame rendered so far as tightly packed RGBA8, top row first; _rgba holds nWidth * nHeight * 4 bytes
+void ReadPixels( unsigned char * _rgba );
+bool SupportsMultiDrawIndirect();
+bool SupportsParallelShaderCompile();
 
 void StartFrame( glm::vec4 & clearColor );
 void RebindVertexArray();
@@ -70,16 +103,136 @@ bool WantsToQuit();
 void RenderFullscreenQuad();
 
 Shader * CreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize, char * szErrorBuffer, int nErrorBufferSize );
+
+// Non-blocking shader creation: Begin submits the sources and the link, IsShaderReady polls whether the
+// driver is done with them, and Finish checks the result (returns NULL and frees the shader on failure)
+Shader * BeginCreateShader( const char * szVertexShaderCode, int nVertexShaderCodeSize, const char * szFragmentShaderCode, int nFragmentShaderCodeSize );
+bool IsShaderReady( Shader * _shader );
+Shader * FinishCreateShader( Shader * _shader, char * szErrorBuffer, int nErrorBufferSize );
 void ReleaseShader( Shader * _shader );
 
+// Feature bits a shader can be specialised for; each set bit is injected as the matching #define
+enum SHADERFEATURE
+{
+  SHADERFEATURE_MAP_ALBEDO = 1 << 0,
+  SHADERFEATURE_MAP_DIFFUSE = 1 << 1,
+  SHADERFEATURE_MAP_NORMALS = 1 << 2,
+  SHADERFEATURE_MAP_SPECULAR = 1 << 3,
+  SHADERFEATURE_MAP_ROUGHNESS = 1 << 4,
+  SHADERFEATURE_MAP_METALLIC = 1 << 5,
+  SHADERFEATURE_MAP_AO = 1 << 6,
+  SHADERFEATURE_MAP_AMBIENT = 1 << 7,
+  SHADERFEATURE_IBL = 1 << 8,
+  SHADERFEATURE_SKY_CUBEMAP = 1 << 9,
+  SHADERFEATURE_DEBUG_MAPS = 1 << 10,
+  SHADERFEATURE_DEBUG_AMBIENT = 1 << 11,
+  SHADERFEATURE_COUNT = 12,
+};
+
+// A family of programs built from the same sources with different feature #defines.
+// Variants are built on demand; Request starts one in the background, Poll takes in the ones that are done, Get waits for it.
+struct ShaderVariants
+{
+  std::string mVertexShaderCode;
+  std::string mFragmentShaderCode;
+  std::map<uint32_t, Shader *> mVariants; // NULL if the variant failed to build
+  std::map<uint32_t, Shader *> mPending;
+  std::string mErrors; // Build logs of the variants that failed
+
+  void Request( uint32_t _features );
+  Shader * Get( uint32_t _features );
+  // Doesn't wait: the variant if it's built, otherwise the _fallback variant if that one is, otherwise NULL
+  Shader * Find( uint32_t _features, uint32_t _fallback );
+  bool Poll();
+  bool IsPending() const { return !mPending.empty(); }
+  // Drops the variants, built or pending, whose features aren't in _used
+  void ReleaseUnused( const std::vector<uint32_t> & _used );
+
+  // Per-frame constants go to every variant built so far, which is why the unused ones get released
+  template<typename T>
+  void SetConstant( const char * szConstName, const T & x )
+  {
+    for ( std::map<uint32_t, Shader *>::iterator it = mVariants.begin(); it != mVariants.end(); it++ )
+    {
+      if ( it->second )
+      {
+        it->second->SetConstant( szConstName, x );
+      }
+    }
+  }
+  void SetTexture( const char * szTextureName, Texture * tex );
+};
+
+ShaderVariants * CreateShaderVariants( const char * szVertexShaderCode, const char * szFragmentShaderCode );
+void ReleaseShaderVariants( ShaderVariants * _variants );
+// Moves the programs and sources of _replacement into _variants in one go, releasing the old ones; deletes _replacement
+void ReplaceShaderVariants( ShaderVariants * _variants, ShaderVariants * _replacement );
+
 void Close();
 
 Texture * CreateRGBA8TextureFromFile( const char * szFilename, const bool _loadAsSRGB = false );
+// The two halves of CreateRGBA8TextureFromFile(); LoadImageFromFile() doesn't touch GL
+bool LoadImageFromFile( const char * szFilename, Image & _image, const bool _loadAsSRGB = false );
+Texture * CreateTextureFromImage( const Image & _image );
 Texture * CreateRG32FTextureFromRawFile( const char* szFilename, int width, int height );
+Texture * CreateRG32FTexture( const char * szFilename, int width, int height, const float * _data );
+// Level i of _levels is ( width >> i ) x ( height >> i ) RGB floats, stored packed on the GPU; no further mips are generated
+Texture * CreateR11G11B10FTextureFromMipLevels( const char * szFilename, int width, int height, const std::vector< std::vector<float> > & _levels );
+// Level i of _levels is the 6 faces of ( size >> i ) x ( size >> i ) RGB floats in GL face order, stored packed on the GPU
+Texture * CreateR11G11B10FCubemapFromMipLevels( const char * szFilename, int size, const std::vector< std::vector<float> > & _levels );
 void ReleaseTexture( Texture * tex );
 
 void SetShader( Shader * _shader );
 
+struct StateStatistics
+{
+  int mIssuedCalls;
+  int mFilteredCalls;
+  int mDrawCalls;
+};
+
+void BindProgram( unsigned int _program );
+void BindVertexArray( unsigned int _vertexArray );
+void BindBuffer( unsigned int _target, unsigned int _buffer );
+void BindTexture( int _unit, unsigned int _target, unsigned int _texture );
+void SetDepthTest( bool _enable );
+void SetDepthFunc( unsigned int _func );
+void SetDepthMask( bool _enable );
+void SetBlend( bool _enable );
+void SetBlendFunc( unsigned int _src, unsigned int _dst );
+void SetPolygonMode( unsigned int _mode );
+void SetViewport( int _x, int _y, int _width, int _height );
+void InvalidateStateCache();
+const StateStatistics & GetStateStatistics();
+
+void DrawElements( int _indexCount, int _firstIndex );
+void DrawElementsInstanced( int _indexCount, int _firstIndex, int _instanceCount );
+void MultiDrawElementsIndirect( int _firstCommand, int _commandCount );
+
+// A recorded sequence of binds, uniform updates and draws. Between BeginCommandList()
+// and EndCommandList(), everything going through Renderer is executed as usual and also
+// appended to the list, with uniform locations already resolved; ExecuteCommandList()
+// then replays it without any lookups.
+struct CommandList
+{
+  struct Command
+  {
+    unsigned char mType;
+    unsigned int mObject;
+    int mParams[ 3 ];
+  };
+  std::vector<Command> mCommands;
+  std::vector<float> mData;
+  bool mValid;
+
+  CommandList() : mValid( false ) {}
+  void Clear();
+};
+
+void BeginCommandList( CommandList * _list );
+void EndCommandList();
+void ExecuteCommandList( const CommandList * _list );
+
 enum MOUSEEVENTTYPE
 {
   MOUSEEVENTTYPE_DOWN = 0,
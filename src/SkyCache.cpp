@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Renderer.h"
+#include "SkyCache.h"
+#include "SkyPrefilter.h"
+
+#define GLEW_NO_GLU
+#include "GL/glew.h"
+
+namespace SkyCache
+{
+
+enum ENTRYSTATE
+{
+  ENTRYSTATE_EMPTY,
+  ENTRYSTATE_DECODING,
+  ENTRYSTATE_DECODED,
+  ENTRYSTATE_RESIDENT,
+};
+
+struct Entry
+{
+  std::string mPath;
+  ENTRYSTATE mState;
+  bool mPrefetched; // prefetching only ever tries once, so an entry that didn't fit isn't decoded again and again
+
+  // Decoded on the worker, released once uploaded
+  bool mDecodeSucceeded;
+  SkyPrefilter::Result mPrefiltered;
+  SkyPrefilter::Cubemap mCubemap;
+
+  Sky mSky;
+  size_t mBytes;
+  unsigned int mLastUsed;
+};
+
+std::vector<Entry> entries;
+bool cubemaps = true;
+int residentCount = 1;
+size_t budgetBytes = 0;
+
+int requestedIndex = -1;
+int currentIndex = -1;
+unsigned int useCounter = 0;
+
+std::mutex mutex;
+std::condition_variable workAvailable;
+std::condition_variable entryDecoded;
+std::thread worker;
+bool quit = false;
+
+//////////////////////////////////////////////////////////////////////////
+// Worker
+
+int CountResidentOrDecoded()
+{
+  int count = 0;
+  for ( int i = 0; i < entries.size(); i++ )
+  {
+    count += ( entries[ i ].mState == ENTRYSTATE_DECODED || entries[ i ].mState == ENTRYSTATE_RESIDENT ) ? 1 : 0;
+  }
+  return count;
+}
+
+// Called with the lock held
+int PickNextEntry()
+{
+  if ( requestedIndex >= 0 && entries[ requestedIndex ].mState == ENTRYSTATE_EMPTY )
+  {
+    return requestedIndex;
+  }
+
+  // Prefetching only fills free slots, it never causes evictions
+  if ( CountResidentOrDecoded() >= residentCount )
+  {
+    return -1;
+  }
+  for ( int i = 0; i < entries.size(); i++ )
+  {
+    if ( entries[ i ].mState == ENTRYSTATE_EMPTY && !entries[ i ].mPrefetched )
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void WorkerThread()
+{
+  std::unique_lock<std::mutex> lock( mutex );
+  while ( true )
+  {
+    int index = -1;
+    workAvailable.wait( lock, [ & ]() { return quit || ( index = PickNextEntry() ) >= 0; } );
+    if ( quit )
+    {
+      return;
+    }
+
+    Entry & entry = entries[ index ];
+    entry.mState = ENTRYSTATE_DECODING;
+    entry.mPrefetched = true;
+    std::string path = entry.mPath;
+    lock.unlock();
+
+    SkyPrefilter::Result prefiltered;
+    SkyPrefilter::Cubemap cubemap;
+    bool succeeded = SkyPrefilter::Load( path.c_str(), prefiltered );
+    if ( succeeded && cubemaps )
+    {
+      SkyPrefilter::ConvertToCubemap( prefiltered, cubemap );
+      // The panorama levels aren't needed anymore, only the irradiance
+      prefiltered.mLevels.clear();
+    }
+
+    lock.lock();
+    entry.mDecodeSucceeded = succeeded;
+    entry.mPrefiltered = std::move( prefiltered );
+    entry.mCubemap = std::move( cubemap );
+    entry.mState = ENTRYSTATE_DECODED;
+    entryDecoded.notify_all();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Residency
+
+size_t GetTextureBytes( const Renderer::Texture * _texture, int _levels )
+{
+  // Every format used for skies is 4 bytes per texel; without explicit levels it's a full mip chain
+  size_t faceCount = _texture->mType == Renderer::TEXTURETYPE_CUBE ? 6 : 1;
+  size_t bytes = 0;
+  int width = _texture->mWidth;
+  int height = _texture->mHeight;
+  for ( int i = 0; _levels ? i < _levels : ( width > 0 || height > 0 ); i++ )
+  {
+    bytes += faceCount * ( width > 1 ? width : 1 ) * ( height > 1 ? height : 1 ) * 4;
+    width >>= 1;
+    height >>= 1;
+  }
+  return bytes;
+}
+
+size_t GetResidentBytes()
+{
+  size_t bytes = 0;
+  for ( int i = 0; i < entries.size(); i++ )
+  {
+    bytes += entries[ i ].mState == ENTRYSTATE_RESIDENT ? entries[ i ].mBytes : 0;
+  }
+  return bytes;
+}
+
+int GetResidentCount()
+{
+  int count = 0;
+  for ( int i = 0; i < entries.size(); i++ )
+  {
+    count += entries[ i ].mState == ENTRYSTATE_RESIDENT ? 1 : 0;
+  }
+  return count;
+}
+
+void Evict( Entry & _entry )
+{
+  if ( _entry.mSky.mReflection )
+  {
+    Renderer::ReleaseTexture( _entry.mSky.mReflection );
+    delete _entry.mSky.mReflection;
+    _entry.mSky.mReflection = NULL;
+  }
+  _entry.mState = ENTRYSTATE_EMPTY;
+}
+
+// Makes room for _bytes more, least recently used first; returns false if that'd mean evicting the current sky
+bool MakeRoom( size_t _bytes )
+{
+  while ( GetResidentCount() >= residentCount || GetResidentBytes() + _bytes > budgetBytes )
+  {
+    int oldest = -1;
+    for ( int i = 0; i < entries.size(); i++ )
+    {
+      if ( entries[ i ].mState == ENTRYSTATE_RESIDENT && i != currentIndex && ( oldest < 0 || entries[ i ].mLastUsed < entries[ oldest ].mLastUsed ) )
+      {
+        oldest = i;
+      }
+    }
+    if ( oldest < 0 )
+    {
+      return false;
+    }
+    printf( "[SkyCache] Evicting '%s'\n", entries[ oldest ].mPath.c_str() );
+    Evict( entries[ oldest ] );
+  }
+  return true;
+}
+
+void Upload( Entry & _entry )
+{
+  Sky & sky = _entry.mSky;
+  sky.mReflection = NULL;
+  sky.mReflectionRoughnessLevels = 0;
+  for ( int i = 0; i < 9; i++ )
+  {
+    sky.mIrradianceSH[ i ] = glm::vec3( 0.0f );
+  }
+
+  if ( _entry.mDecodeSucceeded )
+  {
+    int levels = 0;
+    if ( cubemaps )
+    {
+      sky.mReflection = Renderer::CreateR11G11B10FCubemapFromMipLevels( _entry.mPath.c_str(), _entry.mCubemap.mSize, _entry.mCubemap.mLevels );
+      levels = (int) _entry.mCubemap.mLevels.size();
+    }
+    else
+    {
+      sky.mReflection = Renderer::CreateR11G11B10FTextureFromMipLevels( _entry.mPath.c_str(), _entry.mPrefiltered.mWidth, _entry.mPrefiltered.mHeight, _entry.mPrefiltered.mLevels );
+      levels = (int) _entry.mPrefiltered.mLevels.size();
+    }
+    sky.mReflectionRoughnessLevels = sky.mReflection ? levels : 0;
+    for ( int i = 0; i < 9; i++ )
+    {
+      sky.mIrradianceSH[ i ] = glm::vec3( _entry.mPrefiltered.mIrradianceSH[ i ][ 0 ], _entry.mPrefiltered.mIrradianceSH[ i ][ 1 ], _entry.mPrefiltered.mIrradianceSH[ i ][ 2 ] );
+    }
+  }
+  if ( !sky.mReflection )
+  {
+    // Not something the prefilter can read; rare enough to load synchronously
+    sky.mReflection = Renderer::CreateRGBA8TextureFromFile( _entry.mPath.c_str() );
+  }
+
+  if ( sky.mReflection && sky.mReflection->mType == Renderer::TEXTURETYPE_2D )
+  {
+    Renderer::BindTexture( sky.mReflection->mGLTextureUnit, GL_TEXTURE_2D, sky.mReflection->mGLTextureID );
+
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
+  }
+
+  _entry.mBytes = sky.mReflection ? GetTextureBytes( sky.mReflection, sky.mReflectionRoughnessLevels ) : 0;
+  _entry.mState = ENTRYSTATE_RESIDENT;
+  _entry.mLastUsed = ++useCounter;
+  _entry.mPrefiltered = SkyPrefilter::Result();
+  _entry.mCubemap = SkyPrefilter::Cubemap();
+}
+
+size_t EstimateBytes( const Entry & _entry )
+{
+  size_t bytes = 0;
+  for ( int i = 0; i < _entry.mCubemap.mLevels.size(); i++ )
+  {
+    bytes += _entry.mCubemap.mLevels[ i ].size() / 3 * 4;
+  }
+  for ( int i = 0; i < _entry.mPrefiltered.mLevels.size(); i++ )
+  {
+    bytes += _entry.mPrefiltered.mLevels[ i ].size() / 3 * 4;
+  }
+  return bytes;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interface
+
+void Open( const std::vector<std::string> & _paths, bool _cubemaps, int _residentCount, size_t _budgetBytes )
+{
+  entries.resize( _paths.size() );
+  for ( int i = 0; i < _paths.size(); i++ )
+  {
+    Entry & entry = entries[ i ];
+    entry.mPath = _paths[ i ];
+    entry.mState = ENTRYSTATE_EMPTY;
+    entry.mPrefetched = false;
+    entry.mDecodeSucceeded = false;
+    entry.mSky.mReflection = NULL;
+    entry.mSky.mReflectionRoughnessLevels = 0;
+    entry.mBytes = 0;
+    entry.mLastUsed = 0;
+  }
+  cubemaps = _cubemaps;
+  residentCount = _residentCount > 1 ? _residentCount : 1;
+  budgetBytes = _budgetBytes;
+  printf( "[SkyCache] Keeping up to %d of %d skies resident within %d MB\n", residentCount, (int) entries.size(), (int) ( budgetBytes / ( 1024 * 1024 ) ) );
+
+  quit = false;
+  worker = std::thread( WorkerThread );
+}
+
+void Request( int _index )
+{
+  if ( _index < 0 || _index >= entries.size() )
+  {
+    return;
+  }
+  std::lock_guard<std::mutex> lock( mutex );
+  if ( entries[ _index ].mState != ENTRYSTATE_RESIDENT )
+  {
+    requestedIndex = _index;
+    workAvailable.notify_one();
+  }
+}
+
+void Update()
+{
+  std::lock_guard<std::mutex> lock( mutex );
+
+  // The requested sky goes first and may evict, prefetched ones only take what's free
+  int index = requestedIndex >= 0 && entries[ requestedIndex ].mState == ENTRYSTATE_DECODED ? requestedIndex : -1;
+  for ( int i = 0; index < 0 && i < entries.size(); i++ )
+  {
+    index = entries[ i ].mState == ENTRYSTATE_DECODED ? i : -1;
+  }
+  if ( index < 0 )
+  {
+    return;
+  }
+
+  Entry & entry = entries[ index ];
+  size_t bytes = EstimateBytes( entry );
+  if ( index == requestedIndex )
+  {
+    MakeRoom( bytes ); // the requested sky gets uploaded even if it doesn't fit next to the current one
+    requestedIndex = -1;
+  }
+  else if ( GetResidentCount() >= residentCount || GetResidentBytes() + bytes > budgetBytes )
+  {
+    printf( "[SkyCache] No room to keep '%s' resident\n", entry.mPath.c_str() );
+    entry.mPrefiltered = SkyPrefilter::Result();
+    entry.mCubemap = SkyPrefilter::Cubemap();
+    entry.mState = ENTRYSTATE_EMPTY;
+    workAvailable.notify_one();
+    return;
+  }
+
+  Upload( entry );
+  printf( "[SkyCache] '%s' is resident (%d KB)\n", entry.mPath.c_str(), (int) ( entry.mBytes / 1024 ) );
+
+  // A slot may have freed up for prefetching
+  workAvailable.notify_one();
+}
+
+const Sky * Use( int _index )
+{
+  if ( _index < 0 || _index >= entries.size() )
+  {
+    return NULL;
+  }
+  std::lock_guard<std::mutex> lock( mutex );
+  Entry & entry = entries[ _index ];
+  if ( entry.mState != ENTRYSTATE_RESIDENT )
+  {
+    return NULL;
+  }
+  currentIndex = _index;
+  entry.mLastUsed = ++useCounter;
+  return &entry.mSky;
+}
+
+const Sky * Wait( int _index )
+{
+  if ( _index < 0 || _index >= entries.size() )
+  {
+    return NULL;
+  }
+  Request( _index );
+  while ( true )
+  {
+    {
+      std::unique_lock<std::mutex> lock( mutex );
+      entryDecoded.wait( lock, [ & ]() { return entries[ _index ].mState == ENTRYSTATE_DECODED || entries[ _index ].mState == ENTRYSTATE_RESIDENT; } );
+    }
+    Update();
+    const Sky * sky = Use( _index );
+    if ( sky )
+    {
+      return sky;
+    }
+  }
+}
+
+void WaitDecoded( int _index )
+{
+  if ( _index < 0 || _index >= entries.size() )
+  {
+    return;
+  }
+  Request( _index );
+  std::unique_lock<std::mutex> lock( mutex );
+  entryDecoded.wait( lock, [ & ]() { return quit || entries[ _index ].mState == ENTRYSTATE_DECODED || entries[ _index ].mState == ENTRYSTATE_RESIDENT; } );
+}
+
+void Close()
+{
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    quit = true;
+    workAvailable.notify_one();
+    entryDecoded.notify_all();
+  }
+  if ( worker.joinable() )
+  {
+    worker.join();
+  }
+
+  for ( int i = 0; i < entries.size(); i++ )
+  {
+    if ( entries[ i ].mState == ENTRYSTATE_RESIDENT )
+    {
+      Evict( entries[ i ] );
+    }
+  }
+  entries.clear();
+  requestedIndex = -1;
+  currentIndex = -1;
+}
+
+}
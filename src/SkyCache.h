@@ -0,0 +1,28 @@
+#include <string>
+#include <vector>
+
+// Keeps the configured skies ready to switch to: they're decoded and prefiltered on a worker thread in the
+// background, and the most recently used ones stay uploaded within a count and a texture memory budget.
+namespace SkyCache
+{
+  struct Sky
+  {
+    Renderer::Texture * mReflection;
+    int mReflectionRoughnessLevels; // 0 if the reflection only has a box filtered mip chain
+    glm::vec3 mIrradianceSH[ 9 ];
+  };
+
+  // Starts prefetching every sky in _paths, in order
+  void Open( const std::vector<std::string> & _paths, bool _cubemaps, int _residentCount, size_t _budgetBytes );
+  // Moves the sky to the front of the queue; it'll be made resident even if that means evicting others
+  void Request( int _index );
+  // Uploads at most one decoded sky; call once per frame from the GL thread
+  void Update();
+  // Returns the sky if it's resident and makes it the current one, which is never evicted; NULL otherwise
+  const Sky * Use( int _index );
+  // Requests the sky and blocks until it's resident
+  const Sky * Wait( int _index );
+  // Requests the sky and blocks until it's decoded, without touching GL; callable from any thread
+  void WaitDecoded( int _index );
+  void Close();
+}
@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define SKYPREFILTER_SSE
+#include <emmintrin.h>
+#endif
+
+#include "stb_image.h"
+
+#include "SkyPrefilter.h"
+#include "HDRImage.h"
+#include "Parallel.h"
+
+namespace SkyPrefilter
+{
+
+#define SKYPREFILTER_CACHE_DIRECTORY "SkyCache"
+#define SKYPREFILTER_LEVELS 6
+#define SKYPREFILTER_SAMPLES 64
+#define SKYPREFILTER_MIN_HEIGHT 8
+
+const float PI = 3.1415926536f;
+
+struct CacheHeader
+{
+  char mMagic[ 4 ];
+  int mWidth;
+  int mHeight;
+  int mLevels;
+  int mSamples;
+};
+
+// An RGBA float image; the source is kept as a box filtered chain so wide lobes can read from smaller levels
+struct Image
+{
+  int mWidth;
+  int mHeight;
+  std::vector<float> mTexels;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Caching
+
+bool HashFile( const char * _path, uint64_t & _hash )
+{
+  FILE * file = fopen( _path, "rb" );
+  if ( !file )
+  {
+    return false;
+  }
+
+  // FNV-1a
+  _hash = 14695981039346656037ULL;
+  std::vector<unsigned char> buffer( 1024 * 1024 );
+  size_t read = 0;
+  while ( ( read = fread( &buffer[ 0 ], 1, buffer.size(), file ) ) > 0 )
+  {
+    for ( size_t i = 0; i < read; i++ )
+    {
+      _hash ^= buffer[ i ];
+      _hash *= 1099511628211ULL;
+    }
+  }
+  fclose( file );
+  return true;
+}
+
+std::string GetCachePath( uint64_t _hash )
+{
+  char filename[ 64 ];
+  snprintf( filename, 64, SKYPREFILTER_CACHE_DIRECTORY "/%016llx.ggx", (unsigned long long) _hash );
+  return filename;
+}
+
+bool LoadFromCache( uint64_t _hash, Result & _result )
+{
+  FILE * file = fopen( GetCachePath( _hash ).c_str(), "rb" );
+  if ( !file )
+  {
+    return false;
+  }
+
+  CacheHeader header;
+  bool valid = fread( &header, sizeof( CacheHeader ), 1, file ) == 1
+    && memcmp( header.mMagic, "GGX1", 4 ) == 0
+    && header.mWidth == _result.mWidth
+    && header.mHeight == _result.mHeight
+    && header.mLevels == (int) _result.mLevels.size()
+    && header.mSamples == SKYPREFILTER_SAMPLES;
+
+  for ( int i = 1; valid && i < header.mLevels; i++ )
+  {
+    _result.mLevels[ i ].resize( ( _result.mWidth >> i ) * ( _result.mHeight >> i ) * 3 );
+    valid = fread( &_result.mLevels[ i ][ 0 ], sizeof( float ), _result.mLevels[ i ].size(), file ) == _result.mLevels[ i ].size();
+  }
+  fclose( file );
+
+  return valid;
+}
+
+void SaveToCache( uint64_t _hash, const Result & _result )
+{
+#ifdef _WIN32
+  CreateDirectoryA( SKYPREFILTER_CACHE_DIRECTORY, NULL );
+#else
+  mkdir( SKYPREFILTER_CACHE_DIRECTORY, 0755 );
+#endif
+
+  FILE * file = fopen( GetCachePath( _hash ).c_str(), "wb" );
+  if ( !file )
+  {
+    printf( "[SkyPrefilter] Can't write cache entry '%s'\n", GetCachePath( _hash ).c_str() );
+    return;
+  }
+
+  CacheHeader header;
+  memcpy( header.mMagic, "GGX1", 4 );
+  header.mWidth = _result.mWidth;
+  header.mHeight = _result.mHeight;
+  header.mLevels = (int) _result.mLevels.size();
+  header.mSamples = SKYPREFILTER_SAMPLES;
+  fwrite( &header, sizeof( CacheHeader ), 1, file );
+
+  for ( int i = 1; i < _result.mLevels.size(); i++ )
+  {
+    fwrite( &_result.mLevels[ i ][ 0 ], sizeof( float ), _result.mLevels[ i ].size(), file );
+  }
+  fclose( file );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Filtering
+
+void Downsample( const Image & _source, Image & _target )
+{
+  _target.mWidth = _source.mWidth > 1 ? _source.mWidth / 2 : 1;
+  _target.mHeight = _source.mHeight > 1 ? _source.mHeight / 2 : 1;
+  _target.mTexels.resize( _target.mWidth * _target.mHeight * 4 );
+
+  for ( int y = 0; y < _target.mHeight; y++ )
+  {
+    int y0 = y * 2 < _source.mHeight ? y * 2 : _source.mHeight - 1;
+    int y1 = y * 2 + 1 < _source.mHeight ? y * 2 + 1 : _source.mHeight - 1;
+    for ( int x = 0; x < _target.mWidth; x++ )
+    {
+      int x0 = x * 2 < _source.mWidth ? x * 2 : _source.mWidth - 1;
+      int x1 = x * 2 + 1 < _source.mWidth ? x * 2 + 1 : _source.mWidth - 1;
+      for ( int c = 0; c < 4; c++ )
+      {
+        _target.mTexels[ ( y * _target.mWidth + x ) * 4 + c ] = 0.25f * (
+          _source.mTexels[ ( y0 * _source.mWidth + x0 ) * 4 + c ] +
+          _source.mTexels[ ( y0 * _source.mWidth + x1 ) * 4 + c ] +
+          _source.mTexels[ ( y1 * _source.mWidth + x0 ) * 4 + c ] +
+          _source.mTexels[ ( y1 * _source.mWidth + x1 ) * 4 + c ] );
+      }
+    }
+  }
+}
+
+// Same mapping as sphere_to_polar() in the shaders: u wraps around, v clamps at the poles
+void DirectionToUV( const float * _direction, float & _u, float & _v )
+{
+  _u = atan2f( _direction[ 2 ], _direction[ 0 ] ) / PI / 2.0f + 0.5f;
+  float y = _direction[ 1 ] < -1.0f ? -1.0f : ( _direction[ 1 ] > 1.0f ? 1.0f : _direction[ 1 ] );
+  _v = acosf( y ) / PI;
+}
+
+void UVToDirection( float _u, float _v, float * _direction )
+{
+  float phi = ( _u - 0.5f ) * 2.0f * PI;
+  float theta = _v * PI;
+  _direction[ 0 ] = sinf( theta ) * cosf( phi );
+  _direction[ 1 ] = cosf( theta );
+  _direction[ 2 ] = sinf( theta ) * sinf( phi );
+}
+
+#ifdef SKYPREFILTER_SSE
+typedef __m128 Color;
+inline Color ColorZero() { return _mm_setzero_ps(); }
+inline Color ColorLoad( const float * _texel ) { return _mm_loadu_ps( _texel ); }
+inline Color ColorMulAdd( Color _sum, Color _color, float _weight ) { return _mm_add_ps( _sum, _mm_mul_ps( _color, _mm_set1_ps( _weight ) ) ); }
+inline void ColorStore( Color _color, float * _out ) { _mm_storeu_ps( _out, _color ); }
+#else
+struct Color { float c[ 4 ]; };
+inline Color ColorZero() { Color r = { { 0.0f, 0.0f, 0.0f, 0.0f } }; return r; }
+inline Color ColorLoad( const float * _texel ) { Color r = { { _texel[ 0 ], _texel[ 1 ], _texel[ 2 ], _texel[ 3 ] } }; return r; }
+inline Color ColorMulAdd( Color _sum, Color _color, float _weight ) { for ( int i = 0; i < 4; i++ ) _sum.c[ i ] += _color.c[ i ] * _weight; return _sum; }
+inline void ColorStore( Color _color, float * _out ) { for ( int i = 0; i < 4; i++ ) _out[ i ] = _color.c[ i ]; }
+#endif
+
+inline Color SampleBilinear( const Image & _image, float _u, float _v )
+{
+  float x = _u * _image.mWidth - 0.5f;
+  float y = _v * _image.mHeight - 0.5f;
+  float fx = floorf( x );
+  float fy = floorf( y );
+  float wx = x - fx;
+  float wy = y - fy;
+
+  int x0 = ( (int) fx % _image.mWidth + _image.mWidth ) % _image.mWidth;
+  int x1 = ( x0 + 1 ) % _image.mWidth;
+  int y0 = (int) fy < 0 ? 0 : ( (int) fy >= _image.mHeight ? _image.mHeight - 1 : (int) fy );
+  int y1 = y0 + 1 < _image.mHeight ? y0 + 1 : _image.mHeight - 1;
+
+  const float * texels = &_image.mTexels[ 0 ];
+  Color color = ColorZero();
+  color = ColorMulAdd( color, ColorLoad( texels + ( y0 * _image.mWidth + x0 ) * 4 ), ( 1.0f - wx ) * ( 1.0f - wy ) );
+  color = ColorMulAdd( color, ColorLoad( texels + ( y0 * _image.mWidth + x1 ) * 4 ), wx * ( 1.0f - wy ) );
+  color = ColorMulAdd( color, ColorLoad( texels + ( y1 * _image.mWidth + x0 ) * 4 ), ( 1.0f - wx ) * wy );
+  color = ColorMulAdd( color, ColorLoad( texels + ( y1 * _image.mWidth + x1 ) * 4 ), wx * wy );
+  return color;
+}
+
+// A GGX lobe sample around +Z, independent of the texel it's used for
+struct LobeSample
+{
+  float mHalfVector[ 3 ];
+  float mNdotL;
+  int mSourceLevel;
+};
+
+void BuildLobeSamples( float _roughness, const std::vector<Image> & _chain, std::vector<LobeSample> & _samples )
+{
+  float a = _roughness * _roughness;
+  float a2 = a * a;
+  float texelSolidAngle = 4.0f * PI / ( _chain[ 0 ].mWidth * _chain[ 0 ].mHeight );
+
+  for ( int i = 0; i < SKYPREFILTER_SAMPLES; i++ )
+  {
+    // Hammersley point set
+    uint32_t bits = (uint32_t) i;
+    bits = ( bits << 16u ) | ( bits >> 16u );
+    bits = ( ( bits & 0x55555555u ) << 1u ) | ( ( bits & 0xAAAAAAAAu ) >> 1u );
+    bits = ( ( bits & 0x33333333u ) << 2u ) | ( ( bits & 0xCCCCCCCCu ) >> 2u );
+    bits = ( ( bits & 0x0F0F0F0Fu ) << 4u ) | ( ( bits & 0xF0F0F0F0u ) >> 4u );
+    bits = ( ( bits & 0x00FF00FFu ) << 8u ) | ( ( bits & 0xFF00FF00u ) >> 8u );
+    float xi0 = i / (float) SKYPREFILTER_SAMPLES;
+    float xi1 = bits * 2.3283064365386963e-10f;
+
+    float phi = 2.0f * PI * xi0;
+    float cosTheta = sqrtf( ( 1.0f - xi1 ) / ( 1.0f + ( a2 - 1.0f ) * xi1 ) );
+    float sinTheta = sqrtf( 1.0f - cosTheta * cosTheta );
+
+    LobeSample sample;
+    sample.mHalfVector[ 0 ] = sinTheta * cosf( phi );
+    sample.mHalfVector[ 1 ] = sinTheta * sinf( phi );
+    sample.mHalfVector[ 2 ] = cosTheta;
+
+    // With V = N, L is H mirrored around N
+    sample.mNdotL = 2.0f * cosTheta * cosTheta - 1.0f;
+    if ( sample.mNdotL <= 0.0f )
+    {
+      continue;
+    }
+
+    // Filtered importance sampling: read from the source level whose texels cover about as much
+    // of the sphere as this sample does, which removes most of the noise of a low sample count
+    float factor = cosTheta * cosTheta * ( a2 - 1.0f ) + 1.0f;
+    float D = a2 / ( PI * factor * factor );
+    float pdf = D / 4.0f;
+    float sampleSolidAngle = 1.0f / ( SKYPREFILTER_SAMPLES * pdf + 0.0001f );
+    float level = 0.5f * log2f( sampleSolidAngle / texelSolidAngle ) + 1.0f;
+    int sourceLevel = (int) ( level + 0.5f );
+    sample.mSourceLevel = sourceLevel < 0 ? 0 : ( sourceLevel >= (int) _chain.size() ? (int) _chain.size() - 1 : sourceLevel );
+
+    _samples.push_back( sample );
+  }
+}
+
+void PrefilterLevel( const std::vector<Image> & _chain, float _roughness, int _width, int _height, std::vector<float> & _output )
+{
+  std::vector<LobeSample> samples;
+  BuildLobeSamples( _roughness, _chain, samples );
+
+  _output.resize( _width * _height * 3 );
+  Parallel::For( _height, [ & ]( int y )
+  {
+    for ( int x = 0; x < _width; x++ )
+    {
+      float N[ 3 ];
+      UVToDirection( ( x + 0.5f ) / _width, ( y + 0.5f ) / _height, N );
+
+      float up[ 3 ] = { 0.0f, 0.0f, 1.0f };
+      if ( fabsf( N[ 2 ] ) >= 0.999f )
+      {
+        up[ 0 ] = 1.0f;
+        up[ 2 ] = 0.0f;
+      }
+      float tx[ 3 ] = { up[ 1 ] * N[ 2 ] - up[ 2 ] * N[ 1 ], up[ 2 ] * N[ 0 ] - up[ 0 ] * N[ 2 ], up[ 0 ] * N[ 1 ] - up[ 1 ] * N[ 0 ] };
+      float length = sqrtf( tx[ 0 ] * tx[ 0 ] + tx[ 1 ] * tx[ 1 ] + tx[ 2 ] * tx[ 2 ] );
+      tx[ 0 ] /= length;
+      tx[ 1 ] /= length;
+      tx[ 2 ] /= length;
+      float ty[ 3 ] = { N[ 1 ] * tx[ 2 ] - N[ 2 ] * tx[ 1 ], N[ 2 ] * tx[ 0 ] - N[ 0 ] * tx[ 2 ], N[ 0 ] * tx[ 1 ] - N[ 1 ] * tx[ 0 ] };
+
+      Color sum = ColorZero();
+      float weight = 0.0f;
+      for ( int i = 0; i < samples.size(); i++ )
+      {
+        const LobeSample & sample = samples[ i ];
+        float H[ 3 ];
+        float L[ 3 ];
+        for ( int c = 0; c < 3; c++ )
+        {
+          H[ c ] = tx[ c ] * sample.mHalfVector[ 0 ] + ty[ c ] * sample.mHalfVector[ 1 ] + N[ c ] * sample.mHalfVector[ 2 ];
+          L[ c ] = 2.0f * sample.mHalfVector[ 2 ] * H[ c ] - N[ c ];
+        }
+
+        float u = 0.0f;
+        float v = 0.0f;
+        DirectionToUV( L, u, v );
+        sum = ColorMulAdd( sum, SampleBilinear( _chain[ sample.mSourceLevel ], u, v ), sample.mNdotL );
+        weight += sample.mNdotL;
+      }
+
+      float color[ 4 ];
+      ColorStore( sum, color );
+      for ( int c = 0; c < 3; c++ )
+      {
+        _output[ ( y * _width + x ) * 3 + c ] = weight > 0.0f ? color[ c ] / weight : 0.0f;
+      }
+    }
+  } );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Irradiance
+
+void EvaluateSHBasis( const float * _direction, float * _basis )
+{
+  float x = _direction[ 0 ];
+  float y = _direction[ 1 ];
+  float z = _direction[ 2 ];
+  _basis[ 0 ] = 0.282095f;
+  _basis[ 1 ] = 0.488603f * y;
+  _basis[ 2 ] = 0.488603f * z;
+  _basis[ 3 ] = 0.488603f * x;
+  _basis[ 4 ] = 1.092548f * x * y;
+  _basis[ 5 ] = 1.092548f * y * z;
+  _basis[ 6 ] = 0.315392f * ( 3.0f * z * z - 1.0f );
+  _basis[ 7 ] = 1.092548f * x * z;
+  _basis[ 8 ] = 0.546274f * ( x * x - y * y );
+}
+
+void ProjectIrradianceSH( const Image & _image, float _coefficients[ 9 ][ 3 ] )
+{
+  // Every row reduces into its own sums, which are added up in order afterwards so the result doesn't depend on the thread count
+  std::vector<float> rowSums( _image.mHeight * 9 * 4 );
+  Parallel::For( _image.mHeight, [ & ]( int y )
+  {
+    float v = ( y + 0.5f ) / _image.mHeight;
+    // Equirectangular texels shrink towards the poles
+    float solidAngle = ( 2.0f * PI / _image.mWidth ) * ( PI / _image.mHeight ) * sinf( v * PI );
+
+    Color sums[ 9 ];
+    for ( int i = 0; i < 9; i++ )
+    {
+      sums[ i ] = ColorZero();
+    }
+
+    for ( int x = 0; x < _image.mWidth; x++ )
+    {
+      float direction[ 3 ];
+      UVToDirection( ( x + 0.5f ) / _image.mWidth, v, direction );
+
+      float basis[ 9 ];
+      EvaluateSHBasis( direction, basis );
+
+      Color color = ColorLoad( &_image.mTexels[ ( y * _image.mWidth + x ) * 4 ] );
+      for ( int i = 0; i < 9; i++ )
+      {
+        sums[ i ] = ColorMulAdd( sums[ i ], color, basis[ i ] * solidAngle );
+      }
+    }
+
+    for ( int i = 0; i < 9; i++ )
+    {
+      ColorStore( sums[ i ], &rowSums[ ( y * 9 + i ) * 4 ] );
+    }
+  } );
+
+  // Convolution with the clamped cosine per band (Ramamoorthi & Hanrahan), divided by PI
+  const float bandScale[ 9 ] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+  for ( int i = 0; i < 9; i++ )
+  {
+    for ( int c = 0; c < 3; c++ )
+    {
+      double sum = 0.0;
+      for ( int y = 0; y < _image.mHeight; y++ )
+      {
+        sum += rowSums[ ( y * 9 + i ) * 4 + c ];
+      }
+      _coefficients[ i ][ c ] = (float) sum * bandScale[ i ];
+    }
+  }
+}
+
+bool Load( const char * _path, Result & _result )
+{
+  int width = 0;
+  int height = 0;
+  std::vector<Image> chain( 1 );
+  if ( stbi_is_hdr( _path ) )
+  {
+    if ( !HDRImage::LoadRGBA32F( _path, width, height, chain[ 0 ].mTexels ) )
+    {
+      return false;
+    }
+  }
+  else
+  {
+    int comp = 0;
+    float * data = stbi_loadf( _path, &width, &height, &comp, STBI_rgb_alpha );
+    if ( !data )
+    {
+      return false;
+    }
+    chain[ 0 ].mTexels.assign( data, data + width * height * 4 );
+    stbi_image_free( data );
+  }
+  chain[ 0 ].mWidth = width;
+  chain[ 0 ].mHeight = height;
+
+  int levels = 1;
+  while ( levels < SKYPREFILTER_LEVELS && ( height >> levels ) >= SKYPREFILTER_MIN_HEIGHT )
+  {
+    levels++;
+  }
+
+  _result.mWidth = width;
+  _result.mHeight = height;
+  _result.mLevels.clear();
+  _result.mLevels.resize( levels );
+
+  ProjectIrradianceSH( chain[ 0 ], _result.mIrradianceSH );
+
+  _result.mLevels[ 0 ].resize( width * height * 3 );
+  for ( int i = 0; i < width * height; i++ )
+  {
+    for ( int c = 0; c < 3; c++ )
+    {
+      _result.mLevels[ 0 ][ i * 3 + c ] = chain[ 0 ].mTexels[ i * 4 + c ];
+    }
+  }
+
+  uint64_t hash = 0;
+  bool hashed = HashFile( _path, hash );
+  if ( hashed && LoadFromCache( hash, _result ) )
+  {
+    printf( "[SkyPrefilter] Loaded '%s' from cache\n", _path );
+    return true;
+  }
+
+  printf( "[SkyPrefilter] Prefiltering '%s' (%d levels) on %d threads\n", _path, levels, Parallel::GetThreadCount() );
+  while ( chain.back().mWidth > 1 || chain.back().mHeight > 1 )
+  {
+    chain.push_back( Image() );
+    Downsample( chain[ chain.size() - 2 ], chain.back() );
+  }
+
+  for ( int i = 1; i < levels; i++ )
+  {
+    PrefilterLevel( chain, i / (float) ( levels - 1 ), width >> i, height >> i, _result.mLevels[ i ] );
+  }
+
+  if ( hashed )
+  {
+    SaveToCache( hash, _result );
+  }
+
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Cubemaps
+
+// Direction through texel center ( _s, _t ) in [-1, 1] of a face, per the GL cube map face selection rules
+void CubeFaceToDirection( int _face, float _s, float _t, float * _direction )
+{
+  switch ( _face )
+  {
+    case 0: _direction[ 0 ] = 1.0f; _direction[ 1 ] = -_t; _direction[ 2 ] = -_s; break;
+    case 1: _direction[ 0 ] = -1.0f; _direction[ 1 ] = -_t; _direction[ 2 ] = _s; break;
+    case 2: _direction[ 0 ] = _s; _direction[ 1 ] = 1.0f; _direction[ 2 ] = _t; break;
+    case 3: _direction[ 0 ] = _s; _direction[ 1 ] = -1.0f; _direction[ 2 ] = -_t; break;
+    case 4: _direction[ 0 ] = _s; _direction[ 1 ] = -_t; _direction[ 2 ] = 1.0f; break;
+    case 5: _direction[ 0 ] = -_s; _direction[ 1 ] = -_t; _direction[ 2 ] = -1.0f; break;
+  }
+  float length = sqrtf( _direction[ 0 ] * _direction[ 0 ] + _direction[ 1 ] * _direction[ 1 ] + _direction[ 2 ] * _direction[ 2 ] );
+  _direction[ 0 ] /= length;
+  _direction[ 1 ] /= length;
+  _direction[ 2 ] /= length;
+}
+
+void SampleLevelBilinear( const std::vector<float> & _level, int _width, int _height, float _u, float _v, float * _rgb )
+{
+  float x = _u * _width - 0.5f;
+  float y = _v * _height - 0.5f;
+  float fx = floorf( x );
+  float fy = floorf( y );
+  float wx = x - fx;
+  float wy = y - fy;
+
+  int x0 = ( (int) fx % _width + _width ) % _width;
+  int x1 = ( x0 + 1 ) % _width;
+  int y0 = (int) fy < 0 ? 0 : ( (int) fy >= _height ? _height - 1 : (int) fy );
+  int y1 = y0 + 1 < _height ? y0 + 1 : _height - 1;
+
+  for ( int c = 0; c < 3; c++ )
+  {
+    _rgb[ c ] =
+      _level[ ( y0 * _width + x0 ) * 3 + c ] * ( 1.0f - wx ) * ( 1.0f - wy ) +
+      _level[ ( y0 * _width + x1 ) * 3 + c ] * wx * ( 1.0f - wy ) +
+      _level[ ( y1 * _width + x0 ) * 3 + c ] * ( 1.0f - wx ) * wy +
+      _level[ ( y1 * _width + x1 ) * 3 + c ] * wx * wy;
+  }
+}
+
+void ConvertToCubemap( const Result & _result, Cubemap & _cubemap )
+{
+  _cubemap.mSize = _result.mHeight / 2;
+  _cubemap.mLevels.clear();
+  _cubemap.mLevels.resize( _result.mLevels.size() );
+
+  for ( int i = 0; i < _result.mLevels.size(); i++ )
+  {
+    int size = _cubemap.mSize >> i;
+    int width = _result.mWidth >> i;
+    int height = _result.mHeight >> i;
+    std::vector<float> & faces = _cubemap.mLevels[ i ];
+    faces.resize( 6 * size * size * 3 );
+
+    // One item per row of every face
+    Parallel::For( 6 * size, [ & ]( int row )
+    {
+      int face = row / size;
+      int y = row % size;
+      float t = ( y + 0.5f ) / size * 2.0f - 1.0f;
+      for ( int x = 0; x < size; x++ )
+      {
+        float s = ( x + 0.5f ) / size * 2.0f - 1.0f;
+        float direction[ 3 ];
+        CubeFaceToDirection( face, s, t, direction );
+
+        float u = 0.0f;
+        float v = 0.0f;
+        DirectionToUV( direction, u, v );
+        SampleLevelBilinear( _result.mLevels[ i ], width, height, u, v, &faces[ ( ( face * size + y ) * size + x ) * 3 ] );
+      }
+    } );
+  }
+}
+
+}
@@ -0,0 +1,30 @@
+#include <vector>
+
+// Turns an equirectangular sky into a roughness mip chain for image based specular lighting:
+// level i is the sky convolved with a GGX lobe of roughness i / ( levels - 1 ), level 0 being the sky itself.
+namespace SkyPrefilter
+{
+  struct Result
+  {
+    int mWidth;
+    int mHeight;
+    std::vector< std::vector<float> > mLevels; // RGB floats, level i is ( mWidth >> i ) x ( mHeight >> i )
+
+    // Diffuse irradiance as 9 (L2) spherical harmonics coefficients, RGB each; already convolved with
+    // the cosine lobe and divided by PI, so evaluating them at a normal gives the diffuse ambient color
+    float mIrradianceSH[ 9 ][ 3 ];
+  };
+
+  // The same chain resampled into cube faces in GL order (+X, -X, +Y, -Y, +Z, -Z); level i is the 6 faces of
+  // ( mSize >> i ) x ( mSize >> i ) RGB floats one after the other
+  struct Cubemap
+  {
+    int mSize;
+    std::vector< std::vector<float> > mLevels;
+  };
+
+  // Loads the prefiltered chain from the cache if there's one for this exact file, computes and caches it otherwise
+  bool Load( const char * _path, Result & _result );
+  // Faces are half as wide as the panorama is tall, which keeps the texel density of its equator
+  void ConvertToCubemap( const Result & _result, Cubemap & _cubemap );
+}
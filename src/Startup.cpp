@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "Startup.h"
+
+namespace Startup
+{
+
+enum TASKSTATE
+{
+  TASKSTATE_WAITING,
+  TASKSTATE_RUNNING,
+  TASKSTATE_SUCCEEDED,
+  TASKSTATE_FAILED,
+  TASKSTATE_SKIPPED,
+};
+
+struct Task
+{
+  std::string mName;
+  TASKTHREAD mThread;
+  std::vector<int> mDependencies;
+  std::function<bool()> mFunction;
+  TASKSTATE mState;
+  double mStart; // milliseconds since Begin(), negative until the task runs
+  double mEnd;
+};
+
+// A few are enough: the heavy tasks spread over every core by themselves
+const int WORKER_THREAD_COUNT = 4;
+
+std::vector<Task> tasks;
+std::chrono::steady_clock::time_point beginTime;
+bool reported = false;
+
+std::mutex mutex;
+std::condition_variable workAvailable;
+std::condition_variable taskFinished;
+std::vector<std::thread> workers;
+bool quit = false;
+
+double GetTime()
+{
+  return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - beginTime ).count();
+}
+
+bool IsFinished( const Task & _task )
+{
+  return _task.mState == TASKSTATE_SUCCEEDED || _task.mState == TASKSTATE_FAILED || _task.mState == TASKSTATE_SKIPPED;
+}
+
+// Called with the lock held
+void SkipDependents()
+{
+  bool changed = true;
+  while ( changed )
+  {
+    changed = false;
+    for ( int i = 0; i < tasks.size(); i++ )
+    {
+      if ( tasks[ i ].mState != TASKSTATE_WAITING )
+      {
+        continue;
+      }
+      for ( int j = 0; j < tasks[ i ].mDependencies.size(); j++ )
+      {
+        const Task & dependency = tasks[ tasks[ i ].mDependencies[ j ] ];
+        if ( dependency.mState == TASKSTATE_FAILED || dependency.mState == TASKSTATE_SKIPPED )
+        {
+          printf( "[Startup] Skipping '%s', '%s' didn't succeed\n", tasks[ i ].mName.c_str(), dependency.mName.c_str() );
+          tasks[ i ].mState = TASKSTATE_SKIPPED;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Called with the lock held
+int PickReadyTask( TASKTHREAD _thread )
+{
+  for ( int i = 0; i < tasks.size(); i++ )
+  {
+    if ( tasks[ i ].mThread != _thread || tasks[ i ].mState != TASKSTATE_WAITING )
+    {
+      continue;
+    }
+    bool ready = true;
+    for ( int j = 0; j < tasks[ i ].mDependencies.size() && ready; j++ )
+    {
+      ready = tasks[ tasks[ i ].mDependencies[ j ] ].mState == TASKSTATE_SUCCEEDED;
+    }
+    if ( ready )
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Called with the lock held; releases it while the task runs
+void Run( int _index, std::unique_lock<std::mutex> & _lock )
+{
+  tasks[ _index ].mState = TASKSTATE_RUNNING;
+  tasks[ _index ].mStart = GetTime();
+  std::function<bool()> function = tasks[ _index ].mFunction;
+  _lock.unlock();
+
+  bool succeeded = function();
+  double end = GetTime();
+
+  _lock.lock();
+  Task & task = tasks[ _index ];
+  task.mEnd = end;
+  task.mState = succeeded ? TASKSTATE_SUCCEEDED : TASKSTATE_FAILED;
+  printf( "[Startup] '%s' %s in %.1f ms (%.1f - %.1f ms)\n", task.mName.c_str(), succeeded ? "done" : "failed", task.mEnd - task.mStart, task.mStart, task.mEnd );
+  SkipDependents();
+
+  workAvailable.notify_all();
+  taskFinished.notify_all();
+}
+
+void WorkerThread()
+{
+  std::unique_lock<std::mutex> lock( mutex );
+  while ( true )
+  {
+    int index = -1;
+    workAvailable.wait( lock, [ & ]() { return quit || ( index = PickReadyTask( TASKTHREAD_WORKER ) ) >= 0; } );
+    if ( quit )
+    {
+      return;
+    }
+    Run( index, lock );
+  }
+}
+
+// Called with the lock held. Walks back from the task that finished last, through whichever dependency
+// finished last, i.e. the chain that actually held startup up.
+void ReportCriticalPath()
+{
+  int last = -1;
+  for ( int i = 0; i < tasks.size(); i++ )
+  {
+    if ( tasks[ i ].mEnd >= 0.0 && ( last < 0 || tasks[ i ].mEnd > tasks[ last ].mEnd ) )
+    {
+      last = i;
+    }
+  }
+  if ( last < 0 )
+  {
+    return;
+  }
+
+  std::vector<int> path;
+  for ( int current = last; current >= 0; )
+  {
+    path.push_back( current );
+    int next = -1;
+    for ( int j = 0; j < tasks[ current ].mDependencies.size(); j++ )
+    {
+      int dependency = tasks[ current ].mDependencies[ j ];
+      if ( next < 0 || tasks[ dependency ].mEnd > tasks[ next ].mEnd )
+      {
+        next = dependency;
+      }
+    }
+    current = next;
+  }
+
+  printf( "[Startup] Finished after %.1f ms, critical path:\n", tasks[ last ].mEnd );
+  for ( int i = (int) path.size() - 1; i >= 0; i-- )
+  {
+    const Task & task = tasks[ path[ i ] ];
+    printf( "[Startup]   %8.1f - %8.1f ms  %s (%s)\n", task.mStart, task.mEnd, task.mName.c_str(), task.mThread == TASKTHREAD_WORKER ? "worker" : "context" );
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interface
+
+void Begin()
+{
+  beginTime = std::chrono::steady_clock::now();
+  reported = false;
+  quit = false;
+  for ( int i = 0; i < WORKER_THREAD_COUNT; i++ )
+  {
+    workers.push_back( std::thread( WorkerThread ) );
+  }
+}
+
+int Add( const char * _name, TASKTHREAD _thread, const std::vector<int> & _dependencies, const std::function<bool()> & _function )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+
+  Task task;
+  task.mName = _name;
+  task.mThread = _thread;
+  task.mDependencies = _dependencies;
+  task.mFunction = _function;
+  task.mState = TASKSTATE_WAITING;
+  task.mStart = -1.0;
+  task.mEnd = -1.0;
+  tasks.push_back( task );
+
+  SkipDependents();
+  workAvailable.notify_all();
+  return (int) tasks.size() - 1;
+}
+
+void Milestone( const char * _name )
+{
+  printf( "[Startup] %s after %.1f ms\n", _name, GetTime() );
+}
+
+void Poll()
+{
+  std::unique_lock<std::mutex> lock( mutex );
+  for ( int index = PickReadyTask( TASKTHREAD_CONTEXT ); index >= 0; index = PickReadyTask( TASKTHREAD_CONTEXT ) )
+  {
+    Run( index, lock );
+  }
+
+  if ( reported )
+  {
+    return;
+  }
+  for ( int i = 0; i < tasks.size(); i++ )
+  {
+    if ( !IsFinished( tasks[ i ] ) )
+    {
+      return;
+    }
+  }
+  ReportCriticalPath();
+  reported = true;
+}
+
+bool Wait( int _task )
+{
+  std::unique_lock<std::mutex> lock( mutex );
+  while ( !IsFinished( tasks[ _task ] ) )
+  {
+    int index = PickReadyTask( TASKTHREAD_CONTEXT );
+    if ( index >= 0 )
+    {
+      Run( index, lock );
+    }
+    else
+    {
+      taskFinished.wait( lock );
+    }
+  }
+  return tasks[ _task ].mState == TASKSTATE_SUCCEEDED;
+}
+
+bool IsDone( int _task )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  return IsFinished( tasks[ _task ] );
+}
+
+bool HasFailed( int _task )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  return tasks[ _task ].mState == TASKSTATE_FAILED || tasks[ _task ].mState == TASKSTATE_SKIPPED;
+}
+
+double GetDuration( int _task )
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  const Task & task = tasks[ _task ];
+  return task.mStart >= 0.0 && task.mEnd >= 0.0 ? task.mEnd - task.mStart : -1.0;
+}
+
+bool IsComplete()
+{
+  std::lock_guard<std::mutex> lock( mutex );
+  for ( int i = 0; i < tasks.size(); i++ )
+  {
+    if ( !IsFinished( tasks[ i ] ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Close()
+{
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    quit = true;
+    workAvailable.notify_all();
+  }
+  for ( int i = 0; i < workers.size(); i++ )
+  {
+    workers[ i ].join();
+  }
+  workers.clear();
+  tasks.clear();
+}
+
+}
@@ -0,0 +1,34 @@
+#include <functional>
+#include <vector>
+
+// Startup as a small task graph: CPU work (file reads, decoding, importing) runs on worker threads as soon as its
+// dependencies are done, while the tasks that need GL are run one after the other on the context thread.
+namespace Startup
+{
+  enum TASKTHREAD
+  {
+    TASKTHREAD_WORKER,
+    TASKTHREAD_CONTEXT,
+  };
+
+  // Starts the clock every task and milestone is timed against, and the worker threads
+  void Begin();
+  // Adds a task that runs once all of _dependencies succeeded; if one of them failed, the task is skipped and
+  // counts as failed too. Returns the handle to depend on.
+  int Add( const char * _name, TASKTHREAD _thread, const std::vector<int> & _dependencies, const std::function<bool()> & _function );
+  // Logs the time since Begin()
+  void Milestone( const char * _name );
+  // Runs the context tasks that are ready; call once per frame from the GL thread.
+  // Logs the critical path once every task has finished.
+  void Poll();
+  // Runs context tasks as they become ready until _task has finished; returns whether it succeeded
+  bool Wait( int _task );
+  bool IsDone( int _task );
+  bool HasFailed( int _task );
+  // Milliseconds the task ran for, negative if it hasn't finished
+  double GetDuration( int _task );
+  // Whether every task has finished, successfully or not
+  bool IsComplete();
+  // Waits for the worker tasks that are running; the ones that haven't started are dropped
+  void Close();
+}